@@ -0,0 +1,122 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Admission control for the HTTP endpoints. Each endpoint has a bound on requests in flight,
+ * and requests over it are answered right away with 503 (429 for ingestion, which is limited
+ * to keep a long stream from starving identify requests of the lock) instead of queueing up
+ * behind the lock. Requests carrying a timeout are also dropped once the client stopped waiting,
+ * both on arrival and after waiting for the lock.
+ * The epoll front-end counts requests from when they are read, including those waiting behind
+ * others on their connection. onion only hands a request over once one of its threads is free,
+ * so there the limits are shares of its threads, see admit_workers.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "admit.h"
+#include "metrics.h"
+
+admit_policy_t admit_policy = {
+        {ADMIT_IDENTIFY_MAX, ADMIT_INDEX_MAX, ADMIT_INGEST_MAX}
+};
+
+const char *admit_endpoint_names[ADMIT_ENDPOINTS] = {
+        "identify",
+        "index",
+        "ingest"
+};
+
+static uint32_t in_flight[ADMIT_ENDPOINTS] = {0};
+// Limits set by admit_parse, which admit_workers keeps
+static uint8_t parsed[ADMIT_ENDPOINTS] = {0};
+
+// Parses limits like "identify=1024,index=64,ingest=1"
+int admit_parse(char *options) {
+    char *const tokens[] = {"identify", "index", "ingest", NULL};
+    char *value;
+
+    while (*options) {
+        int i = getsubopt(&options, tokens, &value);
+        if (i < 0 || !value || !*value) {
+            fprintf(stderr, "invalid admission option: %s\n", value ? value : "");
+            return 0;
+        }
+
+        char *end;
+        unsigned long long n = strtoull(value, &end, 10);
+        if (*end || n > UINT32_MAX) {
+            fprintf(stderr, "invalid admission limit: %s\n", value);
+            return 0;
+        }
+
+        admit_policy.max[i] = (uint32_t) n;
+        parsed[i] = 1;
+    }
+
+    return 1;
+}
+
+void admit_workers(uint32_t workers) {
+    uint32_t index = workers / 4 ? workers / 4 : 1;
+    uint32_t ingest = admit_policy.max[ADMIT_INGEST];
+    uint32_t rest = workers > index + ingest ? workers - index - ingest : 1;
+
+    if (!parsed[ADMIT_INDEX]) admit_policy.max[ADMIT_INDEX] = index;
+    if (!parsed[ADMIT_IDENTIFY]) admit_policy.max[ADMIT_IDENTIFY] = rest;
+}
+
+uint32_t admit_enter(uint32_t endpoint) {
+    uint32_t n = __atomic_add_fetch(&in_flight[endpoint], 1, __ATOMIC_RELAXED);
+    uint32_t max = admit_policy.max[endpoint];
+    if (max && n > max) {
+        __atomic_sub_fetch(&in_flight[endpoint], 1, __ATOMIC_RELAXED);
+        metrics_count(METRICS_REJECTED_IDENTIFY + endpoint, 1);
+        return 0;
+    }
+    return 1;
+}
+
+void admit_leave(uint32_t endpoint) {
+    __atomic_sub_fetch(&in_flight[endpoint], 1, __ATOMIC_RELAXED);
+}
+
+uint32_t admit_in_flight(uint32_t endpoint) {
+    return __atomic_load_n(&in_flight[endpoint], __ATOMIC_RELAXED);
+}
+
+uint64_t admit_deadline(const char *timeout, uint64_t received) {
+    if (!timeout) return 0;
+
+    char *end;
+    unsigned long long ms = strtoull(timeout, &end, 10);
+    if (end == timeout || !ms) return 0;
+    return received + (uint64_t) ms * 1000000;
+}
+
+uint32_t admit_expired(uint32_t endpoint, uint64_t deadline) {
+    if (!deadline || metrics_now() < deadline) return 0;
+    metrics_count(METRICS_SHED_IDENTIFY + endpoint, 1);
+    return 1;
+}
@@ -0,0 +1,47 @@
+#ifndef TITLE_FINGERPRINT_DB_ADMIT_H
+#define TITLE_FINGERPRINT_DB_ADMIT_H
+
+#include <stdint.h>
+
+#define ADMIT_IDENTIFY 0
+#define ADMIT_INDEX 1
+#define ADMIT_INGEST 2
+#define ADMIT_ENDPOINTS 3
+
+// Requests in flight per endpoint, including those waiting for the lock or read by the epoll front-end
+// and waiting on their connection, 0 is unlimited
+#define ADMIT_IDENTIFY_MAX 1024
+#define ADMIT_INDEX_MAX 64
+#define ADMIT_INGEST_MAX 1
+
+// Header with the time in ms the client is going to wait for the response
+#define ADMIT_TIMEOUT_HEADER "X-Request-Timeout"
+
+typedef struct admit_policy {
+    uint32_t max[ADMIT_ENDPOINTS];
+} admit_policy_t;
+
+extern admit_policy_t admit_policy;
+
+extern const char *admit_endpoint_names[ADMIT_ENDPOINTS];
+
+int admit_parse(char *options);
+
+// Limits identify and index requests to shares of a front-end that handles at most this many at a time,
+// so they're reached before requests queue up unseen, unless admit_parse set them
+void admit_workers(uint32_t workers);
+
+// Returns 0 and counts a rejection if the endpoint is at its limit, otherwise admit_leave must follow
+uint32_t admit_enter(uint32_t endpoint);
+
+void admit_leave(uint32_t endpoint);
+
+uint32_t admit_in_flight(uint32_t endpoint);
+
+// Deadline in metrics_now time from a timeout header value in ms relative to received, 0 without a timeout
+uint64_t admit_deadline(const char *timeout, uint64_t received);
+
+// Returns 1 and counts a shed request if the client has stopped waiting
+uint32_t admit_expired(uint32_t endpoint, uint64_t deadline);
+
+#endif //TITLE_FINGERPRINT_DB_ADMIT_H
@@ -0,0 +1,652 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <jansson.h>
+#include <jemalloc/jemalloc.h>
+#include "ht.h"
+#include "api.h"
+#include "arena.h"
+#include "jsonscan.h"
+#include "metrics.h"
+#include "trace.h"
+#include "admit.h"
+#include "reload.h"
+#include "repl.h"
+#include "router.h"
+
+// Worst case of an escaped string is \u00XX for every byte, plus quotes
+#define API_ESCAPED_MAX(len) ((len) * 6 + 2)
+// Braces, keys, separators and numbers of a response
+#define API_RESPONSE_OVERHEAD 256
+#define API_TRACE_MAX 1024
+#define API_DEPTH_MAX 4
+
+extern pthread_rwlock_t rwlock;
+
+// Same checks as jansson does for json_string, so responses keep leaving out invalid strings
+static uint32_t api_utf8_valid(const uint8_t *s) {
+    while (*s) {
+        uint32_t c = *s;
+        uint32_t n;
+        if (c < 0x80) n = 0;
+        else if (c >= 0xC2 && c <= 0xDF) n = 1, c &= 0x1F;
+        else if (c >= 0xE0 && c <= 0xEF) n = 2, c &= 0x0F;
+        else if (c >= 0xF0 && c <= 0xF4) n = 3, c &= 0x07;
+        else return 0;
+        s++;
+
+        for (uint32_t i = 0; i < n; i++, s++) {
+            if ((*s & 0xC0) != 0x80) return 0;
+            c = (c << 6) | (*s & 0x3F);
+        }
+
+        if ((n == 2 && c < 0x800) || (n == 3 && c < 0x10000) || c > 0x10FFFF) return 0;
+        if (c >= 0xD800 && c <= 0xDFFF) return 0;
+    }
+    return 1;
+}
+
+/*
+ * A minimal serializer producing the same output as json_dumps with JSON_INDENT(1) | JSON_PRESERVE_ORDER.
+ * Objects are opened lazily by their first field, so an empty one comes out as {} like in jansson.
+ * The caller sizes the buffer, nothing is checked here.
+ */
+typedef struct api_writer {
+    char *p;
+    uint32_t depth;
+    uint32_t fields[API_DEPTH_MAX];
+} api_writer_t;
+
+static void api_put_key(api_writer_t *w, const char *key) {
+    w->p += sprintf(w->p, "%s\n%*s\"%s\": ", w->fields[w->depth]++ ? "," : "{", w->depth + 1, "", key);
+}
+
+static void api_put_string(api_writer_t *w, const char *key, const uint8_t *s) {
+    if (!api_utf8_valid(s)) return;
+
+    api_put_key(w, key);
+    char *p = w->p;
+    *p++ = '"';
+    for (; *s; s++) {
+        switch (*s) {
+            case '"':
+                *p++ = '\\';
+                *p++ = '"';
+                break;
+            case '\\':
+                *p++ = '\\';
+                *p++ = '\\';
+                break;
+            case '\b':
+                *p++ = '\\';
+                *p++ = 'b';
+                break;
+            case '\f':
+                *p++ = '\\';
+                *p++ = 'f';
+                break;
+            case '\n':
+                *p++ = '\\';
+                *p++ = 'n';
+                break;
+            case '\r':
+                *p++ = '\\';
+                *p++ = 'r';
+                break;
+            case '\t':
+                *p++ = '\\';
+                *p++ = 't';
+                break;
+            default:
+                if (*s < 0x20) p += sprintf(p, "\\u%04X", *s);
+                else *p++ = *s;
+        }
+    }
+    *p++ = '"';
+    w->p = p;
+}
+
+static void api_put_integer(api_writer_t *w, const char *key, uint64_t value) {
+    api_put_key(w, key);
+    w->p += sprintf(w->p, "%lu", (unsigned long) value);
+}
+
+static void api_put_object(api_writer_t *w, const char *key) {
+    api_put_key(w, key);
+    w->fields[++w->depth] = 0;
+}
+
+static void api_put_end(api_writer_t *w) {
+    if (w->fields[w->depth]) w->p += sprintf(w->p, "\n%*s}", w->depth, "");
+    else w->p += sprintf(w->p, "{}");
+    if (w->depth) w->depth--;
+}
+
+static void api_put_trace(api_writer_t *w, trace_t *trace) {
+    char key[32];
+    api_put_object(w, "trace");
+    api_put_integer(w, "total_ns", trace->total_ns);
+    api_put_integer(w, "lock_wait_ns", trace->lock_wait_ns);
+    for (uint32_t i = 0; i < TRACE_STAGES; i++) {
+        sprintf(key, "%s_ns", trace_stage_names[i]);
+        api_put_integer(w, key, trace->stage_ns[i]);
+    }
+    api_put_integer(w, "text_len", trace->text_len);
+    api_put_integer(w, "lines", trace->lines);
+    api_put_integer(w, "candidates", trace->candidates);
+    api_put_integer(w, "rows_probed", trace->rows_probed);
+    api_put_integer(w, "row_hits", trace->row_hits);
+    api_put_integer(w, "slots_checked", trace->slots_checked);
+    api_put_integer(w, "name_positions", trace->name_positions);
+    api_put_end(w);
+}
+
+// Text field of an identify request, root is set if the body had to be parsed with jansson
+static uint8_t *api_identify_text(const char *data, size_t data_len, arena_t *arena, json_t **root, uint8_t *debug) {
+    jsonscan_string_t text;
+    if (jsonscan_identify(data, data_len, &text, debug)) {
+        *root = 0;
+        return jsonscan_copy(arena, &text);
+    }
+
+    json_error_t error;
+    *root = json_loadb(data, data_len, 0, &error);
+
+    if (!*root || !json_is_object(*root)) {
+        return 0;
+    }
+
+    *debug = json_is_true(json_object_get(*root, "debug"));
+    json_t *json_text = json_object_get(*root, "text");
+
+    if (!json_is_string(json_text)) {
+        return 0;
+    }
+
+    return json_string_value(json_text);
+}
+
+char *api_identify_admitted(const char *data, size_t data_len, uint64_t deadline, uint32_t *status) {
+    uint64_t start = metrics_now();
+    arena_t *arena = arena_local();
+    json_t *root;
+    uint8_t debug = 0;
+
+    uint8_t *text = api_identify_text(data, data_len, arena, &root, &debug);
+    result_t *result = text ? arena_alloc(arena, sizeof(result_t)) : 0;
+    if (!result) {
+        json_decref(root);
+        *status = text ? API_UNAVAILABLE : API_BAD_REQUEST;
+        return 0;
+    }
+
+    // Requested traces are returned, sampled ones only end up in the slow request log
+    trace_t *trace = 0;
+    if (debug || trace_sample()) {
+        trace = arena_alloc(arena, sizeof(trace_t));
+        if (trace) {
+            memset(trace, 0, sizeof(trace_t));
+            trace->text_len = (uint32_t) strlen(text);
+        }
+    }
+
+    uint32_t rc;
+    uint64_t wait_start = trace ? metrics_now() : 0;
+    uint64_t locked, st, et;
+
+    if (router_enabled()) {
+        // Shards take their own locks, but the request may have waited for a worker
+        if (admit_expired(ADMIT_IDENTIFY, deadline)) {
+            json_decref(root);
+            *status = API_UNAVAILABLE;
+            return 0;
+        }
+        locked = st = metrics_now();
+        int reached = router_identify(text, result, trace, deadline, &rc);
+        et = metrics_now();
+        json_decref(root);
+        if (!reached) {
+            *status = API_UNAVAILABLE;
+            return 0;
+        }
+    } else {
+        locked = metrics_rdlock(&rwlock);
+
+        // The lock is where requests queue up, so the client may have given up by now
+        if (admit_expired(ADMIT_IDENTIFY, deadline)) {
+            metrics_unlock(&rwlock, locked, 0);
+            json_decref(root);
+            *status = API_UNAVAILABLE;
+            return 0;
+        }
+
+        st = metrics_now();
+        rc = ht_identify_traced(text, result, trace);
+        et = metrics_now();
+
+        metrics_unlock(&rwlock, locked, 0);
+        json_decref(root);
+    }
+
+    uint32_t elapsed = (uint32_t) ((et - st) / 1000);
+
+    if (trace) {
+        trace->lock_wait_ns = locked - wait_start;
+        trace->total_ns = et - start;
+        trace_slow(trace);
+        if (!debug) trace = 0;
+    }
+
+    size_t len = API_RESPONSE_OVERHEAD + (trace ? API_TRACE_MAX : 0);
+    if (rc) {
+        len += API_ESCAPED_MAX(strlen(result->title)) + API_ESCAPED_MAX(strlen(result->name)) +
+               API_ESCAPED_MAX(strlen(result->identifiers));
+    }
+
+    char *str = arena_alloc(arena, len);
+    if (!str) {
+        *status = API_UNAVAILABLE;
+        return 0;
+    }
+
+    api_writer_t w = {str, 0, {0}};
+    if (rc) {
+        api_put_integer(&w, "time", elapsed);
+        api_put_string(&w, "title", result->title);
+        api_put_string(&w, "name", result->name);
+        api_put_string(&w, "identifiers", result->identifiers);
+    }
+    if (trace) api_put_trace(&w, trace);
+    api_put_end(&w);
+
+    metrics_since(METRICS_HTTP_IDENTIFY, start);
+    *status = API_OK;
+    return str;
+}
+
+char *api_identify(const char *data, size_t data_len, uint64_t deadline, uint32_t *status) {
+    *status = API_UNAVAILABLE;
+    if (admit_expired(ADMIT_IDENTIFY, deadline) || !admit_enter(ADMIT_IDENTIFY)) return 0;
+    char *str = api_identify_admitted(data, data_len, deadline, status);
+    admit_leave(ADMIT_IDENTIFY);
+    return str;
+}
+
+// Routers send records to the shards owning them and count what was indexed once all are sent
+static uint32_t api_index_one(uint8_t *title, uint8_t *name, uint8_t *identifiers) {
+    return router_enabled() ? router_index(title, name, identifiers) : ht_index(title, name, identifiers);
+}
+
+// Strings are unescaped one record at a time into memory released after indexing it
+static uint32_t api_index_records(arena_t *arena, jsonscan_record_t *records, uint32_t records_len) {
+    uint32_t indexed = 0;
+    for (uint32_t i = 0; i < records_len; i++) {
+        size_t mark = arena_mark(arena);
+        uint8_t *title = jsonscan_copy(arena, &records[i].title);
+        uint8_t *name = jsonscan_copy(arena, &records[i].name);
+        uint8_t *identifiers = jsonscan_copy(arena, &records[i].identifiers);
+        if (api_index_one(title, name, identifiers))
+            indexed++;
+        arena_release(arena, mark);
+    }
+    return indexed;
+}
+
+static uint32_t api_index_json(json_t *root) {
+    uint32_t indexed = 0;
+    if (json_is_array(root)) {
+        uint32_t n = (uint32_t) json_array_size(root);
+        int i;
+        for (i = 0; i < n; i++) {
+            json_t *el = json_array_get(root, i);
+            if (json_is_object(el)) {
+                json_t *json_title = json_object_get(el, "title");
+                json_t *json_name = json_object_get(el, "name");
+                json_t *json_identifiers = json_object_get(el, "identifiers");
+                uint8_t *title = json_string_value(json_title);
+                uint8_t *name = json_string_value(json_name);
+                uint8_t *identifiers = json_string_value(json_identifiers);
+                if (api_index_one(title, name, identifiers))
+                    indexed++;
+            }
+        }
+    }
+    return indexed;
+}
+
+char *api_index_admitted(const char *data, size_t data_len, uint64_t deadline, uint32_t *status) {
+    if (repl_following()) {
+        *status = API_FORBIDDEN;
+        return 0;
+    }
+
+    uint64_t start = metrics_now();
+    arena_t *arena = arena_local();
+    uint32_t indexed;
+
+    jsonscan_record_t *records;
+    uint32_t records_len;
+    json_t *root = 0;
+    if (!jsonscan_index(data, data_len, arena, &records, &records_len)) {
+        json_error_t error;
+
+        root = json_loadb(data, data_len, 0, &error);
+
+        if (!root) {
+            *status = API_BAD_REQUEST;
+            return 0;
+        }
+    }
+
+    if (router_enabled()) {
+        if (admit_expired(ADMIT_INDEX, deadline)) {
+            json_decref(root);
+            *status = API_UNAVAILABLE;
+            return 0;
+        }
+        root ? api_index_json(root) : api_index_records(arena, records, records_len);
+        indexed = router_index_wait();
+    } else {
+        uint64_t locked = metrics_wrlock(&rwlock);
+        if (admit_expired(ADMIT_INDEX, deadline)) {
+            metrics_unlock(&rwlock, locked, 1);
+            json_decref(root);
+            *status = API_UNAVAILABLE;
+            return 0;
+        }
+        indexed = root ? api_index_json(root) : api_index_records(arena, records, records_len);
+        metrics_unlock(&rwlock, locked, 1);
+    }
+
+    json_decref(root);
+
+    char *str = arena_alloc(arena, API_RESPONSE_OVERHEAD);
+    if (!str) {
+        *status = API_UNAVAILABLE;
+        return 0;
+    }
+
+    api_writer_t w = {str, 0, {0}};
+    api_put_integer(&w, "indexed", indexed);
+    api_put_end(&w);
+
+    metrics_since(METRICS_HTTP_INDEX, start);
+    *status = API_OK;
+    return str;
+}
+
+char *api_index(const char *data, size_t data_len, uint64_t deadline, uint32_t *status) {
+    if (repl_following()) {
+        *status = API_FORBIDDEN;
+        return 0;
+    }
+    *status = API_UNAVAILABLE;
+    if (admit_expired(ADMIT_INDEX, deadline) || !admit_enter(ADMIT_INDEX)) return 0;
+    char *str = api_index_admitted(data, data_len, deadline, status);
+    admit_leave(ADMIT_INDEX);
+    return str;
+}
+
+// Records indexed per write lock
+#define API_INGEST_BATCH 256
+#define API_INGEST_PROGRESS_INTERVAL 100000
+
+struct api_ingest {
+    api_ingest_write_t write;
+    void *ctx;
+    uint64_t start;
+    // Line carried over from the previous part of the body
+    char *line;
+    uint32_t line_len;
+    // The current line is longer than API_INGEST_LINE_MAX and is skipped up to its end
+    uint8_t skipping;
+    uint32_t lines;
+    json_t *records[API_INGEST_BATCH];
+    uint32_t records_len;
+    uint32_t indexed;
+    // Lines that aren't JSON objects
+    uint32_t invalid;
+    // Records without title or name
+    uint32_t incomplete;
+    // Records ht_index didn't accept, e.g. too short titles
+    uint32_t rejected;
+    // Lines longer than API_INGEST_LINE_MAX
+    uint32_t too_long;
+};
+
+static uint32_t api_ingest_progress(api_ingest_t *ingest, uint8_t done) {
+    char str[API_RESPONSE_OVERHEAD];
+    int len = snprintf(str, sizeof(str), "{\"indexed\":%u,\"invalid\":%u,\"incomplete\":%u,\"rejected\":%u,"
+                                         "\"too_long\":%u,\"done\":%s}\n", ingest->indexed, ingest->invalid,
+                       ingest->incomplete, ingest->rejected, ingest->too_long, done ? "true" : "false");
+    return ingest->write(ingest->ctx, str, (size_t) len);
+}
+
+// Indexes parsed records under one write lock and frees them
+static void api_ingest_batch(api_ingest_t *ingest) {
+    // A router sends records to the shards owning them, which take their own locks
+    uint8_t routed = router_enabled();
+    uint64_t locked = routed ? 0 : metrics_wrlock(&rwlock);
+    uint32_t sent = 0;
+    for (uint32_t i = 0; i < ingest->records_len; i++) {
+        uint8_t *title = json_string_value(json_object_get(ingest->records[i], "title"));
+        uint8_t *name = json_string_value(json_object_get(ingest->records[i], "name"));
+        uint8_t *identifiers = json_string_value(json_object_get(ingest->records[i], "identifiers"));
+        if (!title || !name) {
+            ingest->incomplete++;
+        } else if (api_index_one(title, name, identifiers)) {
+            sent++;
+        } else {
+            ingest->rejected++;
+        }
+    }
+
+    if (routed) {
+        uint32_t indexed = router_index_wait();
+        ingest->indexed += indexed;
+        ingest->rejected += sent - indexed;
+    } else {
+        metrics_unlock(&rwlock, locked, 1);
+        ingest->indexed += sent;
+    }
+
+    for (uint32_t i = 0; i < ingest->records_len; i++) {
+        json_decref(ingest->records[i]);
+    }
+    ingest->records_len = 0;
+}
+
+// Parses the complete line in the line buffer
+static uint32_t api_ingest_line(api_ingest_t *ingest) {
+    uint32_t len = ingest->line_len;
+    ingest->line_len = 0;
+
+    if (++ingest->lines % API_INGEST_PROGRESS_INTERVAL == 0 && !api_ingest_progress(ingest, 0)) return 0;
+
+    if (ingest->skipping) {
+        ingest->skipping = 0;
+        ingest->too_long++;
+        return 1;
+    }
+
+    while (len && ingest->line[len - 1] == '\r') len--;
+    if (!len) return 1;
+
+    json_error_t error;
+    json_t *record = json_loadb(ingest->line, len, 0, &error);
+    if (!record || !json_is_object(record)) {
+        if (record) json_decref(record);
+        ingest->invalid++;
+        return 1;
+    }
+
+    ingest->records[ingest->records_len++] = record;
+    if (ingest->records_len == API_INGEST_BATCH) api_ingest_batch(ingest);
+    return 1;
+}
+
+// Concurrent ingestion is limited, so that streams holding the write lock batch after batch can't starve identify
+api_ingest_t *api_ingest_start(api_ingest_write_t write, void *ctx, uint32_t *status) {
+    if (repl_following()) {
+        *status = API_FORBIDDEN;
+        return 0;
+    }
+
+    if (!admit_enter(ADMIT_INGEST)) {
+        *status = API_TOO_MANY_REQUESTS;
+        return 0;
+    }
+
+    api_ingest_t *ingest = calloc(1, sizeof(api_ingest_t));
+    if (!ingest || !(ingest->line = malloc(API_INGEST_LINE_MAX))) {
+        fprintf(stderr, "ingest malloc failed\n");
+        free(ingest);
+        admit_leave(ADMIT_INGEST);
+        *status = API_UNAVAILABLE;
+        return 0;
+    }
+
+    ingest->write = write;
+    ingest->ctx = ctx;
+    ingest->start = metrics_now();
+    *status = API_OK;
+    return ingest;
+}
+
+/*
+ * Records are parsed as their lines complete, so memory doesn't depend on the body size.
+ * They are indexed API_INGEST_BATCH at a time, and a progress line is written every
+ * API_INGEST_PROGRESS_INTERVAL lines.
+ */
+uint32_t api_ingest_feed(api_ingest_t *ingest, const char *data, size_t data_len) {
+    const char *end = data + data_len;
+    while (data < end) {
+        const char *lf = memchr(data, '\n', (size_t) (end - data));
+        size_t len = (size_t) ((lf ? lf : end) - data);
+
+        if (!ingest->skipping) {
+            if (ingest->line_len + len > API_INGEST_LINE_MAX) {
+                ingest->skipping = 1;
+            } else {
+                memcpy(ingest->line + ingest->line_len, data, len);
+                ingest->line_len += (uint32_t) len;
+            }
+        }
+
+        if (!lf) break;
+        data = lf + 1;
+        if (!api_ingest_line(ingest)) return 0;
+    }
+    return 1;
+}
+
+void api_ingest_free(api_ingest_t *ingest) {
+    if (ingest->records_len) api_ingest_batch(ingest);
+    admit_leave(ADMIT_INGEST);
+    free(ingest->line);
+    free(ingest);
+}
+
+uint32_t api_ingest_end(api_ingest_t *ingest) {
+    // The last line doesn't need a line feed
+    uint32_t rc = ingest->line_len || ingest->skipping ? api_ingest_line(ingest) : 1;
+    if (ingest->records_len) api_ingest_batch(ingest);
+
+    if (rc) rc = api_ingest_progress(ingest, 1);
+    metrics_since(METRICS_HTTP_INGEST, ingest->start);
+    api_ingest_free(ingest);
+    return rc;
+}
+
+char *api_stats() {
+    uint64_t start = metrics_now();
+    // A reload frees the rows it replaces
+    uint64_t locked = metrics_rdlock(&rwlock);
+    stats_t stats = ht_stats();
+    metrics_unlock(&rwlock, locked, 0);
+
+    char *str = arena_alloc(arena_local(), API_RESPONSE_OVERHEAD);
+    if (!str) return 0;
+
+    api_writer_t w = {str, 0, {0}};
+    api_put_integer(&w, "used_hashes", stats.used_hashes);
+    api_put_integer(&w, "used_slots", stats.used_slots);
+    api_put_integer(&w, "max_slots", stats.max_slots);
+    api_put_end(&w);
+
+    metrics_since(METRICS_HTTP_STATS, start);
+    return str;
+}
+
+char *api_metrics() {
+    uint64_t locked = metrics_rdlock(&rwlock);
+    char *formatted = metrics_format();
+    metrics_unlock(&rwlock, locked, 0);
+    if (!formatted) return 0;
+
+    size_t len = strlen(formatted) + 1;
+    char *str = arena_alloc(arena_local(), len);
+    if (str) memcpy(str, formatted, len);
+    free(formatted);
+    return str;
+}
+
+char *api_reload(const char *data, size_t data_len, uint64_t deadline, uint32_t *status) {
+    // Only starts the reload in the background, there is nothing to give up on
+    (void) deadline;
+    json_error_t error;
+    json_t *root = json_loadb(data, data_len, 0, &error);
+    const char *directory = json_string_value(json_object_get(root, "directory"));
+
+    if (repl_following() || router_enabled()) {
+        json_decref(root);
+        *status = API_FORBIDDEN;
+        return 0;
+    }
+
+    if (!directory || !*directory) {
+        json_decref(root);
+        *status = API_BAD_REQUEST;
+        return 0;
+    }
+
+    if (!reload_start(directory)) {
+        json_decref(root);
+        *status = API_CONFLICT;
+        return 0;
+    }
+
+    char *str = arena_alloc(arena_local(), API_ESCAPED_MAX(strlen(directory)) + API_RESPONSE_OVERHEAD);
+    if (str) {
+        api_writer_t w = {str, 0, {0}};
+        api_put_string(&w, "reloading", (const uint8_t *) directory);
+        api_put_end(&w);
+    }
+    json_decref(root);
+    *status = str ? API_OK : API_UNAVAILABLE;
+    return str;
+}
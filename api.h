@@ -0,0 +1,59 @@
+#ifndef TITLE_FINGERPRINT_DB_API_H
+#define TITLE_FINGERPRINT_DB_API_H
+
+#include <stddef.h>
+
+#include <stdint.h>
+
+// HTTP status of a route's result
+#define API_OK 200
+#define API_BAD_REQUEST 400
+// Updates sent to a follower, which only takes them from its leader, and reloads sent to a router
+#define API_FORBIDDEN 403
+#define API_CONFLICT 409
+#define API_TOO_MANY_REQUESTS 429
+#define API_UNAVAILABLE 503
+
+// Routes shared by the HTTP front-ends. They take the request body as is (it doesn't
+// have to be NUL terminated) and return a JSON response, or 0 with the error status.
+// Responses live in the calling thread's arena, the caller resets it once the response is sent.
+// A request with a deadline (metrics_now time, 0 for none) is dropped once it passes.
+
+char *api_identify(const char *data, size_t data_len, uint64_t deadline, uint32_t *status);
+
+char *api_index(const char *data, size_t data_len, uint64_t deadline, uint32_t *status);
+
+// Same as api_identify and api_index, for a caller that did admit_enter itself and calls admit_leave afterwards
+char *api_identify_admitted(const char *data, size_t data_len, uint64_t deadline, uint32_t *status);
+
+char *api_index_admitted(const char *data, size_t data_len, uint64_t deadline, uint32_t *status);
+
+char *api_stats();
+
+// Prometheus text format instead of JSON
+char *api_metrics();
+
+// Starts reloading the db directory in {"directory": "..."}, answers 409 while a reload is running
+char *api_reload(const char *data, size_t data_len, uint64_t deadline, uint32_t *status);
+
+// Longest accepted ingest line
+#define API_INGEST_LINE_MAX 1048576
+
+// Receives progress lines of an ingestion, returns 0 to stop it
+typedef int (*api_ingest_write_t)(void *ctx, const char *data, size_t data_len);
+
+typedef struct api_ingest api_ingest_t;
+
+// Starts ingesting newline delimited JSON records, or returns 0 with the error status before any body is read
+api_ingest_t *api_ingest_start(api_ingest_write_t write, void *ctx, uint32_t *status);
+
+// Takes the next part of the body, split anywhere, returns 0 if the ingestion has to stop
+uint32_t api_ingest_feed(api_ingest_t *ingest, const char *data, size_t data_len);
+
+// Indexes what is left once the whole body was fed, writes the final progress line and frees the ingestion
+uint32_t api_ingest_end(api_ingest_t *ingest);
+
+// Frees an ingestion whose body didn't arrive in full, complete records fed so far are indexed
+void api_ingest_free(api_ingest_t *ingest);
+
+#endif //TITLE_FINGERPRINT_DB_API_H
@@ -0,0 +1,111 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <jemalloc/jemalloc.h>
+#include "arena.h"
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+static __thread arena_t arena_thread = {0};
+
+static void arena_free_spills(arena_t *arena) {
+    while (arena->spills) {
+        arena_spill_t *next = arena->spills->next;
+        free(arena->spills);
+        arena->spills = next;
+    }
+    arena->spilled = 0;
+}
+
+static void arena_destroy(void *arg) {
+    arena_t *arena = arg;
+    arena_free_spills(arena);
+    free(arena->data);
+    arena->data = 0;
+    arena->size = 0;
+    arena->used = 0;
+}
+
+static void arena_key_init() {
+    pthread_key_create(&arena_key, arena_destroy);
+}
+
+arena_t *arena_local() {
+    arena_t *arena = &arena_thread;
+    if (arena->data) return arena;
+
+    arena->data = malloc(ARENA_BLOCK_LEN);
+    if (arena->data) {
+        arena->size = ARENA_BLOCK_LEN;
+    } else {
+        fprintf(stderr, "failed to allocate arena\n");
+    }
+
+    pthread_once(&arena_once, arena_key_init);
+    pthread_setspecific(arena_key, arena);
+    return arena;
+}
+
+void *arena_alloc(arena_t *arena, size_t len) {
+    len = (len + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    if (arena->size - arena->used >= len) {
+        void *p = arena->data + arena->used;
+        arena->used += len;
+        return p;
+    }
+
+    arena_spill_t *spill = malloc(sizeof(arena_spill_t) + len);
+    if (!spill) {
+        fprintf(stderr, "failed to allocate %zu bytes\n", len);
+        return 0;
+    }
+    spill->next = arena->spills;
+    arena->spills = spill;
+    arena->spilled += len;
+    return spill->data;
+}
+
+void arena_reset(arena_t *arena) {
+    arena->used = 0;
+    if (!arena->spills) return;
+
+    size_t size = arena->size + arena->spilled;
+    if (size < arena->size * 2) size = arena->size * 2;
+    if (size > ARENA_RETAIN_MAX) size = ARENA_RETAIN_MAX;
+    arena_free_spills(arena);
+    if (size <= arena->size) return;
+
+    uint8_t *data = malloc(size);
+    if (!data) {
+        // Keep the old block, the next large request spills again
+        fprintf(stderr, "failed to grow arena to %zu bytes\n", size);
+        return;
+    }
+    free(arena->data);
+    arena->data = data;
+    arena->size = size;
+}
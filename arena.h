@@ -0,0 +1,49 @@
+#ifndef TITLE_FINGERPRINT_DB_ARENA_H
+#define TITLE_FINGERPRINT_DB_ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Initial size of a thread's arena, enough for an identify request and its response
+#define ARENA_BLOCK_LEN 262144
+#define ARENA_ALIGN 16
+// The block isn't grown past this, larger requests keep spilling
+#define ARENA_RETAIN_MAX 8388608
+
+typedef struct arena_spill {
+    struct arena_spill *next;
+    uint8_t pad[ARENA_ALIGN - sizeof(struct arena_spill *)];
+    uint8_t data[];
+} arena_spill_t;
+
+/*
+ * Bump allocator for per-request scratch and response memory. Allocations that don't fit
+ * go to separate blocks, which are freed on reset and the block is grown to fit them next time,
+ * so after warming up a request doesn't touch the heap at all.
+ */
+typedef struct arena {
+    uint8_t *data;
+    size_t size;
+    size_t used;
+    arena_spill_t *spills;
+    size_t spilled;
+} arena_t;
+
+// Arena of the calling thread, freed when the thread exits
+arena_t *arena_local();
+
+void *arena_alloc(arena_t *arena, size_t len);
+
+static inline size_t arena_mark(arena_t *arena) {
+    return arena->used;
+}
+
+// Releases everything allocated after the mark, spilled blocks are kept until reset
+static inline void arena_release(arena_t *arena, size_t mark) {
+    arena->used = mark;
+}
+
+// Called once a request is answered, invalidates everything allocated from the arena
+void arena_reset(arena_t *arena);
+
+#endif //TITLE_FINGERPRINT_DB_ARENA_H
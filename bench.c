@@ -0,0 +1,199 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * Microbenchmarks for the hot paths that don't need a database.
+ * Usage: title-fingerprint-bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include "text.h"
+#include "rowcodec.h"
+
+#define BENCH_TEXT_LEN 65536
+#define BENCH_NGRAMS 1000
+#define BENCH_ROWS 4096
+
+uint8_t bench_text[BENCH_TEXT_LEN];
+uint8_t *bench_ngrams[BENCH_NGRAMS];
+uint32_t bench_ngram_lens[BENCH_NGRAMS];
+
+uint64_t bench_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Ngram lengths are drawn from [min_len, max_len] like in ht_identify and ht_locate_name
+void bench_ngrams_init(uint32_t min_len, uint32_t max_len) {
+    for (uint32_t i = 0; i < BENCH_NGRAMS; i++) {
+        bench_ngram_lens[i] = min_len + rand() % (max_len - min_len + 1);
+        bench_ngrams[i] = bench_text + rand() % (BENCH_TEXT_LEN - max_len);
+    }
+}
+
+uint32_t bench_hash(char *name, uint32_t iterations) {
+    uint64_t hashes[BENCH_NGRAMS];
+    uint64_t checksum_scalar = 0, checksum_batch = 0;
+    uint64_t t;
+
+    t = bench_ns();
+    for (uint32_t k = 0; k < iterations; k++) {
+        for (uint32_t i = 0; i < BENCH_NGRAMS; i++) {
+            checksum_scalar += text_hash56(bench_ngrams[i], bench_ngram_lens[i]);
+        }
+    }
+    uint64_t scalar_ns = bench_ns() - t;
+
+    t = bench_ns();
+    for (uint32_t k = 0; k < iterations; k++) {
+        text_hash56_batch(bench_ngrams, bench_ngram_lens, BENCH_NGRAMS, hashes);
+        for (uint32_t i = 0; i < BENCH_NGRAMS; i++) {
+            checksum_batch += hashes[i];
+        }
+    }
+    uint64_t batch_ns = bench_ns() - t;
+
+    printf("%-24s scalar %8.1f ns/hash, batch %8.1f ns/hash, speedup %.2fx\n", name,
+           (double) scalar_ns / iterations / BENCH_NGRAMS,
+           (double) batch_ns / iterations / BENCH_NGRAMS,
+           (double) scalar_ns / batch_ns);
+
+    if (checksum_scalar != checksum_batch) {
+        fprintf(stderr, "%s: batch hashes differ from scalar hashes\n", name);
+        return 0;
+    }
+    return 1;
+}
+
+uint32_t bench_rand32() {
+    return ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+}
+
+int bench_slot_cmp(const void *a, const void *b) {
+    const slot_t *x = a;
+    const slot_t *y = b;
+    if (x->hash32 != y->hash32) return x->hash32 < y->hash32 ? -1 : 1;
+    if (x->data != y->data) return x->data < y->data ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Rows with 1..2*avg_slots-1 random slots, a meta_id on the given share of them
+ * drawn from meta_ids_max, and names of 2-40 bytes
+ */
+uint32_t bench_rowcodec(char *name, uint32_t avg_slots, double meta_share, uint32_t meta_ids_max,
+                        uint32_t iterations) {
+    static slot_t rows[BENCH_ROWS][255];
+    static uint32_t rows_len[BENCH_ROWS];
+    static uint8_t encoded[BENCH_ROWS][ROWCODEC_MAX_LEN(255)];
+    static uint32_t encoded_len[BENCH_ROWS];
+    slot_t decoded[255];
+    uint64_t raw_bytes = 0, encoded_bytes = 0, slots = 0;
+    uint64_t checksum = 0;
+    uint64_t t;
+
+    for (uint32_t i = 0; i < BENCH_ROWS; i++) {
+        rows_len[i] = 1 + rand() % (2 * avg_slots - 1);
+        for (uint32_t j = 0; j < rows_len[i]; j++) {
+            uint64_t meta_id = (double) rand() / RAND_MAX < meta_share ? 1 + bench_rand32() % meta_ids_max : 0;
+            uint64_t name_len = 2 + rand() % 39;
+            rows[i][j].hash32 = bench_rand32();
+            rows[i][j].data = (meta_id << 34) | (((uint64_t) bench_rand32() & 0xFFFFFFF) << 6) | name_len;
+        }
+        raw_bytes += sizeof(slot_t) * rows_len[i];
+        slots += rows_len[i];
+    }
+
+    t = bench_ns();
+    for (uint32_t k = 0; k < iterations; k++) {
+        for (uint32_t i = 0; i < BENCH_ROWS; i++) {
+            encoded_len[i] = rowcodec_encode(rows[i], rows_len[i], encoded[i]);
+        }
+    }
+    uint64_t encode_ns = bench_ns() - t;
+
+    t = bench_ns();
+    for (uint32_t k = 0; k < iterations; k++) {
+        for (uint32_t i = 0; i < BENCH_ROWS; i++) {
+            checksum += rowcodec_decode(encoded[i], encoded_len[i], decoded, 255);
+            checksum += decoded[0].data;
+        }
+    }
+    uint64_t decode_ns = bench_ns() - t;
+
+    for (uint32_t i = 0; i < BENCH_ROWS; i++) {
+        encoded_bytes += encoded_len[i];
+        if (rowcodec_decode(encoded[i], encoded_len[i], decoded, 255) != rows_len[i]) {
+            fprintf(stderr, "%s: row %u decodes to a different length\n", name, i);
+            return 0;
+        }
+        qsort(rows[i], rows_len[i], sizeof(slot_t), bench_slot_cmp);
+        qsort(decoded, rows_len[i], sizeof(slot_t), bench_slot_cmp);
+        if (memcmp(rows[i], decoded, sizeof(slot_t) * rows_len[i])) {
+            fprintf(stderr, "%s: row %u decodes to different slots\n", name, i);
+            return 0;
+        }
+    }
+
+    printf("%-24s %5.1f%% of raw size, encode %6.1f ns/slot, decode %6.1f ns/slot (%" PRIu64 ")\n", name,
+           100.0 * encoded_bytes / raw_bytes,
+           (double) encode_ns / iterations / slots,
+           (double) decode_ns / iterations / slots, checksum % 10);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    uint32_t iterations = 1000;
+    if (argc > 1) iterations = (uint32_t) atoi(argv[1]);
+
+    srand(1);
+    for (uint32_t i = 0; i < BENCH_TEXT_LEN; i++) {
+        bench_text[i] = (uint8_t) ('a' + rand() % 26);
+    }
+
+    printf("hashing %u ngrams x %u iterations, %u lanes\n", BENCH_NGRAMS, iterations, TEXT_HASH_LANES);
+
+    bench_ngrams_init(8, 8);
+    if (!bench_hash("name scan (8 bytes)", iterations)) return EXIT_FAILURE;
+
+    bench_ngrams_init(2, 63);
+    if (!bench_hash("names (2-63 bytes)", iterations)) return EXIT_FAILURE;
+
+    bench_ngrams_init(20, 500);
+    if (!bench_hash("titles (20-500 bytes)", iterations)) return EXIT_FAILURE;
+
+    uint32_t row_iterations = iterations / 10 ? iterations / 10 : 1;
+    printf("coding %u rows x %u iterations\n", BENCH_ROWS, row_iterations);
+
+    if (!bench_rowcodec("1 slot, 70% meta_ids", 1, 0.7, 100000000, row_iterations)) return EXIT_FAILURE;
+    if (!bench_rowcodec("6 slots, 70% meta_ids", 6, 0.7, 100000000, row_iterations)) return EXIT_FAILURE;
+    if (!bench_rowcodec("6 slots, no meta_ids", 6, 0, 1, row_iterations)) return EXIT_FAILURE;
+    if (!bench_rowcodec("30 slots, 70% meta_ids", 30, 0.7, 100000000, row_iterations)) return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,637 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Offline builder. Reads a dump with title, name and identifiers per line and writes
+ * a new hashtable and identifiers db that the server can load, without going
+ * through ht_index one record at a time.
+ *
+ * Input is split into chunks at line feeds. Each chunk is parsed, fingerprinted and
+ * sorted on its own thread, then the sorted chunks are merged. Records with the same
+ * title hash and name fingerprint become one slot and their identifiers are merged,
+ * the same result as indexing them one by one.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <linux/limits.h>
+#include <jansson.h>
+#include <jemalloc/jemalloc.h>
+#include "ht.h"
+#include "db.h"
+#include "text.h"
+#include "idcodec.h"
+
+#define BUILD_THREADS_MAX 64
+#define BUILD_FORMAT_JSONL 0
+#define BUILD_FORMAT_CSV 1
+
+typedef struct build_record {
+    uint64_t hash;
+    uint64_t name_fingerprint;
+    // Encoded identifiers in the chunk's codes arena
+    uint64_t codes_offset;
+    uint32_t codes_len;
+    // Position of the record in its chunk
+    uint32_t seq;
+} build_record_t;
+
+// Records of one slot, merged
+typedef struct build_group {
+    uint64_t name_fingerprint;
+    // Input position of the first record, chunk index in the upper half
+    uint64_t first;
+    uint64_t codes_offset;
+    uint32_t codes_len;
+} build_group_t;
+
+typedef struct build_chunk {
+    uint8_t *start;
+    uint8_t *end;
+    uint8_t format;
+    build_record_t *records;
+    uint32_t records_len;
+    uint32_t records_size;
+    uint8_t *codes;
+    uint64_t codes_len;
+    uint64_t codes_size;
+    uint32_t rejected;
+    uint8_t failed;
+} build_chunk_t;
+
+uint64_t build_time() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// Records with the same key end up in the same slot
+int build_key_cmp(const build_record_t *x, const build_record_t *y) {
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    if (x->name_fingerprint != y->name_fingerprint) return x->name_fingerprint < y->name_fingerprint ? -1 : 1;
+    return 0;
+}
+
+int build_record_cmp(const void *a, const void *b) {
+    const build_record_t *x = a;
+    const build_record_t *y = b;
+    int cmp = build_key_cmp(x, y);
+    if (cmp) return cmp;
+    if (x->seq != y->seq) return x->seq < y->seq ? -1 : 1;
+    return 0;
+}
+
+int build_group_cmp(const void *a, const void *b) {
+    const build_group_t *x = a;
+    const build_group_t *y = b;
+    if (x->first != y->first) return x->first < y->first ? -1 : 1;
+    return 0;
+}
+
+// Copies a CSV field into out and returns a pointer past the field and its separator
+uint8_t *build_csv_field(uint8_t *p, uint8_t *end, uint8_t *out) {
+    if (p < end && *p == '"') {
+        p++;
+        while (p < end) {
+            if (*p == '"') {
+                if (p + 1 < end && p[1] == '"') {
+                    *out++ = '"';
+                    p += 2;
+                    continue;
+                }
+                p++;
+                break;
+            }
+            *out++ = *p++;
+        }
+        while (p < end && *p != ',') p++;
+    } else {
+        while (p < end && *p != ',') *out++ = *p++;
+    }
+    *out = 0;
+    return p < end ? p + 1 : p;
+}
+
+int build_chunk_record(build_chunk_t *chunk, uint8_t *title, uint8_t *name, uint8_t *identifiers) {
+    build_record_t record;
+
+    if (!title || !name || !ht_fingerprint(title, name, &record.hash, &record.name_fingerprint)) {
+        chunk->rejected++;
+        return 1;
+    }
+
+    // Codes can be a few bytes longer than identifiers, and are inserted directly at the arena tail
+    uint32_t identifiers_len = identifiers ? (uint32_t) strlen(identifiers) : 0;
+    uint64_t needed = chunk->codes_len + 4 * (uint64_t) identifiers_len + 16;
+    if (needed > chunk->codes_size) {
+        uint64_t size = chunk->codes_size;
+        while (needed > size) size *= 2;
+        uint8_t *codes;
+        if (!(codes = realloc(chunk->codes, size))) {
+            fprintf(stderr, "codes realloc failed\n");
+            return 0;
+        }
+        chunk->codes = codes;
+        chunk->codes_size = size;
+    }
+
+    if (chunk->records_len == chunk->records_size) {
+        uint32_t size = chunk->records_size * 2;
+        build_record_t *records;
+        if (!(records = realloc(chunk->records, sizeof(build_record_t) * size))) {
+            fprintf(stderr, "records realloc failed\n");
+            return 0;
+        }
+        chunk->records = records;
+        chunk->records_size = size;
+    }
+
+    uint8_t *list = chunk->codes + chunk->codes_len;
+    uint32_t list_len = 0;
+    uint8_t code[IDCODEC_CODE_MAX_LEN];
+
+    if (identifiers) {
+        uint8_t *p = identifiers;
+        uint8_t *s;
+
+        while (1) {
+            while (*p == ',' || *p == ' ') p++;
+            if (!*p) break;
+            s = p;
+            while (*p && *p != ',' && *p != ' ') p++;
+
+            uint32_t code_len = idcodec_encode(s, p - s, code);
+            if (code_len) {
+                list_len = idcodec_insert(list, list_len, code, code_len);
+            }
+
+            if (!*p) break;
+        }
+    }
+
+    record.codes_offset = chunk->codes_len;
+    record.codes_len = list_len;
+    record.seq = chunk->records_len;
+    chunk->codes_len += list_len;
+    chunk->records[chunk->records_len++] = record;
+    return 1;
+}
+
+void *build_chunk_process(void *arg) {
+    build_chunk_t *chunk = arg;
+    uint8_t *p = chunk->start;
+    uint8_t *line_buf = 0;
+    uint32_t line_buf_size = 0;
+
+    chunk->records_size = 65536;
+    chunk->codes_size = 1048576;
+    if (!(chunk->records = malloc(sizeof(build_record_t) * chunk->records_size))
+        || !(chunk->codes = malloc(chunk->codes_size))) {
+        fprintf(stderr, "chunk malloc failed\n");
+        chunk->failed = 1;
+        return 0;
+    }
+
+    while (p < chunk->end) {
+        uint8_t *line = p;
+        while (p < chunk->end && *p != '\n') p++;
+        uint8_t *line_end = p;
+        p++;
+
+        if (line_end > line && line_end[-1] == '\r') line_end--;
+        if (line_end == line) continue;
+
+        if (chunk->format == BUILD_FORMAT_JSONL) {
+            json_error_t error;
+            json_t *root = json_loadb((char *) line, line_end - line, 0, &error);
+            if (!root || !json_is_object(root)) {
+                chunk->rejected++;
+                if (root) json_decref(root);
+                continue;
+            }
+
+            uint8_t *title = (uint8_t *) json_string_value(json_object_get(root, "title"));
+            uint8_t *name = (uint8_t *) json_string_value(json_object_get(root, "name"));
+            uint8_t *identifiers = (uint8_t *) json_string_value(json_object_get(root, "identifiers"));
+
+            int rc = build_chunk_record(chunk, title, name, identifiers);
+            json_decref(root);
+            if (!rc) {
+                chunk->failed = 1;
+                break;
+            }
+        } else {
+            // Three fields, each unescaped into its own NUL terminated part of the line buffer
+            uint32_t len = (uint32_t) (line_end - line);
+            if (3 * (len + 1) > line_buf_size) {
+                line_buf_size = 3 * (len + 1);
+                free(line_buf);
+                if (!(line_buf = malloc(line_buf_size))) {
+                    fprintf(stderr, "line malloc failed\n");
+                    chunk->failed = 1;
+                    break;
+                }
+            }
+
+            uint8_t *title = line_buf;
+            uint8_t *name = line_buf + len + 1;
+            uint8_t *identifiers = line_buf + 2 * (len + 1);
+            uint8_t *f = build_csv_field(line, line_end, title);
+            f = build_csv_field(f, line_end, name);
+            build_csv_field(f, line_end, identifiers);
+
+            if (!strcmp((char *) title, "title") && !strcmp((char *) name, "name")) continue;
+
+            if (!build_chunk_record(chunk, title, name, identifiers)) {
+                chunk->failed = 1;
+                break;
+            }
+        }
+    }
+
+    free(line_buf);
+    qsort(chunk->records, chunk->records_len, sizeof(build_record_t), build_record_cmp);
+    return 0;
+}
+
+typedef struct build_state {
+    snapshot_t snapshot;
+    uint32_t last_meta_id;
+    uint32_t skipped;
+    // Slots of the current title hash
+    build_group_t *groups;
+    uint32_t groups_len;
+    uint32_t groups_size;
+    uint8_t *codes;
+    uint64_t codes_len;
+    uint64_t codes_size;
+} build_state_t;
+
+/*
+ * Adds the slots of one title hash. ht_index keeps the first MAX_SLOTS_PER_TITLE slots
+ * of a title in input order, so slots are taken in the order their first record came in.
+ */
+int build_write_title(build_state_t *state, uint64_t hash) {
+    snapshot_t *snapshot = &state->snapshot;
+
+    qsort(state->groups, state->groups_len, sizeof(build_group_t), build_group_cmp);
+
+    uint32_t row_id = (uint32_t) (hash >> 32);
+    uint8_t hash_slots = 0;
+
+    for (uint32_t i = 0; i < state->groups_len; i++) {
+        build_group_t *group = &state->groups[i];
+
+        uint32_t new_row = !snapshot->rows_len || row_id != snapshot->row_ids[snapshot->rows_len - 1];
+        uint32_t row_slots = new_row ? 0 : snapshot->used_slots - snapshot->offsets[snapshot->rows_len - 1];
+
+        // row_t.len is an uint8_t
+        if (hash_slots >= MAX_SLOTS_PER_TITLE || row_slots >= UINT8_MAX) {
+            state->skipped++;
+            continue;
+        }
+
+        if (new_row) {
+            snapshot->row_ids[snapshot->rows_len] = row_id;
+            snapshot->offsets[snapshot->rows_len] = snapshot->used_slots;
+            snapshot->rows_len++;
+        }
+
+        // Titles without identifiers get slots without meta_id, as in ht_index
+        uint32_t meta_id = 0;
+        if (group->codes_len) {
+            meta_id = ++state->last_meta_id;
+            if (!db_put_identifiers(meta_id, state->codes + group->codes_offset, group->codes_len)) return 0;
+        }
+
+        slot_t *slot = snapshot->slots + snapshot->used_slots++;
+        slot->hash32 = (uint32_t) (hash & 0xFFFFFFFF);
+        slot->data = (((uint64_t) meta_id) << 34) | group->name_fingerprint;
+        hash_slots++;
+    }
+
+    state->groups_len = 0;
+    state->codes_len = 0;
+    return 1;
+}
+
+/*
+ * Merges the sorted chunks and collects the slots of each title hash before writing them.
+ * Slots are collected into one snapshot, which is written in a single transaction.
+ */
+int build_write(build_chunk_t *chunks, uint32_t chunks_len, uint64_t records_len) {
+    uint32_t positions[BUILD_THREADS_MAX] = {0};
+    build_state_t state = {0};
+    snapshot_t *snapshot = &state.snapshot;
+    uint64_t bytes;
+    int rc = 0;
+
+    if (!(snapshot->row_ids = malloc(sizeof(uint32_t) * (records_len + 1)))
+        || !(snapshot->offsets = malloc(sizeof(uint32_t) * (records_len + 2)))
+        || !(snapshot->slots = malloc(sizeof(slot_t) * (records_len + 1)))) {
+        fprintf(stderr, "snapshot malloc failed\n");
+        goto done;
+    }
+
+    uint64_t hash = 0;
+
+    while (1) {
+        // Smallest head, ties go to the earlier chunk to keep input order
+        build_record_t *head = 0;
+        for (uint32_t i = 0; i < chunks_len; i++) {
+            if (positions[i] == chunks[i].records_len) continue;
+            build_record_t *r = chunks[i].records + positions[i];
+            if (!head || build_key_cmp(r, head) < 0) head = r;
+        }
+
+        if ((!head || head->hash != hash) && state.groups_len && !build_write_title(&state, hash)) goto done;
+        if (!head) break;
+        hash = head->hash;
+
+        if (state.groups_len == state.groups_size) {
+            uint32_t size = state.groups_size ? state.groups_size * 2 : 64;
+            build_group_t *groups;
+            if (!(groups = realloc(state.groups, sizeof(build_group_t) * size))) {
+                fprintf(stderr, "groups realloc failed\n");
+                goto done;
+            }
+            state.groups = groups;
+            state.groups_size = size;
+        }
+
+        build_record_t key = *head;
+        build_group_t *group = &state.groups[state.groups_len++];
+        group->name_fingerprint = key.name_fingerprint;
+        group->first = UINT64_MAX;
+        group->codes_offset = state.codes_len;
+        group->codes_len = 0;
+
+        // Records of the group in all chunks
+        for (uint32_t i = 0; i < chunks_len; i++) {
+            while (positions[i] < chunks[i].records_len) {
+                build_record_t *r = chunks[i].records + positions[i];
+                if (build_key_cmp(r, &key)) break;
+
+                uint64_t first = ((uint64_t) i << 32) | r->seq;
+                if (first < group->first) group->first = first;
+
+                if (state.codes_len + group->codes_len + r->codes_len > state.codes_size) {
+                    uint64_t size = (state.codes_len + group->codes_len + r->codes_len) * 2;
+                    uint8_t *codes;
+                    if (!(codes = realloc(state.codes, size))) {
+                        fprintf(stderr, "codes realloc failed\n");
+                        goto done;
+                    }
+                    state.codes = codes;
+                    state.codes_size = size;
+                }
+
+                uint8_t *list = state.codes + group->codes_offset;
+                uint8_t *codes = chunks[i].codes + r->codes_offset;
+                uint32_t pos = 0;
+                uint32_t n;
+                while (pos < r->codes_len && (n = idcodec_next(codes + pos, r->codes_len - pos))) {
+                    group->codes_len = idcodec_insert(list, group->codes_len, codes + pos, n);
+                    pos += n;
+                }
+                positions[i]++;
+            }
+        }
+        state.codes_len += group->codes_len;
+    }
+
+    snapshot->offsets[snapshot->rows_len] = snapshot->used_slots;
+    snapshot->used_hashes = snapshot->rows_len;
+
+    if (!db_save_identifiers()) goto done;
+
+    if (!db_save_hashtable(snapshot, &bytes)) goto done;
+
+    printf("wrote %u rows, %u slots, %u titles with identifiers, skipped %u slots over limits\n",
+           snapshot->rows_len, snapshot->used_slots, state.last_meta_id, state.skipped);
+    rc = 1;
+
+    done:
+    free(state.groups);
+    free(state.codes);
+    free(snapshot->row_ids);
+    free(snapshot->offsets);
+    free(snapshot->slots);
+    return rc;
+}
+
+/*
+ * The db is built in a temporary directory next to where it goes and moved in place when it's complete,
+ * so a failed build leaves nothing behind that would block a rerun.
+ */
+void build_remove(char *directory) {
+    const char *names[] = {"hashtable.sqlite", "identifiers.sqlite"};
+    const char *suffixes[] = {"", "-wal", "-shm", "-journal"};
+    char path[PATH_MAX];
+
+    for (uint32_t i = 0; i < 2; i++) {
+        for (uint32_t j = 0; j < 4; j++) {
+            snprintf(path, PATH_MAX, "%s/%s%s", directory, names[i], suffixes[j]);
+            unlink(path);
+        }
+    }
+    rmdir(directory);
+}
+
+int build_fail(char *directory) {
+    build_remove(directory);
+    return EXIT_FAILURE;
+}
+
+int build_move(char *from, char *to) {
+    const char *names[] = {"hashtable.sqlite", "identifiers.sqlite"};
+    char from_path[PATH_MAX];
+    char to_path[PATH_MAX];
+
+    for (uint32_t i = 0; i < 2; i++) {
+        snprintf(from_path, PATH_MAX, "%s/%s", from, names[i]);
+        snprintf(to_path, PATH_MAX, "%s/%s", to, names[i]);
+        if (rename(from_path, to_path)) {
+            fprintf(stderr, "rename: %s: %s\n", from_path, strerror(errno));
+            // Without its other half a moved file would only block a rerun
+            for (uint32_t j = 0; j < i; j++) {
+                snprintf(to_path, PATH_MAX, "%s/%s", to, names[j]);
+                unlink(to_path);
+            }
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void print_usage() {
+    printf("Missing parameters.\nUsage example:\ntitle-fingerprint-build -i dump.jsonl -d /var/db\n"
+           "Options:\n"
+           "  -f  input format, jsonl (default) or csv with title,name,identifiers columns\n"
+           "  -t  number of threads, all cores by default\n");
+}
+
+int main(int argc, char **argv) {
+    char *opt_input = 0;
+    char *opt_db_directory = 0;
+    uint8_t format = BUILD_FORMAT_JSONL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:d:f:t:")) != -1) {
+        switch (opt) {
+            case 'i':
+                opt_input = optarg;
+                break;
+            case 'd':
+                opt_db_directory = optarg;
+                break;
+            case 'f':
+                if (!strcmp(optarg, "csv")) {
+                    format = BUILD_FORMAT_CSV;
+                } else if (strcmp(optarg, "jsonl")) {
+                    print_usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                threads = atol(optarg);
+                break;
+            default:
+                print_usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!opt_input || !opt_db_directory) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (threads < 1) threads = 1;
+    if (threads > BUILD_THREADS_MAX) threads = BUILD_THREADS_MAX;
+
+    // Slots are written as a fresh db, merging into an existing one isn't supported
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/hashtable.sqlite", opt_db_directory);
+    if (!access(path, F_OK)) {
+        fprintf(stderr, "%s already exists\n", path);
+        return EXIT_FAILURE;
+    }
+    snprintf(path, PATH_MAX, "%s/identifiers.sqlite", opt_db_directory);
+    if (!access(path, F_OK)) {
+        fprintf(stderr, "%s already exists\n", path);
+        return EXIT_FAILURE;
+    }
+
+    int fd;
+    struct stat st;
+    if ((fd = open(opt_input, O_RDONLY)) < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "failed to open %s\n", opt_input);
+        return EXIT_FAILURE;
+    }
+
+    uint8_t *input = 0;
+    if (st.st_size && (input = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "failed to mmap %s\n", opt_input);
+        return EXIT_FAILURE;
+    }
+    if (st.st_size) madvise(input, st.st_size, MADV_SEQUENTIAL);
+
+    if (!text_init()) return EXIT_FAILURE;
+
+    // Left over by a build that was killed
+    char tmp_directory[PATH_MAX];
+    snprintf(tmp_directory, PATH_MAX, "%s/.build", opt_db_directory);
+    build_remove(tmp_directory);
+    if (mkdir(tmp_directory, 0755)) {
+        fprintf(stderr, "mkdir: %s: %s\n", tmp_directory, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (!db_init(tmp_directory)) return build_fail(tmp_directory);
+
+    uint64_t t = build_time();
+
+    build_chunk_t chunks[BUILD_THREADS_MAX] = {0};
+    pthread_t tids[BUILD_THREADS_MAX];
+    uint32_t chunks_len = 0;
+    uint8_t *p = input;
+    uint8_t *end = input + st.st_size;
+
+    while (p < end && chunks_len < threads) {
+        uint8_t *chunk_end = chunks_len == threads - 1 ? end : p + (end - p) / (threads - chunks_len);
+        while (chunk_end < end && *chunk_end != '\n') chunk_end++;
+        if (chunk_end < end) chunk_end++;
+
+        build_chunk_t *chunk = &chunks[chunks_len];
+        chunk->start = p;
+        chunk->end = chunk_end;
+        chunk->format = format;
+        if (pthread_create(&tids[chunks_len], NULL, build_chunk_process, chunk)) {
+            fprintf(stderr, "pthread_create failed\n");
+            return build_fail(tmp_directory);
+        }
+        chunks_len++;
+        p = chunk_end;
+    }
+
+    uint64_t records_len = 0;
+    uint32_t rejected = 0;
+    for (uint32_t i = 0; i < chunks_len; i++) {
+        pthread_join(tids[i], NULL);
+        if (chunks[i].failed) return build_fail(tmp_directory);
+        records_len += chunks[i].records_len;
+        rejected += chunks[i].rejected;
+    }
+
+    printf("fingerprinted %" PRIu64 " records, rejected %u, on %u threads in %" PRIu64 " ms\n",
+           records_len, rejected, chunks_len, build_time() - t);
+
+    t = build_time();
+    if (!build_write(chunks, chunks_len, records_len)) {
+        fprintf(stderr, "build failed\n");
+        return build_fail(tmp_directory);
+    }
+    printf("written in %" PRIu64 " ms\n", build_time() - t);
+
+    for (uint32_t i = 0; i < chunks_len; i++) {
+        free(chunks[i].records);
+        free(chunks[i].codes);
+    }
+    if (st.st_size) munmap(input, st.st_size);
+    close(fd);
+
+    if (!db_close() || !build_move(tmp_directory, opt_db_directory)) return build_fail(tmp_directory);
+    build_remove(tmp_directory);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,285 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Client library for the binary protocol. It has no dependencies besides libc,
+ * so it can be built into other programs on its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "client.h"
+
+#define CLIENT_OUT_BUF_LEN 262144
+#define CLIENT_IN_BUF_LEN (PROTO_HEADER_LEN + PROTO_PAYLOAD_MAX)
+
+static client_t *client_new(int fd) {
+    client_t *client = malloc(sizeof(client_t));
+    if (!client) {
+        close(fd);
+        return 0;
+    }
+    client->fd = fd;
+    client->next_id = 1;
+    client->out = malloc(CLIENT_OUT_BUF_LEN);
+    client->out_len = 0;
+    client->in = malloc(CLIENT_IN_BUF_LEN);
+    client->in_start = 0;
+    client->in_len = 0;
+    if (!client->out || !client->in) {
+        client_close(client);
+        return 0;
+    }
+    return client;
+}
+
+client_t *client_connect_tcp(char *host, char *port) {
+    struct addrinfo hints, *res, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rc = getaddrinfo(host, port, &hints, &res);
+    if (rc) {
+        fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(rc));
+        return 0;
+    }
+
+    int fd = -1;
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        fprintf(stderr, "failed to connect to %s:%s\n", host, port);
+        return 0;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return client_new(fd);
+}
+
+client_t *client_connect_unix(char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path is too long: %s\n", path);
+        return 0;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return 0;
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "failed to connect to %s: %s\n", path, strerror(errno));
+        close(fd);
+        return 0;
+    }
+
+    return client_new(fd);
+}
+
+void client_close(client_t *client) {
+    if (!client) return;
+    close(client->fd);
+    free(client->out);
+    free(client->in);
+    free(client);
+}
+
+int client_set_timeout(client_t *client, uint32_t timeout_ms) {
+    struct timeval tv = {(time_t) (timeout_ms / 1000), (suseconds_t) (timeout_ms % 1000) * 1000};
+    if (setsockopt(client->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        fprintf(stderr, "failed to set the receive timeout: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+int client_flush(client_t *client) {
+    uint8_t *data = client->out;
+    uint32_t len = client->out_len;
+    while (len) {
+        ssize_t n = send(client->fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        data += n;
+        len -= (uint32_t) n;
+    }
+    client->out_len = 0;
+    return 1;
+}
+
+static uint8_t *client_frame(client_t *client, uint8_t op, uint32_t payload_len, uint32_t *id) {
+    if (payload_len > PROTO_PAYLOAD_MAX) return 0;
+
+    if (client->out_len + PROTO_HEADER_LEN + payload_len > CLIENT_OUT_BUF_LEN && !client_flush(client)) {
+        return 0;
+    }
+
+    *id = client->next_id++;
+    if (!client->next_id) client->next_id = 1;
+
+    uint8_t *p = client->out + client->out_len;
+    proto_put_u32(p, payload_len);
+    p[4] = op;
+    proto_put_u32(p + 5, *id);
+    client->out_len += PROTO_HEADER_LEN + payload_len;
+    return p + PROTO_HEADER_LEN;
+}
+
+uint32_t client_send_identify(client_t *client, uint8_t *text, uint32_t text_len) {
+    uint32_t id;
+    uint8_t *p = client_frame(client, PROTO_OP_IDENTIFY, text_len, &id);
+    if (!p) return 0;
+    memcpy(p, text, text_len);
+    return id;
+}
+
+uint32_t client_send_index(client_t *client, uint8_t *title, uint8_t *name, uint8_t *identifiers) {
+    uint8_t *fields[3] = {title, name, identifiers};
+    size_t lens[3];
+    uint32_t payload_len = 0;
+    for (int i = 0; i < 3; i++) {
+        lens[i] = strlen((char *) fields[i]);
+        if (lens[i] > UINT16_MAX) return 0;
+        payload_len += 2 + (uint32_t) lens[i];
+    }
+
+    uint32_t id;
+    uint8_t *p = client_frame(client, PROTO_OP_INDEX, payload_len, &id);
+    if (!p) return 0;
+
+    for (int i = 0; i < 3; i++) {
+        proto_put_u16(p, (uint16_t) lens[i]);
+        memcpy(p + 2, fields[i], lens[i]);
+        p += 2 + lens[i];
+    }
+    return id;
+}
+
+uint32_t client_send_probe(client_t *client, uint64_t *hashes, uint32_t hashes_len) {
+    if (hashes_len > PROTO_PROBE_MAX) return 0;
+
+    uint32_t id;
+    uint8_t *p = client_frame(client, PROTO_OP_PROBE, hashes_len * 8, &id);
+    if (!p) return 0;
+
+    for (uint32_t i = 0; i < hashes_len; i++) {
+        proto_put_u64(p + i * 8, hashes[i]);
+    }
+    return id;
+}
+
+uint32_t client_send_identifiers(client_t *client, uint32_t meta_id) {
+    uint32_t id;
+    uint8_t *p = client_frame(client, PROTO_OP_IDENTIFIERS, 4, &id);
+    if (!p) return 0;
+    proto_put_u32(p, meta_id);
+    return id;
+}
+
+static int client_parse_string(uint8_t *payload, uint32_t len, uint32_t *pos, uint8_t **str, uint16_t *str_len) {
+    if (len - *pos < 2) return 0;
+    *str_len = proto_get_u16(payload + *pos);
+    *pos += 2;
+    if (len - *pos < *str_len) return 0;
+    *str = payload + *pos;
+    *pos += *str_len;
+    return 1;
+}
+
+int client_recv_raw(client_t *client, client_response_t *response) {
+    if (client->out_len && !client_flush(client)) return 0;
+
+    // Drop the previously returned frame
+    if (client->in_start) {
+        memmove(client->in, client->in + client->in_start, client->in_len - client->in_start);
+        client->in_len -= client->in_start;
+        client->in_start = 0;
+    }
+
+    uint32_t len = 0;
+    while (1) {
+        if (client->in_len >= PROTO_HEADER_LEN) {
+            len = proto_get_u32(client->in);
+            if (len > PROTO_PAYLOAD_MAX) {
+                fprintf(stderr, "invalid response frame length %u\n", len);
+                return 0;
+            }
+            if (client->in_len >= PROTO_HEADER_LEN + len) break;
+        }
+
+        ssize_t n = read(client->fd, client->in + client->in_len, CLIENT_IN_BUF_LEN - client->in_len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        client->in_len += (uint32_t) n;
+    }
+
+    memset(response, 0, sizeof(client_response_t));
+    response->status = client->in[4];
+    response->id = proto_get_u32(client->in + 5);
+    response->payload = client->in + PROTO_HEADER_LEN;
+    response->payload_len = len;
+    client->in_start = PROTO_HEADER_LEN + len;
+    return 1;
+}
+
+int client_recv(client_t *client, client_response_t *response) {
+    if (!client_recv_raw(client, response)) return 0;
+
+    uint32_t len = response->payload_len;
+    if (response->status == PROTO_OK && len) {
+        uint8_t *payload = response->payload;
+        uint32_t pos = 0;
+        if (!client_parse_string(payload, len, &pos, &response->title, &response->title_len) ||
+            !client_parse_string(payload, len, &pos, &response->name, &response->name_len) ||
+            !client_parse_string(payload, len, &pos, &response->identifiers, &response->identifiers_len)) {
+            fprintf(stderr, "malformed response %u\n", response->id);
+            return 0;
+        }
+    }
+
+    return 1;
+}
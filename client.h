@@ -0,0 +1,65 @@
+#ifndef TITLE_FINGERPRINT_DB_CLIENT_H
+#define TITLE_FINGERPRINT_DB_CLIENT_H
+
+#include <stdint.h>
+#include "proto.h"
+
+/*
+ * Client for the binary protocol. Requests are queued with client_send_*,
+ * which return the request id (never 0), and responses are read in the same
+ * order with client_recv. Keeping several requests in flight (pipelining)
+ * avoids paying a round trip per request. The server stops reading while
+ * its responses aren't read, so keep the window to what socket buffers hold
+ * (a few hundred requests).
+ */
+
+typedef struct client {
+    int fd;
+    uint32_t next_id;
+    uint8_t *out;
+    uint32_t out_len;
+    uint8_t *in;
+    uint32_t in_start;
+    uint32_t in_len;
+} client_t;
+
+// Strings point into the client's buffer and stay valid until the next client_recv
+typedef struct client_response {
+    uint8_t status;
+    uint32_t id;
+    uint8_t *title;
+    uint16_t title_len;
+    uint8_t *name;
+    uint16_t name_len;
+    uint8_t *identifiers;
+    uint16_t identifiers_len;
+    // Whole payload, the only part client_recv_raw sets besides status and id
+    uint8_t *payload;
+    uint32_t payload_len;
+} client_response_t;
+
+client_t *client_connect_tcp(char *host, char *port);
+
+client_t *client_connect_unix(char *path);
+
+void client_close(client_t *client);
+
+// Bounds each wait for a response, a read that times out fails like a closed connection. 0 waits forever
+int client_set_timeout(client_t *client, uint32_t timeout_ms);
+
+uint32_t client_send_identify(client_t *client, uint8_t *text, uint32_t text_len);
+
+uint32_t client_send_index(client_t *client, uint8_t *title, uint8_t *name, uint8_t *identifiers);
+
+uint32_t client_send_probe(client_t *client, uint64_t *hashes, uint32_t hashes_len);
+
+uint32_t client_send_identifiers(client_t *client, uint32_t meta_id);
+
+int client_flush(client_t *client);
+
+int client_recv(client_t *client, client_response_t *response);
+
+// For responses other than of identify, whose payload isn't split into strings
+int client_recv_raw(client_t *client, client_response_t *response);
+
+#endif //TITLE_FINGERPRINT_DB_CLIENT_H
@@ -25,17 +25,57 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <inttypes.h>
 #include <linux/limits.h>
 #include "ht.h"
 #include "db.h"
+#include "idcodec.h"
+#include "rowcodec.h"
 
 sqlite3 *sqlite;
 sqlite3 *sqlite_identifiers;
-sqlite3 *sqlite_identifiers_read;
+char sqlite_identifiers_path[PATH_MAX];
+char db_directory[PATH_MAX];
+// Incremented each time a db directory is opened, so readers of the previous one are reopened
+uint32_t db_generation = 0;
+
+// Each thread that looks up identifiers gets its own read-only connection and prepared statement
+typedef struct reader {
+    sqlite3 *sqlite;
+    sqlite3_stmt *get_identifiers_stmt;
+    uint32_t generation;
+} reader_t;
+
+pthread_key_t reader_key;
+pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+int reader_key_rc = 0;
 
 uint32_t last_meta_id = 0;
 uint32_t identifiers_in_transaction = 0;
 sqlite3_stmt *insert_stmt = 0;
+sqlite3_stmt *select_stmt = 0;
+
+// Identifiers of one meta_id while they are being updated
+uint8_t *identifiers_buf = 0;
+uint32_t identifiers_buf_size = 0;
+
+/*
+ * Lists changed in the current transaction, keyed by meta_id in an open addressing table.
+ * Each one is written once when the transaction is committed, instead of on every added identifier.
+ */
+typedef struct pending_list {
+    uint32_t meta_id;
+    uint32_t len;
+    uint32_t size;
+    uint8_t *list;
+} pending_list_t;
+
+pending_list_t *pending_lists = 0;
+uint32_t pending_lists_size = 0;
+uint32_t pending_lists_len = 0;
 
 int db_init(char *directory) {
     int rc;
@@ -45,7 +85,8 @@ int db_init(char *directory) {
     snprintf(path_hashtable, PATH_MAX, "%s/hashtable.sqlite", directory);
     snprintf(path_identifiers, PATH_MAX, "%s/identifiers.sqlite", directory);
 
-    if ((rc = sqlite3_config(SQLITE_CONFIG_SERIALIZED)) != SQLITE_OK) {
+    // SQLite can only be configured before it's initialized, a reload opens another directory later
+    if (!db_generation++ && (rc = sqlite3_config(SQLITE_CONFIG_SERIALIZED)) != SQLITE_OK) {
         fprintf(stderr, "sqlite3_config: (%i)\n", rc);
         return 0;
     }
@@ -58,28 +99,39 @@ int db_init(char *directory) {
         return 0;
     }
 
+    snprintf(db_directory, PATH_MAX, "%s", directory);
     return 1;
 }
 
+void db_pending_free() {
+    for (uint32_t i = 0; i < pending_lists_size; i++) free(pending_lists[i].list);
+    free(pending_lists);
+    pending_lists = 0;
+    pending_lists_size = 0;
+    pending_lists_len = 0;
+}
+
 int db_close() {
     int rc;
     printf("closing db\n");
+    // Lists of a transaction that wasn't committed are dropped, like the transaction itself
+    db_pending_free();
     if ((rc = sqlite3_finalize(insert_stmt)) != SQLITE_OK) {
         fprintf(stderr, "sqlite3_finalize: (%d): %s\n", rc, sqlite3_errmsg(sqlite));
         return 0;
     }
 
-    if ((rc = sqlite3_close(sqlite)) != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_close: (%d): %s\n", rc, sqlite3_errmsg(sqlite));
+    if ((rc = sqlite3_finalize(select_stmt)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_finalize: (%d): %s\n", rc, sqlite3_errmsg(sqlite));
         return 0;
     }
 
-    if ((rc = sqlite3_close(sqlite_identifiers)) != SQLITE_OK) {
+    if ((rc = sqlite3_close(sqlite)) != SQLITE_OK) {
         fprintf(stderr, "sqlite3_close: (%d): %s\n", rc, sqlite3_errmsg(sqlite));
         return 0;
     }
 
-    if ((rc = sqlite3_close(sqlite_identifiers_read)) != SQLITE_OK) {
+    if ((rc = sqlite3_close(sqlite_identifiers)) != SQLITE_OK) {
         fprintf(stderr, "sqlite3_close: (%d): %s\n", rc, sqlite3_errmsg(sqlite));
         return 0;
     }
@@ -102,49 +154,382 @@ int db_init_hashtable(char *path) {
         return 0;
     }
 
+    // Hashtable totals as of the last checkpoint, used to size memory and report progress at load time
+    sql = "CREATE TABLE IF NOT EXISTS meta (key TEXT PRIMARY KEY, value INTEGER);";
+    if ((rc = sqlite3_exec(sqlite, sql, 0, 0, &err_msg)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_exec: %s (%d): %s\n", sql, rc, err_msg);
+        sqlite3_free(err_msg);
+        return 0;
+    }
+
+    if (!db_migrate_hashtable()) {
+        return 0;
+    }
+
     return 1;
 }
 
-int db_init_identifiers(char *path) {
+// Rewrites rows stored as raw slots by earlier versions with the row codec
+int db_migrate_hashtable() {
     char *sql;
     int rc;
     char *err_msg = 0;
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_stmt *write_stmt = NULL;
+    uint32_t format = ROWCODEC_FORMAT_RAW;
 
-    if ((rc = sqlite3_open(path, &sqlite_identifiers)) != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_open: %s (%d): %s\n", path, rc, sqlite3_errmsg(sqlite_identifiers));
+    sql = "PRAGMA user_version";
+    if ((rc = sqlite3_prepare_v2(sqlite, sql, -1, &stmt, NULL)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite));
         return 0;
     }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        format = (uint32_t) sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
 
-    sql = "PRAGMA journal_mode = WAL;";
-    if ((rc = sqlite3_exec(sqlite_identifiers, sql, NULL, 0, 0)) != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_exec: %s (%d): %s\n", sql, rc, err_msg);
+    if (format == ROWCODEC_FORMAT_PACKED) return 1;
+
+    if (format != ROWCODEC_FORMAT_RAW) {
+        fprintf(stderr, "unknown hashtable format %u\n", format);
+        return 0;
+    }
+
+    sql = "BEGIN TRANSACTION;"
+          "CREATE TABLE hashtable_packed (id INTEGER PRIMARY KEY, data BLOB);";
+    if ((rc = sqlite3_exec(sqlite, sql, NULL, NULL, &err_msg)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_exec: %s (%i): %s\n", sql, rc, err_msg);
         sqlite3_free(err_msg);
         return 0;
     }
 
-    sql = "CREATE TABLE IF NOT EXISTS identifiers (meta_id INTEGER, identifier TEXT)";
-    if ((rc = sqlite3_exec(sqlite_identifiers, sql, 0, 0, &err_msg)) != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_exec: %s (%d): %s\n", sql, rc, err_msg);
+    sql = "INSERT INTO hashtable_packed (id, data) VALUES (?,?)";
+    if ((rc = sqlite3_prepare_v2(sqlite, sql, -1, &write_stmt, NULL)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite));
+        sqlite3_exec(sqlite, "ROLLBACK", NULL, NULL, NULL);
+        return 0;
+    }
+
+    sql = "SELECT id, data FROM hashtable";
+    if ((rc = sqlite3_prepare_v2(sqlite, sql, -1, &stmt, NULL)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite));
+        sqlite3_finalize(write_stmt);
+        sqlite3_exec(sqlite, "ROLLBACK", NULL, NULL, NULL);
+        return 0;
+    }
+
+    uint8_t out[ROWCODEC_MAX_LEN(ROW_SLOTS_MAX)];
+    uint64_t raw_bytes = 0;
+    uint64_t packed_bytes = 0;
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        uint32_t id = (uint32_t) sqlite3_column_int(stmt, 0);
+        slot_t *slots = (slot_t *) sqlite3_column_blob(stmt, 1);
+        uint32_t len = (uint32_t) sqlite3_column_bytes(stmt, 1);
+        uint32_t slots_len = len / sizeof(slot_t);
+
+        if (slots_len > UINT8_MAX) slots_len = UINT8_MAX;
+        if (!slots_len) continue;
+
+        uint32_t out_len = rowcodec_encode(slots, slots_len, out);
+
+        if (sqlite3_bind_int(write_stmt, 1, id) != SQLITE_OK
+            || sqlite3_bind_blob(write_stmt, 2, out, out_len, SQLITE_STATIC) != SQLITE_OK
+            || sqlite3_step(write_stmt) != SQLITE_DONE) {
+            fprintf(stderr, "failed to write row %u: %s\n", id, sqlite3_errmsg(sqlite));
+            rc = SQLITE_ERROR;
+            break;
+        }
+        sqlite3_reset(write_stmt);
+
+        raw_bytes += len;
+        packed_bytes += out_len;
+    }
+
+    sqlite3_finalize(stmt);
+    sqlite3_finalize(write_stmt);
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "hashtable migration failed\n");
+        sqlite3_exec(sqlite, "ROLLBACK", NULL, NULL, NULL);
+        return 0;
+    }
+
+    sql = "DROP TABLE hashtable;"
+          "ALTER TABLE hashtable_packed RENAME TO hashtable;"
+          "PRAGMA user_version = 1;"
+          "END TRANSACTION;";
+    if ((rc = sqlite3_exec(sqlite, sql, NULL, NULL, &err_msg)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_exec: %s (%i): %s\n", sql, rc, err_msg);
         sqlite3_free(err_msg);
+        sqlite3_exec(sqlite, "ROLLBACK", NULL, NULL, NULL);
         return 0;
     }
 
-    sql = "CREATE UNIQUE INDEX IF NOT EXISTS idx_meta_id_identifier ON identifiers (meta_id, identifier)";
-    if ((rc = sqlite3_exec(sqlite_identifiers, sql, 0, 0, &err_msg)) != SQLITE_OK) {
+    if (raw_bytes) {
+        sql = "VACUUM";
+        if ((rc = sqlite3_exec(sqlite, sql, NULL, NULL, &err_msg)) != SQLITE_OK) {
+            fprintf(stderr, "sqlite3_exec: %s (%i): %s\n", sql, rc, err_msg);
+            sqlite3_free(err_msg);
+        }
+
+        printf("migrated hashtable rows, %" PRIu64 " bytes of slots packed into %" PRIu64 " bytes\n",
+               raw_bytes, packed_bytes);
+    }
+    return 1;
+}
+
+void db_reader_free(void *arg) {
+    reader_t *reader = arg;
+    sqlite3_finalize(reader->get_identifiers_stmt);
+    sqlite3_close(reader->sqlite);
+    free(reader);
+}
+
+void db_reader_key() {
+    reader_key_rc = pthread_key_create(&reader_key, db_reader_free);
+}
+
+// Returns the calling thread's reader, opening it on first use and after the db directory changed
+reader_t *db_reader() {
+    reader_t *reader;
+    char *sql;
+    int rc;
+
+    if ((reader = pthread_getspecific(reader_key))) {
+        if (reader->generation == db_generation) return reader;
+        db_reader_free(reader);
+        pthread_setspecific(reader_key, 0);
+    }
+
+    if (!(reader = calloc(1, sizeof(reader_t)))) {
+        fprintf(stderr, "reader calloc failed\n");
+        return 0;
+    }
+
+    // The connection is used by one thread only, so SQLite's own mutexes aren't needed
+    if ((rc = sqlite3_open_v2(sqlite_identifiers_path, &reader->sqlite,
+                              SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_open_v2: %s (%d): %s\n", sqlite_identifiers_path, rc,
+                sqlite3_errmsg(reader->sqlite));
+        db_reader_free(reader);
+        return 0;
+    }
+
+    sql = "PRAGMA mmap_size = 1073741824;";
+    if ((rc = sqlite3_exec(reader->sqlite, sql, 0, 0, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_exec: %s (%d): %s\n", sql, rc, sqlite3_errmsg(reader->sqlite));
+        db_reader_free(reader);
+        return 0;
+    }
+
+    sql = "SELECT data FROM identifiers_packed WHERE meta_id = ?";
+    if ((rc = sqlite3_prepare_v3(reader->sqlite, sql, -1, SQLITE_PREPARE_PERSISTENT,
+                                 &reader->get_identifiers_stmt, NULL)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_prepare_v3: %s (%i): %s\n", sql, rc, sqlite3_errmsg(reader->sqlite));
+        db_reader_free(reader);
+        return 0;
+    }
+
+    reader->generation = db_generation;
+    pthread_setspecific(reader_key, reader);
+    return reader;
+}
+
+int db_identifiers_reserve(uint32_t len) {
+    if (len <= identifiers_buf_size) return 1;
+
+    uint32_t size = identifiers_buf_size ? identifiers_buf_size : 4096;
+    while (len > size) size *= 2;
+    uint8_t *buf;
+    if (!(buf = realloc(identifiers_buf, size))) {
+        fprintf(stderr, "identifiers buffer realloc failed\n");
+        return 0;
+    }
+    identifiers_buf = buf;
+    identifiers_buf_size = size;
+    return 1;
+}
+
+int db_write_identifiers(sqlite3_stmt *stmt, uint32_t meta_id, uint8_t *list, uint32_t list_len) {
+    int rc;
+
+    if ((rc = sqlite3_bind_int(stmt, 1, meta_id)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_bind_int: (%i): %s\n", rc, sqlite3_errmsg(sqlite_identifiers));
+        return 0;
+    }
+
+    if ((rc = sqlite3_bind_blob(stmt, 2, list, list_len, SQLITE_STATIC)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_bind_blob: (%i): %s\n", rc, sqlite3_errmsg(sqlite_identifiers));
+        return 0;
+    }
+
+    if ((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+        fprintf(stderr, "sqlite3_step: (%i): %s\n", rc, sqlite3_errmsg(sqlite_identifiers));
+        sqlite3_reset(stmt);
+        return 0;
+    }
+
+    if ((rc = sqlite3_reset(stmt)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_reset: (%i): %s\n", rc, sqlite3_errmsg(sqlite_identifiers));
+        return 0;
+    }
+    return 1;
+}
+
+// Converts the identifiers table of earlier versions, a text row per identifier, into identifiers_packed
+int db_migrate_identifiers() {
+    char *sql;
+    int rc;
+    char *err_msg = 0;
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_stmt *write_stmt = NULL;
+    uint32_t exists = 0;
+
+    sql = "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'identifiers'";
+    if ((rc = sqlite3_prepare_v2(sqlite_identifiers, sql, -1, &stmt, NULL)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite_identifiers));
+        return 0;
+    }
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        exists = (uint32_t) sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    if (!exists) return 1;
+
+    printf("migrating identifiers..\n");
+
+    sql = "BEGIN TRANSACTION";
+    if ((rc = sqlite3_exec(sqlite_identifiers, sql, NULL, NULL, &err_msg)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_exec: %s (%i): %s\n", sql, rc, err_msg);
+        sqlite3_free(err_msg);
+        return 0;
+    }
+
+    sql = "INSERT OR REPLACE INTO identifiers_packed (meta_id, data) VALUES (?,?);";
+    if ((rc = sqlite3_prepare_v2(sqlite_identifiers, sql, -1, &write_stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite_identifiers));
+        return 0;
+    }
+
+    sql = "SELECT meta_id, identifier FROM identifiers ORDER BY meta_id";
+    if ((rc = sqlite3_prepare_v2(sqlite_identifiers, sql, -1, &stmt, NULL)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite_identifiers));
+        sqlite3_finalize(write_stmt);
+        return 0;
+    }
+
+    uint8_t code[IDCODEC_CODE_MAX_LEN];
+    uint32_t meta_id = 0;
+    uint32_t list_len = 0;
+    uint32_t identifiers = 0;
+    uint32_t titles = 0;
+    uint64_t raw_bytes = 0;
+    uint64_t packed_bytes = 0;
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        uint32_t row_meta_id = (uint32_t) sqlite3_column_int(stmt, 0);
+        uint8_t *identifier = (uint8_t *) sqlite3_column_text(stmt, 1);
+        uint32_t identifier_len = (uint32_t) sqlite3_column_bytes(stmt, 1);
+
+        if (row_meta_id != meta_id && list_len) {
+            if (!db_write_identifiers(write_stmt, meta_id, identifiers_buf, list_len)) break;
+            packed_bytes += list_len;
+            titles++;
+            list_len = 0;
+        }
+        meta_id = row_meta_id;
+
+        uint32_t code_len = idcodec_encode(identifier, identifier_len, code);
+        if (!code_len) {
+            fprintf(stderr, "skipping too long identifier of meta_id %u\n", meta_id);
+            continue;
+        }
+
+        if (!db_identifiers_reserve(list_len + code_len)) break;
+        list_len = idcodec_insert(identifiers_buf, list_len, code, code_len);
+        raw_bytes += identifier_len;
+        identifiers++;
+    }
+
+    if (rc == SQLITE_DONE && list_len) {
+        if (db_write_identifiers(write_stmt, meta_id, identifiers_buf, list_len)) {
+            packed_bytes += list_len;
+            titles++;
+        } else {
+            rc = SQLITE_ERROR;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    sqlite3_finalize(write_stmt);
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "identifiers migration failed\n");
+        sqlite3_exec(sqlite_identifiers, "ROLLBACK", NULL, NULL, NULL);
+        return 0;
+    }
+
+    sql = "DROP TABLE identifiers";
+    if ((rc = sqlite3_exec(sqlite_identifiers, sql, NULL, NULL, &err_msg)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_exec: %s (%i): %s\n", sql, rc, err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_exec(sqlite_identifiers, "ROLLBACK", NULL, NULL, NULL);
+        return 0;
+    }
+
+    sql = "END TRANSACTION";
+    if ((rc = sqlite3_exec(sqlite_identifiers, sql, NULL, NULL, &err_msg)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_exec: %s (%i): %s\n", sql, rc, err_msg);
+        sqlite3_free(err_msg);
+        return 0;
+    }
+
+    // Gives the space of the old table and its indexes back
+    sql = "VACUUM; PRAGMA wal_checkpoint(TRUNCATE);";
+    if ((rc = sqlite3_exec(sqlite_identifiers, sql, NULL, NULL, &err_msg)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_exec: %s (%i): %s\n", sql, rc, err_msg);
+        sqlite3_free(err_msg);
+    }
+
+    printf("migrated %u identifiers of %u titles, %" PRIu64 " bytes of text packed into %" PRIu64 " bytes\n",
+           identifiers, titles, raw_bytes, packed_bytes);
+    return 1;
+}
+
+int db_init_identifiers(char *path) {
+    char *sql;
+    int rc;
+    char *err_msg = 0;
+
+    if ((rc = sqlite3_open(path, &sqlite_identifiers)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_open: %s (%d): %s\n", path, rc, sqlite3_errmsg(sqlite_identifiers));
+        return 0;
+    }
+
+    sql = "PRAGMA journal_mode = WAL;";
+    if ((rc = sqlite3_exec(sqlite_identifiers, sql, NULL, 0, 0)) != SQLITE_OK) {
         fprintf(stderr, "sqlite3_exec: %s (%d): %s\n", sql, rc, err_msg);
         sqlite3_free(err_msg);
         return 0;
     }
 
-    sql = "CREATE INDEX IF NOT EXISTS idx_meta_id ON identifiers (meta_id)";
+    // Identifiers of a meta_id are stored together as one list of codes, see idcodec.c
+    sql = "CREATE TABLE IF NOT EXISTS identifiers_packed (meta_id INTEGER PRIMARY KEY, data BLOB)";
     if ((rc = sqlite3_exec(sqlite_identifiers, sql, 0, 0, &err_msg)) != SQLITE_OK) {
         fprintf(stderr, "sqlite3_exec: %s (%d): %s\n", sql, rc, err_msg);
         sqlite3_free(err_msg);
         return 0;
     }
 
+    if (!db_migrate_identifiers()) {
+        return 0;
+    }
+
     sqlite3_stmt *stmt = NULL;
-    sql = "SELECT MAX(meta_id) FROM identifiers";
+    sql = "SELECT MAX(meta_id) FROM identifiers_packed";
     if ((rc = sqlite3_prepare_v2(sqlite_identifiers, sql, -1, &stmt, NULL)) != SQLITE_OK) {
         fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite_identifiers));
         return 0;
@@ -168,14 +553,23 @@ int db_init_identifiers(char *path) {
         return 0;
     }
 
-    sql = "INSERT OR IGNORE INTO identifiers (meta_id,identifier) VALUES (?,?);";
+    sql = "INSERT OR REPLACE INTO identifiers_packed (meta_id, data) VALUES (?,?);";
     if ((rc = sqlite3_prepare_v2(sqlite_identifiers, sql, -1, &insert_stmt, 0)) != SQLITE_OK) {
         fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite_identifiers));
         return 0;
     }
 
-    if ((rc = sqlite3_open(path, &sqlite_identifiers_read)) != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_open: %s (%d): %s\n", path, rc, sqlite3_errmsg(sqlite_identifiers_read));
+    sql = "SELECT data FROM identifiers_packed WHERE meta_id = ?;";
+    if ((rc = sqlite3_prepare_v2(sqlite_identifiers, sql, -1, &select_stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite_identifiers));
+        return 0;
+    }
+
+    snprintf(sqlite_identifiers_path, PATH_MAX, "%s", path);
+
+    pthread_once(&reader_once, db_reader_key);
+    if (reader_key_rc) {
+        fprintf(stderr, "pthread_key_create: (%d)\n", reader_key_rc);
         return 0;
     }
 
@@ -187,6 +581,13 @@ int db_save_identifiers() {
     char *err_msg = 0;
     int rc;
 
+    for (uint32_t i = 0; i < pending_lists_size; i++) {
+        pending_list_t *pending = &pending_lists[i];
+        if (!pending->list) continue;
+        if (!db_write_identifiers(insert_stmt, pending->meta_id, pending->list, pending->len)) return 0;
+    }
+    db_pending_free();
+
     sql = "END TRANSACTION";
     if ((rc = sqlite3_exec(sqlite_identifiers, sql, NULL, NULL, &err_msg)) != SQLITE_OK) {
         fprintf(stderr, "sqlite3_exec: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite_identifiers));
@@ -204,73 +605,247 @@ int db_save_identifiers() {
     return 1;
 }
 
-int db_insert_identifier(uint32_t meta_id, uint8_t *identifier, uint32_t identifier_len) {
+pending_list_t *db_pending_find(uint32_t meta_id) {
+    if (!pending_lists_size) return 0;
+    uint32_t i = (meta_id * 2654435761u) & (pending_lists_size - 1);
+    while (pending_lists[i].list) {
+        if (pending_lists[i].meta_id == meta_id) return &pending_lists[i];
+        i = (i + 1) & (pending_lists_size - 1);
+    }
+    return 0;
+}
+
+// Takes a copy of the list, the table is kept at most half full
+pending_list_t *db_pending_add(uint32_t meta_id, uint8_t *list, uint32_t list_len) {
+    if ((pending_lists_len + 1) * 2 > pending_lists_size) {
+        uint32_t size = pending_lists_size ? pending_lists_size * 2 : 1024;
+        pending_list_t *lists = calloc(size, sizeof(pending_list_t));
+        if (!lists) {
+            fprintf(stderr, "pending lists calloc failed\n");
+            return 0;
+        }
+        for (uint32_t j = 0; j < pending_lists_size; j++) {
+            if (!pending_lists[j].list) continue;
+            uint32_t i = (pending_lists[j].meta_id * 2654435761u) & (size - 1);
+            while (lists[i].list) i = (i + 1) & (size - 1);
+            lists[i] = pending_lists[j];
+        }
+        free(pending_lists);
+        pending_lists = lists;
+        pending_lists_size = size;
+    }
+
+    uint32_t i = (meta_id * 2654435761u) & (pending_lists_size - 1);
+    while (pending_lists[i].list) i = (i + 1) & (pending_lists_size - 1);
+
+    pending_list_t *pending = &pending_lists[i];
+    uint32_t size = list_len * 2 > 64 ? list_len * 2 : 64;
+    if (!(pending->list = malloc(size))) {
+        fprintf(stderr, "pending list malloc failed\n");
+        return 0;
+    }
+    memcpy(pending->list, list, list_len);
+    pending->meta_id = meta_id;
+    pending->len = list_len;
+    pending->size = size;
+    pending_lists_len++;
+    return pending;
+}
+
+/*
+ * Adds an encoded identifier to the ones the meta_id already has.
+ * The stored list is read once per transaction, later identifiers of the meta_id go to its pending list.
+ */
+int db_insert_identifier(uint32_t meta_id, uint8_t *code, uint32_t code_len) {
+    pending_list_t *pending = db_pending_find(meta_id);
+    if (pending) {
+        if (pending->len + code_len > pending->size) {
+            uint32_t size = (pending->len + code_len) * 2;
+            uint8_t *list = realloc(pending->list, size);
+            if (!list) {
+                fprintf(stderr, "pending list realloc failed\n");
+                return 0;
+            }
+            pending->list = list;
+            pending->size = size;
+        }
+
+        uint32_t len = idcodec_insert(pending->list, pending->len, code, code_len);
+        if (len == pending->len) return 1;
+        pending->len = len;
+        identifiers_in_transaction++;
+        return 1;
+    }
+
+    uint32_t list_len = 0;
     int rc;
 
-    if ((rc = sqlite3_bind_int(insert_stmt, 1, meta_id)) != SQLITE_OK) {
+    if ((rc = sqlite3_bind_int(select_stmt, 1, meta_id)) != SQLITE_OK) {
         fprintf(stderr, "sqlite3_bind_int: (%i): %s\n", rc, sqlite3_errmsg(sqlite_identifiers));
         return 0;
     }
 
-    if ((rc = sqlite3_bind_text(insert_stmt, 2, identifier, identifier_len, SQLITE_STATIC)) != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_bind_text: (%i): %s\n", rc, sqlite3_errmsg(sqlite_identifiers));
+    if ((rc = sqlite3_step(select_stmt)) == SQLITE_ROW) {
+        uint8_t *list = (uint8_t *) sqlite3_column_blob(select_stmt, 0);
+        list_len = (uint32_t) sqlite3_column_bytes(select_stmt, 0);
+        if (!db_identifiers_reserve(list_len + code_len)) {
+            sqlite3_reset(select_stmt);
+            return 0;
+        }
+        memcpy(identifiers_buf, list, list_len);
+    } else if (rc != SQLITE_DONE) {
+        fprintf(stderr, "sqlite3_step: (%i): %s\n", rc, sqlite3_errmsg(sqlite_identifiers));
+        sqlite3_reset(select_stmt);
         return 0;
     }
 
-    if ((rc = sqlite3_step(insert_stmt)) != SQLITE_DONE) {
-        fprintf(stderr, "sqlite3_step: (%i): %s\n", rc, sqlite3_errmsg(sqlite));
+    if ((rc = sqlite3_reset(select_stmt)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_reset: (%i): %s\n", rc, sqlite3_errmsg(sqlite_identifiers));
         return 0;
     }
 
-    if ((rc = sqlite3_clear_bindings(insert_stmt)) != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_clear_bindings: (%i): %s\n", rc, sqlite3_errmsg(sqlite));
+    if (!db_identifiers_reserve(list_len + code_len)) return 0;
+
+    uint32_t len = idcodec_insert(identifiers_buf, list_len, code, code_len);
+    if (len == list_len) return 1;
+
+    if (!db_pending_add(meta_id, identifiers_buf, len)) return 0;
+
+    identifiers_in_transaction++;
+    return 1;
+}
+
+// Deletes the identifiers of all meta_ids in the open transaction
+int db_clear_identifiers() {
+    char *sql;
+    char *err_msg = 0;
+    int rc;
+
+    db_pending_free();
+
+    sql = "DELETE FROM identifiers_packed";
+    if ((rc = sqlite3_exec(sqlite_identifiers, sql, NULL, NULL, &err_msg)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_exec: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite_identifiers));
+        sqlite3_free(err_msg);
         return 0;
     }
 
-    if ((rc = sqlite3_reset(insert_stmt)) != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_reset: (%i): %s\n", rc, sqlite3_errmsg(sqlite));
+    identifiers_in_transaction++;
+    return 1;
+}
+
+// Drops the writes of the open transaction and begins a new one
+int db_rollback_identifiers() {
+    char *sql;
+    char *err_msg = 0;
+    int rc;
+
+    db_pending_free();
+
+    sql = "ROLLBACK;"
+          "BEGIN TRANSACTION;";
+    if ((rc = sqlite3_exec(sqlite_identifiers, sql, NULL, NULL, &err_msg)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_exec: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite_identifiers));
+        sqlite3_free(err_msg);
         return 0;
     }
 
+    identifiers_in_transaction = 0;
+    return 1;
+}
+
+// Writes all encoded identifiers of a new meta_id at once, used by the offline builder
+int db_put_identifiers(uint32_t meta_id, uint8_t *list, uint32_t list_len) {
+    if (!db_write_identifiers(insert_stmt, meta_id, list, list_len)) return 0;
     identifiers_in_transaction++;
     return 1;
 }
 
-int db_get_identifiers(uint32_t id, uint8_t *identifiers, uint32_t identifiers_max_len) {
+/*
+ * Passes encoded identifiers of each meta_id, ordered by meta_id, to the callback.
+ * Reads on its own connection, so a directory can be loaded while another one is in use.
+ */
+int db_load_identifiers(char *directory, int (*load)(void *arg, uint32_t meta_id, uint8_t *list, uint32_t list_len),
+                        void *arg) {
+    char path[PATH_MAX];
     char *sql;
     int rc;
-
+    uint32_t loaded = 0;
+    uint64_t bytes = 0;
+    sqlite3 *db = 0;
     sqlite3_stmt *stmt = NULL;
-    sql = "SELECT GROUP_CONCAT(identifier) AS identifiers FROM identifiers WHERE meta_id = ? LIMIT 50";
-    if ((rc = sqlite3_prepare_v2(sqlite_identifiers_read, sql, -1, &stmt, NULL)) != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite_identifiers_read));
+
+    snprintf(path, PATH_MAX, "%s/identifiers.sqlite", directory);
+    if ((rc = sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_open_v2: %s (%d): %s\n", path, rc, sqlite3_errmsg(db));
+        sqlite3_close(db);
         return 0;
     }
 
-    if ((rc = sqlite3_bind_int(stmt, 1, id)) != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_bind_int: (%i): %s\n", rc, sqlite3_errmsg(sqlite_identifiers_read));
+    sql = "SELECT meta_id, data FROM identifiers_packed ORDER BY meta_id";
+    if ((rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(db));
+        sqlite3_close(db);
         return 0;
     }
 
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        uint8_t *row_identifiers = sqlite3_column_blob(stmt, 0);
-        uint32_t row_identifiers_len = (uint32_t) sqlite3_column_bytes(stmt, 0);
-        if (row_identifiers_len > identifiers_max_len - 1) {
-            row_identifiers_len = identifiers_max_len - 1;
-        }
-        memcpy(identifiers, row_identifiers, row_identifiers_len);
-        *(identifiers + row_identifiers_len) = 0;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        uint32_t meta_id = (uint32_t) sqlite3_column_int(stmt, 0);
+        uint8_t *list = (uint8_t *) sqlite3_column_blob(stmt, 1);
+        uint32_t list_len = (uint32_t) sqlite3_column_bytes(stmt, 1);
+        if (!load(arg, meta_id, list, list_len)) break;
+        loaded++;
+        bytes += list_len;
+    }
+
+    if (SQLITE_DONE != rc) {
+        if (SQLITE_ROW != rc) fprintf(stderr, "sqlite3_step: (%i): %s\n", rc, sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+        return 0;
     }
 
     if ((rc = sqlite3_finalize(stmt)) != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_finalize: (%d): %s\n", rc, sqlite3_errmsg(sqlite));
+        fprintf(stderr, "sqlite3_finalize: (%d): %s\n", rc, sqlite3_errmsg(db));
+        sqlite3_close(db);
         return 0;
     }
+    sqlite3_close(db);
+
+    printf("loaded identifiers of %u titles (%" PRIu64 " bytes)\n", loaded, bytes);
     return 1;
 }
 
+// Also returns the length of the identifiers before truncation to identifiers_max_len - 1
+int db_get_identifiers(uint32_t id, uint8_t *identifiers, uint32_t identifiers_max_len, uint32_t *identifiers_len) {
+    reader_t *reader;
+    sqlite3_stmt *stmt;
+    int rc;
+
+    if (!(reader = db_reader())) return 0;
+    stmt = reader->get_identifiers_stmt;
 
-int db_save_hashtable(row_t *rows, uint32_t rows_len) {
+    if ((rc = sqlite3_bind_int(stmt, 1, id)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_bind_int: (%i): %s\n", rc, sqlite3_errmsg(reader->sqlite));
+        return 0;
+    }
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        uint8_t *list = (uint8_t *) sqlite3_column_blob(stmt, 0);
+        uint32_t list_len = (uint32_t) sqlite3_column_bytes(stmt, 0);
+        *identifiers_len = idcodec_join(list, list_len, identifiers, identifiers_max_len);
+    }
+
+    if ((rc = sqlite3_reset(stmt)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_reset: (%d): %s\n", rc, sqlite3_errmsg(reader->sqlite));
+        return 0;
+    }
+    return 1;
+}
+
+// Saves snapshot rows and returns the number of encoded row bytes written
+int db_save_hashtable(snapshot_t *snapshot, uint64_t *bytes) {
+    uint8_t out[ROWCODEC_MAX_LEN(ROW_SLOTS_MAX)];
     char *sql;
     char *err_msg;
     int rc;
@@ -283,67 +858,156 @@ int db_save_hashtable(row_t *rows, uint32_t rows_len) {
     }
 
     sql = "BEGIN TRANSACTION";
-    if (sqlite3_exec(sqlite, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+    if ((rc = sqlite3_exec(sqlite, sql, NULL, NULL, &err_msg)) != SQLITE_OK) {
         fprintf(stderr, "sqlite3_exec: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite));
         sqlite3_free(err_msg);
+        sqlite3_finalize(stmt);
         return 0;
     }
 
-    for (int i = 0; i < rows_len; i++) {
-        row_t *row = &rows[i];
+    *bytes = 0;
+    for (uint32_t i = 0; i < snapshot->rows_len; i++) {
+        slot_t *slots = snapshot->slots + snapshot->offsets[i];
+        uint32_t slots_len = snapshot->offsets[i + 1] - snapshot->offsets[i];
 
-        if (!row->updated) continue;
-        row->updated = 0;
-
-        if ((rc = sqlite3_bind_int(stmt, 1, i)) != SQLITE_OK) {
+        if ((rc = sqlite3_bind_int(stmt, 1, snapshot->row_ids[i])) != SQLITE_OK) {
             fprintf(stderr, "sqlite3_bind_int: (%i): %s\n", rc, sqlite3_errmsg(sqlite));
-            return 0;
+            goto fail;
         }
 
-        if ((rc = sqlite3_bind_blob(stmt, 2, row->slots, sizeof(slot_t) * row->len, SQLITE_STATIC)) != SQLITE_OK) {
+        uint32_t out_len = rowcodec_encode(slots, slots_len, out);
+        if ((rc = sqlite3_bind_blob(stmt, 2, out, out_len, SQLITE_STATIC)) != SQLITE_OK) {
             fprintf(stderr, "sqlite3_bind_blob: (%i): %s\n", rc, sqlite3_errmsg(sqlite));
-            return 0;
+            goto fail;
         }
 
         if ((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
             fprintf(stderr, "sqlite3_step: (%i): %s\n", rc, sqlite3_errmsg(sqlite));
-            return 0;
+            goto fail;
         }
 
         if ((rc = sqlite3_clear_bindings(stmt)) != SQLITE_OK) {
             fprintf(stderr, "sqlite3_clear_bindings: (%i): %s\n", rc, sqlite3_errmsg(sqlite));
-            return 0;
+            goto fail;
         }
 
         if ((rc = sqlite3_reset(stmt)) != SQLITE_OK) {
             fprintf(stderr, "sqlite3_reset: (%i): %s\n", rc, sqlite3_errmsg(sqlite));
-            return 0;
+            goto fail;
         }
+
+        *bytes += out_len;
     }
 
-    sql = "END TRANSACTION";
-    if (sqlite3_exec(sqlite, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_exec: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite));
-        return 0;
+    rc = sqlite3_finalize(stmt);
+    stmt = NULL;
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_finalize: (%d): %s\n", rc, sqlite3_errmsg(sqlite));
+        goto fail;
     }
 
-    if ((rc = sqlite3_finalize(stmt)) != SQLITE_OK) {
+    sql = "INSERT OR REPLACE INTO meta (key, value) VALUES ('used_hashes', ?), ('used_slots', ?);";
+    if ((rc = sqlite3_prepare_v2(sqlite, sql, -1, &stmt, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite));
+        goto fail;
+    }
+
+    if ((rc = sqlite3_bind_int64(stmt, 1, snapshot->used_hashes)) != SQLITE_OK
+        || (rc = sqlite3_bind_int64(stmt, 2, snapshot->used_slots)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_bind_int64: (%i): %s\n", rc, sqlite3_errmsg(sqlite));
+        goto fail;
+    }
+
+    if ((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+        fprintf(stderr, "sqlite3_step: (%i): %s\n", rc, sqlite3_errmsg(sqlite));
+        goto fail;
+    }
+
+    rc = sqlite3_finalize(stmt);
+    stmt = NULL;
+    if (rc != SQLITE_OK) {
         fprintf(stderr, "sqlite3_finalize: (%d): %s\n", rc, sqlite3_errmsg(sqlite));
-        return 0;
+        goto fail;
+    }
+
+    sql = "END TRANSACTION";
+    if ((rc = sqlite3_exec(sqlite, sql, NULL, NULL, &err_msg)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_exec: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite));
+        sqlite3_free(err_msg);
+        goto fail;
     }
 
     return 1;
+
+    // The transaction must not stay open, or no later checkpoint could begin one
+    fail:
+    sqlite3_finalize(stmt);
+    sqlite3_exec(sqlite, "ROLLBACK", NULL, NULL, NULL);
+    return 0;
 }
 
-int db_load_hashtable(row_t *rows) {
+// Slots of all loaded rows are allocated from one block sized by the stored slot count
+typedef struct load_arena {
+    slot_t *slots;
+    uint64_t len;
+    uint64_t used;
+} load_arena_t;
+
+typedef struct load_range {
+    char *path;
+    row_t *rows;
+    load_arena_t *arena;
+    uint32_t start;
+    uint32_t end;
+    uint32_t loaded_hashes;
+    uint32_t loaded_slots;
+    uint8_t done;
     int rc;
-    char *sql;
+} load_range_t;
+
+slot_t *db_load_slots(load_arena_t *load_arena, uint32_t len, uint8_t *arena) {
+    if (load_arena->slots) {
+        uint64_t offset = __atomic_fetch_add(&load_arena->used, len, __ATOMIC_RELAXED);
+        if (offset + len <= load_arena->len) {
+            *arena = 1;
+            return load_arena->slots + offset;
+        }
+    }
+    *arena = 0;
+    return malloc(sizeof(slot_t) * len);
+}
+
+// Loads rows of one id range on its own read-only connection
+void *db_load_range(void *arg) {
+    load_range_t *range = arg;
+    sqlite3 *db = 0;
     sqlite3_stmt *stmt = NULL;
+    char *sql;
+    int rc;
 
-    sql = "SELECT id, data FROM hashtable";
-    if ((rc = sqlite3_prepare_v2(sqlite, sql, -1, &stmt, NULL)) != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(sqlite));
-        return 0;
+    range->rc = 0;
+
+    if ((rc = sqlite3_open_v2(range->path, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_open_v2: %s (%d): %s\n", range->path, rc, sqlite3_errmsg(db));
+        goto end;
+    }
+
+    sql = "PRAGMA mmap_size = 1073741824;";
+    if ((rc = sqlite3_exec(db, sql, 0, 0, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_exec: %s (%d): %s\n", sql, rc, sqlite3_errmsg(db));
+        goto end;
+    }
+
+    sql = "SELECT id, data FROM hashtable WHERE id >= ? AND id < ?";
+    if ((rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(db));
+        goto end;
+    }
+
+    if ((rc = sqlite3_bind_int(stmt, 1, range->start)) != SQLITE_OK
+        || (rc = sqlite3_bind_int(stmt, 2, range->end)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_bind_int: (%i): %s\n", rc, sqlite3_errmsg(db));
+        goto end;
     }
 
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
@@ -351,22 +1015,183 @@ int db_load_hashtable(row_t *rows) {
         uint8_t *data = sqlite3_column_blob(stmt, 1);
         uint32_t len = (uint32_t) sqlite3_column_bytes(stmt, 1);
 
-        if (id >= HASHTABLE_SIZE) continue;
+        uint32_t slots_len = rowcodec_count(data, len);
+        if (id >= HASHTABLE_SIZE || !slots_len || slots_len > UINT8_MAX) continue;
+
+        row_t *row = &range->rows[id];
+        if (!(row->slots = db_load_slots(range->arena, slots_len, &row->arena))) {
+            fprintf(stderr, "slot malloc failed\n");
+            goto end;
+        }
+
+        if (!(row->len = rowcodec_decode(data, len, row->slots, slots_len))) {
+            fprintf(stderr, "malformed row %u\n", id);
+            if (!row->arena) free(row->slots);
+            row->slots = 0;
+            continue;
+        }
 
-        rows[id].len = len / sizeof(slot_t);
-        rows[id].slots = malloc(len);
-        memcpy(rows[id].slots, data, len);
+        __atomic_add_fetch(&range->loaded_hashes, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&range->loaded_slots, row->len, __ATOMIC_RELAXED);
     }
 
     if (SQLITE_DONE != rc) {
-        fprintf(stderr, "sqlite3_step: (%i): %s\n", rc, sqlite3_errmsg(sqlite));
+        fprintf(stderr, "sqlite3_step: (%i): %s\n", rc, sqlite3_errmsg(db));
+        goto end;
+    }
+
+    range->rc = 1;
+
+    end:
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    __atomic_store_n(&range->done, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Reads the totals stored by the last checkpoint, they are 0 for databases saved before they were stored.
+ * Rows must already be in the row codec format, which opening the db with db_init migrates to.
+ */
+int db_load_meta(char *path, uint32_t *used_hashes, uint32_t *used_slots) {
+    int rc;
+    char *sql;
+    sqlite3 *db = 0;
+    sqlite3_stmt *stmt = NULL;
+    uint32_t format = ROWCODEC_FORMAT_RAW;
+
+    *used_hashes = 0;
+    *used_slots = 0;
+
+    if ((rc = sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, 0)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_open_v2: %s (%d): %s\n", path, rc, sqlite3_errmsg(db));
+        sqlite3_close(db);
         return 0;
     }
 
-    if ((rc = sqlite3_finalize(stmt)) != SQLITE_OK) {
-        fprintf(stderr, "sqlite3_finalize: (%d): %s\n", rc, sqlite3_errmsg(sqlite));
+    sql = "PRAGMA user_version";
+    if ((rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return 0;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        format = (uint32_t) sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    if (format != ROWCODEC_FORMAT_PACKED) {
+        fprintf(stderr, "%s: hashtable format %u needs to be migrated first\n", path, format);
+        sqlite3_close(db);
+        return 0;
+    }
+
+    sql = "SELECT key, value FROM meta";
+    if ((rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_prepare_v2: %s (%i): %s\n", sql, rc, sqlite3_errmsg(db));
+        sqlite3_close(db);
         return 0;
     }
 
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *key = (const char *) sqlite3_column_text(stmt, 0);
+        if (!strcmp(key, "used_hashes")) *used_hashes = (uint32_t) sqlite3_column_int64(stmt, 1);
+        else if (!strcmp(key, "used_slots")) *used_slots = (uint32_t) sqlite3_column_int64(stmt, 1);
+    }
+
+    if ((rc = sqlite3_finalize(stmt)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_finalize: (%d): %s\n", rc, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return 0;
+    }
+    sqlite3_close(db);
     return 1;
 }
+
+/*
+ * Loads the hashtable of a db directory into empty rows by splitting the row id space into ranges,
+ * each loaded on its own thread and connection. Rows with the arena flag set have their slots in
+ * the block returned in slots, which must be freed only together with the rows.
+ */
+int db_load_hashtable(char *directory, row_t *rows, slot_t **slots,
+                      uint32_t *used_hashes, uint32_t *used_slots) {
+    load_range_t ranges[DB_LOAD_THREADS_MAX] = {0};
+    pthread_t threads[DB_LOAD_THREADS_MAX];
+    load_arena_t load_arena = {0};
+    char path[PATH_MAX];
+    uint32_t stored_hashes, stored_slots;
+    struct timeval st, ct;
+
+    *slots = 0;
+    snprintf(path, PATH_MAX, "%s/hashtable.sqlite", directory);
+    if (!db_load_meta(path, &stored_hashes, &stored_slots)) return 0;
+
+    if (stored_slots && !(load_arena.slots = malloc(sizeof(slot_t) * stored_slots))) {
+        fprintf(stderr, "slot arena malloc failed\n");
+        return 0;
+    }
+    load_arena.len = stored_slots;
+    *slots = load_arena.slots;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads_len = cpus > DB_LOAD_THREADS_MAX ? DB_LOAD_THREADS_MAX : (cpus > 0 ? (uint32_t) cpus : 1);
+
+    gettimeofday(&st, NULL);
+
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < threads_len; i++) {
+        ranges[i].path = path;
+        ranges[i].rows = rows;
+        ranges[i].arena = &load_arena;
+        ranges[i].start = (uint32_t) ((uint64_t) HASHTABLE_SIZE * i / threads_len);
+        ranges[i].end = (uint32_t) ((uint64_t) HASHTABLE_SIZE * (i + 1) / threads_len);
+        if (pthread_create(&threads[i], NULL, db_load_range, &ranges[i])) {
+            fprintf(stderr, "pthread_create failed\n");
+            break;
+        }
+        started++;
+    }
+
+    uint32_t done = 0;
+    uint32_t ticks = 0;
+    while (done < started) {
+        usleep(100000);
+
+        uint32_t hashes = 0, slots = 0;
+        done = 0;
+        for (uint32_t i = 0; i < started; i++) {
+            hashes += __atomic_load_n(&ranges[i].loaded_hashes, __ATOMIC_RELAXED);
+            slots += __atomic_load_n(&ranges[i].loaded_slots, __ATOMIC_RELAXED);
+            done += __atomic_load_n(&ranges[i].done, __ATOMIC_ACQUIRE);
+        }
+
+        if (++ticks % 10 == 0 && done < started) {
+            gettimeofday(&ct, NULL);
+            double elapsed = (ct.tv_sec - st.tv_sec) + (ct.tv_usec - st.tv_usec) / 1000000.0;
+            if (stored_slots) {
+                printf("loading: %u/%u rows, %u/%u slots (%.0f%%), %.0f slots/s\n", hashes, stored_hashes,
+                       slots, stored_slots, 100.0 * slots / stored_slots, slots / elapsed);
+            } else {
+                printf("loading: %u rows, %u slots, %.0f slots/s\n", hashes, slots, slots / elapsed);
+            }
+            fflush(stdout);
+        }
+    }
+
+    int rc = started == threads_len;
+    *used_hashes = 0;
+    *used_slots = 0;
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (!ranges[i].rc) rc = 0;
+        *used_hashes += ranges[i].loaded_hashes;
+        *used_slots += ranges[i].loaded_slots;
+    }
+
+    gettimeofday(&ct, NULL);
+    double elapsed = (ct.tv_sec - st.tv_sec) + (ct.tv_usec - st.tv_usec) / 1000000.0;
+    printf("loaded %u rows, %u slots on %u threads in %.2f s (%.0f slots/s)\n",
+           *used_hashes, *used_slots, started, elapsed, elapsed > 0 ? *used_slots / elapsed : 0);
+
+    return rc;
+}
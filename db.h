@@ -1,22 +1,38 @@
 #ifndef TITLE_FINGERPRINT_DB_DB_H
 #define TITLE_FINGERPRINT_DB_DB_H
 
+#define DB_LOAD_THREADS_MAX 16
+
 int db_init(char *directory);
 
 int db_close();
 
 int db_init_hashtable(char *path);
 
+int db_migrate_hashtable();
+
 int db_init_identifiers(char *path);
 
 int db_save_identifiers();
 
-int db_insert_identifier(uint32_t meta_id, uint8_t *identifier, uint32_t identifier_len);
+int db_migrate_identifiers();
+
+int db_insert_identifier(uint32_t meta_id, uint8_t *code, uint32_t code_len);
+
+int db_clear_identifiers();
+
+int db_rollback_identifiers();
+
+int db_put_identifiers(uint32_t meta_id, uint8_t *list, uint32_t list_len);
+
+int db_load_identifiers(char *directory, int (*load)(void *arg, uint32_t meta_id, uint8_t *list, uint32_t list_len),
+                        void *arg);
 
-int db_get_identifiers(uint32_t id, uint8_t *dis, uint32_t dis_max_len);
+int db_get_identifiers(uint32_t id, uint8_t *dis, uint32_t dis_max_len, uint32_t *dis_len);
 
-int db_save_hashtable(row_t *rows, uint32_t rows_len);
+int db_save_hashtable(snapshot_t *snapshot, uint64_t *bytes);
 
-int db_load_hashtable(row_t *rows);
+int db_load_hashtable(char *directory, row_t *rows, slot_t **slots,
+                      uint32_t *used_hashes, uint32_t *used_slots);
 
 #endif //TITLE_FINGERPRINT_DB_DB_H
@@ -0,0 +1,251 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Streams every slot with its identifiers, either to part files (one row range per thread)
+ * or to a caller supplied writer. Rows are formatted EXPORT_CHUNK_ROWS at a time under
+ * the read lock, and the lock is released before the chunk is written out.
+ * Chunks after a reload come from the reloaded version.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <linux/limits.h>
+#include <jemalloc/jemalloc.h>
+#include "ht.h"
+#include "export.h"
+#include "metrics.h"
+
+extern row_t *rows;
+extern pthread_rwlock_t rwlock;
+
+typedef struct export_buf {
+    uint8_t *data;
+    uint32_t len;
+    uint32_t size;
+} export_buf_t;
+
+typedef struct export_part {
+    uint32_t row_start;
+    uint32_t row_end;
+    uint8_t format;
+    FILE *file;
+    uint64_t slots;
+    uint8_t failed;
+} export_part_t;
+
+int export_reserve(export_buf_t *buf, uint32_t len) {
+    if (buf->len + len <= buf->size) return 1;
+
+    uint32_t size = buf->size ? buf->size : 65536;
+    while (buf->len + len > size) size *= 2;
+    uint8_t *data;
+    if (!(data = realloc(buf->data, size))) {
+        fprintf(stderr, "export buffer realloc failed\n");
+        return 0;
+    }
+    buf->data = data;
+    buf->size = size;
+    return 1;
+}
+
+int export_ndjson_slot(export_buf_t *buf, uint64_t hash, uint64_t data, uint8_t *identifiers) {
+    // Escaping can at most sextuple identifiers, plus the numbers and keys
+    if (!export_reserve(buf, 6 * strlen((char *) identifiers) + 128)) return 0;
+
+    uint8_t *p = buf->data + buf->len;
+    p += sprintf((char *) p, "{\"hash\":%" PRIu64 ",\"meta_id\":%" PRIu64 ",\"name_fingerprint\":%" PRIu64
+                 ",\"identifiers\":\"", hash, data >> 34, data & 0x3FFFFFFFF);
+
+    for (uint8_t *s = identifiers; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            *p++ = '\\';
+            *p++ = *s;
+        } else if (*s < 0x20) {
+            p += sprintf((char *) p, "\\u%04x", *s);
+        } else {
+            *p++ = *s;
+        }
+    }
+
+    *p++ = '"';
+    *p++ = '}';
+    *p++ = '\n';
+    buf->len = (uint32_t) (p - buf->data);
+    return 1;
+}
+
+int export_binary_slot(export_buf_t *buf, uint64_t hash, uint64_t data, uint8_t *identifiers) {
+    size_t len = strlen((char *) identifiers);
+    // Lists the length field can't hold fail the export, rather than being cut
+    if (len >= EXPORT_BINARY_ERROR) {
+        fprintf(stderr, "identifiers of meta_id %" PRIu64 " are too long for a binary export (%zu bytes)\n",
+                data >> 34, len);
+        return 0;
+    }
+
+    uint16_t identifiers_len = (uint16_t) len;
+    if (!export_reserve(buf, 18 + identifiers_len)) return 0;
+
+    uint8_t *p = buf->data + buf->len;
+    memcpy(p, &hash, 8);
+    memcpy(p + 8, &data, 8);
+    memcpy(p + 16, &identifiers_len, 2);
+    memcpy(p + 18, identifiers, identifiers_len);
+    buf->len += 18 + identifiers_len;
+    return 1;
+}
+
+int export_rows(uint32_t row_start, uint32_t row_end, uint8_t format,
+                export_write_t write, void *ctx, uint64_t *slots) {
+    export_buf_t buf = {0};
+    // Grown to the longest identifiers list, which is always exported in full
+    uint32_t identifiers_size = 4096;
+    uint8_t *identifiers = malloc(identifiers_size);
+    int rc = 1;
+
+    if (!identifiers) {
+        fprintf(stderr, "identifiers malloc failed\n");
+        return 0;
+    }
+
+    if (row_end > HASHTABLE_SIZE) row_end = HASHTABLE_SIZE;
+    *slots = 0;
+
+    for (uint32_t chunk_start = row_start; chunk_start < row_end && rc; chunk_start += EXPORT_CHUNK_ROWS) {
+        uint32_t chunk_end = chunk_start + EXPORT_CHUNK_ROWS < row_end ? chunk_start + EXPORT_CHUNK_ROWS : row_end;
+        buf.len = 0;
+
+        uint64_t locked = metrics_rdlock(&rwlock);
+        for (uint32_t i = chunk_start; i < chunk_end && rc; i++) {
+            row_t *row = rows + i;
+            for (uint32_t j = 0; j < row->len; j++) {
+                slot_t *slot = row->slots + j;
+                uint64_t hash = (((uint64_t) i) << 32) | slot->hash32;
+                uint32_t meta_id = (uint32_t) (slot->data >> 34);
+
+                identifiers[0] = 0;
+                uint32_t identifiers_len = meta_id ? ht_get_identifiers(meta_id, identifiers, identifiers_size) : 0;
+                if (identifiers_len >= identifiers_size) {
+                    uint8_t *p;
+                    if (!(p = realloc(identifiers, identifiers_len + 1))) {
+                        fprintf(stderr, "identifiers realloc failed\n");
+                        rc = 0;
+                        break;
+                    }
+                    identifiers = p;
+                    identifiers_size = identifiers_len + 1;
+                    ht_get_identifiers(meta_id, identifiers, identifiers_size);
+                }
+
+                if (format == EXPORT_FORMAT_BINARY) {
+                    rc = export_binary_slot(&buf, hash, slot->data, identifiers);
+                } else {
+                    rc = export_ndjson_slot(&buf, hash, slot->data, identifiers);
+                }
+                if (!rc) break;
+                (*slots)++;
+            }
+        }
+        metrics_unlock(&rwlock, locked, 0);
+
+        if (rc && buf.len) rc = write(ctx, buf.data, buf.len);
+    }
+
+    free(buf.data);
+    free(identifiers);
+    return rc;
+}
+
+int export_file_write(void *ctx, uint8_t *data, uint32_t data_len) {
+    export_part_t *part = ctx;
+    if (fwrite(data, 1, data_len, part->file) != data_len) {
+        fprintf(stderr, "export write failed\n");
+        return 0;
+    }
+    return 1;
+}
+
+void *export_part_thread(void *arg) {
+    export_part_t *part = arg;
+    if (!export_rows(part->row_start, part->row_end, part->format, export_file_write, part, &part->slots)) {
+        part->failed = 1;
+    }
+    return 0;
+}
+
+// Writes part-NNN files to the directory, each with a contiguous range of rows
+int export_files(char *directory, uint32_t threads, uint8_t format) {
+    export_part_t parts[EXPORT_THREADS_MAX];
+    pthread_t tids[EXPORT_THREADS_MAX];
+    char path[PATH_MAX];
+    struct timeval st, et;
+    uint64_t slots = 0;
+    int rc = 1;
+
+    if (threads < 1) threads = 1;
+    if (threads > EXPORT_THREADS_MAX) threads = EXPORT_THREADS_MAX;
+
+    gettimeofday(&st, NULL);
+
+    uint32_t rows_per_part = (HASHTABLE_SIZE + threads - 1) / threads;
+    for (uint32_t i = 0; i < threads; i++) {
+        export_part_t *part = &parts[i];
+        memset(part, 0, sizeof(export_part_t));
+        part->row_start = i * rows_per_part;
+        part->row_end = part->row_start + rows_per_part;
+        part->format = format;
+
+        snprintf(path, PATH_MAX, "%s/part-%03u.%s", directory, i,
+                 format == EXPORT_FORMAT_BINARY ? "bin" : "ndjson");
+        if (!(part->file = fopen(path, "wb"))) {
+            fprintf(stderr, "failed to open %s\n", path);
+            threads = i;
+            rc = 0;
+            break;
+        }
+
+        if (pthread_create(&tids[i], NULL, export_part_thread, part)) {
+            fprintf(stderr, "pthread_create failed\n");
+            fclose(part->file);
+            threads = i;
+            rc = 0;
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        if (fclose(parts[i].file) || parts[i].failed) rc = 0;
+        slots += parts[i].slots;
+    }
+
+    gettimeofday(&et, NULL);
+    uint64_t elapsed = (et.tv_sec - st.tv_sec) * 1000 + (et.tv_usec - st.tv_usec) / 1000;
+    printf("exported %" PRIu64 " slots to %u files in %" PRIu64 " ms\n", slots, threads, elapsed);
+    return rc;
+}
@@ -0,0 +1,26 @@
+#ifndef TITLE_FINGERPRINT_DB_EXPORT_H
+#define TITLE_FINGERPRINT_DB_EXPORT_H
+
+#include <stdint.h>
+
+#define EXPORT_THREADS_MAX 16
+
+// Rows formatted per read lock, writers wait at most for one chunk
+#define EXPORT_CHUNK_ROWS 4096
+
+#define EXPORT_FORMAT_NDJSON 0
+// Per slot: uint64 hash, uint64 data, uint16 identifiers length and comma separated identifiers, little-endian
+#define EXPORT_FORMAT_BINARY 1
+
+// Identifiers length of a binary record that ends a failed export, the record has no identifiers
+#define EXPORT_BINARY_ERROR 0xFFFF
+
+// Receives formatted slots, returns 0 to stop the export
+typedef int (*export_write_t)(void *ctx, uint8_t *data, uint32_t data_len);
+
+int export_rows(uint32_t row_start, uint32_t row_end, uint8_t format,
+                export_write_t write, void *ctx, uint64_t *slots);
+
+int export_files(char *directory, uint32_t threads, uint8_t format);
+
+#endif //TITLE_FINGERPRINT_DB_EXPORT_H
@@ -30,29 +30,46 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
-#include <sys/time.h>
+#include <linux/limits.h>
 #include <jemalloc/jemalloc.h>
 #include "ht.h"
 #include "db.h"
 #include "text.h"
-
-row_t rows[HASHTABLE_SIZE] = {0};
-struct timeval t_updated = {0};
+#include "oplog.h"
+#include "idcodec.h"
+#include "idstore.h"
+#include "metrics.h"
+#include "persist.h"
+#include "arena.h"
+#include "replog.h"
+#include "shard.h"
+
+// Current version, swapped by ht_switch under the write lock
+row_t *rows = 0;
+slot_t *rows_slots = 0;
+idstore_t *idstore = 0;
+
+uint32_t used_hashes = 0;
+uint32_t used_slots = 0;
+
+// Ids of rows changed since the last snapshot, row->updated tells if a row is already listed
+uint32_t *dirty_rows = 0;
+uint32_t dirty_rows_len = 0;
+uint32_t dirty_rows_size = 0;
 extern uint32_t last_meta_id;
+extern uint32_t identifiers_in_transaction;
+extern char db_directory[PATH_MAX];
+// Identifiers are looked up in SQLite instead of the in-memory store if set to 0
+uint8_t identifiers_in_memory = 1;
 //uint32_t indexed = 0;
 
-uint32_t ht_init() {
-    printf("loading hashtable..\n");
-    if (!db_load_hashtable(rows)) {
-        return 0;
-    }
-    return 1;
-}
-
 stats_t ht_stats() {
     stats_t stats = {0};
+    // A router has no rows of its own
+    if (!rows) return stats;
     for (uint32_t i = 0; i < HASHTABLE_SIZE; i++) {
         if (rows[i].len) stats.used_hashes++;
         stats.used_slots += rows[i].len;
@@ -86,6 +103,94 @@ uint8_t ht_hash_slots(uint64_t hash, slot_t **slots, uint8_t *slots_len) {
     return *slots_len;
 }
 
+uint32_t ht_mark_dirty(row_t *row) {
+    if (row->updated) return 1;
+
+    if (dirty_rows_len == dirty_rows_size) {
+        uint32_t size = dirty_rows_size ? dirty_rows_size * 2 : 65536;
+        uint32_t *list;
+        if (!(list = realloc(dirty_rows, sizeof(uint32_t) * size))) {
+            fprintf(stderr, "dirty rows realloc failed");
+            return 0;
+        }
+        dirty_rows = list;
+        dirty_rows_size = size;
+    }
+
+    dirty_rows[dirty_rows_len++] = (uint32_t) (row - rows);
+    row->updated = 1;
+    return 1;
+}
+
+int ht_row_id_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+void ht_snapshot_free(snapshot_t *snapshot) {
+    if (!snapshot) return;
+    free(snapshot->row_ids);
+    free(snapshot->offsets);
+    free(snapshot->slots);
+    free(snapshot);
+}
+
+/*
+ * Copies rows changed since the last snapshot and starts tracking changes anew.
+ * Only changed rows are copied, so taking a snapshot under the lock is proportional
+ * to the amount of change. Row ids are sorted for sequential inserts.
+ */
+snapshot_t *ht_snapshot() {
+    snapshot_t *snapshot;
+    uint32_t len = 0;
+    uint32_t slots_len = 0;
+
+    qsort(dirty_rows, dirty_rows_len, sizeof(uint32_t), ht_row_id_cmp);
+
+    // A row is listed twice if it was changed again after a failed checkpoint
+    for (uint32_t i = 0; i < dirty_rows_len; i++) {
+        if (!len || dirty_rows[len - 1] != dirty_rows[i]) {
+            dirty_rows[len++] = dirty_rows[i];
+            slots_len += rows[dirty_rows[i]].len;
+        }
+    }
+    dirty_rows_len = len;
+
+    if (!(snapshot = calloc(1, sizeof(snapshot_t)))
+        || !(snapshot->row_ids = malloc(sizeof(uint32_t) * (len + 1)))
+        || !(snapshot->offsets = malloc(sizeof(uint32_t) * (len + 1)))
+        || !(snapshot->slots = malloc(sizeof(slot_t) * (slots_len + 1)))) {
+        fprintf(stderr, "snapshot malloc failed");
+        ht_snapshot_free(snapshot);
+        return 0;
+    }
+
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        row_t *row = &rows[dirty_rows[i]];
+        snapshot->row_ids[i] = dirty_rows[i];
+        snapshot->offsets[i] = offset;
+        memcpy(snapshot->slots + offset, row->slots, sizeof(slot_t) * row->len);
+        offset += row->len;
+        row->updated = 0;
+    }
+    snapshot->offsets[len] = offset;
+    snapshot->rows_len = len;
+    snapshot->used_hashes = used_hashes;
+    snapshot->used_slots = used_slots;
+
+    dirty_rows_len = 0;
+    return snapshot;
+}
+
+// Marks rows of a snapshot that failed to be written as changed again
+void ht_snapshot_restore(snapshot_t *snapshot) {
+    for (uint32_t i = 0; i < snapshot->rows_len; i++) {
+        ht_mark_dirty(&rows[snapshot->row_ids[i]]);
+    }
+}
+
 uint32_t ht_add_slot(uint64_t hash, uint64_t data) {
     uint32_t hash23 = (uint32_t) (hash >> 32);
     uint32_t hash32 = (uint32_t) (hash & 0xFFFFFFFF);
@@ -96,31 +201,379 @@ uint32_t ht_add_slot(uint64_t hash, uint64_t data) {
             fprintf(stderr, "reached ROW_SLOTS_MAX limit");
             return 0;
         }
-        if (!(row->slots = realloc(row->slots, sizeof(slot_t) * (row->len + 1)))) {
+        if (row->arena) {
+            slot_t *slots;
+            if (!(slots = malloc(sizeof(slot_t) * (row->len + 1)))) {
+                fprintf(stderr, "slot malloc failed");
+                return 0;
+            }
+            memcpy(slots, row->slots, sizeof(slot_t) * row->len);
+            row->slots = slots;
+            row->arena = 0;
+        } else if (!(row->slots = realloc(row->slots, sizeof(slot_t) * (row->len + 1)))) {
             fprintf(stderr, "slot realloc failed");
             return 0;
         };
-        row->updated = 1;
     } else {
         if (!(row->slots = malloc(sizeof(slot_t)))) {
             fprintf(stderr, "slot malloc failed");
             return 0;
         }
-        row->updated = 1;
     }
 
+    if (!ht_mark_dirty(row)) return 0;
+
     slot_t *slot = row->slots + row->len;
     slot->hash32 = hash32;
     slot->data = data;
 
+    if (!row->len) used_hashes++;
+    used_slots++;
     row->len++;
     return 1;
 }
 
-uint32_t ht_index(uint8_t *title, uint8_t *name, uint8_t *identifiers) {
+// Finds the slot with the same title hash and name fingerprint
+slot_t *ht_find_slot(uint64_t hash, uint64_t data) {
+    uint32_t hash24 = (uint32_t) (hash >> 32);
+    uint32_t hash32 = (uint32_t) (hash & 0xFFFFFFFF);
+    row_t *row = &rows[hash24];
+    for (uint32_t i = 0; i < row->len; i++) {
+        if (row->slots[i].hash32 == hash32 && (row->slots[i].data & 0x3FFFFFFFF) == (data & 0x3FFFFFFFF)) {
+            return &row->slots[i];
+        }
+    }
+    return 0;
+}
+
+// Applies a log record. Records can already be in the checkpoint, so applying must be idempotent
+int ht_replay(oplog_record_t *record) {
+    uint64_t hash = (((uint64_t) record->hash24) << 32) | record->hash32;
+    uint32_t meta_id = (uint32_t) (record->data >> 34);
+
+    if (record->hash24 >= HASHTABLE_SIZE) return 1;
+
+    slot_t *slot = ht_find_slot(hash, record->data);
+    if (slot) {
+        if (record->type == OPLOG_UPDATE && slot->data != record->data) {
+            slot->data = record->data;
+            if (!ht_mark_dirty(ht_row(hash))) return 0;
+        }
+    } else if (!ht_add_slot(hash, record->data)) {
+        return 0;
+    }
+
+    // Identifiers of the newest meta_ids might have been lost, but their meta_ids must not be reused
+    if (meta_id > last_meta_id) last_meta_id = meta_id;
+    return 1;
+}
+
+// Adds comma or space separated identifiers to a meta_id, returns how many of them were stored
+uint32_t ht_add_identifiers(uint32_t meta_id, uint8_t *identifiers) {
+    uint32_t inserted = 0;
+    uint8_t code[IDCODEC_CODE_MAX_LEN];
+    uint8_t *p = identifiers;
+    uint8_t *s;
+
+    while (1) {
+        while (*p == ',' || *p == ' ') p++;
+        if (!*p) break;
+        s = p;
+        while (*p && *p != ',' && *p != ' ') p++;
+
+        uint32_t code_len = idcodec_encode(s, p - s, code);
+        if (!code_len) {
+            fprintf(stderr, "skipping too long identifier of meta_id %u\n", meta_id);
+        } else if (db_insert_identifier(meta_id, code, code_len)) {
+            if (identifiers_in_memory) idstore_add(idstore, meta_id, code, code_len);
+            inserted++;
+        }
+
+        if (!*p) break;
+    }
+    return inserted;
+}
+
+// Applies a slot change of the leader's log, logged like a local update
+uint32_t ht_apply_slot(uint8_t type, uint64_t hash, uint64_t data) {
+    oplog_record_t record = {type, (uint32_t) (hash >> 32), (uint32_t) (hash & 0xFFFFFFFF), data, 0};
+    if (!ht_replay(&record)) return 0;
+    oplog_append(type, hash, data);
+    persist_updated(identifiers_in_transaction, dirty_rows_len, oplog_size() + oplog_pending());
+    return 1;
+}
+
+// Applies identifiers of the leader's log, its meta_ids are kept as they are
+uint32_t ht_apply_identifiers(uint32_t meta_id, uint8_t *identifiers) {
+    ht_add_identifiers(meta_id, identifiers);
+    if (meta_id > last_meta_id) last_meta_id = meta_id;
+    persist_updated(identifiers_in_transaction, dirty_rows_len, oplog_size() + oplog_pending());
+    return 1;
+}
+
+// Copies comma separated identifiers of a meta_id from wherever they are kept, returns their untruncated length
+uint32_t ht_get_identifiers(uint32_t meta_id, uint8_t *identifiers, uint32_t identifiers_max_len) {
+    if (identifiers_in_memory) {
+        return idstore_get(idstore, meta_id, identifiers, identifiers_max_len);
+    }
+    uint32_t identifiers_len = 0;
+    if (!db_get_identifiers(meta_id, identifiers, identifiers_max_len, &identifiers_len)) return 0;
+    return identifiers_len;
+}
+
+void ht_version_free(ht_version_t *version) {
+    if (!version) return;
+    if (version->rows) {
+        for (uint32_t i = 0; i < HASHTABLE_SIZE; i++) {
+            if (!version->rows[i].arena) free(version->rows[i].slots);
+        }
+    }
+    free(version->rows);
+    free(version->slots);
+    idstore_free(version->idstore);
+    free(version);
+}
+
+/*
+ * Loads the hashtable and identifiers stored in a db directory, without its log.
+ * Nothing in use is touched, so a reload runs this while requests are served.
+ */
+ht_version_t *ht_load(char *directory) {
+    ht_version_t *version;
+
+    if (!(version = calloc(1, sizeof(ht_version_t)))
+        || !(version->rows = calloc(HASHTABLE_SIZE, sizeof(row_t)))) {
+        fprintf(stderr, "hashtable calloc failed\n");
+        ht_version_free(version);
+        return 0;
+    }
+
+    if (identifiers_in_memory) {
+        printf("loading identifiers..\n");
+        if (!(version->idstore = idstore_new())
+            || !db_load_identifiers(directory, idstore_load, version->idstore)) {
+            ht_version_free(version);
+            return 0;
+        }
+    }
+
+    printf("loading hashtable..\n");
+    if (!db_load_hashtable(directory, version->rows, &version->slots, &version->used_hashes, &version->used_slots)) {
+        ht_version_free(version);
+        return 0;
+    }
+    return version;
+}
+
+// Exchanges the current version with the given one
+void ht_swap(ht_version_t *version) {
+    ht_version_t current = {rows, rows_slots, used_hashes, used_slots, idstore};
+    rows = version->rows;
+    rows_slots = version->slots;
+    used_hashes = version->used_hashes;
+    used_slots = version->used_slots;
+    idstore = version->idstore;
+    *version = current;
+}
+
+/*
+ * A follower builds a snapshot into a staged version while its current one keeps serving reads:
+ * ht_stage_new, ht_stage_slot and ht_stage_identifiers for the snapshot chunks,
+ * then ht_stage_save and ht_stage_switch once it is complete.
+ */
+ht_version_t *ht_stage_new() {
+    ht_version_t *version;
+
+    // Identifiers are staged in memory even in low memory mode, ht_stage_save writes them to the db
+    if (!(version = calloc(1, sizeof(ht_version_t)))
+        || !(version->rows = calloc(HASHTABLE_SIZE, sizeof(row_t)))
+        || !(version->idstore = idstore_new())) {
+        fprintf(stderr, "hashtable calloc failed\n");
+        ht_version_free(version);
+        return 0;
+    }
+    return version;
+}
+
+// Adds a slot to a staged version, or sets the data of the slot it already has
+uint32_t ht_stage_slot(ht_version_t *version, uint64_t hash, uint64_t data) {
+    uint32_t hash24 = (uint32_t) (hash >> 32);
+    uint32_t hash32 = (uint32_t) (hash & 0xFFFFFFFF);
+
+    if (hash24 >= HASHTABLE_SIZE) return 1;
+    row_t *row = &version->rows[hash24];
+
+    for (uint32_t i = 0; i < row->len; i++) {
+        if (row->slots[i].hash32 == hash32 && (row->slots[i].data & 0x3FFFFFFFF) == (data & 0x3FFFFFFFF)) {
+            row->slots[i].data = data;
+            return 1;
+        }
+    }
+
+    if (row->len >= ROW_SLOTS_MAX) {
+        fprintf(stderr, "reached ROW_SLOTS_MAX limit");
+        return 0;
+    }
+
+    slot_t *slots;
+    if (!(slots = realloc(row->slots, sizeof(slot_t) * (row->len + 1)))) {
+        fprintf(stderr, "slot realloc failed");
+        return 0;
+    }
+    row->slots = slots;
+    row->slots[row->len].hash32 = hash32;
+    row->slots[row->len].data = data;
+
+    if (!row->len) version->used_hashes++;
+    version->used_slots++;
+    row->len++;
+    return 1;
+}
+
+// Adds comma or space separated identifiers of the leader to a meta_id of a staged version
+uint32_t ht_stage_identifiers(ht_version_t *version, uint32_t meta_id, uint8_t *identifiers) {
+    uint8_t code[IDCODEC_CODE_MAX_LEN];
+    uint8_t *p = identifiers;
+    uint8_t *s;
+
+    while (1) {
+        while (*p == ',' || *p == ' ') p++;
+        if (!*p) break;
+        s = p;
+        while (*p && *p != ',' && *p != ' ') p++;
+
+        uint32_t code_len = idcodec_encode(s, p - s, code);
+        if (!code_len) {
+            fprintf(stderr, "skipping too long identifier of meta_id %u\n", meta_id);
+        } else if (!idstore_add(version->idstore, meta_id, code, code_len)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Writes the identifiers of a staged version in place of all stored ones, in the open transaction,
+ * so readers keep seeing the stored ones until ht_stage_switch commits. Must be called with commits
+ * excluded, on failure the transaction is rolled back.
+ */
+uint32_t ht_stage_save(ht_version_t *version) {
+    idstore_t *store = version->idstore;
+
+    // Commits pending writes first, so a rollback only drops the ones of the snapshot
+    if (!db_save_identifiers()) return 0;
+
+    uint32_t rc = db_clear_identifiers();
+    for (uint32_t meta_id = 0; meta_id < store->entries_size && rc; meta_id++) {
+        idstore_entry_t *entry = &store->entries[meta_id];
+        if (entry->len) rc = db_put_identifiers(meta_id, store->arena + entry->offset, entry->len);
+    }
+    if (!rc) {
+        db_rollback_identifiers();
+        return 0;
+    }
+
+    if (!identifiers_in_memory) {
+        idstore_free(version->idstore);
+        version->idstore = 0;
+    }
+    return 1;
+}
+
+/*
+ * Makes a version staged by ht_stage_save current and commits its identifiers.
+ * Must be called under the write lock, with commits excluded. On return version holds the previous rows
+ * and identifiers, to be freed once the lock is released. Its slots are logged like applied ones, and
+ * a checkpoint is requested for the rows emptied, which the log can't replay.
+ */
+uint32_t ht_stage_switch(ht_version_t *version) {
+    ht_swap(version);
+
+    uint32_t rc = 1;
+    for (uint32_t i = 0; i < HASHTABLE_SIZE; i++) {
+        row_t *row = &rows[i];
+        if (!row->len && !version->rows[i].len) continue;
+        if (!ht_mark_dirty(row)) rc = 0;
+
+        for (uint32_t j = 0; j < row->len; j++) {
+            uint32_t meta_id = (uint32_t) (row->slots[j].data >> 34);
+            if (meta_id > last_meta_id) last_meta_id = meta_id;
+            oplog_append(OPLOG_UPDATE, ((uint64_t) i << 32) | row->slots[j].hash32, row->slots[j].data);
+        }
+    }
+
+    if (!db_save_identifiers()) rc = 0;
+    persist_updated(identifiers_in_transaction, dirty_rows_len, oplog_size() + oplog_pending());
+    persist_checkpoint();
+    return rc;
+}
+
+// Applies the log of the db directory just opened, a large replayed log is checkpointed without waiting
+uint32_t ht_replay_log() {
+    if (!oplog_replay(ht_replay)) return 0;
+    if (dirty_rows_len) persist_updated(identifiers_in_transaction, dirty_rows_len, oplog_size());
+    return 1;
+}
+
+uint32_t ht_init(char *directory) {
+    ht_version_t *version;
+
+    if (!(version = ht_load(directory))) {
+        return 0;
+    }
+    ht_swap(version);
+    ht_version_free(version);
+
+    return ht_replay_log();
+}
+
+/*
+ * Makes a version loaded by ht_load current and moves the db and log to its directory.
+ * Must be called under the write lock, with commits and checkpoints excluded.
+ * Updates of the previous directory are committed to it first, so it stays complete on its own.
+ * On success version holds the previous rows and identifiers, which no reader can reach
+ * once the lock is released. Returns 0 if the previous directory is still in use.
+ */
+uint32_t ht_switch(ht_version_t *version, char *directory) {
+    char previous[PATH_MAX];
+    snprintf(previous, PATH_MAX, "%s", db_directory);
+
+    if (!db_save_identifiers() || !oplog_commit()) return 0;
+
+    if (!db_close() || !oplog_close()) {
+        fprintf(stderr, "failed to close %s\n", previous);
+        exit(EXIT_FAILURE);
+    }
+
+    int opened = db_init(directory);
+    if (!opened || !oplog_init(directory)) {
+        fprintf(stderr, "failed to open %s, reopening %s\n", directory, previous);
+        if (opened) db_close();
+        oplog_close();
+        if (!db_init(previous) || !oplog_init(previous)) {
+            fprintf(stderr, "failed to reopen %s\n", previous);
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
+
+    ht_swap(version);
+    // Changed rows of the previous version are in its log
+    dirty_rows_len = 0;
+    replog_reset();
+
+    if (!ht_replay_log()) {
+        fprintf(stderr, "failed to replay the log of %s\n", directory);
+        exit(EXIT_FAILURE);
+    }
+    return 1;
+}
+
+// Computes the title hash and the name fingerprint of a slot, returns 0 if the title or name is rejected
+uint32_t ht_fingerprint(uint8_t *title, uint8_t *name, uint64_t *hash, uint64_t *name_fingerprint) {
     char output_text[MAX_LOOKUP_TEXT_LEN];
     uint32_t output_text_len = MAX_LOOKUP_TEXT_LEN;
-    text_process(title, output_text, &output_text_len, 0, 0, 0, 0);
+    text_normalize(title, output_text, &output_text_len);
 
     uint8_t name_output[64];
     uint32_t name_output_len = 64;
@@ -130,18 +583,32 @@ uint32_t ht_index(uint8_t *title, uint8_t *name, uint8_t *identifiers) {
 
     if (output_text_len < 10 || output_text_len > MAX_TITLE_LEN) return 0;
 
-    uint64_t hash = text_hash56(output_text, output_text_len);
-    printf("Index: %" PRId64 " %.*s\n", hash, output_text_len, output_text);
+    *hash = text_hash56(output_text, output_text_len);
+
+    uint32_t name_hash28 = text_hash28(name_output, name_output_len);
+    *name_fingerprint = (((uint64_t) name_hash28) << 6) | name_output_len;
+    return 1;
+}
+
+uint32_t ht_index(uint8_t *title, uint8_t *name, uint8_t *identifiers) {
+    uint64_t hash;
+    uint64_t name_fingerprint;
+    if (!ht_fingerprint(title, name, &hash, &name_fingerprint)) {
+        metrics_count(METRICS_INDEX_REJECTED, 1);
+        return 0;
+    }
+
+    // Other shards own the rest of the rows
+    if (!shard_owns(hash)) {
+        metrics_count(METRICS_INDEX_REJECTED, 1);
+        return 0;
+    }
 
     slot_t *slots[MAX_SLOTS_PER_TITLE];
     uint8_t slots_len;
 
     ht_hash_slots(hash, slots, &slots_len);
 
-    uint64_t name_fingerprint;
-    uint32_t name_hash28 = text_hash28(name_output, name_output_len);
-    name_fingerprint = (((uint64_t) name_hash28) << 6) | name_output_len;
-
     uint32_t slot_meta_id = 0;
     slot_t *slot = 0;
     for (uint32_t i = 0; i < slots_len; i++) {
@@ -154,6 +621,7 @@ uint32_t ht_index(uint8_t *title, uint8_t *name, uint8_t *identifiers) {
 
     if (!slot && slots_len >= MAX_SLOTS_PER_TITLE) {
         fprintf(stderr, "reached MAX_SLOTS_PER_TITLE limit for title \"%s\"", title);
+        metrics_count(METRICS_INDEX_REJECTED, 1);
         return 0;
     }
 
@@ -170,23 +638,8 @@ uint32_t ht_index(uint8_t *title, uint8_t *name, uint8_t *identifiers) {
     }
 
     uint32_t inserted = 0;
-
-    if (identifiers) {
-        uint8_t *p = identifiers;
-        uint8_t *s;
-
-        while (1) {
-            while (*p == ',' || *p == ' ') p++;
-            if (!*p) break;
-            s = p;
-            while (*p && *p != ',' && *p != ' ') p++;
-
-            db_insert_identifier(meta_id, s, p - s);
-
-            inserted++;
-
-            if (!*p) break;
-        }
+    if (identifiers && (inserted = ht_add_identifiers(meta_id, identifiers))) {
+        replog_identifiers(meta_id, identifiers);
     }
 
     if (!inserted) {
@@ -197,61 +650,111 @@ uint32_t ht_index(uint8_t *title, uint8_t *name, uint8_t *identifiers) {
 
     if (!slot) {
         uint64_t data = (((uint64_t) new_meta_id) << 34) | name_fingerprint;
-        ht_add_slot(hash, data);
+        if (ht_add_slot(hash, data)) {
+            oplog_append(OPLOG_INSERT, hash, data);
+            replog_slot(REPLOG_INSERT, hash, data);
+        }
     } else if (!slot_meta_id && new_meta_id) {
         slot->data = (((uint64_t) new_meta_id) << 34) | name_fingerprint;
-        row_t *row = ht_row(hash);
-        row->updated = 1;
+        ht_mark_dirty(ht_row(hash));
+        oplog_append(OPLOG_UPDATE, hash, slot->data);
+        replog_slot(REPLOG_UPDATE, hash, slot->data);
     }
 
-    gettimeofday(&t_updated, NULL);
+    persist_updated(identifiers_in_transaction, dirty_rows_len, oplog_size() + oplog_pending());
 
 //    indexed++;
 //    if (indexed % 10000 == 0) {
 //        printf("%d\n", indexed);
 //    }
 
+    metrics_count(METRICS_INDEX_INDEXED, 1);
     return 1;
 }
 
+/*
+ * Looks for the name fingerprint in the text after and before the title.
+ * Candidate positions are hashed TEXT_HASH_LANES at a time, but are checked
+ * in the same order as before, so the nearest position still wins.
+ */
 int32_t ht_locate_name(uint8_t *text, uint32_t text_len, uint32_t title_start,
-                       uint32_t title_end, uint32_t name_hash28, uint8_t name_len) {
+                       uint32_t title_end, uint32_t name_hash28, uint8_t name_len, uint32_t *positions) {
     int32_t distance = NAME_LOOKUP_DISTANCE;
     int32_t pos;
 
+    uint8_t *names[TEXT_HASH_LANES];
+    uint32_t name_lens[TEXT_HASH_LANES];
+    uint32_t name_hashes[TEXT_HASH_LANES];
+    int32_t name_positions[TEXT_HASH_LANES];
+    uint32_t n;
+
+    for (uint32_t l = 0; l < TEXT_HASH_LANES; l++) {
+        name_lens[l] = name_len;
+    }
+
     pos = title_end + 1;
     while (pos + name_len < text_len + 1 && pos <= title_end + distance) {
-        if (text_hash28(text + pos, name_len) == name_hash28) {
-            return pos;
+        n = 0;
+        while (n < TEXT_HASH_LANES && pos + name_len < text_len + 1 && pos <= title_end + distance) {
+            name_positions[n] = pos;
+            names[n++] = text + pos;
+            pos++;
+        }
+
+        text_hash28_batch(names, name_lens, n, name_hashes);
+        *positions += n;
+        for (uint32_t l = 0; l < n; l++) {
+            if (name_hashes[l] == name_hash28) {
+                return name_positions[l];
+            }
         }
-        pos++;
     }
 
     pos = title_start - name_len;
     while (pos >= 0 && pos + distance >= title_start) {
-        if (text_hash28(text + pos, name_len) == name_hash28) {
-            return pos;
+        n = 0;
+        while (n < TEXT_HASH_LANES && pos >= 0 && pos + distance >= title_start) {
+            name_positions[n] = pos;
+            names[n++] = text + pos;
+            pos--;
+        }
+
+        text_hash28_batch(names, name_lens, n, name_hashes);
+        *positions += n;
+        for (uint32_t l = 0; l < n; l++) {
+            if (name_hashes[l] == name_hash28) {
+                return name_positions[l];
+            }
         }
-        pos--;
     }
 
     return -1;
 }
 
-uint32_t ht_identify(uint8_t *text, result_t *result) {
-    char output_text[MAX_LOOKUP_TEXT_LEN];
-    uint32_t output_text_len = MAX_LOOKUP_TEXT_LEN;
-
-    uint32_t map[MAX_LOOKUP_TEXT_LEN];
-    uint32_t map_len = MAX_LOOKUP_TEXT_LEN;
+void ht_count_lookup(uint8_t found, uint64_t looked_up, uint64_t row_hits, uint64_t name_hits) {
+    metrics_count(found ? METRICS_IDENTIFY_FOUND : METRICS_IDENTIFY_NOT_FOUND, 1);
+    metrics_count(METRICS_LOOKUP_NGRAMS, looked_up);
+    metrics_count(METRICS_LOOKUP_ROW_HITS, row_hits);
+    metrics_count(METRICS_LOOKUP_NAME_HITS, name_hits);
+}
 
-    line_t lines[MAX_LOOKUP_TEXT_LEN];
-    uint32_t lines_len = MAX_LOOKUP_TEXT_LEN;
+// Stages are only timed when tracing, an untraced lookup doesn't read the clock
+static inline uint64_t ht_trace_start(trace_t *trace) {
+    return trace ? metrics_now() : 0;
+}
 
-    text_process(text, output_text, &output_text_len, map, &map_len, lines, &lines_len);
+static inline void ht_trace_stop(trace_t *trace, uint32_t stage, uint64_t start) {
+    if (trace) trace->stage_ns[stage] += metrics_now() - start;
+}
 
+/*
+ * Collects title ngrams of up to 5 consecutive lines in the order they are tried,
+ * ngrams must have room for MAX_LOOKUP_NGRAMS + 5 of them.
+ */
+uint32_t ht_ngrams(line_t *lines, uint32_t lines_len, line_t *ngrams) {
+    uint32_t ngrams_len = 0;
     uint32_t tried = 0;
-    for (uint32_t i = 0; i < lines_len && tried <= 1000; i++) {
+    for (uint32_t i = 0; i < lines_len && tried <= MAX_LOOKUP_NGRAMS; i++) {
         for (uint32_t j = i; j < i + 5 && j < lines_len; j++) {
 
             uint32_t title_start = lines[i].start;
@@ -263,49 +766,163 @@ uint32_t ht_identify(uint8_t *text, result_t *result) {
             if (title_len < 20 || title_len > 500) continue;
 
             tried++;
-            uint64_t hash = text_hash56(output_text + title_start, title_end - title_start + 1);
+            ngrams[ngrams_len].start = title_start;
+            ngrams[ngrams_len].end = title_end;
+            ngrams_len++;
+        }
+    }
+    return ngrams_len;
+}
+
+/*
+ * Checks the slots of a title ngram's hash, returns 1 if the ngram is a match.
+ * Sets the name position (-1 if the name isn't near the title), name length and meta_id of the checked slot.
+ */
+uint8_t ht_match(uint8_t *output_text, uint32_t output_text_len, line_t *ngram, uint64_t *slots_data,
+                 uint8_t slots_len, int32_t *name_pos, uint8_t *name_len, uint32_t *id,
+                 uint32_t *slots_checked, uint32_t *name_positions) {
+    uint32_t title_len = ngram->end - ngram->start + 1;
+    *id = 0;
+    *name_pos = 0;
+    *name_len = 0;
+    for (uint32_t k = 0; k < slots_len; k++) {
+        uint32_t name_hash28 = (slots_data[k] >> 6) & 0xFFFFFFF;
+        *name_len = slots_data[k] & 0x3F;
+        *id = slots_data[k] >> 34;
+
+        (*slots_checked)++;
+        *name_pos = ht_locate_name(output_text, output_text_len, ngram->start, ngram->end,
+                                   name_hash28, *name_len, name_positions);
+        if (*name_pos) break;
+    }
+
+    // TODO: If author name is found, or a title has at least 6 tokens, or a title is at least 30 bytes len
+    return *name_pos >= 0 || title_len >= 40;
+}
+
+// Fills the result with the matched title and name as they are in the original text
+void ht_extract(uint8_t *text, uint32_t *map, uint32_t map_len, line_t *ngram,
+                int32_t name_pos, uint8_t name_len, result_t *result) {
+    memset(result, 0, sizeof(result_t));
+
+    if (name_pos >= 0) {
+        text_original_name(text, map, map_len, name_pos, name_pos + name_len - 1,
+                           result->name, sizeof(result->name));
+    }
+
+    text_original_str(text, map, map_len, ngram->start, ngram->end,
+                      result->title, sizeof(result->title));
+}
+
+uint32_t ht_identify(uint8_t *text, result_t *result) {
+    return ht_identify_traced(text, result, 0);
+}
+
+uint32_t ht_identify_traced(uint8_t *text, result_t *result, trace_t *trace) {
+    // Scratch buffers come from the thread's arena and are released before returning
+    arena_t *arena = arena_local();
+    size_t mark = arena_mark(arena);
+
+    uint8_t *output_text = arena_alloc(arena, MAX_LOOKUP_TEXT_LEN);
+    uint32_t output_text_len = MAX_LOOKUP_TEXT_LEN;
+
+    uint32_t *map = arena_alloc(arena, sizeof(uint32_t) * MAX_LOOKUP_TEXT_LEN);
+    uint32_t map_len = MAX_LOOKUP_TEXT_LEN;
+
+    line_t *lines = arena_alloc(arena, sizeof(line_t) * MAX_LOOKUP_TEXT_LEN);
+    uint32_t lines_len = MAX_LOOKUP_TEXT_LEN;
+
+    // Title ngrams are collected first and then hashed TEXT_HASH_LANES at a time
+    line_t *ngrams = arena_alloc(arena, sizeof(line_t) * (MAX_LOOKUP_NGRAMS + 5));
+
+    if (!output_text || !map || !lines || !ngrams) {
+        arena_release(arena, mark);
+        return 0;
+    }
+
+    uint64_t t = ht_trace_start(trace);
+    uint32_t processed = text_process_parallel(text, output_text, &output_text_len, map, &map_len, lines, &lines_len);
+    ht_trace_stop(trace, TRACE_NORMALIZE, t);
+    if (!processed) {
+        arena_release(arena, mark);
+        return 0;
+    }
+
+    uint32_t ngrams_len = ht_ngrams(lines, lines_len, ngrams);
+
+    uint8_t *ngram_texts[TEXT_HASH_LANES];
+    uint32_t ngram_lens[TEXT_HASH_LANES];
+    uint64_t ngram_hashes[TEXT_HASH_LANES];
+
+    // Counted locally and added to metrics once per lookup
+    uint64_t looked_up = 0, row_hits = 0, name_hits = 0;
+    uint32_t slots_checked = 0, name_positions = 0;
+    uint8_t found = 0;
+
+    for (uint32_t i = 0; i < ngrams_len && !found; i += TEXT_HASH_LANES) {
+        uint32_t n = ngrams_len - i < TEXT_HASH_LANES ? ngrams_len - i : TEXT_HASH_LANES;
+        for (uint32_t l = 0; l < n; l++) {
+            ngram_texts[l] = output_text + ngrams[i + l].start;
+            ngram_lens[l] = ngrams[i + l].end - ngrams[i + l].start + 1;
+        }
+        t = ht_trace_start(trace);
+        text_hash56_batch(ngram_texts, ngram_lens, n, ngram_hashes);
+        ht_trace_stop(trace, TRACE_HASH, t);
+
+        for (uint32_t l = 0; l < n; l++) {
+            uint64_t hash = ngram_hashes[l];
             //printf("Lookup: %" PRId64 " %.*s\n", hash, title_end-title_start+1, output_text+title_start);
 
             slot_t *slots[MAX_SLOTS_PER_TITLE];
             uint8_t slots_len;
+            t = ht_trace_start(trace);
             ht_hash_slots(hash, slots, &slots_len);
+            ht_trace_stop(trace, TRACE_PROBE, t);
+            looked_up++;
 
             if (slots_len) {
-                uint32_t id = 0;
-                int32_t name_pos = 0;
-                uint8_t name_len = 0;
+                row_hits++;
+                uint64_t slots_data[MAX_SLOTS_PER_TITLE];
+                uint32_t id;
+                int32_t name_pos;
+                uint8_t name_len;
                 for (uint32_t k = 0; k < slots_len; k++) {
-                    uint32_t name_hash28 = (slots[k]->data >> 6) & 0xFFFFFFF;
-                    name_len = slots[k]->data & 0x3F;
-                    id = slots[k]->data >> 34;
-
-                    name_pos = ht_locate_name(output_text, output_text_len, title_start, title_end,
-                                              name_hash28, name_len);
-                    if (name_pos) break;
+                    slots_data[k] = slots[k]->data;
                 }
+                t = ht_trace_start(trace);
+                uint8_t match = ht_match(output_text, output_text_len, ngrams + i + l, slots_data, slots_len,
+                                         &name_pos, &name_len, &id, &slots_checked, &name_positions);
+                ht_trace_stop(trace, TRACE_LOCATE, t);
+                if (name_pos >= 0) name_hits++;
 
-                // TODO: If author name is found, or a title has at least 6 tokens, or a title is at least 30 bytes len
-                if (name_pos>=0 || title_len >= 40) {
-                    //print_ngram(text, tokens, lines[i].start, lines[j].start + lines[j].len - lines[i].start);
-                    memset(result, 0, sizeof(result_t));
-
-                    if (name_pos>=0) {
-                        text_original_name(text, map, map_len, name_pos, name_pos + name_len - 1,
-                                           result->name, sizeof(result->name));
-                    }
-
-                    text_original_str(text, map, map_len, title_start, title_end,
-                                      result->title, sizeof(result->title));
+                if (match) {
+                    t = ht_trace_start(trace);
+                    ht_extract(text, map, map_len, ngrams + i + l, name_pos, name_len, result);
+                    ht_trace_stop(trace, TRACE_EXTRACT, t);
 
                     if (id) {
-                        db_get_identifiers(id, result->identifiers, sizeof(result->identifiers));
+                        t = ht_trace_start(trace);
+                        ht_get_identifiers(id, result->identifiers, sizeof(result->identifiers));
+                        ht_trace_stop(trace, TRACE_FETCH, t);
                     }
 
-                    return 1;
+                    found = 1;
+                    break;
                 }
             }
         }
     }
 
-    return 0;
+    ht_count_lookup(found, looked_up, row_hits, name_hits);
+    if (trace) {
+        trace->lines = lines_len;
+        trace->candidates = ngrams_len;
+        trace->rows_probed = (uint32_t) looked_up;
+        trace->row_hits = (uint32_t) row_hits;
+        trace->slots_checked = slots_checked;
+        trace->name_positions = name_positions;
+        trace->found = found;
+    }
+    arena_release(arena, mark);
+    return found;
 }
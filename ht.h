@@ -2,6 +2,9 @@
 #define TITLE_FINGERPRINT_DB_HT_H
 
 #include <stdint.h>
+#include "text.h"
+#include "trace.h"
+#include "idstore.h"
 
 #define HASHTABLE_SIZE 16777216
 #define ROW_SLOTS_MAX 256
@@ -10,6 +13,7 @@
 #define MAX_NAME_LEN 63
 #define MAX_LOOKUP_TEXT_LEN 4096
 #define NAME_LOOKUP_DISTANCE 1000
+#define MAX_LOOKUP_NGRAMS 1000
 
 typedef struct stats {
     uint32_t used_hashes;
@@ -30,20 +34,91 @@ typedef struct row {
     slot_t *slots;
     uint8_t len;
     uint8_t updated;
+    // Slots are in the arena allocated at load time and can't be reallocated
+    uint8_t arena;
 } row_t;
 
+// Point-in-time copy of changed rows, written to the hashtable db without holding the lock
+typedef struct snapshot {
+    uint32_t used_hashes;
+    uint32_t used_slots;
+    uint32_t rows_len;
+    uint32_t *row_ids;
+    // Slots of row i are slots[offsets[i]] .. slots[offsets[i + 1] - 1]
+    uint32_t *offsets;
+    slot_t *slots;
+} snapshot_t;
+
+// Rows and identifiers of one db directory. Only the current version is reachable by requests
+typedef struct ht_version {
+    row_t *rows;
+    // Block the slots of rows with the arena flag are in
+    slot_t *slots;
+    uint32_t used_hashes;
+    uint32_t used_slots;
+    // 0 in low memory mode
+    idstore_t *idstore;
+} ht_version_t;
+
 typedef struct result {
     uint8_t title[4096];
     uint8_t name[64];
     uint8_t identifiers[4096];
 } result_t;
 
-uint32_t ht_init();
+uint32_t ht_init(char *directory);
+
+ht_version_t *ht_load(char *directory);
+
+uint32_t ht_switch(ht_version_t *version, char *directory);
+
+void ht_version_free(ht_version_t *version);
 
 stats_t ht_stats();
 
+snapshot_t *ht_snapshot();
+
+void ht_snapshot_restore(snapshot_t *snapshot);
+
+void ht_snapshot_free(snapshot_t *snapshot);
+
+uint32_t ht_get_identifiers(uint32_t meta_id, uint8_t *identifiers, uint32_t identifiers_max_len);
+
+uint32_t ht_fingerprint(uint8_t *title, uint8_t *name, uint64_t *hash, uint64_t *name_fingerprint);
+
 uint32_t ht_index(uint8_t *title, uint8_t *name, uint8_t *identifiers);
 
+uint32_t ht_apply_slot(uint8_t type, uint64_t hash, uint64_t data);
+
+uint32_t ht_apply_identifiers(uint32_t meta_id, uint8_t *identifiers);
+
+ht_version_t *ht_stage_new();
+
+uint32_t ht_stage_slot(ht_version_t *version, uint64_t hash, uint64_t data);
+
+uint32_t ht_stage_identifiers(ht_version_t *version, uint32_t meta_id, uint8_t *identifiers);
+
+uint32_t ht_stage_save(ht_version_t *version);
+
+uint32_t ht_stage_switch(ht_version_t *version);
+
+uint8_t ht_hash_slots(uint64_t hash, slot_t **slots, uint8_t *slots_len);
+
+// Stages of a lookup, also used by the router (see router.c) on slots probed from shards
+uint32_t ht_ngrams(line_t *lines, uint32_t lines_len, line_t *ngrams);
+
+uint8_t ht_match(uint8_t *output_text, uint32_t output_text_len, line_t *ngram, uint64_t *slots_data,
+                 uint8_t slots_len, int32_t *name_pos, uint8_t *name_len, uint32_t *id,
+                 uint32_t *slots_checked, uint32_t *name_positions);
+
+void ht_extract(uint8_t *text, uint32_t *map, uint32_t map_len, line_t *ngram,
+                int32_t name_pos, uint8_t name_len, result_t *result);
+
+void ht_count_lookup(uint8_t found, uint64_t looked_up, uint64_t row_hits, uint64_t name_hits);
+
 uint32_t ht_identify(uint8_t *text, result_t *result);
 
+// Same as ht_identify, and fills the stage breakdown if trace isn't 0
+uint32_t ht_identify_traced(uint8_t *text, result_t *result, trace_t *trace);
+
 #endif //TITLE_FINGERPRINT_DB_HT_H
@@ -0,0 +1,719 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * HTTP/1.1 front-end on epoll, an alternative to onion for /identify, /index, /ingest, /stats, /metrics and /reload.
+ * A fixed pool of worker threads share the listening socket and each runs its own
+ * event loop over the connections it accepted, so an idle or slow client only costs
+ * its buffers. Connections are kept alive, and pipelined requests are handled in order
+ * with all their responses written at once. Request bodies are passed to the routes
+ * straight from the connection's read buffer, except for /ingest: its body is passed on
+ * as it is read and its progress lines are sent as a chunked response, so neither has to fit in memory.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <jemalloc/jemalloc.h>
+#include "api.h"
+#include "admit.h"
+#include "arena.h"
+#include "http.h"
+#include "metrics.h"
+
+// Admission of a request read by http_admit
+typedef struct http_admit {
+    // From when the request was read, handling it later doesn't move it
+    uint64_t deadline;
+    uint32_t endpoint;
+    uint8_t state;
+} http_admit_t;
+
+typedef struct http_connection {
+    int fd;
+    char *in;
+    size_t in_len;
+    size_t in_max;
+    char *out;
+    size_t out_len;
+    size_t out_pos;
+    size_t out_max;
+    // Close once the buffered responses are written
+    uint8_t close;
+    // "100 Continue" was already sent for the request at the start of in
+    uint8_t continued;
+    // Ingestion whose body is being read, and how much of it is still to come
+    api_ingest_t *ingest;
+    uint64_t ingest_left;
+    // Admission of each complete request read but not handled yet
+    http_admit_t *admits;
+    size_t admits_len;
+    size_t admits_max;
+    // Bytes of in already counted in admits
+    size_t scanned;
+    // When in was last read
+    uint64_t received;
+} http_connection_t;
+
+// Admission states of a request
+#define HTTP_UNLIMITED 0
+#define HTTP_ADMITTED 1
+#define HTTP_REJECTED 2
+// Not read by http_admit, the route admits it
+#define HTTP_UNSCANNED 3
+// Initial admits of a connection
+#define HTTP_ADMITS 16
+
+typedef struct http_request {
+    char *method;
+    size_t method_len;
+    // Without the query
+    char *path;
+    size_t path_len;
+    size_t header_len;
+    long long content_length;
+    uint8_t chunked;
+    uint8_t expect_continue;
+    uint8_t keep_alive;
+    uint64_t deadline;
+} http_request_t;
+
+static int listen_fd = -1;
+static int stop_fd = -1;
+// Marks the listening socket and the stop eventfd in epoll events
+static char listen_tag, stop_tag;
+
+static int http_reserve(char **buf, size_t *max, size_t len) {
+    if (len <= *max) return 1;
+    size_t new_max = *max;
+    while (new_max < len) new_max *= 2;
+    char *new_buf = realloc(*buf, new_max);
+    if (!new_buf) return 0;
+    *buf = new_buf;
+    *max = new_max;
+    return 1;
+}
+
+static http_connection_t *http_connection_new(int fd) {
+    http_connection_t *c = calloc(1, sizeof(http_connection_t));
+    if (!c) return 0;
+    c->fd = fd;
+    c->in_max = HTTP_READ_LEN;
+    c->in = malloc(c->in_max);
+    c->out_max = HTTP_READ_LEN;
+    c->out = malloc(c->out_max);
+    c->admits_max = HTTP_ADMITS;
+    c->admits = malloc(sizeof(http_admit_t) * c->admits_max);
+    if (!c->in || !c->out || !c->admits) {
+        free(c->in);
+        free(c->out);
+        free(c->admits);
+        free(c);
+        return 0;
+    }
+    return c;
+}
+
+static void http_connection_free(http_connection_t *c) {
+    if (c->ingest) api_ingest_free(c->ingest);
+    for (size_t i = 0; i < c->admits_len; i++) {
+        if (c->admits[i].state == HTTP_ADMITTED) admit_leave(c->admits[i].endpoint);
+    }
+    free(c->admits);
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+static const char *http_reason(int code) {
+    switch (code) {
+        case 100:
+            return "Continue";
+        case 200:
+            return "OK";
+        case 400:
+            return "Bad Request";
+        case 403:
+            return "Forbidden";
+        case 404:
+            return "Not Found";
+        case 405:
+            return "Method Not Allowed";
+        case 409:
+            return "Conflict";
+        case 411:
+            return "Length Required";
+        case 413:
+            return "Payload Too Large";
+        case 429:
+            return "Too Many Requests";
+        case 431:
+            return "Request Header Fields Too Large";
+        case 501:
+            return "Not Implemented";
+        case 503:
+            return "Service Unavailable";
+        default:
+            return "Internal Server Error";
+    }
+}
+
+static int http_respond_type(http_connection_t *c, int code, char *body, const char *content_type) {
+    size_t body_len = body ? strlen(body) : 0;
+    if (!http_reserve(&c->out, &c->out_max, c->out_len + body_len + 256)) return 0;
+
+    c->out_len += (size_t) sprintf(c->out + c->out_len,
+                                   "HTTP/1.1 %d %s\r\n"
+                                   "Content-Type: %s\r\n"
+                                   "Content-Length: %zu\r\n"
+                                   "%s%s\r\n",
+                                   code, http_reason(code), content_type, body_len,
+                                   code == 429 || code == 503 ? "Retry-After: 1\r\n" : "",
+                                   c->close ? "Connection: close\r\n" : "");
+    if (body_len) {
+        memcpy(c->out + c->out_len, body, body_len);
+        c->out_len += body_len;
+    }
+    return 1;
+}
+
+static int http_respond(http_connection_t *c, int code, char *body) {
+    return http_respond_type(c, code, body, "application/json; charset=utf-8");
+}
+
+// Requests of the limited endpoints, -1 for the others
+static int http_endpoint(http_request_t *r) {
+    if (r->method_len != 4 || memcmp(r->method, "POST", 4)) return -1;
+    if (r->path_len == 9 && !memcmp(r->path, "/identify", 9)) return ADMIT_IDENTIFY;
+    if (r->path_len == 6 && !memcmp(r->path, "/index", 6)) return ADMIT_INDEX;
+    return -1;
+}
+
+static int http_is_ingest(http_request_t *r) {
+    return r->path_len == 7 && !memcmp(r->path, "/ingest", 7) &&
+           ((r->method_len == 4 && !memcmp(r->method, "POST", 4)) ||
+            (r->method_len == 3 && !memcmp(r->method, "PUT", 3)));
+}
+
+static int http_route(http_connection_t *c, http_request_t *r, char *body, http_admit_t *admit) {
+    char *path = r->path;
+    size_t path_len = r->path_len;
+    uint8_t post = r->method_len == 4 && !memcmp(r->method, "POST", 4);
+    uint8_t get = r->method_len == 3 && !memcmp(r->method, "GET", 3);
+
+    char *(*route)(const char *, size_t, uint64_t, uint32_t *) = 0;
+    char *(*route_admitted)(const char *, size_t, uint64_t, uint32_t *) = 0;
+    if (path_len == 9 && !memcmp(path, "/identify", 9)) {
+        route = api_identify;
+        route_admitted = api_identify_admitted;
+    } else if (path_len == 6 && !memcmp(path, "/index", 6)) {
+        route = api_index;
+        route_admitted = api_index_admitted;
+    } else if (path_len == 7 && !memcmp(path, "/reload", 7)) {
+        route = api_reload;
+    } else if (path_len == 6 && !memcmp(path, "/stats", 6)) {
+        if (!get && !post) return http_respond(c, 405, 0);
+        int rc = http_respond(c, 200, api_stats());
+        arena_reset(arena_local());
+        return rc;
+    } else if (path_len == 8 && !memcmp(path, "/metrics", 8)) {
+        if (!get) return http_respond(c, 405, 0);
+        char *str = api_metrics();
+        int rc = str ? http_respond_type(c, 200, str, "text/plain; version=0.0.4") : http_respond(c, 500, 0);
+        arena_reset(arena_local());
+        return rc;
+    } else {
+        return http_respond(c, 404, 0);
+    }
+
+    if (!post) return http_respond(c, 405, 0);
+
+    uint32_t status = API_UNAVAILABLE;
+    char *str = 0;
+    if (admit->state == HTTP_ADMITTED) {
+        // Admitted when it was read, the client may have given up while it waited on the connection
+        if (!admit_expired(admit->endpoint, r->deadline)) str = route_admitted(body, (size_t) r->content_length,
+                                                                               r->deadline, &status);
+        admit_leave(admit->endpoint);
+    } else if (admit->state != HTTP_REJECTED) {
+        str = route(body, (size_t) r->content_length, r->deadline, &status);
+    }
+    int rc = http_respond(c, (int) status, str);
+    arena_reset(arena_local());
+    return rc;
+}
+
+// Progress lines of an ingestion, each one a chunk
+static int http_ingest_write(void *ctx, const char *data, size_t data_len) {
+    http_connection_t *c = ctx;
+    if (!http_reserve(&c->out, &c->out_max, c->out_len + data_len + 32)) return 0;
+    c->out_len += (size_t) sprintf(c->out + c->out_len, "%zx\r\n", data_len);
+    memcpy(c->out + c->out_len, data, data_len);
+    c->out_len += data_len;
+    memcpy(c->out + c->out_len, "\r\n", 2);
+    c->out_len += 2;
+    return 1;
+}
+
+// Admission is decided on the header, before any of the body is read
+static int http_ingest_start(http_connection_t *c, uint64_t content_length, uint8_t expect_continue) {
+    uint32_t status;
+    if (!(c->ingest = api_ingest_start(http_ingest_write, c, &status))) {
+        // The body isn't read
+        c->close = 1;
+        return http_respond(c, (int) status, 0);
+    }
+
+    if (!http_reserve(&c->out, &c->out_max, c->out_len + 256)) return 0;
+    if (expect_continue) c->out_len += (size_t) sprintf(c->out + c->out_len, "HTTP/1.1 100 Continue\r\n\r\n");
+    c->out_len += (size_t) sprintf(c->out + c->out_len,
+                                   "HTTP/1.1 200 OK\r\n"
+                                   "Content-Type: application/x-ndjson\r\n"
+                                   "Transfer-Encoding: chunked\r\n"
+                                   "%s\r\n",
+                                   c->close ? "Connection: close\r\n" : "");
+    c->ingest_left = content_length;
+    return 1;
+}
+
+static int http_ingest_end(http_connection_t *c) {
+    api_ingest_t *ingest = c->ingest;
+    c->ingest = 0;
+    if (!api_ingest_end(ingest)) return 0;
+    if (!http_reserve(&c->out, &c->out_max, c->out_len + 8)) return 0;
+    memcpy(c->out + c->out_len, "0\r\n\r\n", 5);
+    c->out_len += 5;
+    return 1;
+}
+
+static int http_header_is(char *line, size_t line_len, char *name, size_t name_len, char **value) {
+    if (line_len <= name_len || line[name_len] != ':' || strncasecmp(line, name, name_len)) return 0;
+    *value = line + name_len + 1;
+    while (**value == ' ' || **value == '\t') (*value)++;
+    return 1;
+}
+
+// Parses the request header at start, returns 0 if it isn't complete yet and -1 with the status if it's invalid
+static int http_parse(char *start, size_t avail, uint64_t received, http_request_t *r, int *status) {
+    char *end = memmem(start, avail, "\r\n\r\n", 4);
+    if (!end) {
+        if (avail > HTTP_HEADER_MAX) {
+            *status = 431;
+            return -1;
+        }
+        return 0;
+    }
+    r->header_len = (size_t) (end - start) + 4;
+
+    // Request line
+    char *line_end = memmem(start, r->header_len, "\r\n", 2);
+    char *method = start;
+    char *sp1 = memchr(method, ' ', (size_t) (line_end - method));
+    char *sp2 = sp1 ? memchr(sp1 + 1, ' ', (size_t) (line_end - sp1 - 1)) : 0;
+    if (!sp2) {
+        *status = 400;
+        return -1;
+    }
+    r->method = method;
+    r->method_len = (size_t) (sp1 - method);
+    r->path = sp1 + 1;
+    r->path_len = (size_t) (sp2 - r->path);
+    char *query = memchr(r->path, '?', r->path_len);
+    if (query) r->path_len = (size_t) (query - r->path);
+
+    char *version = sp2 + 1;
+    uint8_t http10 = line_end - version == 8 && !memcmp(version, "HTTP/1.0", 8);
+    r->keep_alive = !http10;
+    r->content_length = 0;
+    r->chunked = 0;
+    r->expect_continue = 0;
+    r->deadline = 0;
+
+    char *line = line_end + 2;
+    while (line < end + 2) {
+        char *next = memmem(line, (size_t) (end + 2 - line), "\r\n", 2);
+        size_t line_len = (size_t) (next - line);
+        char *value;
+        if (http_header_is(line, line_len, "Content-Length", 14, &value)) {
+            r->content_length = strtoll(value, 0, 10);
+        } else if (http_header_is(line, line_len, "Transfer-Encoding", 17, &value)) {
+            r->chunked = 1;
+        } else if (http_header_is(line, line_len, "Connection", 10, &value)) {
+            if (!strncasecmp(value, "close", 5)) r->keep_alive = 0;
+            else if (!strncasecmp(value, "keep-alive", 10)) r->keep_alive = 1;
+        } else if (http_header_is(line, line_len, "Expect", 6, &value)) {
+            r->expect_continue = !strncasecmp(value, "100-continue", 12);
+        } else if (http_header_is(line, line_len, ADMIT_TIMEOUT_HEADER,
+                                  sizeof(ADMIT_TIMEOUT_HEADER) - 1, &value)) {
+            r->deadline = admit_deadline(value, received);
+        }
+        line = next + 2;
+    }
+    return 1;
+}
+
+/*
+ * Complete requests count against the admission limits as soon as they are read, not once a worker gets to them,
+ * so requests waiting behind others on their connection or worker are in flight too. Reading stops at an ingest
+ * request, its body is read as it's processed.
+ */
+static int http_admit(http_connection_t *c) {
+    while (!c->ingest && c->scanned < c->in_len) {
+        http_request_t r;
+        int status;
+        size_t avail = c->in_len - c->scanned;
+        if (http_parse(c->in + c->scanned, avail, c->received, &r, &status) <= 0 || http_is_ingest(&r)) break;
+        if (r.chunked || r.content_length < 0 || r.content_length > HTTP_BODY_MAX) break;
+        if (avail < r.header_len + (size_t) r.content_length) break;
+
+        if (c->admits_len == c->admits_max) {
+            http_admit_t *admits = realloc(c->admits, sizeof(http_admit_t) * c->admits_max * 2);
+            if (!admits) return 0;
+            c->admits = admits;
+            c->admits_max *= 2;
+        }
+
+        int endpoint = http_endpoint(&r);
+        uint8_t state = HTTP_UNLIMITED;
+        if (endpoint >= 0) {
+            state = admit_expired((uint32_t) endpoint, r.deadline) || !admit_enter((uint32_t) endpoint)
+                    ? HTTP_REJECTED : HTTP_ADMITTED;
+        }
+        http_admit_t *admit = &c->admits[c->admits_len++];
+        admit->deadline = r.deadline;
+        admit->endpoint = endpoint >= 0 ? (uint32_t) endpoint : 0;
+        admit->state = state;
+        c->scanned += r.header_len + (size_t) r.content_length;
+    }
+    return 1;
+}
+
+// Handles all complete requests in the read buffer, returns 0 if the connection must be dropped
+static int http_process(http_connection_t *c) {
+    size_t pos = 0;
+    size_t admitted = 0;
+
+    while (c->ingest || (!c->close && pos < c->in_len)) {
+        if (c->ingest) {
+            size_t n = c->in_len - pos < c->ingest_left ? c->in_len - pos : (size_t) c->ingest_left;
+            if (!api_ingest_feed(c->ingest, c->in + pos, n)) return 0;
+            pos += n;
+            c->ingest_left -= n;
+            if (c->ingest_left) break;
+            if (!http_ingest_end(c)) return 0;
+            continue;
+        }
+
+        char *start = c->in + pos;
+        size_t avail = c->in_len - pos;
+
+        http_request_t r;
+        int status;
+        int parsed = http_parse(start, avail, c->received, &r, &status);
+        if (!parsed) break;
+        if (parsed < 0) {
+            c->close = 1;
+            if (!http_respond(c, status, 0)) return 0;
+            break;
+        }
+
+        if (http_is_ingest(&r)) {
+            if (r.chunked || r.content_length < 0) {
+                c->close = 1;
+                if (!http_respond(c, r.chunked ? 501 : 400, 0)) return 0;
+                break;
+            }
+            c->close = !r.keep_alive;
+            if (!http_ingest_start(c, (uint64_t) r.content_length, r.expect_continue)) return 0;
+            pos += r.header_len;
+            continue;
+        }
+
+        if (r.chunked || r.content_length < 0 || r.content_length > HTTP_BODY_MAX) {
+            c->close = 1;
+            if (!http_respond(c, r.chunked ? 501 : 413, 0)) return 0;
+            break;
+        }
+
+        if (avail < r.header_len + (size_t) r.content_length) {
+            if (!http_reserve(&c->in, &c->in_max, pos + r.header_len + (size_t) r.content_length)) return 0;
+            if (r.expect_continue && !c->continued) {
+                if (!http_reserve(&c->out, &c->out_max, c->out_len + 32)) return 0;
+                c->out_len += (size_t) sprintf(c->out + c->out_len, "HTTP/1.1 100 Continue\r\n\r\n");
+                c->continued = 1;
+            }
+            break;
+        }
+
+        c->close = !r.keep_alive;
+        // Requests after an ingest request weren't read by http_admit and are admitted by their route
+        http_admit_t admit = {r.deadline, 0, HTTP_UNSCANNED};
+        if (admitted < c->admits_len) admit = c->admits[admitted++];
+        // Timeouts count from the read that completed the request, not from the latest one
+        r.deadline = admit.deadline;
+        if (!http_route(c, &r, start + r.header_len, &admit)) return 0;
+
+        pos += r.header_len + (size_t) r.content_length;
+        c->continued = 0;
+    }
+
+    if (admitted) {
+        memmove(c->admits, c->admits + admitted, sizeof(http_admit_t) * (c->admits_len - admitted));
+        c->admits_len -= admitted;
+    }
+
+    if (pos) {
+        memmove(c->in, c->in + pos, c->in_len - pos);
+        c->in_len -= pos;
+        c->scanned = c->scanned > pos ? c->scanned - pos : 0;
+    }
+
+    // Give back memory of a large body
+    if (!c->in_len && c->in_max > HTTP_READ_LEN) {
+        char *in = realloc(c->in, HTTP_READ_LEN);
+        if (in) {
+            c->in = in;
+            c->in_max = HTTP_READ_LEN;
+        }
+    }
+
+    return 1;
+}
+
+// Writes buffered responses, returns -1 on error, 0 if the socket is full and 1 when done
+static int http_flush(http_connection_t *c) {
+    while (c->out_pos < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->out_pos += (size_t) n;
+    }
+    c->out_pos = 0;
+    c->out_len = 0;
+    return 1;
+}
+
+static void http_accept(int epoll_fd) {
+    while (1) {
+        int fd = accept4(listen_fd, 0, 0, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                fprintf(stderr, "http accept failed: %s\n", strerror(errno));
+                usleep(1000);
+            }
+            return;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        http_connection_t *c = http_connection_new(fd);
+        if (!c) {
+            close(fd);
+            continue;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = c;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            http_connection_free(c);
+        }
+    }
+}
+
+// Reads what the connection has and admits its complete requests, returns 0 when the connection is closed
+static int http_read(http_connection_t *c, uint32_t events) {
+    if (events & EPOLLIN) {
+        if (c->in_len == c->in_max && !http_reserve(&c->in, &c->in_max, c->in_max + 1)) return 0;
+
+        ssize_t n = read(c->fd, c->in + c->in_len, c->in_max - c->in_len);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 1;
+        if (n <= 0) return 0;
+        c->in_len += (size_t) n;
+        // Request timeouts count from when the data was read
+        c->received = metrics_now();
+
+        return http_admit(c);
+    }
+    return !(events & (EPOLLERR | EPOLLHUP));
+}
+
+// Handles the requests read by http_read and writes responses, returns 0 when the connection is closed
+static int http_event(int epoll_fd, http_connection_t *c, uint32_t events) {
+    if ((events & EPOLLIN) && !http_process(c)) return 0;
+
+    int rc = http_flush(c);
+    if (rc < 0) return 0;
+    if (rc && c->close) return 0;
+
+    // Stop reading until pending responses are written
+    struct epoll_event ev;
+    ev.events = rc ? EPOLLIN | EPOLLRDHUP : EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0) return 0;
+
+    return 1;
+}
+
+static void *http_worker(void *arg) {
+    (void) arg;
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        fprintf(stderr, "epoll_create1 failed: %s\n", strerror(errno));
+        return 0;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &listen_tag;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &stop_tag;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev);
+
+    struct epoll_event events[HTTP_EVENTS];
+    uint8_t stop = 0;
+    while (!stop) {
+        int n = epoll_wait(epoll_fd, events, HTTP_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        // Reads all ready connections first, so their requests are admitted before any of them is handled
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &stop_tag) {
+                stop = 1;
+                events[i].data.ptr = 0;
+            } else if (events[i].data.ptr == &listen_tag) {
+                http_accept(epoll_fd);
+                events[i].data.ptr = 0;
+            } else if (!http_read(events[i].data.ptr, events[i].events)) {
+                http_connection_free(events[i].data.ptr);
+                events[i].data.ptr = 0;
+            }
+        }
+
+        for (int i = 0; i < n; i++) {
+            http_connection_t *c = events[i].data.ptr;
+            if (c && !http_event(epoll_fd, c, events[i].events)) {
+                http_connection_free(c);
+            }
+        }
+    }
+
+    // Connections still open are left to the process exit
+    close(epoll_fd);
+    return 0;
+}
+
+int http_listen(char *port, uint32_t threads) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int rc = getaddrinfo(NULL, port, &hints, &res);
+    if (rc) {
+        fprintf(stderr, "http port %s: %s\n", port, gai_strerror(rc));
+        return 0;
+    }
+
+    listen_fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK, res->ai_protocol);
+    if (listen_fd < 0) {
+        fprintf(stderr, "http socket failed: %s\n", strerror(errno));
+        freeaddrinfo(res);
+        return 0;
+    }
+
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(listen_fd, res->ai_addr, res->ai_addrlen) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "http listen on port %s failed: %s\n", port, strerror(errno));
+        freeaddrinfo(res);
+        close(listen_fd);
+        return 0;
+    }
+    freeaddrinfo(res);
+
+    stop_fd = eventfd(0, EFD_NONBLOCK);
+    if (stop_fd < 0) {
+        fprintf(stderr, "eventfd failed: %s\n", strerror(errno));
+        close(listen_fd);
+        return 0;
+    }
+
+    if (threads < 1) threads = 1;
+    if (threads > HTTP_THREADS_MAX) threads = HTTP_THREADS_MAX;
+
+    pthread_t tids[HTTP_THREADS_MAX];
+    uint32_t started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, http_worker, 0)) {
+            fprintf(stderr, "failed to start http worker thread\n");
+            http_stop();
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    close(listen_fd);
+    listen_fd = -1;
+    return started == threads;
+}
+
+void http_stop() {
+    // The eventfd stays readable, so every worker sees it
+    if (stop_fd >= 0) {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) < 0) {
+            fprintf(stderr, "failed to stop http workers\n");
+        }
+    }
+}
@@ -0,0 +1,17 @@
+#ifndef TITLE_FINGERPRINT_DB_HTTP_H
+#define TITLE_FINGERPRINT_DB_HTTP_H
+
+#include <stdint.h>
+
+#define HTTP_THREADS_MAX 64
+// Same limit as onion_set_max_post_size
+#define HTTP_BODY_MAX 50000000
+#define HTTP_HEADER_MAX 16384
+#define HTTP_READ_LEN 65536
+#define HTTP_EVENTS 256
+
+int http_listen(char *port, uint32_t threads);
+
+void http_stop();
+
+#endif //TITLE_FINGERPRINT_DB_HTTP_H
@@ -0,0 +1,323 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Compact encoding of identifiers, used both in identifiers.sqlite and in the in-memory store.
+ * Each identifier is a tag byte followed by its remainder. The upper six bits of the tag select
+ * a prefix from the dictionary below (DOIs share a few long registrant prefixes, other
+ * identifiers a type prefix), the lower two bits say how the rest is stored.
+ * Codes are self-delimiting, so identifiers of a meta_id are simply concatenated.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include "idcodec.h"
+
+/*
+ * Prefix dictionary. Codes are stored on disk, so entries can only be appended.
+ * Longest matching prefix wins, 0 is no prefix and IDCODEC_PREFIX_DOI is any other registrant.
+ */
+static const char *idcodec_prefixes[] = {
+        0,
+        0,
+        "10.1016/j.",
+        "10.1016/S",
+        "10.1016/",
+        "10.1007/s",
+        "10.1007/978-",
+        "10.1007/",
+        "10.1002/",
+        "10.1021/acs.",
+        "10.1021/",
+        "10.1038/",
+        "10.1093/",
+        "10.1080/",
+        "10.1111/j.",
+        "10.1111/",
+        "10.1177/",
+        "10.1109/",
+        "10.1103/PhysRev",
+        "10.1103/",
+        "10.1371/journal.p",
+        "10.3390/",
+        "10.1017/",
+        "10.1088/",
+        "10.1126/science.",
+        "10.2307/",
+        "10.1186/",
+        "10.1145/",
+        "10.1039/",
+        "10.1063/",
+        "10.1097/",
+        "10.1515/",
+        "10.1142/S",
+        "PMID:",
+        "PMID",
+        "PMC",
+        "ISBN:",
+        "ISBN",
+        "ISSN:",
+        "arXiv:"
+};
+
+#define IDCODEC_PREFIXES_LEN (sizeof(idcodec_prefixes) / sizeof(idcodec_prefixes[0]))
+
+static inline uint32_t varint_put(uint64_t value, uint8_t *out) {
+    uint32_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (uint8_t) value;
+    return len;
+}
+
+// Returns the number of bytes read, or 0 if the varint is truncated or too long
+static inline uint32_t varint_get(uint8_t *in, uint32_t in_len, uint64_t *value) {
+    *value = 0;
+    for (uint32_t i = 0; i < in_len && i < 10; i++) {
+        *value |= ((uint64_t) (in[i] & 0x7F)) << (7 * i);
+        if (!(in[i] & 0x80)) return i + 1;
+    }
+    return 0;
+}
+
+// Stores the remainder as a number if it's only digits that fit into 64 bits
+static uint32_t idcodec_encode_remainder(uint8_t *s, uint32_t len, uint8_t *tag, uint8_t *code) {
+    if (len && len <= 19) {
+        uint64_t number = 0;
+        uint32_t i;
+        for (i = 0; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+            number = number * 10 + (s[i] - '0');
+        }
+
+        if (i == len) {
+            if (s[0] != '0') {
+                *tag |= IDCODEC_NUMBER;
+                return varint_put(number, code);
+            }
+            *tag |= IDCODEC_DIGITS;
+            uint32_t code_len = varint_put(len, code);
+            return code_len + varint_put(number, code + code_len);
+        }
+    }
+
+    *tag |= IDCODEC_RAW;
+    uint32_t code_len = varint_put(len, code);
+    memcpy(code + code_len, s, len);
+    return code_len + len;
+}
+
+// Returns the code length, or 0 if the identifier is too long
+uint32_t idcodec_encode(uint8_t *identifier, uint32_t identifier_len, uint8_t *code) {
+    if (identifier_len > IDCODEC_IDENTIFIER_MAX_LEN) return 0;
+
+    uint32_t prefix = 0;
+    uint32_t prefix_len = 0;
+    for (uint32_t i = 2; i < IDCODEC_PREFIXES_LEN; i++) {
+        uint32_t len = (uint32_t) strlen(idcodec_prefixes[i]);
+        if (len > prefix_len && len <= identifier_len && !memcmp(identifier, idcodec_prefixes[i], len)) {
+            prefix = i;
+            prefix_len = len;
+        }
+    }
+
+    uint8_t tag = (uint8_t) (prefix << 2);
+    uint32_t code_len = 1;
+
+    // Other DOIs keep the registrant as a number, unless it can't be restored byte for byte
+    if (!prefix && identifier_len > 4 && !memcmp(identifier, "10.", 3) && identifier[3] != '0') {
+        uint64_t registrant = 0;
+        uint32_t i;
+        for (i = 3; i < identifier_len && i < 12 && identifier[i] >= '0' && identifier[i] <= '9'; i++) {
+            registrant = registrant * 10 + (identifier[i] - '0');
+        }
+
+        if (i > 3 && i < identifier_len && identifier[i] == '/') {
+            tag = IDCODEC_PREFIX_DOI << 2;
+            code_len += varint_put(registrant, code + code_len);
+            prefix_len = i + 1;
+        }
+    }
+
+    code_len += idcodec_encode_remainder(identifier + prefix_len, identifier_len - prefix_len, &tag,
+                                         code + code_len);
+    code[0] = tag;
+    return code_len;
+}
+
+/*
+ * Decodes one code into identifier, which must have room for IDCODEC_IDENTIFIER_BUF_LEN bytes.
+ * Returns the identifier length, or 0 if the code is malformed
+ */
+uint32_t idcodec_decode(uint8_t *code, uint32_t code_len, uint8_t *identifier) {
+    if (!code_len) return 0;
+
+    uint8_t tag = code[0];
+    uint32_t prefix = tag >> 2;
+    uint32_t pos = 1;
+    uint32_t len = 0;
+    uint64_t value;
+    uint32_t n;
+
+    if (prefix == IDCODEC_PREFIX_DOI) {
+        if (!(n = varint_get(code + pos, code_len - pos, &value))) return 0;
+        pos += n;
+        len = (uint32_t) sprintf((char *) identifier, "10.%" PRIu64 "/", value);
+    } else if (prefix) {
+        if (prefix >= IDCODEC_PREFIXES_LEN) return 0;
+        len = (uint32_t) strlen(idcodec_prefixes[prefix]);
+        memcpy(identifier, idcodec_prefixes[prefix], len);
+    }
+
+    switch (tag & 3) {
+        case IDCODEC_RAW:
+            if (!(n = varint_get(code + pos, code_len - pos, &value))) return 0;
+            pos += n;
+            if (value > code_len - pos || len + value > IDCODEC_IDENTIFIER_MAX_LEN) return 0;
+            memcpy(identifier + len, code + pos, value);
+            len += value;
+            break;
+        case IDCODEC_NUMBER:
+            if (!varint_get(code + pos, code_len - pos, &value)) return 0;
+            len += sprintf((char *) identifier + len, "%" PRIu64, value);
+            break;
+        case IDCODEC_DIGITS: {
+            uint64_t digits;
+            if (!(n = varint_get(code + pos, code_len - pos, &digits)) || digits > 19) return 0;
+            pos += n;
+            if (!varint_get(code + pos, code_len - pos, &value)) return 0;
+            len += sprintf((char *) identifier + len, "%0*" PRIu64, (int) digits, value);
+            break;
+        }
+        default:
+            return 0;
+    }
+
+    return len;
+}
+
+// Returns the length of the first code in the list, or 0 if it's malformed
+uint32_t idcodec_next(uint8_t *list, uint32_t list_len) {
+    if (!list_len) return 0;
+
+    uint8_t tag = list[0];
+    uint32_t pos = 1;
+    uint64_t value;
+    uint32_t n;
+
+    if ((tag >> 2) == IDCODEC_PREFIX_DOI) {
+        if (!(n = varint_get(list + pos, list_len - pos, &value))) return 0;
+        pos += n;
+    }
+
+    switch (tag & 3) {
+        case IDCODEC_RAW:
+            if (!(n = varint_get(list + pos, list_len - pos, &value))) return 0;
+            pos += n;
+            if (value > list_len - pos) return 0;
+            return pos + (uint32_t) value;
+        case IDCODEC_DIGITS:
+            if (!(n = varint_get(list + pos, list_len - pos, &value))) return 0;
+            pos += n;
+            // fallthrough
+        case IDCODEC_NUMBER:
+            if (!(n = varint_get(list + pos, list_len - pos, &value))) return 0;
+            return pos + n;
+        default:
+            return 0;
+    }
+}
+
+// Encoding is deterministic, so identifiers can be compared by their codes
+uint32_t idcodec_contains(uint8_t *list, uint32_t list_len, uint8_t *code, uint32_t code_len) {
+    uint32_t pos = 0;
+    uint32_t n;
+    while (pos < list_len && (n = idcodec_next(list + pos, list_len - pos))) {
+        if (n == code_len && !memcmp(list + pos, code, code_len)) return 1;
+        pos += n;
+    }
+    return 0;
+}
+
+/*
+ * Inserts a code into the list, which must have room for code_len more bytes.
+ * Identifiers are kept in byte order of their decoded strings, the order identifiers
+ * were returned in when they were stored as text. Returns the new list length,
+ * which is unchanged if the list already has the identifier
+ */
+uint32_t idcodec_insert(uint8_t *list, uint32_t list_len, uint8_t *code, uint32_t code_len) {
+    uint8_t identifier[IDCODEC_IDENTIFIER_BUF_LEN];
+    uint8_t other[IDCODEC_IDENTIFIER_BUF_LEN];
+    uint32_t identifier_len = idcodec_decode(code, code_len, identifier);
+
+    uint32_t pos = 0;
+    uint32_t n;
+    while (pos < list_len && (n = idcodec_next(list + pos, list_len - pos))) {
+        uint32_t other_len = idcodec_decode(list + pos, n, other);
+        uint32_t len = identifier_len < other_len ? identifier_len : other_len;
+        int cmp = memcmp(identifier, other, len);
+        if (!cmp) {
+            if (identifier_len == other_len) return list_len;
+            cmp = identifier_len < other_len ? -1 : 1;
+        }
+        if (cmp < 0) break;
+        pos += n;
+    }
+
+    memmove(list + pos + code_len, list + pos, list_len - pos);
+    memcpy(list + pos, code, code_len);
+    return list_len + code_len;
+}
+
+/*
+ * Writes comma separated identifiers, truncated to out_max_len - 1 bytes.
+ * Like snprintf, returns the length they have without truncation, so a caller can retry with a larger buffer
+ */
+uint32_t idcodec_join(uint8_t *list, uint32_t list_len, uint8_t *out, uint32_t out_max_len) {
+    uint8_t identifier[IDCODEC_IDENTIFIER_BUF_LEN];
+    uint32_t out_len = 0;
+    uint32_t full_len = 0;
+    uint32_t pos = 0;
+    uint32_t n;
+
+    if (!out_max_len) return 0;
+
+    while (pos < list_len && (n = idcodec_next(list + pos, list_len - pos))) {
+        uint32_t len = idcodec_decode(list + pos, n, identifier);
+        pos += n;
+
+        if (full_len) full_len++;
+        full_len += len;
+
+        if (out_len && out_len < out_max_len - 1) out[out_len++] = ',';
+        if (len > out_max_len - 1 - out_len) len = out_max_len - 1 - out_len;
+        memcpy(out + out_len, identifier, len);
+        out_len += len;
+    }
+
+    out[out_len] = 0;
+    return full_len;
+}
@@ -0,0 +1,33 @@
+#ifndef TITLE_FINGERPRINT_DB_IDCODEC_H
+#define TITLE_FINGERPRINT_DB_IDCODEC_H
+
+#include <stdint.h>
+
+// Longer identifiers are rejected, which keeps decoding into fixed buffers safe
+#define IDCODEC_IDENTIFIER_MAX_LEN 1024
+// Upper bound of an encoded identifier: tag, length varint and raw bytes
+#define IDCODEC_CODE_MAX_LEN (IDCODEC_IDENTIFIER_MAX_LEN + 8)
+// Buffer size for a decoded identifier, a number remainder can make it longer than the limit
+#define IDCODEC_IDENTIFIER_BUF_LEN (IDCODEC_IDENTIFIER_MAX_LEN + 32)
+
+// Remainder after the prefix is stored as raw bytes, a number, or digits with leading zeros
+#define IDCODEC_RAW 0
+#define IDCODEC_NUMBER 1
+#define IDCODEC_DIGITS 2
+
+// Prefix code for DOIs whose registrant isn't in the dictionary, "10.<registrant>/"
+#define IDCODEC_PREFIX_DOI 1
+
+uint32_t idcodec_encode(uint8_t *identifier, uint32_t identifier_len, uint8_t *code);
+
+uint32_t idcodec_decode(uint8_t *code, uint32_t code_len, uint8_t *identifier);
+
+uint32_t idcodec_next(uint8_t *list, uint32_t list_len);
+
+uint32_t idcodec_contains(uint8_t *list, uint32_t list_len, uint8_t *code, uint32_t code_len);
+
+uint32_t idcodec_insert(uint8_t *list, uint32_t list_len, uint8_t *code, uint32_t code_len);
+
+uint32_t idcodec_join(uint8_t *list, uint32_t list_len, uint8_t *out, uint32_t out_max_len);
+
+#endif //TITLE_FINGERPRINT_DB_IDCODEC_H
@@ -0,0 +1,147 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * In-memory identifier store used on the identify path.
+ * meta_ids are dense, so entries are a plain array indexed by meta_id, each pointing
+ * to the meta_id's identifiers in a single arena, encoded as in the db (see idcodec.c). SQLite stays the durable
+ * source, the store is loaded from it at startup and updated together with it.
+ * Updates must be serialized with reads by the caller (the hashtable rwlock).
+ * A reload builds a new store next to the one in use, see ht_load.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <jemalloc/jemalloc.h>
+#include "idcodec.h"
+#include "idstore.h"
+
+idstore_t *idstore_new() {
+    idstore_t *store;
+    if (!(store = calloc(1, sizeof(idstore_t)))) {
+        fprintf(stderr, "idstore calloc failed\n");
+        return 0;
+    }
+
+    store->entries_size = 1048576;
+    if (!(store->entries = calloc(store->entries_size, sizeof(idstore_entry_t)))) {
+        fprintf(stderr, "idstore entries calloc failed\n");
+        idstore_free(store);
+        return 0;
+    }
+
+    store->arena_size = 16777216;
+    if (!(store->arena = malloc(store->arena_size))) {
+        fprintf(stderr, "idstore arena malloc failed\n");
+        idstore_free(store);
+        return 0;
+    }
+    store->arena_len = 0;
+    return store;
+}
+
+void idstore_free(idstore_t *store) {
+    if (!store) return;
+    free(store->entries);
+    free(store->arena);
+    free(store);
+}
+
+int idstore_reserve(idstore_t *store, uint32_t meta_id, uint64_t arena_len) {
+    if (meta_id >= store->entries_size) {
+        uint32_t size = store->entries_size;
+        while (meta_id >= size) size *= 2;
+        idstore_entry_t *entries;
+        if (!(entries = realloc(store->entries, sizeof(idstore_entry_t) * size))) {
+            fprintf(stderr, "idstore entries realloc failed\n");
+            return 0;
+        }
+        memset(entries + store->entries_size, 0, sizeof(idstore_entry_t) * (size - store->entries_size));
+        store->entries = entries;
+        store->entries_size = size;
+    }
+
+    if (arena_len > store->arena_size) {
+        uint64_t size = store->arena_size;
+        while (arena_len > size) size *= 2;
+        uint8_t *arena;
+        if (!(arena = realloc(store->arena, size))) {
+            fprintf(stderr, "idstore arena realloc failed\n");
+            return 0;
+        }
+        store->arena = arena;
+        store->arena_size = size;
+    }
+    return 1;
+}
+
+/*
+ * Adds an encoded identifier unless the meta_id already has it. Identifiers of a meta_id that
+ * isn't at the end of the arena are moved there first, which leaves the old copy unused.
+ * That only happens when a title gets more identifiers later.
+ */
+int idstore_add(idstore_t *store, uint32_t meta_id, uint8_t *code, uint32_t code_len) {
+    if (!idstore_reserve(store, meta_id, 0)) return 0;
+
+    idstore_entry_t *entry = &store->entries[meta_id];
+
+    if (entry->len && idcodec_contains(store->arena + entry->offset, entry->len, code, code_len)) return 1;
+
+    if (entry->offset + entry->len != store->arena_len || !entry->len) {
+        if (!idstore_reserve(store, meta_id, store->arena_len + entry->len + code_len)) return 0;
+        memcpy(store->arena + store->arena_len, store->arena + entry->offset, entry->len);
+        entry->offset = store->arena_len;
+        store->arena_len += entry->len;
+    } else if (!idstore_reserve(store, meta_id, store->arena_len + code_len)) {
+        return 0;
+    }
+
+    entry->len = idcodec_insert(store->arena + entry->offset, entry->len, code, code_len);
+    store->arena_len = entry->offset + entry->len;
+    return 1;
+}
+
+// Sets all encoded identifiers of a meta_id at once, used as the db_load_identifiers callback
+int idstore_load(void *arg, uint32_t meta_id, uint8_t *list, uint32_t list_len) {
+    idstore_t *store = arg;
+    if (!idstore_reserve(store, meta_id, store->arena_len + list_len)) return 0;
+
+    idstore_entry_t *entry = &store->entries[meta_id];
+    entry->offset = store->arena_len;
+    entry->len = list_len;
+    memcpy(store->arena + store->arena_len, list, list_len);
+    store->arena_len += list_len;
+    return 1;
+}
+
+// Copies comma separated identifiers of a meta_id, returns 0 if there are none
+uint32_t idstore_get(idstore_t *store, uint32_t meta_id, uint8_t *identifiers, uint32_t identifiers_max_len) {
+    if (meta_id >= store->entries_size || !store->entries[meta_id].len) return 0;
+
+    idstore_entry_t *entry = &store->entries[meta_id];
+    return idcodec_join(store->arena + entry->offset, entry->len, identifiers, identifiers_max_len);
+}
+
+uint64_t idstore_size(idstore_t *store) {
+    return store->arena_len + sizeof(idstore_entry_t) * (uint64_t) store->entries_size;
+}
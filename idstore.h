@@ -0,0 +1,32 @@
+#ifndef TITLE_FINGERPRINT_DB_IDSTORE_H
+#define TITLE_FINGERPRINT_DB_IDSTORE_H
+
+#include <stdint.h>
+
+// Identifiers of a meta_id are kept as one list of codes in the arena
+typedef struct idstore_entry {
+    uint64_t offset:40;
+    uint64_t len:24;
+} idstore_entry_t;
+
+typedef struct idstore {
+    idstore_entry_t *entries;
+    uint32_t entries_size;
+    uint8_t *arena;
+    uint64_t arena_len;
+    uint64_t arena_size;
+} idstore_t;
+
+idstore_t *idstore_new();
+
+void idstore_free(idstore_t *store);
+
+int idstore_add(idstore_t *store, uint32_t meta_id, uint8_t *code, uint32_t code_len);
+
+int idstore_load(void *store, uint32_t meta_id, uint8_t *list, uint32_t list_len);
+
+uint32_t idstore_get(idstore_t *store, uint32_t meta_id, uint8_t *identifiers, uint32_t identifiers_max_len);
+
+uint64_t idstore_size(idstore_t *store);
+
+#endif //TITLE_FINGERPRINT_DB_IDSTORE_H
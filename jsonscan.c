@@ -0,0 +1,372 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "jsonscan.h"
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+typedef struct scanner {
+    const uint8_t *p;
+    const uint8_t *end;
+} scanner_t;
+
+/*
+ * Nonzero if any of the 8 bytes is a quote, a backslash, a control character or a non-ASCII byte.
+ * Lets string scanning skip 8 plain bytes at a time without depending on a particular instruction set.
+ */
+static inline uint64_t special_bytes(uint64_t v) {
+    uint64_t quote = v ^ (ONES * '"');
+    uint64_t backslash = v ^ (ONES * '\\');
+    return (((quote - ONES) & ~quote) | ((backslash - ONES) & ~backslash) | ((v - ONES * 0x20) & ~v) | v) & HIGHS;
+}
+
+static void skip_whitespace(scanner_t *s) {
+    while (s->p < s->end && (*s->p == ' ' || *s->p == '\t' || *s->p == '\n' || *s->p == '\r')) s->p++;
+}
+
+static int32_t hex4(const uint8_t *p) {
+    int32_t value = 0;
+    for (uint32_t i = 0; i < 4; i++) {
+        uint8_t c = p[i];
+        if (c >= '0' && c <= '9') value = value << 4 | (c - '0');
+        else if (c >= 'a' && c <= 'f') value = value << 4 | (c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') value = value << 4 | (c - 'A' + 10);
+        else return -1;
+    }
+    return value;
+}
+
+// Decodes the escape sequence at p, returns its length or 0 if jansson would reject it
+static uint32_t escape_decode(const uint8_t *p, const uint8_t *end, uint32_t *codepoint) {
+    if (end - p < 2) return 0;
+
+    switch (p[1]) {
+        case '"':
+        case '\\':
+        case '/':
+            *codepoint = p[1];
+            return 2;
+        case 'b':
+            *codepoint = '\b';
+            return 2;
+        case 'f':
+            *codepoint = '\f';
+            return 2;
+        case 'n':
+            *codepoint = '\n';
+            return 2;
+        case 'r':
+            *codepoint = '\r';
+            return 2;
+        case 't':
+            *codepoint = '\t';
+            return 2;
+        case 'u':
+            break;
+        default:
+            return 0;
+    }
+
+    if (end - p < 6) return 0;
+    int32_t value = hex4(p + 2);
+    // NUL isn't allowed in jansson strings by default
+    if (value <= 0 || (value >= 0xDC00 && value <= 0xDFFF)) return 0;
+
+    if (value >= 0xD800 && value <= 0xDBFF) {
+        if (end - p < 12 || p[6] != '\\' || p[7] != 'u') return 0;
+        int32_t low = hex4(p + 8);
+        if (low < 0xDC00 || low > 0xDFFF) return 0;
+        *codepoint = 0x10000 + ((uint32_t) (value - 0xD800) << 10) + (uint32_t) (low - 0xDC00);
+        return 12;
+    }
+
+    *codepoint = (uint32_t) value;
+    return 6;
+}
+
+// Length of the UTF-8 sequence at p, or 0 if it's invalid
+static uint32_t utf8_length(const uint8_t *p, const uint8_t *end) {
+    uint32_t c = *p;
+    uint32_t n;
+    if (c >= 0xC2 && c <= 0xDF) n = 1, c &= 0x1F;
+    else if (c >= 0xE0 && c <= 0xEF) n = 2, c &= 0x0F;
+    else if (c >= 0xF0 && c <= 0xF4) n = 3, c &= 0x07;
+    else return 0;
+
+    if (end - p <= n) return 0;
+    for (uint32_t i = 1; i <= n; i++) {
+        if ((p[i] & 0xC0) != 0x80) return 0;
+        c = (c << 6) | (p[i] & 0x3F);
+    }
+
+    if ((n == 2 && c < 0x800) || (n == 3 && c < 0x10000) || c > 0x10FFFF) return 0;
+    if (c >= 0xD800 && c <= 0xDFFF) return 0;
+    return n + 1;
+}
+
+static uint32_t scan_string(scanner_t *s, jsonscan_string_t *str) {
+    const uint8_t *p = s->p + 1;
+    const uint8_t *end = s->end;
+    uint8_t escaped = 0;
+
+    str->data = p;
+    while (1) {
+        while (end - p >= 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            if (special_bytes(v)) break;
+            p += 8;
+        }
+
+        if (p >= end) return 0;
+
+        uint8_t c = *p;
+        if (c == '"') break;
+
+        uint32_t n;
+        if (c == '\\') {
+            uint32_t codepoint;
+            n = escape_decode(p, end, &codepoint);
+            escaped = 1;
+        } else if (c >= 0x80) {
+            n = utf8_length(p, end);
+        } else {
+            n = c >= 0x20;
+        }
+        if (!n) return 0;
+        p += n;
+    }
+
+    str->len = (uint32_t) (p - str->data);
+    str->escaped = escaped;
+    str->is_true = 0;
+    s->p = p + 1;
+    return 1;
+}
+
+// Skips a scalar value that isn't a string
+static uint32_t skip_scalar(scanner_t *s) {
+    const uint8_t *p = s->p;
+    const uint8_t *end = s->end;
+
+    if (end - p >= 4 && (!memcmp(p, "true", 4) || !memcmp(p, "null", 4))) {
+        s->p += 4;
+        return 1;
+    }
+    if (end - p >= 5 && !memcmp(p, "false", 5)) {
+        s->p += 5;
+        return 1;
+    }
+
+    if (p < end && *p == '-') p++;
+    const uint8_t *digits = p;
+    while (p < end && *p >= '0' && *p <= '9') p++;
+    if (p == digits || p - digits > JSONSCAN_DIGITS_MAX || (*digits == '0' && p - digits > 1)) return 0;
+    if (p < end && (*p == '.' || *p == 'e' || *p == 'E')) return 0;
+
+    s->p = p;
+    return 1;
+}
+
+// Scans an object, storing string values of the given keys. Later duplicates win, as in jansson.
+static uint32_t scan_object(scanner_t *s, const char **keys, uint32_t keys_len, jsonscan_string_t *values) {
+    memset(values, 0, sizeof(jsonscan_string_t) * keys_len);
+
+    s->p++;
+    skip_whitespace(s);
+    if (s->p < s->end && *s->p == '}') {
+        s->p++;
+        return 1;
+    }
+
+    while (1) {
+        skip_whitespace(s);
+        if (s->p >= s->end || *s->p != '"') return 0;
+
+        jsonscan_string_t key;
+        if (!scan_string(s, &key) || key.escaped) return 0;
+
+        skip_whitespace(s);
+        if (s->p >= s->end || *s->p != ':') return 0;
+        s->p++;
+        skip_whitespace(s);
+
+        jsonscan_string_t *value = 0;
+        for (uint32_t i = 0; i < keys_len; i++) {
+            if (key.len == strlen(keys[i]) && !memcmp(key.data, keys[i], key.len)) {
+                value = &values[i];
+                break;
+            }
+        }
+
+        if (s->p < s->end && *s->p == '"') {
+            jsonscan_string_t str;
+            if (!scan_string(s, &str)) return 0;
+            if (value) *value = str;
+        } else {
+            uint8_t is_true = s->end - s->p >= 4 && !memcmp(s->p, "true", 4);
+            if (!skip_scalar(s)) return 0;
+            if (value) {
+                memset(value, 0, sizeof(jsonscan_string_t));
+                value->is_true = is_true;
+            }
+        }
+
+        skip_whitespace(s);
+        if (s->p >= s->end) return 0;
+        if (*s->p == ',') {
+            s->p++;
+        } else if (*s->p == '}') {
+            s->p++;
+            return 1;
+        } else {
+            return 0;
+        }
+    }
+}
+
+static uint32_t scan_end(scanner_t *s) {
+    skip_whitespace(s);
+    return s->p == s->end;
+}
+
+uint32_t jsonscan_identify(const char *data, size_t data_len, jsonscan_string_t *text, uint8_t *debug) {
+    static const char *keys[] = {"text", "debug"};
+    scanner_t s = {(const uint8_t *) data, (const uint8_t *) data + data_len};
+
+    skip_whitespace(&s);
+    if (s.p >= s.end || *s.p != '{') return 0;
+
+    jsonscan_string_t values[2];
+    if (!scan_object(&s, keys, 2, values)) return 0;
+    *text = values[0];
+    *debug = values[1].is_true;
+    return scan_end(&s);
+}
+
+uint32_t jsonscan_index(const char *data, size_t data_len, arena_t *arena,
+                        jsonscan_record_t **records, uint32_t *records_len) {
+    static const char *keys[] = {"title", "name", "identifiers"};
+    scanner_t s = {(const uint8_t *) data, (const uint8_t *) data + data_len};
+
+    skip_whitespace(&s);
+    if (s.p >= s.end || *s.p != '[') return 0;
+    s.p++;
+
+    uint32_t max = 64;
+    *records = arena_alloc(arena, sizeof(jsonscan_record_t) * max);
+    *records_len = 0;
+    if (!*records) return 0;
+
+    skip_whitespace(&s);
+    if (s.p < s.end && *s.p == ']') {
+        s.p++;
+        return scan_end(&s);
+    }
+
+    while (1) {
+        skip_whitespace(&s);
+        if (s.p >= s.end) return 0;
+
+        if (*s.p == '{') {
+            if (*records_len == max) {
+                // The arena can't grow in place, the old array is dropped with the rest of the request
+                jsonscan_record_t *grown = arena_alloc(arena, sizeof(jsonscan_record_t) * max * 2);
+                if (!grown) return 0;
+                memcpy(grown, *records, sizeof(jsonscan_record_t) * max);
+                *records = grown;
+                max *= 2;
+            }
+            jsonscan_string_t values[3];
+            if (!scan_object(&s, keys, 3, values)) return 0;
+            jsonscan_record_t *record = &(*records)[(*records_len)++];
+            record->title = values[0];
+            record->name = values[1];
+            record->identifiers = values[2];
+        } else if (*s.p == '"') {
+            jsonscan_string_t str;
+            if (!scan_string(&s, &str)) return 0;
+        } else if (!skip_scalar(&s)) {
+            return 0;
+        }
+
+        skip_whitespace(&s);
+        if (s.p >= s.end) return 0;
+        if (*s.p == ',') {
+            s.p++;
+        } else if (*s.p == ']') {
+            s.p++;
+            return scan_end(&s);
+        } else {
+            return 0;
+        }
+    }
+}
+
+uint8_t *jsonscan_copy(arena_t *arena, const jsonscan_string_t *str) {
+    if (!str->data) return 0;
+
+    // Unescaping never makes a string longer
+    uint8_t *copy = arena_alloc(arena, (size_t) str->len + 1);
+    if (!copy) return 0;
+
+    if (!str->escaped) {
+        memcpy(copy, str->data, str->len);
+        copy[str->len] = 0;
+        return copy;
+    }
+
+    const uint8_t *p = str->data;
+    const uint8_t *end = str->data + str->len;
+    uint8_t *out = copy;
+    while (p < end) {
+        if (*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
+
+        uint32_t c;
+        p += escape_decode(p, end, &c);
+        if (c < 0x80) {
+            *out++ = (uint8_t) c;
+        } else if (c < 0x800) {
+            *out++ = (uint8_t) (0xC0 | c >> 6);
+            *out++ = (uint8_t) (0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            *out++ = (uint8_t) (0xE0 | c >> 12);
+            *out++ = (uint8_t) (0x80 | (c >> 6 & 0x3F));
+            *out++ = (uint8_t) (0x80 | (c & 0x3F));
+        } else {
+            *out++ = (uint8_t) (0xF0 | c >> 18);
+            *out++ = (uint8_t) (0x80 | (c >> 12 & 0x3F));
+            *out++ = (uint8_t) (0x80 | (c >> 6 & 0x3F));
+            *out++ = (uint8_t) (0x80 | (c & 0x3F));
+        }
+    }
+    *out = 0;
+    return copy;
+}
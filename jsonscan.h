@@ -0,0 +1,43 @@
+#ifndef TITLE_FINGERPRINT_DB_JSONSCAN_H
+#define TITLE_FINGERPRINT_DB_JSONSCAN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "arena.h"
+
+// Integers with more digits, and any reals, are left to jansson which rejects out of range numbers
+#define JSONSCAN_DIGITS_MAX 18
+
+/*
+ * In-place scanner for the fixed request shapes of /identify and /index. Strings are returned
+ * as views into the request body, still escaped, and are validated the same way jansson does.
+ * Anything the scanner doesn't handle (nested values in unused fields, escaped keys, reals,
+ * invalid JSON) makes it give up, and the caller falls back to jansson.
+ */
+
+typedef struct jsonscan_string {
+    // 0 if the field is missing or isn't a string
+    const uint8_t *data;
+    uint32_t len;
+    uint8_t escaped;
+    // The value was the literal true instead of a string
+    uint8_t is_true;
+} jsonscan_string_t;
+
+typedef struct jsonscan_record {
+    jsonscan_string_t title;
+    jsonscan_string_t name;
+    jsonscan_string_t identifiers;
+} jsonscan_record_t;
+
+// {"text": "...", "debug": true}
+uint32_t jsonscan_identify(const char *data, size_t data_len, jsonscan_string_t *text, uint8_t *debug);
+
+// [{"title": "...", "name": "...", "identifiers": "..."}, ...], elements that aren't objects are skipped
+uint32_t jsonscan_index(const char *data, size_t data_len, arena_t *arena,
+                        jsonscan_record_t **records, uint32_t *records_len);
+
+// Unescaped NUL terminated copy of the string in the arena, 0 if the field is missing
+uint8_t *jsonscan_copy(arena_t *arena, const jsonscan_string_t *str);
+
+#endif //TITLE_FINGERPRINT_DB_JSONSCAN_H
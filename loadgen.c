@@ -0,0 +1,431 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Identify throughput of the binary protocol (TCP or Unix domain socket, pipelined)
+ * and of the HTTP API, using the same texts, so both can be compared on one server.
+ * Usage: title-fingerprint-loadgen -i texts.txt -u /run/tfdb.sock | -t host:port | -H host:port
+ * The input has one text per line, with line breaks inside a text written as \n.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "client.h"
+
+#define LOADGEN_THREADS_MAX 256
+#define LOADGEN_WINDOW_MAX 1024
+#define LOADGEN_HTTP_BUF_LEN 1048576
+
+typedef struct loadgen_texts {
+    uint8_t **texts;
+    uint32_t *lens;
+    // HTTP requests with the text in a JSON body
+    uint8_t **requests;
+    uint32_t *request_lens;
+    uint32_t len;
+} loadgen_texts_t;
+
+typedef struct loadgen_thread {
+    pthread_t tid;
+    uint32_t offset;
+    uint64_t done;
+    uint64_t found;
+    int failed;
+} loadgen_thread_t;
+
+loadgen_texts_t loadgen_texts;
+char *opt_socket = 0;
+char *opt_host = 0;
+char *opt_port = 0;
+uint8_t opt_http = 0;
+uint32_t opt_requests = 100000;
+uint32_t opt_window = 64;
+
+uint64_t loadgen_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint8_t *loadgen_http_request(uint8_t *text, uint32_t text_len, uint32_t *request_len) {
+    // Every byte can turn into a \u00XX escape
+    uint32_t body_max = 16 + text_len * 6;
+    uint32_t max = body_max + 256 + (uint32_t) strlen(opt_host);
+    uint8_t *request = malloc(max);
+    uint8_t *body = malloc(body_max);
+    if (!request || !body) {
+        free(request);
+        free(body);
+        return 0;
+    }
+
+    uint32_t n = (uint32_t) sprintf((char *) body, "{\"text\":\"");
+    for (uint32_t i = 0; i < text_len; i++) {
+        uint8_t c = text[i];
+        if (c == '"' || c == '\\') {
+            body[n++] = '\\';
+            body[n++] = c;
+        } else if (c < 0x20) {
+            n += sprintf((char *) body + n, "\\u%04x", c);
+        } else {
+            body[n++] = c;
+        }
+    }
+    n += sprintf((char *) body + n, "\"}");
+
+    *request_len = (uint32_t) sprintf((char *) request,
+                                      "POST /identify HTTP/1.1\r\nHost: %s\r\n"
+                                      "Content-Type: application/json\r\nContent-Length: %u\r\n\r\n",
+                                      opt_host, n);
+    memcpy(request + *request_len, body, n);
+    *request_len += n;
+    free(body);
+    return request;
+}
+
+int loadgen_load(char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return 0;
+    }
+
+    uint32_t max = 1024;
+    loadgen_texts.texts = malloc(max * sizeof(uint8_t *));
+    loadgen_texts.lens = malloc(max * sizeof(uint32_t));
+    loadgen_texts.len = 0;
+
+    char *line = 0;
+    size_t line_max = 0;
+    ssize_t n;
+    while ((n = getline(&line, &line_max, file)) > 0) {
+        while (n && (line[n - 1] == '\n' || line[n - 1] == '\r')) n--;
+
+        // Multi-line texts have their line breaks escaped as \n
+        ssize_t len = 0;
+        for (ssize_t i = 0; i < n; i++) {
+            if (line[i] == '\\' && i + 1 < n && (line[i + 1] == 'n' || line[i + 1] == '\\')) {
+                line[len++] = line[++i] == 'n' ? '\n' : '\\';
+            } else {
+                line[len++] = line[i];
+            }
+        }
+        n = len;
+        if (!n || n > PROTO_PAYLOAD_MAX) continue;
+
+        if (loadgen_texts.len == max) {
+            max *= 2;
+            loadgen_texts.texts = realloc(loadgen_texts.texts, max * sizeof(uint8_t *));
+            loadgen_texts.lens = realloc(loadgen_texts.lens, max * sizeof(uint32_t));
+        }
+
+        uint8_t *text = malloc((size_t) n);
+        memcpy(text, line, (size_t) n);
+        loadgen_texts.texts[loadgen_texts.len] = text;
+        loadgen_texts.lens[loadgen_texts.len] = (uint32_t) n;
+        loadgen_texts.len++;
+    }
+    free(line);
+    fclose(file);
+
+    if (!loadgen_texts.len) {
+        fprintf(stderr, "no texts in %s\n", path);
+        return 0;
+    }
+
+    if (opt_http) {
+        loadgen_texts.requests = malloc(loadgen_texts.len * sizeof(uint8_t *));
+        loadgen_texts.request_lens = malloc(loadgen_texts.len * sizeof(uint32_t));
+        for (uint32_t i = 0; i < loadgen_texts.len; i++) {
+            loadgen_texts.requests[i] = loadgen_http_request(loadgen_texts.texts[i], loadgen_texts.lens[i],
+                                                             &loadgen_texts.request_lens[i]);
+            if (!loadgen_texts.requests[i]) return 0;
+        }
+    }
+
+    return 1;
+}
+
+void *loadgen_binary(void *arg) {
+    loadgen_thread_t *t = arg;
+
+    client_t *client = opt_socket ? client_connect_unix(opt_socket) : client_connect_tcp(opt_host, opt_port);
+    if (!client) {
+        t->failed = 1;
+        return 0;
+    }
+
+    uint32_t sent = 0;
+    client_response_t response;
+    while (t->done < opt_requests) {
+        while (sent < opt_requests && sent - t->done < opt_window) {
+            uint32_t i = (t->offset + sent) % loadgen_texts.len;
+            if (!client_send_identify(client, loadgen_texts.texts[i], loadgen_texts.lens[i])) {
+                t->failed = 1;
+                goto end;
+            }
+            sent++;
+        }
+
+        if (!client_recv(client, &response)) {
+            t->failed = 1;
+            break;
+        }
+        if (response.status == PROTO_OK) t->found++;
+        t->done++;
+    }
+
+    end:
+    client_close(client);
+    return 0;
+}
+
+int loadgen_http_connect() {
+    struct addrinfo hints, *res, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(opt_host, opt_port, &hints, &res)) return -1;
+
+    int fd = -1;
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+// Reads one response into buf, returns its length or -1. Sets *close_after if the server closes the connection.
+ssize_t loadgen_http_response(int fd, char *buf, int *close_after) {
+    size_t len = 0;
+    char *body = 0;
+
+    while (!body) {
+        if (len + 1 >= LOADGEN_HTTP_BUF_LEN) return -1;
+        ssize_t n = read(fd, buf + len, LOADGEN_HTTP_BUF_LEN - 1 - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        len += (size_t) n;
+        buf[len] = 0;
+        body = strstr(buf, "\r\n\r\n");
+    }
+    body += 4;
+
+    long content_length = -1;
+    int chunked = 0;
+    *close_after = 0;
+    for (char *h = strstr(buf, "\r\n"); h && h < body - 2; h = strstr(h + 2, "\r\n")) {
+        char *header = h + 2;
+        if (!strncasecmp(header, "Content-Length:", 15)) content_length = atol(header + 15);
+        else if (!strncasecmp(header, "Transfer-Encoding:", 18) && strstr(header, "chunked") < body) chunked = 1;
+        else if (!strncasecmp(header, "Connection:", 11) && !strncasecmp(header + 11 + strspn(header + 11, " "), "close", 5)) *close_after = 1;
+    }
+
+    if (!chunked && content_length < 0) *close_after = 1;
+
+    while (1) {
+        size_t body_len = len - (size_t) (body - buf);
+        if (content_length >= 0 && body_len >= (size_t) content_length) break;
+        if (chunked && (strstr(body, "\r\n0\r\n\r\n") || !strncmp(body, "0\r\n\r\n", 5))) break;
+
+        if (len + 1 >= LOADGEN_HTTP_BUF_LEN) return -1;
+        ssize_t n = read(fd, buf + len, LOADGEN_HTTP_BUF_LEN - 1 - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (!n) {
+            if (*close_after) break;
+            return -1;
+        }
+        len += (size_t) n;
+        buf[len] = 0;
+    }
+
+    return (ssize_t) len;
+}
+
+void *loadgen_http(void *arg) {
+    loadgen_thread_t *t = arg;
+    char *buf = malloc(LOADGEN_HTTP_BUF_LEN);
+    int fd = -1;
+
+    // Requests are sent one at a time, the HTTP server isn't expected to pipeline
+    while (buf && t->done < opt_requests) {
+        if (fd < 0 && (fd = loadgen_http_connect()) < 0) {
+            fprintf(stderr, "failed to connect to %s:%s\n", opt_host, opt_port);
+            t->failed = 1;
+            break;
+        }
+
+        uint32_t i = (t->offset + (uint32_t) t->done) % loadgen_texts.len;
+        uint8_t *data = loadgen_texts.requests[i];
+        uint32_t data_len = loadgen_texts.request_lens[i];
+        while (data_len) {
+            ssize_t n = send(fd, data, data_len, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            data += n;
+            data_len -= (uint32_t) n;
+        }
+
+        int close_after;
+        if (data_len || loadgen_http_response(fd, buf, &close_after) < 0) {
+            t->failed = 1;
+            break;
+        }
+
+        if (strstr(buf, "\"title\"")) t->found++;
+        t->done++;
+
+        if (close_after) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd >= 0) close(fd);
+    free(buf);
+    return 0;
+}
+
+void print_usage() {
+    printf("Missing parameters.\nUsage example:\ntitle-fingerprint-loadgen -i texts.txt -u /run/tfdb.sock\n"
+           "Options:\n"
+           "  -i  file with one text to identify per line\n"
+           "  -u  binary protocol Unix domain socket\n"
+           "  -t  binary protocol host:port\n"
+           "  -H  HTTP API host:port\n"
+           "  -n  requests per connection, 100000 by default\n"
+           "  -c  number of connections, each in its own thread, 1 by default\n"
+           "  -w  binary protocol requests in flight per connection, 64 by default\n");
+}
+
+int main(int argc, char **argv) {
+    char *opt_input = 0;
+    char *opt_address = 0;
+    uint32_t connections = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:u:t:H:n:c:w:")) != -1) {
+        switch (opt) {
+            case 'i':
+                opt_input = optarg;
+                break;
+            case 'u':
+                opt_socket = optarg;
+                break;
+            case 't':
+                opt_address = optarg;
+                break;
+            case 'H':
+                opt_address = optarg;
+                opt_http = 1;
+                break;
+            case 'n':
+                opt_requests = (uint32_t) atol(optarg);
+                break;
+            case 'c':
+                connections = (uint32_t) atol(optarg);
+                break;
+            case 'w':
+                opt_window = (uint32_t) atol(optarg);
+                break;
+            default:
+                print_usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!opt_input || (!opt_socket && !opt_address)) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (opt_address) {
+        char *colon = strrchr(opt_address, ':');
+        if (!colon) {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+        *colon = 0;
+        opt_host = opt_address;
+        opt_port = colon + 1;
+    }
+
+    if (connections < 1) connections = 1;
+    if (connections > LOADGEN_THREADS_MAX) connections = LOADGEN_THREADS_MAX;
+    if (opt_window < 1) opt_window = 1;
+    if (opt_window > LOADGEN_WINDOW_MAX) opt_window = LOADGEN_WINDOW_MAX;
+
+    if (!loadgen_load(opt_input)) return EXIT_FAILURE;
+
+    loadgen_thread_t threads[LOADGEN_THREADS_MAX];
+    memset(threads, 0, sizeof(threads));
+
+    uint64_t start = loadgen_ns();
+    for (uint32_t i = 0; i < connections; i++) {
+        threads[i].offset = (uint32_t) ((uint64_t) i * loadgen_texts.len / connections);
+        pthread_create(&threads[i].tid, NULL, opt_http ? loadgen_http : loadgen_binary, &threads[i]);
+    }
+
+    uint64_t done = 0, found = 0;
+    int failed = 0;
+    for (uint32_t i = 0; i < connections; i++) {
+        pthread_join(threads[i].tid, NULL);
+        done += threads[i].done;
+        found += threads[i].found;
+        failed |= threads[i].failed;
+    }
+    double seconds = (double) (loadgen_ns() - start) / 1e9;
+
+    printf("%s, %u connections, window %u: %llu requests (%llu identified) in %.2fs, %.0f requests/s\n",
+           opt_http ? "http" : opt_socket ? "binary unix" : "binary tcp",
+           connections, opt_http ? 1 : opt_window,
+           (unsigned long long) done, (unsigned long long) found, seconds, done / seconds);
+
+    if (failed) {
+        fprintf(stderr, "some requests failed\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
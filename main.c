@@ -21,7 +21,9 @@
  */
 
 #include <stdio.h>
+#include <inttypes.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <signal.h>
 #include <pthread.h>
@@ -34,14 +36,50 @@
 #include "ht.h"
 #include "db.h"
 #include "text.h"
-
-extern row_t rows[HASHTABLE_SIZE];
-extern struct timeval t_updated;
-extern uint32_t identifiers_in_transaction;
+#include "oplog.h"
+#include "export.h"
+#include "proto.h"
+#include "api.h"
+#include "arena.h"
+#include "http.h"
+#include "metrics.h"
+#include "persist.h"
+#include "trace.h"
+#include "admit.h"
+#include "repl.h"
+#include "shard.h"
+#include "router.h"
+
+extern uint8_t identifiers_in_memory;
+
+// Block size a spooled ingest body is read in
+#define INGEST_READ_LEN 65536
+// Largest ingest body onion spools to a temporary file
+#define INGEST_MAX_SIZE 17179869184
+// Requests onion handles at a time
+#define ONION_THREADS 16
 
 onion *on = NULL;
 pthread_rwlock_t rwlock;
 
+// Invalid requests get an empty response, requests turned away by admission control or a running reload their status
+void url_respond(onion_response *res, char *str, uint32_t status) {
+    if (str) {
+        onion_response_set_header(res, "Content-Type", "application/json; charset=utf-8");
+        onion_response_write0(res, str);
+    } else if (status == API_TOO_MANY_REQUESTS || status == API_UNAVAILABLE) {
+        onion_response_set_code(res, (int) status);
+        onion_response_set_header(res, "Retry-After", "1");
+    } else if (status == API_CONFLICT || status == API_FORBIDDEN) {
+        onion_response_set_code(res, (int) status);
+    }
+}
+
+// Onion doesn't tell when the request arrived, so timeouts count from when it's handled
+uint64_t url_deadline(onion_request *req) {
+    return admit_deadline(onion_request_get_header(req, ADMIT_TIMEOUT_HEADER), metrics_now());
+}
+
 onion_connection_status url_identify(void *_, onion_request *req, onion_response *res) {
     if (!(onion_request_get_flags(req) & OR_POST)) {
         return OCS_PROCESSED;
@@ -51,165 +89,260 @@ onion_connection_status url_identify(void *_, onion_request *req, onion_response
 
     if (!dreq) return OCS_PROCESSED;
 
-    const char *data = onion_block_data(dreq);
+    uint32_t status;
+    char *str = api_identify(onion_block_data(dreq), (size_t) onion_block_size(dreq), url_deadline(req), &status);
+    url_respond(res, str, status);
+    arena_reset(arena_local());
 
-    json_t *root;
-    json_error_t error;
-    root = json_loads(data, 0, &error);
+    return OCS_PROCESSED;
+}
 
-    if (!root || !json_is_object(root)) {
-        return OCS_PROCESSED;
-    }
+onion_connection_status url_index(void *_, onion_request *req, onion_response *res) {
+    if (onion_request_get_flags(req) & OR_POST) {
+        const onion_block *dreq = onion_request_get_data(req);
 
-    json_t *json_text = json_object_get(root, "text");
+        if (!dreq) return OCS_PROCESSED;
 
-    if (!json_is_string(json_text)) {
-        return OCS_PROCESSED;;
+        uint32_t status;
+        char *str = api_index(onion_block_data(dreq), (size_t) onion_block_size(dreq), url_deadline(req), &status);
+        url_respond(res, str, status);
+        arena_reset(arena_local());
     }
 
-    uint8_t *text = json_string_value(json_text);
-
-    struct timeval st, et;
-
-    result_t result;
-    uint32_t rc;
-    pthread_rwlock_rdlock(&rwlock);
-
-    gettimeofday(&st, NULL);
-    rc = ht_identify(text, &result);
-    gettimeofday(&et, NULL);
-
-    pthread_rwlock_unlock(&rwlock);
-
-    uint32_t elapsed = ((et.tv_sec - st.tv_sec) * 1000000) + (et.tv_usec - st.tv_usec);
+    return OCS_PROCESSED;
+}
 
-    json_t *obj = json_object();
+onion_connection_status url_reload(void *_, onion_request *req, onion_response *res) {
+    if (onion_request_get_flags(req) & OR_POST) {
+        const onion_block *dreq = onion_request_get_data(req);
 
-    if (rc) {
-        json_object_set_new(obj, "time", json_integer(elapsed));
-        json_object_set(obj, "title", json_string(result.title));
-        json_object_set(obj, "name", json_string(result.name));
-        json_object_set(obj, "identifiers", json_string(result.identifiers));
-    } else {
+        if (!dreq) return OCS_PROCESSED;
 
+        uint32_t status;
+        char *str = api_reload(onion_block_data(dreq), (size_t) onion_block_size(dreq), 0, &status);
+        url_respond(res, str, status);
+        arena_reset(arena_local());
     }
 
-    char *str = json_dumps(obj, JSON_INDENT(1) | JSON_PRESERVE_ORDER);
-    json_decref(obj);
-
-    onion_response_set_header(res, "Content-Type", "application/json; charset=utf-8");
-    onion_response_printf(res, str);
-    free(str);
-
     return OCS_PROCESSED;
 }
 
-onion_connection_status url_index(void *_, onion_request *req, onion_response *res) {
-    if (onion_request_get_flags(req) & OR_POST) {
-        struct timeval st, et;
+int ingest_response_write(void *ctx, const char *data, size_t data_len) {
+    if (onion_response_write(ctx, data, data_len) < 0) return 0;
+    onion_response_flush(ctx);
+    return 1;
+}
 
-        gettimeofday(&st, NULL);
-        const onion_block *dreq = onion_request_get_data(req);
+/*
+ * Indexes newline delimited JSON records, one {"title", "name", "identifiers"} object per line, see api_ingest_feed.
+ * onion only calls the handler once it has the whole body: a PUT body spooled to a temporary file,
+ * which is read in blocks, or a POST body in memory. The epoll front-end (http.c) parses the body as it arrives.
+ * For the same reason a 429 from admission control only comes after onion has received the whole body,
+ * the epoll front-end answers it before reading any.
+ */
+onion_connection_status url_ingest(void *_, onion_request *req, onion_response *res) {
+    uint32_t method = onion_request_get_flags(req) & OR_METHODS;
+    uint32_t status;
 
-        if (!dreq) return OCS_PROCESSED;
+    api_ingest_t *ingest = api_ingest_start(ingest_response_write, res, &status);
+    if (!ingest) {
+        url_respond(res, 0, status);
+        return OCS_PROCESSED;
+    }
 
-        const char *data = onion_block_data(dreq);
+    FILE *f = 0;
+    const onion_block *dreq = 0;
+    if (method == OR_PUT) {
+        const char *filename = onion_request_get_put(req, "filename");
+        if (filename) f = fopen(filename, "r");
+    } else if (method == OR_POST) {
+        dreq = onion_request_get_data(req);
+        if (dreq && !onion_block_size(dreq)) dreq = 0;
+    }
 
-        json_t *root;
-        json_error_t error;
+    if (!f && !dreq) {
+        api_ingest_free(ingest);
+        onion_response_set_code(res, 400);
+        return OCS_PROCESSED;
+    }
 
-        root = json_loads(data, 0, &error);
+    onion_response_set_header(res, "Content-Type", "application/x-ndjson");
 
-        if (!root) {
-            return OCS_PROCESSED;
+    uint32_t rc = 1;
+    if (f) {
+        char buf[INGEST_READ_LEN];
+        size_t n;
+        while (rc && (n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            rc = api_ingest_feed(ingest, buf, n);
         }
+        fclose(f);
+    } else {
+        rc = api_ingest_feed(ingest, onion_block_data(dreq), (size_t) onion_block_size(dreq));
+    }
 
-        uint32_t indexed = 0;
-        pthread_rwlock_wrlock(&rwlock);
-        if (json_is_array(root)) {
-            uint32_t n = (uint32_t) json_array_size(root);
-            int i;
-            for (i = 0; i < n; i++) {
-                json_t *el = json_array_get(root, i);
-                if (json_is_object(el)) {
-                    json_t *json_title = json_object_get(el, "title");
-                    json_t *json_name = json_object_get(el, "name");
-                    json_t *json_identifiers = json_object_get(el, "identifiers");
-                    uint8_t *title = json_string_value(json_title);
-                    uint8_t *name = json_string_value(json_name);
-                    uint8_t *identifiers = json_string_value(json_identifiers);
-                    if (ht_index(title, name, identifiers))
-                        indexed++;
-                }
-            }
-        }
-        pthread_rwlock_unlock(&rwlock);
+    if (rc) {
+        api_ingest_end(ingest);
+    } else {
+        api_ingest_free(ingest);
+    }
+    return OCS_PROCESSED;
+}
 
-        json_decref(root);
+onion_connection_status url_stats(void *_, onion_request *req, onion_response *res) {
+    char *str = api_stats();
+    if (str) {
+        onion_response_set_header(res, "Content-Type", "application/json; charset=utf-8");
+        onion_response_write0(res, str);
+    }
+    arena_reset(arena_local());
 
-        gettimeofday(&et, NULL);
+    return OCS_PROCESSED;
+}
 
-        json_t *obj = json_object();
-        json_object_set_new(obj, "indexed", json_integer(indexed));
+onion_connection_status url_metrics(void *_, onion_request *req, onion_response *res) {
+    char *str = api_metrics();
+    if (str) {
+        onion_response_set_header(res, "Content-Type", "text/plain; version=0.0.4");
+        onion_response_write0(res, str);
+    } else {
+        onion_response_set_code(res, 500);
+    }
+    arena_reset(arena_local());
 
-        char *str = json_dumps(obj, JSON_INDENT(1) | JSON_PRESERVE_ORDER);
-        json_decref(obj);
+    return OCS_PROCESSED;
+}
 
-        onion_response_set_header(res, "Content-Type", "application/json; charset=utf-8");
-        onion_response_printf(res, str);
-        free(str);
-    }
+typedef struct export_response {
+    onion_response *res;
+    uint64_t written;
+} export_response_t;
 
-    return OCS_PROCESSED;;
+int export_response_write(void *ctx, uint8_t *data, uint32_t data_len) {
+    export_response_t *response = ctx;
+    response->written += data_len;
+    return onion_response_write(response->res, (char *) data, data_len) >= 0;
 }
 
-onion_connection_status url_stats(void *_, onion_request *req, onion_response *res) {
-    stats_t stats = ht_stats();
-    json_t *obj = json_object();
-    json_object_set(obj, "used_hashes", json_integer(stats.used_hashes));
-    json_object_set(obj, "used_slots", json_integer(stats.used_slots));
-    json_object_set(obj, "max_slots", json_integer(stats.max_slots));
+// Streams slots of rows start..end-1 (all rows by default), large exports can be split into ranges
+onion_connection_status url_export(void *_, onion_request *req, onion_response *res) {
+    const char *start = onion_request_get_query(req, "start");
+    const char *end = onion_request_get_query(req, "end");
+    const char *format = onion_request_get_query(req, "format");
 
-    char *str = json_dumps(obj, JSON_INDENT(1) | JSON_PRESERVE_ORDER);
-    json_decref(obj);
+    uint32_t row_start = start ? (uint32_t) strtoul(start, 0, 10) : 0;
+    uint32_t row_end = end ? (uint32_t) strtoul(end, 0, 10) : HASHTABLE_SIZE;
+    uint8_t export_format = format && !strcmp(format, "binary") ? EXPORT_FORMAT_BINARY : EXPORT_FORMAT_NDJSON;
 
-    onion_response_set_header(res, "Content-Type", "application/json; charset=utf-8");
-    onion_response_printf(res, str);
-    free(str);
+    if (row_start > row_end || (format && export_format == EXPORT_FORMAT_NDJSON && strcmp(format, "ndjson"))) {
+        onion_response_set_code(res, 400);
+        return OCS_PROCESSED;
+    }
 
+    onion_response_set_header(res, "Content-Type", export_format == EXPORT_FORMAT_BINARY
+                                                   ? "application/octet-stream" : "application/x-ndjson");
+
+    uint64_t started = metrics_now();
+    uint64_t slots;
+    export_response_t response = {res, 0};
+    if (!export_rows(row_start, row_end, export_format, export_response_write, &response, &slots)) {
+        if (!response.written) {
+            onion_response_set_code(res, 500);
+            onion_response_set_header(res, "Content-Type", "text/plain");
+            onion_response_write0(res, "export failed\n");
+        } else if (export_format == EXPORT_FORMAT_BINARY) {
+            // The status line is already out, so the export ends with a record that says it failed
+            uint8_t record[18] = {0};
+            uint16_t error = EXPORT_BINARY_ERROR;
+            memcpy(record + 16, &error, 2);
+            onion_response_write(res, (char *) record, sizeof(record));
+        } else {
+            onion_response_write0(res, "{\"error\":\"export failed\"}\n");
+        }
+        metrics_since(METRICS_HTTP_EXPORT, started);
+        return OCS_CLOSE_CONNECTION;
+    }
+    metrics_since(METRICS_HTTP_EXPORT, started);
     return OCS_PROCESSED;
 }
 
+// Serializes group commits and checkpoints, so shutdown waits for a checkpoint in progress
+pthread_mutex_t save_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Group commit of identifiers and hashtable log records indexed since the last save
 int save() {
-    printf("saving..\n");
-    pthread_rwlock_rdlock(&rwlock);
-    db_save_identifiers();
-    db_save_hashtable(rows, HASHTABLE_SIZE);
-    pthread_rwlock_unlock(&rwlock);
-    printf("..saved\n");
+    int rc = 0;
+    pthread_mutex_lock(&save_mutex);
+    uint64_t locked = metrics_rdlock(&rwlock);
+    if (db_save_identifiers() && oplog_commit()) rc = 1;
+    metrics_since(METRICS_SAVE, locked);
+    metrics_unlock(&rwlock, locked, 0);
+    pthread_mutex_unlock(&save_mutex);
+    if (!rc) metrics_count(METRICS_SAVE_FAILED, 1);
+    return rc;
 }
 
-void *saver_thread(void *arg) {
-    struct timeval t_current;
+/*
+ * Writes rows changed since the last checkpoint to the hashtable db, after which
+ * their log segments are removed. Only copying the changed rows and rotating the log
+ * happen under the lock, the db write runs while indexing and identifying continue.
+ */
+int checkpoint() {
+    snapshot_t *snapshot = 0;
+    uint32_t seq;
+    uint64_t bytes = 0;
+    int rc = 0;
+
+    pthread_mutex_lock(&save_mutex);
+    uint64_t start = metrics_now();
+
+    uint64_t locked = metrics_rdlock(&rwlock);
+    if (db_save_identifiers() && oplog_rotate(&seq)) {
+        snapshot = ht_snapshot();
+    }
+    metrics_unlock(&rwlock, locked, 0);
+
+    if (snapshot) {
+        if (db_save_hashtable(snapshot, &bytes)) {
+            rc = oplog_remove(seq);
+        } else {
+            // Rows will be written by the next checkpoint, and the log segments are kept until then
+            locked = metrics_rdlock(&rwlock);
+            ht_snapshot_restore(snapshot);
+            metrics_unlock(&rwlock, locked, 0);
+        }
+    }
 
-    while (1) {
-        usleep(10000);
+    uint32_t elapsed = (uint32_t) ((metrics_since(METRICS_CHECKPOINT, start) - start) / 1000000);
+    if (!rc) metrics_count(METRICS_CHECKPOINT_FAILED, 1);
+    printf("checkpoint %s: %u rows, %" PRIu64 " bytes, %u ms\n", rc ? "saved" : "failed",
+           snapshot ? snapshot->rows_len : 0, bytes, elapsed);
 
-        // Force flush because otherwise Docker doesn't output logs
-        fflush(stdout);
-        fflush(stderr);
+    ht_snapshot_free(snapshot);
+    pthread_mutex_unlock(&save_mutex);
+    return rc;
+}
 
-        if (!t_updated.tv_sec) {
-            continue;
-        }
+// Commits and checkpoints when the persistence policy says so, see persist.c
+void *saver_thread(void *arg) {
+    // Signals are handled by other threads, because the handler waits for this thread's checkpoint
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
 
-        gettimeofday(&t_current, NULL);
-        if (t_current.tv_sec - t_updated.tv_sec >= 10
-            || identifiers_in_transaction > 50000000) {
-            save();
-            t_updated.tv_sec = 0;
-            t_updated.tv_usec = 0;
+    while (1) {
+        uint64_t seen;
+        uint8_t reason = persist_wait(&seen);
+
+        int rc;
+        if (reason == PERSIST_CHECKPOINT_LOG || reason == PERSIST_CHECKPOINT_DIRTY) {
+            rc = checkpoint();
+        } else {
+            rc = save();
         }
+
+        persist_done(reason, seen, rc);
     }
 }
 
@@ -220,10 +353,19 @@ void signal_handler(int signum) {
         onion_listen_stop(on);
     }
 
-    save();
-    if (!db_close()) {
-        fprintf(stderr, "db close failed\n");
-        return;
+    http_stop();
+
+    proto_close();
+
+    repl_close();
+
+    // A router has nothing to save
+    if (!router_enabled()) {
+        save();
+        if (!db_close() || !oplog_close()) {
+            fprintf(stderr, "db close failed\n");
+            return;
+        }
     }
 
     fprintf(stderr, "exit\n");
@@ -235,15 +377,45 @@ void signal_handler(int signum) {
 }
 
 void print_usage() {
-    printf("Missing parameters.\nUsage example:\ntitle-fingerprint-db -d /var/db -p 8080\n");
+    printf("Missing parameters.\nUsage example:\ntitle-fingerprint-db -d /var/db -p 8080\n"
+           "Options:\n"
+           "  -l  low memory mode, look up identifiers in SQLite instead of keeping them in memory\n"
+           "  -e  export all slots to part files in this directory and exit, port isn't needed\n"
+           "  -b  export in binary instead of NDJSON format\n"
+           "  -t  also serve the binary protocol on this TCP port\n"
+           "  -u  also serve the binary protocol on this Unix domain socket\n"
+           "  -P  persistence policy, e.g. idle=100,age=1000,batch=100000,dirty=1048576,log=67108864\n"
+           "      commit after idle ms without updates, when the oldest update is age ms old or after batch\n"
+           "      identifier writes, checkpoint after dirty changed rows or log bytes of hashtable log\n"
+           "  -A  admission limits on requests in flight, e.g. identify=1024,index=64,ingest=1, 0 is unlimited,\n"
+           "      with onion they default to shares of its 16 threads, identify=11,index=4,ingest=1\n"
+           "  -T  slow identify log, e.g. slow=50,sample=16 traces every 16th request and logs\n"
+           "      the stage breakdown of those taking at least 50 ms\n"
+           "  -f  HTTP front-end, onion (default) or epoll, which only serves /identify, /index, /ingest, /stats,\n"
+           "      /metrics and /reload, and reads /ingest bodies as they arrive instead of spooling them\n"
+           "  -R  replication leader, followers connect to this TCP port for its index operations\n"
+           "  -F  replication follower of the leader at host:port, only the leader takes updates\n"
+           "  -S  shard index/count, e.g. 1/4, only indexes titles in its range of the hashtable rows\n"
+           "  -r  router to the shards at host:port,host:port,.. listed in shard order, keeps no db\n"
+           "      and serves /identify, /index, /ingest, /stats and /metrics, -d isn't needed\n"
+           "POST /reload with {\"directory\": \"/var/db-new\"} loads that db directory in the background\n"
+           "and switches to it, updates are persisted there from then on\n");
 }
 
 int main(int argc, char **argv) {
     char *opt_db_directory = 0;
     char *opt_port = 0;
+    char *opt_export_directory = 0;
+    uint8_t opt_export_format = EXPORT_FORMAT_NDJSON;
+    char *opt_proto_port = 0;
+    char *opt_proto_socket = 0;
+    uint8_t opt_epoll = 0;
+    char *opt_leader_port = 0;
+    char *opt_leader_address = 0;
+    char *opt_router_shards = 0;
 
     int opt;
-    while ((opt = getopt(argc, argv, "d:p:")) != -1) {
+    while ((opt = getopt(argc, argv, "d:p:le:bt:u:f:P:T:A:R:F:S:r:")) != -1) {
         switch (opt) {
             case 'd':
                 opt_db_directory = optarg;
@@ -251,17 +423,89 @@ int main(int argc, char **argv) {
             case 'p':
                 opt_port = optarg;
                 break;
+            case 'l':
+                identifiers_in_memory = 0;
+                break;
+            case 'e':
+                opt_export_directory = optarg;
+                break;
+            case 'b':
+                opt_export_format = EXPORT_FORMAT_BINARY;
+                break;
+            case 't':
+                opt_proto_port = optarg;
+                break;
+            case 'u':
+                opt_proto_socket = optarg;
+                break;
+            case 'R':
+                opt_leader_port = optarg;
+                break;
+            case 'F':
+                opt_leader_address = optarg;
+                break;
+            case 'S':
+                if (!shard_parse(optarg)) {
+                    print_usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                if (!router_parse(optarg)) {
+                    print_usage();
+                    return EXIT_FAILURE;
+                }
+                opt_router_shards = optarg;
+                break;
+            case 'P':
+                if (!persist_parse(optarg)) {
+                    print_usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'T':
+                if (!trace_parse(optarg)) {
+                    print_usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'A':
+                if (!admit_parse(optarg)) {
+                    print_usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'f':
+                if (!strcmp(optarg, "epoll")) {
+                    opt_epoll = 1;
+                } else if (strcmp(optarg, "onion")) {
+                    print_usage();
+                    return EXIT_FAILURE;
+                }
+                break;
             default:
                 print_usage();
                 return EXIT_FAILURE;
         }
     }
 
-    if (!opt_db_directory || !opt_port) {
+    // Followers don't pass on what they apply
+    if ((!opt_db_directory && !opt_router_shards) || (!opt_port && !opt_export_directory) ||
+        (opt_leader_port && opt_leader_address)) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    // A router only serves HTTP
+    if (opt_router_shards && (opt_export_directory || opt_proto_port || opt_proto_socket || opt_leader_port ||
+                              opt_leader_address || shard_count > 1)) {
         print_usage();
         return EXIT_FAILURE;
     }
 
+    // Line buffered, because otherwise Docker doesn't output logs
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
     setenv("ONION_LOG", "noinfo", 1);
     pthread_rwlock_init(&rwlock, 0);
 
@@ -270,26 +514,74 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    if (!db_init(opt_db_directory)) {
-        fprintf(stderr, "failed to initialize db\n");
-        return EXIT_FAILURE;
+    if (opt_router_shards) {
+        printf("routing to shards %s\n", opt_router_shards);
+    } else {
+        uint64_t load_start = metrics_now();
+
+        if (!db_init(opt_db_directory)) {
+            fprintf(stderr, "failed to initialize db\n");
+            return EXIT_FAILURE;
+        }
+
+        if (!oplog_init(opt_db_directory)) {
+            fprintf(stderr, "failed to initialize hashtable log\n");
+            return EXIT_FAILURE;
+        }
+
+        if (!ht_init(opt_db_directory)) {
+            fprintf(stderr, "failed to initialize hashtable\n");
+            return EXIT_FAILURE;
+        }
+
+        metrics_load_ns = metrics_now() - load_start;
+
+        stats_t stats = ht_stats();
+        printf("used_hashes=%u, used_slots=%u, max_slots=%u\n",
+               stats.used_hashes, stats.used_slots, stats.max_slots);
+
+        if (shard_count > 1) {
+            uint32_t row_start, row_end;
+            shard_range(shard_index, shard_count, &row_start, &row_end);
+            printf("shard %u/%u owns rows %u-%u\n", shard_index, shard_count, row_start, row_end - 1);
+        }
     }
 
-    if (!ht_init()) {
-        fprintf(stderr, "failed to initialize hashtable\n");
-        return EXIT_FAILURE;
+    if (opt_export_directory) {
+        long threads = sysconf(_SC_NPROCESSORS_ONLN);
+        int rc = export_files(opt_export_directory, threads > 0 ? (uint32_t) threads : 1, opt_export_format);
+        db_close();
+        oplog_close();
+        return rc ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+
+    if (!opt_router_shards) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, saver_thread, 0);
     }
 
-    stats_t stats = ht_stats();
-    printf("used_hashes=%u, used_slots=%u, max_slots=%u\n",
-           stats.used_hashes, stats.used_slots, stats.max_slots);
 
+    if (!opt_epoll) {
+        admit_workers(ONION_THREADS);
+        on = onion_new(O_POOL);
 
-    pthread_t tid;
-    pthread_create(&tid, NULL, saver_thread, 0);
+        onion_set_port(on, opt_port);
+        onion_set_max_threads(on, ONION_THREADS);
+        onion_set_max_post_size(on, 50000000);
+        onion_set_max_file_size(on, INGEST_MAX_SIZE);
 
+        onion_url *urls = onion_root_url(on);
 
-    on = onion_new(O_POOL);
+        onion_url_add(urls, "identify", url_identify);
+        onion_url_add(urls, "index", url_index);
+        onion_url_add(urls, "stats", url_stats);
+        onion_url_add(urls, "metrics", url_metrics);
+        if (!opt_router_shards) onion_url_add(urls, "export", url_export);
+        onion_url_add(urls, "ingest", url_ingest);
+        onion_url_add(urls, "reload", url_reload);
+        onion_url_add_handler(urls, "panel", onion_handler_export_local_new("static/panel.html"));
+    }
 
     // Signal handler must be initialized after onion_new
     struct sigaction action;
@@ -298,19 +590,33 @@ int main(int argc, char **argv) {
     sigaction(SIGINT, &action, NULL);
     sigaction(SIGTERM, &action, NULL);
 
-    onion_set_port(on, opt_port);
-    onion_set_max_threads(on, 16);
-    onion_set_max_post_size(on, 50000000);
+    if (opt_proto_port) {
+        if (!proto_listen_tcp(opt_proto_port)) return EXIT_FAILURE;
+        printf("binary protocol listening on port %s\n", opt_proto_port);
+    }
+
+    if (opt_proto_socket) {
+        if (!proto_listen_unix(opt_proto_socket)) return EXIT_FAILURE;
+        printf("binary protocol listening on %s\n", opt_proto_socket);
+    }
 
-    onion_url *urls = onion_root_url(on);
+    if (opt_leader_port) {
+        if (!repl_listen(opt_leader_port)) return EXIT_FAILURE;
+        printf("replication leader listening on port %s\n", opt_leader_port);
+    }
 
-    onion_url_add(urls, "identify", url_identify);
-    onion_url_add(urls, "index", url_index);
-    onion_url_add(urls, "stats", url_stats);
-    onion_url_add_handler(urls, "panel", onion_handler_export_local_new("static/panel.html"));
+    if (opt_leader_address) {
+        if (!repl_follow(opt_leader_address)) return EXIT_FAILURE;
+        printf("replication follower of %s\n", opt_leader_address);
+    }
 
     printf("listening on port %s\n", opt_port);
 
+    if (opt_epoll) {
+        long threads = sysconf(_SC_NPROCESSORS_ONLN);
+        return http_listen(opt_port, threads > 0 ? (uint32_t) threads : 1) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     onion_listen(on);
 
     onion_free(on);
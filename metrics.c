@@ -0,0 +1,400 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Counters and latency histograms for /metrics. Each thread updates its own block
+ * without atomic read-modify-write, so instrumentation doesn't contend on the hot path.
+ * Blocks are only summed up when metrics are formatted, and a block of a finished
+ * thread is folded into a retired block. Durations are measured on the monotonic clock.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <jemalloc/jemalloc.h>
+#include "ht.h"
+#include "metrics.h"
+#include "persist.h"
+#include "admit.h"
+#include "replog.h"
+
+typedef struct metrics_block {
+    uint64_t counters[METRICS_COUNTERS];
+    uint64_t sums[METRICS_HISTOGRAMS];
+    uint64_t buckets[METRICS_HISTOGRAMS][METRICS_BUCKETS];
+    struct metrics_block *next;
+} metrics_block_t;
+
+typedef struct metrics_buf {
+    char *data;
+    size_t len;
+    size_t max;
+} metrics_buf_t;
+
+uint64_t metrics_load_ns = 0;
+
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+static metrics_block_t *metrics_blocks = 0;
+static metrics_block_t metrics_retired;
+static __thread metrics_block_t *metrics_local = 0;
+
+static const char *histogram_names[METRICS_HISTOGRAMS] = {
+        "tfdb_http_request_duration_seconds{endpoint=\"identify\"",
+        "tfdb_http_request_duration_seconds{endpoint=\"index\"",
+        "tfdb_http_request_duration_seconds{endpoint=\"stats\"",
+        "tfdb_http_request_duration_seconds{endpoint=\"ingest\"",
+        "tfdb_http_request_duration_seconds{endpoint=\"export\"",
+        "tfdb_proto_request_duration_seconds{op=\"identify\"",
+        "tfdb_proto_request_duration_seconds{op=\"index\"",
+        "tfdb_lock_wait_seconds{mode=\"read\"",
+        "tfdb_lock_wait_seconds{mode=\"write\"",
+        "tfdb_lock_hold_seconds{mode=\"read\"",
+        "tfdb_lock_hold_seconds{mode=\"write\"",
+        "tfdb_save_duration_seconds{",
+        "tfdb_checkpoint_duration_seconds{",
+        "tfdb_proto_request_duration_seconds{op=\"probe\"",
+        "tfdb_router_probe_duration_seconds{"
+};
+
+static const char *counter_names[METRICS_COUNTERS] = {
+        "tfdb_identify_total{result=\"found\"}",
+        "tfdb_identify_total{result=\"not_found\"}",
+        "tfdb_lookup_ngrams_total",
+        "tfdb_lookup_row_hits_total",
+        "tfdb_lookup_name_hits_total",
+        "tfdb_index_total{result=\"indexed\"}",
+        "tfdb_index_total{result=\"rejected\"}",
+        "tfdb_save_failures_total",
+        "tfdb_checkpoint_failures_total",
+        "tfdb_commits_total{reason=\"idle\"}",
+        "tfdb_commits_total{reason=\"age\"}",
+        "tfdb_commits_total{reason=\"batch\"}",
+        "tfdb_checkpoints_total{reason=\"log_bytes\"}",
+        "tfdb_checkpoints_total{reason=\"dirty_rows\"}",
+        "tfdb_admission_rejected_total{endpoint=\"identify\"}",
+        "tfdb_admission_rejected_total{endpoint=\"index\"}",
+        "tfdb_admission_rejected_total{endpoint=\"ingest\"}",
+        "tfdb_admission_shed_total{endpoint=\"identify\"}",
+        "tfdb_admission_shed_total{endpoint=\"index\"}",
+        "tfdb_reloads_total{result=\"done\"}",
+        "tfdb_reloads_total{result=\"failed\"}",
+        "tfdb_router_shard_errors_total"
+};
+
+// Only the owning thread writes, readers may see a slightly stale value but never a torn one
+#define METRICS_ADD(x, n) __atomic_store_n(&(x), __atomic_load_n(&(x), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+static void metrics_retire(void *arg) {
+    metrics_block_t *block = arg;
+
+    pthread_mutex_lock(&metrics_mutex);
+    for (uint32_t i = 0; i < METRICS_COUNTERS; i++) {
+        metrics_retired.counters[i] += block->counters[i];
+    }
+    for (uint32_t i = 0; i < METRICS_HISTOGRAMS; i++) {
+        metrics_retired.sums[i] += block->sums[i];
+        for (uint32_t j = 0; j < METRICS_BUCKETS; j++) {
+            metrics_retired.buckets[i][j] += block->buckets[i][j];
+        }
+    }
+
+    metrics_block_t **p = &metrics_blocks;
+    while (*p && *p != block) p = &(*p)->next;
+    if (*p) *p = block->next;
+    pthread_mutex_unlock(&metrics_mutex);
+
+    free(block);
+}
+
+static void metrics_key_init() {
+    pthread_key_create(&metrics_key, metrics_retire);
+}
+
+static metrics_block_t *metrics_block() {
+    if (metrics_local) return metrics_local;
+
+    metrics_block_t *block = calloc(1, sizeof(metrics_block_t));
+    if (!block) {
+        fprintf(stderr, "failed to allocate metrics\n");
+        return 0;
+    }
+
+    pthread_once(&metrics_once, metrics_key_init);
+    pthread_setspecific(metrics_key, block);
+
+    pthread_mutex_lock(&metrics_mutex);
+    block->next = metrics_blocks;
+    metrics_blocks = block;
+    pthread_mutex_unlock(&metrics_mutex);
+
+    metrics_local = block;
+    return block;
+}
+
+static uint32_t metrics_bucket(uint64_t ns) {
+    if (ns < (1 << METRICS_SUB_BITS)) return (uint32_t) ns;
+    uint32_t magnitude = 63 - (uint32_t) __builtin_clzll(ns);
+    if (magnitude > METRICS_MAGNITUDE_MAX) return METRICS_BUCKETS - 1;
+    uint32_t sub = (uint32_t) (ns >> (magnitude - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1);
+    return ((magnitude - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) + sub;
+}
+
+// Exclusive upper bound of a bucket
+static uint64_t metrics_bucket_end(uint32_t bucket) {
+    if (bucket < (1 << METRICS_SUB_BITS)) return bucket + 1;
+    uint32_t magnitude = (bucket >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << METRICS_SUB_BITS) - 1);
+    return ((1 << METRICS_SUB_BITS) + sub + 1) << (magnitude - METRICS_SUB_BITS);
+}
+
+uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_count(uint32_t counter, uint64_t n) {
+    metrics_block_t *block = metrics_block();
+    if (!block) return;
+    METRICS_ADD(block->counters[counter], n);
+}
+
+void metrics_observe(uint32_t histogram, uint64_t ns) {
+    metrics_block_t *block = metrics_block();
+    if (!block) return;
+    METRICS_ADD(block->buckets[histogram][metrics_bucket(ns)], 1);
+    METRICS_ADD(block->sums[histogram], ns);
+}
+
+uint64_t metrics_since(uint32_t histogram, uint64_t start) {
+    uint64_t now = metrics_now();
+    metrics_observe(histogram, now - start);
+    return now;
+}
+
+uint64_t metrics_rdlock(pthread_rwlock_t *lock) {
+    uint64_t start = metrics_now();
+    pthread_rwlock_rdlock(lock);
+    return metrics_since(METRICS_LOCK_READ_WAIT, start);
+}
+
+uint64_t metrics_wrlock(pthread_rwlock_t *lock) {
+    uint64_t start = metrics_now();
+    pthread_rwlock_wrlock(lock);
+    return metrics_since(METRICS_LOCK_WRITE_WAIT, start);
+}
+
+void metrics_unlock(pthread_rwlock_t *lock, uint64_t locked, uint8_t write) {
+    pthread_rwlock_unlock(lock);
+    metrics_observe(write ? METRICS_LOCK_WRITE_HOLD : METRICS_LOCK_READ_HOLD, metrics_now() - locked);
+}
+
+static int metrics_printf(metrics_buf_t *buf, const char *format, ...) {
+    va_list args;
+    while (1) {
+        va_start(args, format);
+        int n = vsnprintf(buf->data + buf->len, buf->max - buf->len, format, args);
+        va_end(args);
+        if (n < 0) return 0;
+        if (buf->len + n < buf->max) {
+            buf->len += n;
+            return 1;
+        }
+        size_t max = buf->max * 2 + (size_t) n;
+        char *data = realloc(buf->data, max);
+        if (!data) return 0;
+        buf->data = data;
+        buf->max = max;
+    }
+}
+
+static void metrics_sum(metrics_block_t *total) {
+    memcpy(total, &metrics_retired, sizeof(metrics_block_t));
+    for (metrics_block_t *block = metrics_blocks; block; block = block->next) {
+        for (uint32_t i = 0; i < METRICS_COUNTERS; i++) {
+            total->counters[i] += __atomic_load_n(&block->counters[i], __ATOMIC_RELAXED);
+        }
+        for (uint32_t i = 0; i < METRICS_HISTOGRAMS; i++) {
+            total->sums[i] += __atomic_load_n(&block->sums[i], __ATOMIC_RELAXED);
+            for (uint32_t j = 0; j < METRICS_BUCKETS; j++) {
+                total->buckets[i][j] += __atomic_load_n(&block->buckets[i][j], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+/*
+ * Histograms are exposed with power of two buckets from 1 µs to about a minute,
+ * which are exact sums of the finer buckets.
+ */
+static int metrics_histogram(metrics_buf_t *buf, uint32_t h, uint64_t *buckets, uint64_t sum) {
+    const char *name = histogram_names[h];
+    int family_len = (int) strcspn(name, "{");
+    const char *labels = name + family_len + 1;
+    const char *sep = *labels ? "," : "";
+    const char *open = *labels ? "{" : "";
+    const char *close = *labels ? "}" : "";
+
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < METRICS_BUCKETS; i++) count += buckets[i];
+
+    uint64_t cumulative = 0;
+    uint32_t bucket = 0;
+    for (uint32_t k = 10; k <= 36; k++) {
+        uint32_t end = ((k - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS);
+        for (; bucket < end; bucket++) cumulative += buckets[bucket];
+        if (!metrics_printf(buf, "%.*s_bucket{%s%sle=\"%g\"} %llu\n", family_len, name, labels, sep,
+                            (double) (1ULL << k) / 1e9, (unsigned long long) cumulative)) {
+            return 0;
+        }
+    }
+
+    return metrics_printf(buf, "%.*s_bucket{%s%sle=\"+Inf\"} %llu\n", family_len, name, labels, sep,
+                          (unsigned long long) count) &&
+           metrics_printf(buf, "%.*s_sum%s%s%s %.9f\n", family_len, name, open, labels, close,
+                          (double) sum / 1e9) &&
+           metrics_printf(buf, "%.*s_count%s%s%s %llu\n", family_len, name, open, labels, close,
+                          (unsigned long long) count);
+}
+
+// Quantiles from the finer buckets, as the upper bound of the bucket the quantile falls in
+static int metrics_quantiles(metrics_buf_t *buf, uint32_t h, uint64_t *buckets) {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    const char *name = histogram_names[h];
+    int family_len = (int) strcspn(name, "{");
+    const char *labels = name + family_len + 1;
+    const char *sep = *labels ? "," : "";
+
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < METRICS_BUCKETS; i++) count += buckets[i];
+
+    for (uint32_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]) && count; q++) {
+        uint64_t rank = (uint64_t) (quantiles[q] * (double) count);
+        if (rank >= count) rank = count - 1;
+        uint64_t cumulative = 0;
+        uint32_t bucket;
+        for (bucket = 0; bucket < METRICS_BUCKETS - 1; bucket++) {
+            cumulative += buckets[bucket];
+            if (cumulative > rank) break;
+        }
+        if (!metrics_printf(buf, "tfdb_quantile_seconds{metric=\"%.*s\",%s%squantile=\"%g\"} %.9f\n",
+                            family_len, name, labels, sep, quantiles[q],
+                            (double) metrics_bucket_end(bucket) / 1e9)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Counters and histograms of the same family are next to each other in the name tables
+static int metrics_same_family(const char *a, const char *b) {
+    size_t len = strcspn(a, "{");
+    return len == strcspn(b, "{") && !strncmp(a, b, len);
+}
+
+char *metrics_format() {
+    metrics_block_t *total = malloc(sizeof(metrics_block_t));
+    metrics_buf_t buf = {malloc(65536), 0, 65536};
+    if (!total || !buf.data) {
+        free(total);
+        free(buf.data);
+        return 0;
+    }
+
+    pthread_mutex_lock(&metrics_mutex);
+    metrics_sum(total);
+    pthread_mutex_unlock(&metrics_mutex);
+
+    int rc = 1;
+    for (uint32_t h = 0; h < METRICS_HISTOGRAMS && rc; h++) {
+        const char *name = histogram_names[h];
+        if (!h || !metrics_same_family(histogram_names[h - 1], name)) {
+            rc = metrics_printf(&buf, "# TYPE %.*s histogram\n", (int) strcspn(name, "{"), name);
+        }
+        rc = rc && metrics_histogram(&buf, h, total->buckets[h], total->sums[h]);
+    }
+
+    rc = rc && metrics_printf(&buf, "# TYPE tfdb_quantile_seconds gauge\n");
+    for (uint32_t h = 0; h < METRICS_HISTOGRAMS && rc; h++) {
+        rc = metrics_quantiles(&buf, h, total->buckets[h]);
+    }
+
+    for (uint32_t i = 0; i < METRICS_COUNTERS && rc; i++) {
+        const char *name = counter_names[i];
+        if (!i || !metrics_same_family(counter_names[i - 1], name)) {
+            rc = metrics_printf(&buf, "# TYPE %.*s counter\n", (int) strcspn(name, "{"), name);
+        }
+        rc = rc && metrics_printf(&buf, "%s %llu\n", name, (unsigned long long) total->counters[i]);
+    }
+
+    persist_state_t persist = persist_state();
+    rc = rc && metrics_printf(&buf, "# TYPE tfdb_pending_age_seconds gauge\ntfdb_pending_age_seconds %.3f\n"
+                                    "# TYPE tfdb_pending_identifiers gauge\ntfdb_pending_identifiers %u\n"
+                                    "# TYPE tfdb_dirty_rows gauge\ntfdb_dirty_rows %u\n"
+                                    "# TYPE tfdb_log_bytes gauge\ntfdb_log_bytes %llu\n",
+                              (double) persist.pending_age_ns / 1e9, persist.identifiers, persist.dirty_rows,
+                              (unsigned long long) persist.log_bytes);
+
+    rc = rc && metrics_printf(&buf, "# TYPE tfdb_admission_in_flight gauge\n");
+    for (uint32_t i = 0; i < ADMIT_ENDPOINTS && rc; i++) {
+        rc = metrics_printf(&buf, "tfdb_admission_in_flight{endpoint=\"%s\"} %u\n",
+                            admit_endpoint_names[i], admit_in_flight(i));
+    }
+    rc = rc && metrics_printf(&buf, "# TYPE tfdb_admission_limit gauge\n");
+    for (uint32_t i = 0; i < ADMIT_ENDPOINTS && rc; i++) {
+        rc = metrics_printf(&buf, "tfdb_admission_limit{endpoint=\"%s\"} %u\n",
+                            admit_endpoint_names[i], admit_policy.max[i]);
+    }
+
+    replog_state_t replication = replog_state();
+    if (replication.role) {
+        rc = rc && metrics_printf(&buf, "# TYPE tfdb_replication_lsn gauge\ntfdb_replication_lsn{role=\"%s\"} %llu\n"
+                                        "# TYPE tfdb_replication_lag_bytes gauge\ntfdb_replication_lag_bytes %llu\n"
+                                        "# TYPE tfdb_replication_connections gauge\ntfdb_replication_connections %u\n",
+                                  replication.role == REPLOG_LEADER ? "leader" : "follower",
+                                  (unsigned long long) replication.applied,
+                                  (unsigned long long) (replication.head - replication.applied),
+                                  replication.connections);
+    }
+
+    stats_t stats = ht_stats();
+    rc = rc && metrics_printf(&buf, "# TYPE tfdb_used_hashes gauge\ntfdb_used_hashes %u\n"
+                                    "# TYPE tfdb_used_slots gauge\ntfdb_used_slots %u\n"
+                                    "# TYPE tfdb_max_slots gauge\ntfdb_max_slots %u\n"
+                                    "# TYPE tfdb_load_duration_seconds gauge\ntfdb_load_duration_seconds %.3f\n",
+                              stats.used_hashes, stats.used_slots, stats.max_slots,
+                              (double) metrics_load_ns / 1e9);
+
+    free(total);
+    if (!rc) {
+        free(buf.data);
+        return 0;
+    }
+    return buf.data;
+}
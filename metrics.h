@@ -0,0 +1,80 @@
+#ifndef TITLE_FINGERPRINT_DB_METRICS_H
+#define TITLE_FINGERPRINT_DB_METRICS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Log-linear histogram buckets: 2^METRICS_SUB_BITS buckets per power of two, durations in ns
+#define METRICS_SUB_BITS 3
+#define METRICS_MAGNITUDE_MAX 40
+#define METRICS_BUCKETS ((METRICS_MAGNITUDE_MAX - METRICS_SUB_BITS + 2) << METRICS_SUB_BITS)
+
+#define METRICS_HTTP_IDENTIFY 0
+#define METRICS_HTTP_INDEX 1
+#define METRICS_HTTP_STATS 2
+#define METRICS_HTTP_INGEST 3
+#define METRICS_HTTP_EXPORT 4
+#define METRICS_PROTO_IDENTIFY 5
+#define METRICS_PROTO_INDEX 6
+#define METRICS_LOCK_READ_WAIT 7
+#define METRICS_LOCK_WRITE_WAIT 8
+#define METRICS_LOCK_READ_HOLD 9
+#define METRICS_LOCK_WRITE_HOLD 10
+#define METRICS_SAVE 11
+#define METRICS_CHECKPOINT 12
+#define METRICS_PROTO_PROBE 13
+// Router's round trip to the shards probed for a lookup
+#define METRICS_ROUTER_PROBE 14
+#define METRICS_HISTOGRAMS 15
+
+#define METRICS_IDENTIFY_FOUND 0
+#define METRICS_IDENTIFY_NOT_FOUND 1
+// Title ngrams looked up, ngrams whose row has slots, and slots confirmed by the name
+#define METRICS_LOOKUP_NGRAMS 2
+#define METRICS_LOOKUP_ROW_HITS 3
+#define METRICS_LOOKUP_NAME_HITS 4
+#define METRICS_INDEX_INDEXED 5
+#define METRICS_INDEX_REJECTED 6
+#define METRICS_SAVE_FAILED 7
+#define METRICS_CHECKPOINT_FAILED 8
+// Commits and checkpoints by the policy limit that triggered them
+#define METRICS_COMMIT_IDLE 9
+#define METRICS_COMMIT_AGE 10
+#define METRICS_COMMIT_BATCH 11
+#define METRICS_CHECKPOINT_LOG 12
+#define METRICS_CHECKPOINT_DIRTY 13
+// Requests turned away by admission control, indexed by the ADMIT_ endpoint
+#define METRICS_REJECTED_IDENTIFY 14
+#define METRICS_REJECTED_INDEX 15
+#define METRICS_REJECTED_INGEST 16
+// Requests dropped because the client's timeout passed, ingestion has no timeout
+#define METRICS_SHED_IDENTIFY 17
+#define METRICS_SHED_INDEX 18
+#define METRICS_RELOAD 19
+#define METRICS_RELOAD_FAILED 20
+// Router requests that failed because a shard couldn't be reached
+#define METRICS_ROUTER_SHARD_ERRORS 21
+#define METRICS_COUNTERS 22
+
+// Time the last load took, at startup or by a reload
+extern uint64_t metrics_load_ns;
+
+uint64_t metrics_now();
+
+void metrics_count(uint32_t counter, uint64_t n);
+
+void metrics_observe(uint32_t histogram, uint64_t ns);
+
+// Observes the time since start and returns the current time
+uint64_t metrics_since(uint32_t histogram, uint64_t start);
+
+// Take the lock recording wait time, and return the time it was acquired for metrics_unlock
+uint64_t metrics_rdlock(pthread_rwlock_t *lock);
+
+uint64_t metrics_wrlock(pthread_rwlock_t *lock);
+
+void metrics_unlock(pthread_rwlock_t *lock, uint64_t locked, uint8_t write);
+
+char *metrics_format();
+
+#endif //TITLE_FINGERPRINT_DB_METRICS_H
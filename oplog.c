@@ -0,0 +1,368 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * Append-only log of hashtable slot inserts and updates.
+ * Records are buffered in memory by the indexing path and written with a single
+ * write+fdatasync per commit (group commit). The log is replayed on top of the last
+ * hashtable checkpoint at startup and truncated after each new checkpoint.
+ * Each record carries a checksum, so a torn write at the end of the log is detected
+ * and cut off during replay.
+ *
+ * When a checkpoint starts, the active log is rotated into a numbered segment
+ * (hashtable.log.<seq>), which is removed only after the checkpoint is written.
+ * Records indexed meanwhile go to a new active log.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <linux/limits.h>
+#include <jemalloc/jemalloc.h>
+#include "xxhash.h"
+#include "oplog.h"
+
+char oplog_directory[PATH_MAX];
+int oplog_fd = -1;
+uint64_t oplog_file_size = 0;
+// Number of the last rotated segment
+uint32_t oplog_seq = 0;
+
+uint8_t *oplog_buffer = 0;
+uint64_t oplog_buffer_len = 0;
+uint64_t oplog_buffer_size = 0;
+
+uint32_t oplog_checksum(oplog_record_t *record) {
+    return XXH32(record, sizeof(oplog_record_t) - sizeof(record->checksum), 0);
+}
+
+int oplog_open() {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/hashtable.log", oplog_directory);
+
+    if ((oplog_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+        fprintf(stderr, "open: %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    off_t size;
+    if ((size = lseek(oplog_fd, 0, SEEK_END)) < 0) {
+        fprintf(stderr, "lseek: %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    oplog_file_size = (uint64_t) size;
+    return 1;
+}
+
+int oplog_seq_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Lists the sorted numbers of all rotated segments that still exist, the caller frees *seqs
+int oplog_segments(uint32_t **seqs, uint32_t *seqs_len) {
+    DIR *dir;
+    struct dirent *entry;
+    uint32_t seqs_max = OPLOG_SEGMENTS;
+
+    *seqs_len = 0;
+    if (!(*seqs = malloc(sizeof(uint32_t) * seqs_max))) {
+        fprintf(stderr, "segments malloc failed\n");
+        return 0;
+    }
+
+    if (!(dir = opendir(oplog_directory))) {
+        fprintf(stderr, "opendir: %s: %s\n", oplog_directory, strerror(errno));
+        free(*seqs);
+        *seqs = 0;
+        return 0;
+    }
+
+    while ((entry = readdir(dir))) {
+        uint32_t seq;
+        char c;
+        if (sscanf(entry->d_name, "hashtable.log.%u%c", &seq, &c) != 1) continue;
+
+        if (*seqs_len == seqs_max) {
+            uint32_t *grown;
+            if (!(grown = realloc(*seqs, sizeof(uint32_t) * seqs_max * 2))) {
+                fprintf(stderr, "segments realloc failed\n");
+                closedir(dir);
+                free(*seqs);
+                *seqs = 0;
+                return 0;
+            }
+            *seqs = grown;
+            seqs_max *= 2;
+        }
+        (*seqs)[(*seqs_len)++] = seq;
+    }
+    closedir(dir);
+
+    qsort(*seqs, *seqs_len, sizeof(uint32_t), oplog_seq_cmp);
+    return 1;
+}
+
+int oplog_init(char *directory) {
+    uint32_t *seqs;
+    uint32_t seqs_len;
+
+    snprintf(oplog_directory, PATH_MAX, "%s", directory);
+
+    if (!oplog_segments(&seqs, &seqs_len)) return 0;
+    oplog_seq = seqs_len ? seqs[seqs_len - 1] : 0;
+    free(seqs);
+
+    return oplog_open();
+}
+
+int oplog_close() {
+    if (oplog_fd < 0) return 1;
+    if (close(oplog_fd)) {
+        fprintf(stderr, "close: %s\n", strerror(errno));
+        return 0;
+    }
+    oplog_fd = -1;
+    free(oplog_buffer);
+    oplog_buffer = 0;
+    oplog_buffer_len = 0;
+    oplog_buffer_size = 0;
+    return 1;
+}
+
+int oplog_append(uint8_t type, uint64_t hash, uint64_t data) {
+    if (oplog_buffer_len + sizeof(oplog_record_t) > oplog_buffer_size) {
+        uint64_t size = oplog_buffer_size ? oplog_buffer_size * 2 : sizeof(oplog_record_t) * 65536;
+        uint8_t *buffer;
+        if (!(buffer = realloc(oplog_buffer, size))) {
+            fprintf(stderr, "oplog buffer realloc failed\n");
+            return 0;
+        }
+        oplog_buffer = buffer;
+        oplog_buffer_size = size;
+    }
+
+    oplog_record_t record;
+    record.type = type;
+    record.hash24 = (uint32_t) (hash >> 32);
+    record.hash32 = (uint32_t) (hash & 0xFFFFFFFF);
+    record.data = data;
+    record.checksum = oplog_checksum(&record);
+
+    memcpy(oplog_buffer + oplog_buffer_len, &record, sizeof(oplog_record_t));
+    oplog_buffer_len += sizeof(oplog_record_t);
+    return 1;
+}
+
+// Writes and syncs all buffered records. Must not run concurrently with oplog_append
+int oplog_commit() {
+    uint64_t written = 0;
+
+    if (!oplog_buffer_len) return 1;
+
+    while (written < oplog_buffer_len) {
+        ssize_t n = pwrite(oplog_fd, oplog_buffer + written, oplog_buffer_len - written,
+                           oplog_file_size + written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "oplog write: %s\n", strerror(errno));
+            return 0;
+        }
+        written += n;
+    }
+
+    if (fdatasync(oplog_fd)) {
+        fprintf(stderr, "oplog fdatasync: %s\n", strerror(errno));
+        return 0;
+    }
+
+    oplog_file_size += oplog_buffer_len;
+    oplog_buffer_len = 0;
+    return 1;
+}
+
+int oplog_replay_file(int fd, uint64_t *size, int (*apply)(oplog_record_t *record), uint64_t *replayed) {
+    uint8_t buffer[sizeof(oplog_record_t) * 4096];
+    uint64_t offset = 0;
+
+    while (offset < *size) {
+        ssize_t n = pread(fd, buffer, sizeof(buffer), offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "oplog read: %s\n", strerror(errno));
+            return 0;
+        }
+
+        uint64_t records_len = (uint64_t) n / sizeof(oplog_record_t);
+        if (!records_len) break;
+
+        for (uint64_t i = 0; i < records_len; i++) {
+            oplog_record_t record;
+            memcpy(&record, buffer + i * sizeof(oplog_record_t), sizeof(oplog_record_t));
+
+            if (record.checksum != oplog_checksum(&record)) {
+                fprintf(stderr, "oplog: invalid record at offset %" PRIu64 ", ignoring the rest of the log\n",
+                        offset);
+                goto end;
+            }
+
+            if (!apply(&record)) return 0;
+
+            offset += sizeof(oplog_record_t);
+            (*replayed)++;
+        }
+    }
+
+    end:
+    // Cut off a partially written or corrupted tail, so new records are appended after the last valid one
+    if (offset < *size) {
+        if (ftruncate(fd, offset)) {
+            fprintf(stderr, "oplog ftruncate: %s\n", strerror(errno));
+            return 0;
+        }
+        *size = offset;
+    }
+
+    return 1;
+}
+
+// Replays rotated segments that weren't checkpointed yet, then the active log
+int oplog_replay(int (*apply)(oplog_record_t *record)) {
+    uint32_t *seqs;
+    uint32_t seqs_len;
+    uint64_t replayed = 0;
+
+    if (!oplog_segments(&seqs, &seqs_len)) return 0;
+
+    for (uint32_t i = 0; i < seqs_len; i++) {
+        char path[PATH_MAX];
+        int fd;
+        off_t size;
+        snprintf(path, PATH_MAX, "%s/hashtable.log.%u", oplog_directory, seqs[i]);
+
+        if ((fd = open(path, O_RDWR)) < 0) {
+            fprintf(stderr, "open: %s: %s\n", path, strerror(errno));
+            free(seqs);
+            return 0;
+        }
+
+        if ((size = lseek(fd, 0, SEEK_END)) < 0) {
+            fprintf(stderr, "lseek: %s: %s\n", path, strerror(errno));
+            close(fd);
+            free(seqs);
+            return 0;
+        }
+
+        uint64_t segment_size = (uint64_t) size;
+        int rc = oplog_replay_file(fd, &segment_size, apply, &replayed);
+        close(fd);
+        if (!rc) {
+            free(seqs);
+            return 0;
+        }
+    }
+    free(seqs);
+
+    if (!oplog_replay_file(oplog_fd, &oplog_file_size, apply, &replayed)) return 0;
+
+    printf("replayed %" PRIu64 " log records from %u segments\n", replayed, seqs_len + 1);
+    return 1;
+}
+
+int oplog_sync_directory() {
+    int fd;
+    if ((fd = open(oplog_directory, O_RDONLY | O_DIRECTORY)) < 0) {
+        fprintf(stderr, "open: %s: %s\n", oplog_directory, strerror(errno));
+        return 0;
+    }
+    if (fsync(fd)) {
+        fprintf(stderr, "fsync: %s: %s\n", oplog_directory, strerror(errno));
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    return 1;
+}
+
+/*
+ * Commits buffered records and moves the active log into a new segment.
+ * Everything logged so far is in segments numbered up to *seq.
+ * Must not run concurrently with oplog_append.
+ */
+int oplog_rotate(uint32_t *seq) {
+    char path[PATH_MAX];
+    char segment_path[PATH_MAX];
+
+    if (!oplog_commit()) return 0;
+
+    snprintf(path, PATH_MAX, "%s/hashtable.log", oplog_directory);
+    snprintf(segment_path, PATH_MAX, "%s/hashtable.log.%u", oplog_directory, oplog_seq + 1);
+
+    if (rename(path, segment_path)) {
+        fprintf(stderr, "rename: %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    oplog_seq++;
+
+    close(oplog_fd);
+    oplog_fd = -1;
+    if (!oplog_open()) return 0;
+    if (!oplog_sync_directory()) return 0;
+
+    *seq = oplog_seq;
+    return 1;
+}
+
+// Removes segments up to seq after their records were checkpointed
+int oplog_remove(uint32_t seq) {
+    uint32_t *seqs;
+    uint32_t seqs_len;
+
+    if (!oplog_segments(&seqs, &seqs_len)) return 0;
+
+    for (uint32_t i = 0; i < seqs_len && seqs[i] <= seq; i++) {
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, "%s/hashtable.log.%u", oplog_directory, seqs[i]);
+        if (unlink(path)) {
+            fprintf(stderr, "unlink: %s: %s\n", path, strerror(errno));
+            free(seqs);
+            return 0;
+        }
+    }
+    free(seqs);
+
+    return oplog_sync_directory();
+}
+
+uint64_t oplog_pending() {
+    return oplog_buffer_len;
+}
+
+uint64_t oplog_size() {
+    return oplog_file_size;
+}
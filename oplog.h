@@ -0,0 +1,44 @@
+#ifndef TITLE_FINGERPRINT_DB_OPLOG_H
+#define TITLE_FINGERPRINT_DB_OPLOG_H
+
+#include <stdint.h>
+
+#define OPLOG_INSERT 1
+#define OPLOG_UPDATE 2
+
+// Committed records are checkpointed into the hashtable db when the log grows above this size
+#define OPLOG_CHECKPOINT_SIZE 67108864
+// Default longest wait in ms before buffered records are written and synced, see persist.h
+#define OPLOG_COMMIT_INTERVAL 1000
+// Rotated segments are only left behind by failed checkpoints, the list of them grows from this
+#define OPLOG_SEGMENTS 64
+
+#pragma pack(push, 1)
+typedef struct oplog_record {
+    uint8_t type;
+    uint32_t hash24;
+    uint32_t hash32;
+    uint64_t data;
+    uint32_t checksum;
+} oplog_record_t;
+#pragma pack(pop)
+
+int oplog_init(char *directory);
+
+int oplog_close();
+
+int oplog_append(uint8_t type, uint64_t hash, uint64_t data);
+
+int oplog_commit();
+
+int oplog_replay(int (*apply)(oplog_record_t *record));
+
+int oplog_rotate(uint32_t *seq);
+
+int oplog_remove(uint32_t seq);
+
+uint64_t oplog_pending();
+
+uint64_t oplog_size();
+
+#endif //TITLE_FINGERPRINT_DB_OPLOG_H
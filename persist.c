@@ -0,0 +1,233 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Decides when indexed data is committed (identifiers transaction and hashtable log)
+ * and when a checkpoint is written. The indexing path reports each update with
+ * persist_updated, and the saver thread sleeps on a condition variable in persist_wait
+ * until a policy limit is reached or the next idle/age deadline passes.
+ *
+ * Commits are group commits bounded by max_batch identifier writes, so continuous
+ * indexing can't grow a single identifiers transaction without limit.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "oplog.h"
+#include "metrics.h"
+#include "persist.h"
+
+persist_policy_t persist_policy = {
+        PERSIST_IDLE_MS,
+        OPLOG_COMMIT_INTERVAL,
+        PERSIST_MAX_BATCH,
+        PERSIST_MAX_DIRTY_ROWS,
+        OPLOG_CHECKPOINT_SIZE
+};
+
+static pthread_mutex_t persist_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t persist_cond;
+static pthread_once_t persist_once = PTHREAD_ONCE_INIT;
+
+// Updated by persist_updated under persist_mutex
+static uint64_t updates = 0;
+static uint64_t pending_since = 0;
+static uint64_t last_update = 0;
+static uint32_t identifiers = 0;
+static uint32_t dirty_rows = 0;
+static uint64_t log_bytes = 0;
+static uint64_t retry_at = 0;
+static uint8_t checkpoint_requested = 0;
+
+static void persist_init() {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&persist_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// Parses a comma separated policy like "idle=100,age=1000,batch=100000,dirty=1048576,log=67108864"
+int persist_parse(char *options) {
+    char *const tokens[] = {"idle", "age", "batch", "dirty", "log", NULL};
+    char *value;
+
+    while (*options) {
+        int i = getsubopt(&options, tokens, &value);
+        if (i < 0 || !value || !*value) {
+            fprintf(stderr, "invalid persistence policy option: %s\n", value ? value : "");
+            return 0;
+        }
+
+        char *end;
+        unsigned long long n = strtoull(value, &end, 10);
+        if (*end || (i != 4 && n > UINT32_MAX)) {
+            fprintf(stderr, "invalid persistence policy value: %s\n", value);
+            return 0;
+        }
+
+        switch (i) {
+            case 0:
+                persist_policy.idle_ms = (uint32_t) n;
+                break;
+            case 1:
+                persist_policy.max_age_ms = (uint32_t) n;
+                break;
+            case 2:
+                persist_policy.max_batch = (uint32_t) n;
+                break;
+            case 3:
+                persist_policy.max_dirty_rows = (uint32_t) n;
+                break;
+            case 4:
+                persist_policy.max_log_bytes = n;
+                break;
+        }
+    }
+
+    return 1;
+}
+
+static uint8_t persist_due(uint64_t now, uint64_t *deadline) {
+    *deadline = UINT64_MAX;
+
+    if (now < retry_at) {
+        *deadline = retry_at;
+        return PERSIST_NONE;
+    }
+
+    // A checkpoint commits everything too
+    if (log_bytes >= persist_policy.max_log_bytes) return PERSIST_CHECKPOINT_LOG;
+    if (dirty_rows >= persist_policy.max_dirty_rows || checkpoint_requested) return PERSIST_CHECKPOINT_DIRTY;
+
+    if (!pending_since) return PERSIST_NONE;
+
+    if (identifiers >= persist_policy.max_batch) return PERSIST_COMMIT_BATCH;
+
+    uint64_t age_deadline = pending_since + (uint64_t) persist_policy.max_age_ms * 1000000;
+    uint64_t idle_deadline = last_update + (uint64_t) persist_policy.idle_ms * 1000000;
+    if (now >= age_deadline) return PERSIST_COMMIT_AGE;
+    if (now >= idle_deadline) return PERSIST_COMMIT_IDLE;
+
+    *deadline = age_deadline < idle_deadline ? age_deadline : idle_deadline;
+    return PERSIST_NONE;
+}
+
+// Called by the indexing path, under the write lock, after each update
+void persist_updated(uint32_t identifiers_len, uint32_t dirty_rows_len, uint64_t log_len) {
+    pthread_once(&persist_once, persist_init);
+
+    uint64_t now = metrics_now();
+    pthread_mutex_lock(&persist_mutex);
+    uint8_t wake = !pending_since;
+    updates++;
+    if (!pending_since) pending_since = now;
+    last_update = now;
+    identifiers = identifiers_len;
+    dirty_rows = dirty_rows_len;
+    log_bytes = log_len;
+
+    uint64_t deadline;
+    if (wake || persist_due(now, &deadline) != PERSIST_NONE) {
+        pthread_cond_signal(&persist_cond);
+    }
+    pthread_mutex_unlock(&persist_mutex);
+}
+
+// Checkpoints without waiting for a policy limit, for changes the log can't replay like emptied rows
+void persist_checkpoint() {
+    pthread_once(&persist_once, persist_init);
+
+    pthread_mutex_lock(&persist_mutex);
+    checkpoint_requested = 1;
+    pthread_cond_signal(&persist_cond);
+    pthread_mutex_unlock(&persist_mutex);
+}
+
+// Blocks until a commit or checkpoint is due and returns why. Pass seen to persist_done
+uint8_t persist_wait(uint64_t *seen) {
+    pthread_once(&persist_once, persist_init);
+
+    pthread_mutex_lock(&persist_mutex);
+    while (1) {
+        uint64_t deadline;
+        uint8_t reason = persist_due(metrics_now(), &deadline);
+        if (reason != PERSIST_NONE) {
+            *seen = updates;
+            pthread_mutex_unlock(&persist_mutex);
+            return reason;
+        }
+
+        if (deadline == UINT64_MAX) {
+            pthread_cond_wait(&persist_cond, &persist_mutex);
+        } else {
+            struct timespec ts;
+            ts.tv_sec = (time_t) (deadline / 1000000000);
+            ts.tv_nsec = (long) (deadline % 1000000000);
+            pthread_cond_timedwait(&persist_cond, &persist_mutex, &ts);
+        }
+    }
+}
+
+void persist_done(uint8_t reason, uint64_t seen, int ok) {
+    static const uint32_t reason_metrics[] = {0, METRICS_COMMIT_IDLE, METRICS_COMMIT_AGE, METRICS_COMMIT_BATCH,
+                                              METRICS_CHECKPOINT_LOG, METRICS_CHECKPOINT_DIRTY};
+    uint64_t now = metrics_now();
+
+    pthread_mutex_lock(&persist_mutex);
+    if (!ok) {
+        retry_at = now + (uint64_t) PERSIST_RETRY_MS * 1000000;
+    } else {
+        retry_at = 0;
+        identifiers = 0;
+        if (reason == PERSIST_CHECKPOINT_LOG || reason == PERSIST_CHECKPOINT_DIRTY) {
+            dirty_rows = 0;
+            log_bytes = 0;
+            checkpoint_requested = 0;
+        }
+        // Updates that raced with the commit may not be in it, so they stay pending
+        pending_since = updates == seen ? 0 : now;
+    }
+    pthread_mutex_unlock(&persist_mutex);
+
+    if (ok) metrics_count(reason_metrics[reason], 1);
+}
+
+persist_state_t persist_state() {
+    persist_state_t state;
+    uint64_t now = metrics_now();
+
+    pthread_mutex_lock(&persist_mutex);
+    state.pending = pending_since != 0;
+    state.pending_age_ns = pending_since ? now - pending_since : 0;
+    state.identifiers = identifiers;
+    state.dirty_rows = dirty_rows;
+    state.log_bytes = log_bytes;
+    pthread_mutex_unlock(&persist_mutex);
+
+    return state;
+}
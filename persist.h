@@ -0,0 +1,55 @@
+#ifndef TITLE_FINGERPRINT_DB_PERSIST_H
+#define TITLE_FINGERPRINT_DB_PERSIST_H
+
+#include <stdint.h>
+
+// Defaults of the policy, the log size and commit interval defaults are in oplog.h
+#define PERSIST_IDLE_MS 100
+#define PERSIST_MAX_BATCH 100000
+#define PERSIST_MAX_DIRTY_ROWS 1048576
+// Wait before retrying a failed commit or checkpoint
+#define PERSIST_RETRY_MS 1000
+
+#define PERSIST_NONE 0
+#define PERSIST_COMMIT_IDLE 1
+#define PERSIST_COMMIT_AGE 2
+#define PERSIST_COMMIT_BATCH 3
+#define PERSIST_CHECKPOINT_LOG 4
+#define PERSIST_CHECKPOINT_DIRTY 5
+
+typedef struct persist_policy {
+    // Commit when nothing was indexed for this long
+    uint32_t idle_ms;
+    // Commit when the oldest uncommitted update is this old
+    uint32_t max_age_ms;
+    // Commit when this many identifier writes are in the open transaction
+    uint32_t max_batch;
+    // Checkpoint when this many rows changed since the last checkpoint
+    uint32_t max_dirty_rows;
+    // Checkpoint when the hashtable log grows above this size
+    uint64_t max_log_bytes;
+} persist_policy_t;
+
+typedef struct persist_state {
+    uint8_t pending;
+    uint64_t pending_age_ns;
+    uint32_t identifiers;
+    uint32_t dirty_rows;
+    uint64_t log_bytes;
+} persist_state_t;
+
+extern persist_policy_t persist_policy;
+
+int persist_parse(char *options);
+
+void persist_updated(uint32_t identifiers, uint32_t dirty_rows, uint64_t log_bytes);
+
+void persist_checkpoint();
+
+uint8_t persist_wait(uint64_t *seen);
+
+void persist_done(uint8_t reason, uint64_t seen, int ok);
+
+persist_state_t persist_state();
+
+#endif //TITLE_FINGERPRINT_DB_PERSIST_H
@@ -0,0 +1,420 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Length-prefixed binary protocol (see proto.h) for co-located clients, served on TCP
+ * and/or a Unix domain socket next to the HTTP API. Each connection gets its own thread,
+ * reads as many pipelined frames as are available, answers them in order and writes
+ * all responses with one write. Consecutive requests of the same kind in a read
+ * share one lock acquisition, but the lock is never held while doing socket I/O.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <jemalloc/jemalloc.h>
+#include "ht.h"
+#include "proto.h"
+#include "arena.h"
+#include "metrics.h"
+#include "repl.h"
+
+#define LOCK_NONE 0
+#define LOCK_READ 1
+#define LOCK_WRITE 2
+
+typedef struct connection {
+    int fd;
+    uint8_t in[PROTO_HEADER_LEN + PROTO_PAYLOAD_MAX];
+    uint32_t in_len;
+    uint8_t out[PROTO_OUT_BUF_LEN];
+    uint32_t out_len;
+    // NUL terminated copies of request strings
+    uint8_t text[PROTO_PAYLOAD_MAX + 3];
+    result_t result;
+    uint8_t lock;
+    // When the lock was acquired
+    uint64_t locked;
+} connection_t;
+
+extern pthread_rwlock_t rwlock;
+
+static int listen_fds[2] = {-1, -1};
+static char unix_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static uint32_t connections = 0;
+
+static void set_lock(connection_t *c, uint8_t lock) {
+    if (c->lock == lock) return;
+    if (c->lock != LOCK_NONE) metrics_unlock(&rwlock, c->locked, c->lock == LOCK_WRITE);
+    if (lock == LOCK_READ) c->locked = metrics_rdlock(&rwlock);
+    else if (lock == LOCK_WRITE) c->locked = metrics_wrlock(&rwlock);
+    c->lock = lock;
+}
+
+static int write_all(int fd, uint8_t *data, uint32_t len) {
+    while (len) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        data += n;
+        len -= (uint32_t) n;
+    }
+    return 1;
+}
+
+static int flush(connection_t *c) {
+    set_lock(c, LOCK_NONE);
+    int rc = write_all(c->fd, c->out, c->out_len);
+    c->out_len = 0;
+    arena_reset(arena_local());
+    return rc;
+}
+
+static uint8_t *begin_response(connection_t *c, uint8_t status, uint32_t id) {
+    uint8_t *p = c->out + c->out_len;
+    p[4] = status;
+    proto_put_u32(p + 5, id);
+    return p;
+}
+
+static void end_response(connection_t *c, uint8_t *p, uint32_t payload_len) {
+    proto_put_u32(p, payload_len);
+    c->out_len += PROTO_HEADER_LEN + payload_len;
+}
+
+static uint32_t put_string(uint8_t *p, uint8_t *str) {
+    uint16_t len = (uint16_t) strlen((char *) str);
+    proto_put_u16(p, len);
+    memcpy(p + 2, str, len);
+    return 2 + (uint32_t) len;
+}
+
+// Splits an index payload into NUL terminated title, name and identifiers in c->text
+static int parse_index(connection_t *c, uint8_t *payload, uint32_t len, uint8_t **fields) {
+    uint8_t *t = c->text;
+    uint32_t pos = 0;
+    for (int i = 0; i < 3; i++) {
+        if (len - pos < 2) return 0;
+        uint16_t field_len = proto_get_u16(payload + pos);
+        pos += 2;
+        if (len - pos < field_len) return 0;
+        memcpy(t, payload + pos, field_len);
+        t[field_len] = 0;
+        fields[i] = t;
+        t += field_len + 1;
+        pos += field_len;
+    }
+    return pos == len;
+}
+
+static void process(connection_t *c, uint8_t op, uint32_t id, uint8_t *payload, uint32_t len) {
+    uint8_t *p;
+
+    if (op == PROTO_OP_IDENTIFY) {
+        memcpy(c->text, payload, len);
+        c->text[len] = 0;
+        set_lock(c, LOCK_READ);
+        if (!ht_identify(c->text, &c->result)) {
+            p = begin_response(c, PROTO_NOT_FOUND, id);
+            end_response(c, p, 0);
+            return;
+        }
+        p = begin_response(c, PROTO_OK, id);
+        uint32_t n = put_string(p + PROTO_HEADER_LEN, c->result.title);
+        n += put_string(p + PROTO_HEADER_LEN + n, c->result.name);
+        n += put_string(p + PROTO_HEADER_LEN + n, c->result.identifiers);
+        end_response(c, p, n);
+    } else if (op == PROTO_OP_INDEX) {
+        uint8_t *fields[3];
+        if (!parse_index(c, payload, len, fields)) {
+            p = begin_response(c, PROTO_BAD_REQUEST, id);
+            end_response(c, p, 0);
+            return;
+        }
+        // Followers only take updates from their leader
+        if (repl_following()) {
+            p = begin_response(c, PROTO_REJECTED, id);
+            end_response(c, p, 0);
+            return;
+        }
+        set_lock(c, LOCK_WRITE);
+        p = begin_response(c, ht_index(fields[0], fields[1], fields[2]) ? PROTO_OK : PROTO_REJECTED, id);
+        end_response(c, p, 0);
+    } else if (op == PROTO_OP_PROBE) {
+        if (len % 8 || len / 8 > PROTO_PROBE_MAX) {
+            p = begin_response(c, PROTO_BAD_REQUEST, id);
+            end_response(c, p, 0);
+            return;
+        }
+        set_lock(c, LOCK_READ);
+        p = begin_response(c, PROTO_OK, id);
+        uint8_t *q = p + PROTO_HEADER_LEN;
+        for (uint32_t i = 0; i < len; i += 8) {
+            uint64_t hash = proto_get_u64(payload + i);
+            slot_t *slots[MAX_SLOTS_PER_TITLE];
+            uint8_t slots_len = 0;
+            if ((hash >> 32) < HASHTABLE_SIZE) ht_hash_slots(hash, slots, &slots_len);
+            *q++ = slots_len;
+            for (uint32_t k = 0; k < slots_len; k++, q += 8) {
+                proto_put_u64(q, slots[k]->data);
+            }
+        }
+        end_response(c, p, (uint32_t) (q - p - PROTO_HEADER_LEN));
+    } else if (op == PROTO_OP_IDENTIFIERS) {
+        if (len != 4) {
+            p = begin_response(c, PROTO_BAD_REQUEST, id);
+            end_response(c, p, 0);
+            return;
+        }
+        set_lock(c, LOCK_READ);
+        c->result.identifiers[0] = 0;
+        ht_get_identifiers(proto_get_u32(payload), c->result.identifiers, sizeof(c->result.identifiers));
+        p = begin_response(c, PROTO_OK, id);
+        end_response(c, p, put_string(p + PROTO_HEADER_LEN, c->result.identifiers));
+    } else {
+        p = begin_response(c, PROTO_BAD_REQUEST, id);
+        end_response(c, p, 0);
+    }
+}
+
+static void *connection_thread(void *arg) {
+    connection_t *c = arg;
+
+    while (1) {
+        ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        c->in_len += (uint32_t) n;
+
+        uint32_t pos = 0;
+        int fail = 0;
+        while (c->in_len - pos >= PROTO_HEADER_LEN) {
+            uint8_t *frame = c->in + pos;
+            uint32_t len = proto_get_u32(frame);
+            uint32_t id = proto_get_u32(frame + 5);
+
+            if (c->out_len + PROTO_RESPONSE_MAX > sizeof(c->out) && !flush(c)) {
+                fail = 1;
+                break;
+            }
+
+            if (len > PROTO_PAYLOAD_MAX) {
+                // The stream can't be resynchronized after an oversized frame
+                uint8_t *p = begin_response(c, PROTO_BAD_REQUEST, id);
+                end_response(c, p, 0);
+                flush(c);
+                fail = 1;
+                break;
+            }
+
+            if (c->in_len - pos < PROTO_HEADER_LEN + len) break;
+
+            uint64_t start = metrics_now();
+            process(c, frame[4], id, frame + PROTO_HEADER_LEN, len);
+            if (frame[4] == PROTO_OP_IDENTIFY) metrics_since(METRICS_PROTO_IDENTIFY, start);
+            else if (frame[4] == PROTO_OP_INDEX) metrics_since(METRICS_PROTO_INDEX, start);
+            else if (frame[4] == PROTO_OP_PROBE) metrics_since(METRICS_PROTO_PROBE, start);
+            pos += PROTO_HEADER_LEN + len;
+        }
+
+        if (fail || !flush(c)) break;
+
+        memmove(c->in, c->in + pos, c->in_len - pos);
+        c->in_len -= pos;
+    }
+
+    set_lock(c, LOCK_NONE);
+    close(c->fd);
+    free(c);
+    __sync_fetch_and_sub(&connections, 1);
+    return 0;
+}
+
+static void *listener_thread(void *arg) {
+    int listen_fd = (int) (intptr_t) arg;
+
+    while (1) {
+        int fd = accept(listen_fd, 0, 0);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE || errno == ENOMEM) {
+                usleep(10000);
+                continue;
+            }
+            // Listener was closed
+            break;
+        }
+
+        if (__sync_add_and_fetch(&connections, 1) > PROTO_CONNECTIONS_MAX) {
+            __sync_fetch_and_sub(&connections, 1);
+            close(fd);
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        connection_t *c = malloc(sizeof(connection_t));
+        if (!c) {
+            fprintf(stderr, "failed to allocate binary protocol connection\n");
+            __sync_fetch_and_sub(&connections, 1);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->in_len = 0;
+        c->out_len = 0;
+        c->lock = LOCK_NONE;
+
+        pthread_t tid;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&tid, &attr, connection_thread, c)) {
+            fprintf(stderr, "failed to start binary protocol connection thread\n");
+            __sync_fetch_and_sub(&connections, 1);
+            close(fd);
+            free(c);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    return 0;
+}
+
+static int start_listener(int fd, int i) {
+    if (listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "binary protocol listen failed: %s\n", strerror(errno));
+        close(fd);
+        return 0;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, listener_thread, (void *) (intptr_t) fd)) {
+        fprintf(stderr, "failed to start binary protocol listener thread\n");
+        close(fd);
+        return 0;
+    }
+    pthread_detach(tid);
+
+    listen_fds[i] = fd;
+    return 1;
+}
+
+int proto_listen_tcp(char *port) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int rc = getaddrinfo(NULL, port, &hints, &res);
+    if (rc) {
+        fprintf(stderr, "binary protocol port %s: %s\n", port, gai_strerror(rc));
+        return 0;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0) {
+        fprintf(stderr, "binary protocol socket failed: %s\n", strerror(errno));
+        freeaddrinfo(res);
+        return 0;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        fprintf(stderr, "binary protocol bind to port %s failed: %s\n", port, strerror(errno));
+        freeaddrinfo(res);
+        close(fd);
+        return 0;
+    }
+    freeaddrinfo(res);
+
+    return start_listener(fd, 0);
+}
+
+int proto_listen_unix(char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path is too long: %s\n", path);
+        return 0;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Remove a socket left behind by a previous run, but nothing else
+    struct stat st;
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "binary protocol socket failed: %s\n", strerror(errno));
+        return 0;
+    }
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "binary protocol bind to %s failed: %s\n", path, strerror(errno));
+        close(fd);
+        return 0;
+    }
+
+    if (!start_listener(fd, 1)) {
+        unlink(path);
+        return 0;
+    }
+
+    strcpy(unix_path, path);
+    return 1;
+}
+
+void proto_close() {
+    for (int i = 0; i < 2; i++) {
+        if (listen_fds[i] >= 0) {
+            shutdown(listen_fds[i], SHUT_RDWR);
+            close(listen_fds[i]);
+            listen_fds[i] = -1;
+        }
+    }
+
+    if (*unix_path) {
+        unlink(unix_path);
+        *unix_path = 0;
+    }
+}
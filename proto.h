@@ -0,0 +1,79 @@
+#ifndef TITLE_FINGERPRINT_DB_PROTO_H
+#define TITLE_FINGERPRINT_DB_PROTO_H
+
+#include <stdint.h>
+
+/*
+ * Frame: uint32 payload length, uint8 op (requests) or status (responses),
+ * uint32 request id echoed back in the response, payload. Integers are little-endian.
+ *
+ * PROTO_OP_IDENTIFY payload: text
+ * PROTO_OP_INDEX payload: uint16 length + title, uint16 length + name, uint16 length + identifiers
+ * PROTO_OK identify response payload: same layout as the index request
+ * PROTO_OP_PROBE payload: uint64 title hashes, at most PROTO_PROBE_MAX
+ * PROTO_OK probe response payload: for each hash, uint8 slot count and the uint64 data of its slots
+ * PROTO_OP_IDENTIFIERS payload: uint32 meta_id
+ * PROTO_OK identifiers response payload: uint16 length + identifiers
+ *
+ * Probes and identifiers are how a router (see router.c) looks up titles on shards.
+ *
+ * Requests on a connection can be pipelined and are answered in order.
+ */
+
+#define PROTO_HEADER_LEN 9
+#define PROTO_PAYLOAD_MAX 65536
+// Largest response payload: title, name and identifiers of result_t with their lengths
+#define PROTO_RESPONSE_MAX (PROTO_HEADER_LEN + 6 + 4096 + 64 + 4096)
+// Probe responses of up to 5 slots per hash fit in PROTO_RESPONSE_MAX too
+#define PROTO_PROBE_MAX 192
+
+#define PROTO_OP_IDENTIFY 1
+#define PROTO_OP_INDEX 2
+#define PROTO_OP_PROBE 3
+#define PROTO_OP_IDENTIFIERS 4
+
+#define PROTO_OK 0
+#define PROTO_NOT_FOUND 1
+#define PROTO_REJECTED 2
+#define PROTO_BAD_REQUEST 3
+
+#define PROTO_CONNECTIONS_MAX 256
+// Responses are buffered and written once the pipelined requests read so far are processed
+#define PROTO_OUT_BUF_LEN 262144
+
+static inline void proto_put_u16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+}
+
+static inline void proto_put_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+    p[2] = (uint8_t) (v >> 16);
+    p[3] = (uint8_t) (v >> 24);
+}
+
+static inline void proto_put_u64(uint8_t *p, uint64_t v) {
+    proto_put_u32(p, (uint32_t) v);
+    proto_put_u32(p + 4, (uint32_t) (v >> 32));
+}
+
+static inline uint16_t proto_get_u16(const uint8_t *p) {
+    return (uint16_t) (p[0] | p[1] << 8);
+}
+
+static inline uint32_t proto_get_u32(const uint8_t *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline uint64_t proto_get_u64(const uint8_t *p) {
+    return (uint64_t) proto_get_u32(p) | (uint64_t) proto_get_u32(p + 4) << 32;
+}
+
+int proto_listen_tcp(char *port);
+
+int proto_listen_unix(char *path);
+
+void proto_close();
+
+#endif //TITLE_FINGERPRINT_DB_PROTO_H
@@ -0,0 +1,96 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Hot reload of a db directory, e.g. one rebuilt with build. The hashtable and identifiers
+ * are loaded on a background thread while the current version keeps serving requests.
+ * Then, under the write lock, the db and log are switched to the new directory and the
+ * versions swapped (see ht_switch). Taking the write lock means no reader still uses
+ * the previous version, so it's freed right after the lock is released.
+ * Updates indexed before the switch stay in the previous directory only.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/limits.h>
+#include "ht.h"
+#include "metrics.h"
+#include "reload.h"
+
+extern pthread_rwlock_t rwlock;
+extern pthread_mutex_t save_mutex;
+
+static uint32_t running = 0;
+static char reload_directory[PATH_MAX];
+
+static void *reload_thread(void *arg) {
+    (void) arg;
+    uint64_t start = metrics_now();
+    int rc = 0;
+
+    printf("reloading %s..\n", reload_directory);
+
+    ht_version_t *version = ht_load(reload_directory);
+    uint64_t loaded = metrics_now();
+    uint64_t switched = loaded;
+
+    if (version) {
+        pthread_mutex_lock(&save_mutex);
+        uint64_t locked = metrics_wrlock(&rwlock);
+        rc = ht_switch(version, reload_directory);
+        metrics_unlock(&rwlock, locked, 1);
+        pthread_mutex_unlock(&save_mutex);
+        switched = metrics_now();
+
+        // Either the previous version or, if switching failed, the one just loaded
+        ht_version_free(version);
+    }
+
+    if (rc) metrics_load_ns = loaded - start;
+    metrics_count(rc ? METRICS_RELOAD : METRICS_RELOAD_FAILED, 1);
+    printf("reload %s: %s, loaded in %u ms, switched in %u ms\n", rc ? "done" : "failed", reload_directory,
+           (uint32_t) ((loaded - start) / 1000000), (uint32_t) ((switched - loaded) / 1000000));
+
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int reload_start(const char *directory) {
+    pthread_t tid;
+
+    if (__atomic_exchange_n(&running, 1, __ATOMIC_ACQ_REL)) return 0;
+
+    snprintf(reload_directory, PATH_MAX, "%s", directory);
+    if (pthread_create(&tid, NULL, reload_thread, 0)) {
+        fprintf(stderr, "pthread_create failed\n");
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        return 0;
+    }
+    pthread_detach(tid);
+    return 1;
+}
+
+uint32_t reload_running() {
+    return __atomic_load_n(&running, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,11 @@
+#ifndef TITLE_FINGERPRINT_DB_RELOAD_H
+#define TITLE_FINGERPRINT_DB_RELOAD_H
+
+#include <stdint.h>
+
+// Starts loading a db directory in the background, returns 0 if a reload is already running
+int reload_start(const char *directory);
+
+uint32_t reload_running();
+
+#endif //TITLE_FINGERPRINT_DB_RELOAD_H
@@ -0,0 +1,514 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Leader/follower replication by log shipping. A leader (-R) keeps its index operations
+ * in the replication log (see replog.c) and streams them to followers that connect to it.
+ * A follower (-F) applies them through the same paths as local updates, so they are
+ * persisted in its own db directory, and serves reads.
+ *
+ * A follower that connects for the first time, or can't continue from where it stopped,
+ * gets a snapshot first: all slots with their identifiers, read in chunks like an export,
+ * followed by the log from the position taken before the snapshot started. Applying is
+ * idempotent, so changes that made it into both the snapshot and the log are harmless.
+ * A snapshot replaces what the follower has, which can be from an earlier epoch of the leader's log
+ * (a reload on the leader starts a new one). It is built into a staged version while the current one
+ * keeps serving reads, and swapped in once complete, the log from then on is applied as usual.
+ * The position isn't persisted, a restarted follower gets a snapshot.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <jemalloc/jemalloc.h>
+#include "ht.h"
+#include "export.h"
+#include "metrics.h"
+#include "replog.h"
+#include "repl.h"
+
+extern pthread_rwlock_t rwlock;
+extern pthread_mutex_t save_mutex;
+
+static int listen_fd = -1;
+static uint8_t following = 0;
+static char leader_host[NI_MAXHOST];
+static char leader_port[NI_MAXSERV];
+
+static int repl_write(int fd, const void *data, size_t len, int flags) {
+    const uint8_t *p = data;
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL | flags);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        p += n;
+        len -= (size_t) n;
+    }
+    return 1;
+}
+
+static int repl_send(int fd, uint8_t type, const void *payload, uint32_t len) {
+    uint8_t header[REPLOG_HEADER_LEN];
+    header[0] = type;
+    memcpy(header + 1, &len, 4);
+    return repl_write(fd, header, REPLOG_HEADER_LEN, len ? MSG_MORE : 0) && repl_write(fd, payload, len, 0);
+}
+
+static int repl_send_snapshot(void *ctx, uint8_t *data, uint32_t data_len) {
+    return repl_send(*(int *) ctx, REPLOG_SNAPSHOT, data, data_len);
+}
+
+static int repl_read(int fd, void *data, size_t len) {
+    uint8_t *p = data;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t) n;
+    }
+    return 1;
+}
+
+static void repl_timeout(int fd, uint32_t ms) {
+    struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+// Streams the log to one follower, after a snapshot if it can't continue from its position
+static void *repl_sender_thread(void *arg) {
+    int fd = (int) (intptr_t) arg;
+    uint8_t hello[REPLOG_HELLO_LEN];
+    uint8_t start[REPLOG_START_LEN];
+    uint8_t *buf = 0;
+    uint64_t epoch, lsn, slots = 0;
+
+    repl_timeout(fd, REPL_TIMEOUT_MS);
+    if (!repl_read(fd, hello, REPLOG_HELLO_LEN)) goto end;
+    memcpy(&epoch, hello, 8);
+    memcpy(&lsn, hello + 8, 8);
+
+    uint8_t snapshot = !replog_position(&epoch, &lsn);
+    memcpy(start, &epoch, 8);
+    memcpy(start + 8, &lsn, 8);
+    start[16] = snapshot;
+    if (!repl_send(fd, REPLOG_START, start, REPLOG_START_LEN)) goto end;
+
+    if (snapshot) {
+        uint64_t started = metrics_now();
+        if (!export_rows(0, HASHTABLE_SIZE, EXPORT_FORMAT_BINARY, repl_send_snapshot, &fd, &slots)
+            || !repl_send(fd, REPLOG_SNAPSHOT_END, 0, 0)) {
+            goto end;
+        }
+        printf("sent a snapshot of %" PRIu64 " slots to a follower in %u ms\n", slots,
+               (uint32_t) ((metrics_now() - started) / 1000000));
+    }
+
+    if (!(buf = malloc(REPL_CHUNK_LEN))) {
+        fprintf(stderr, "replication buffer malloc failed\n");
+        goto end;
+    }
+
+    while (1) {
+        int64_t n = replog_read(epoch, lsn, buf, REPL_CHUNK_LEN, REPL_HEARTBEAT_MS);
+        if (n < 0) {
+            printf("a follower can't continue from the replication log and starts over\n");
+            break;
+        }
+
+        if (n) {
+            if (!repl_write(fd, buf, (size_t) n, 0)) break;
+            lsn += (uint64_t) n;
+        } else {
+            uint64_t head = replog_head();
+            if (!repl_send(fd, REPLOG_HEARTBEAT, &head, 8)) break;
+        }
+    }
+
+    end:
+    free(buf);
+    close(fd);
+    replog_connected(-1);
+    return 0;
+}
+
+static void *repl_listener_thread(void *arg) {
+    int fd_listen = (int) (intptr_t) arg;
+
+    while (1) {
+        int fd = accept(fd_listen, 0, 0);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE || errno == ENOMEM) {
+                usleep(10000);
+                continue;
+            }
+            // Listener was closed
+            break;
+        }
+
+        if (replog_state().connections >= REPL_FOLLOWERS_MAX) {
+            close(fd);
+            continue;
+        }
+        replog_connected(1);
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        pthread_t tid;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&tid, &attr, repl_sender_thread, (void *) (intptr_t) fd)) {
+            fprintf(stderr, "failed to start replication sender thread\n");
+            replog_connected(-1);
+            close(fd);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    return 0;
+}
+
+int repl_listen(char *port) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (!replog_init(REPLOG_SIZE)) return 0;
+
+    int rc = getaddrinfo(NULL, port, &hints, &res);
+    if (rc) {
+        fprintf(stderr, "replication port %s: %s\n", port, gai_strerror(rc));
+        return 0;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0) {
+        fprintf(stderr, "replication socket failed: %s\n", strerror(errno));
+        freeaddrinfo(res);
+        return 0;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "replication listen on port %s failed: %s\n", port, strerror(errno));
+        freeaddrinfo(res);
+        close(fd);
+        return 0;
+    }
+    freeaddrinfo(res);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, repl_listener_thread, (void *) (intptr_t) fd)) {
+        fprintf(stderr, "failed to start replication listener thread\n");
+        close(fd);
+        return 0;
+    }
+    pthread_detach(tid);
+
+    listen_fd = fd;
+    return 1;
+}
+
+static int repl_connect() {
+    struct addrinfo hints, *res, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rc = getaddrinfo(leader_host, leader_port, &hints, &res);
+    if (rc) {
+        fprintf(stderr, "%s:%s: %s\n", leader_host, leader_port, gai_strerror(rc));
+        return -1;
+    }
+
+    int fd = -1;
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/*
+ * Adds slots of a snapshot chunk to the staged version, identifiers first as the leader indexed them.
+ * Like repl_apply, the byte after the chunk can be overwritten temporarily.
+ */
+static int repl_apply_snapshot(ht_version_t *staged, uint8_t *data, uint32_t len) {
+    uint32_t pos = 0;
+
+    while (pos + 18 <= len) {
+        uint64_t hash, slot_data;
+        uint16_t identifiers_len;
+        memcpy(&hash, data + pos, 8);
+        memcpy(&slot_data, data + pos + 8, 8);
+        memcpy(&identifiers_len, data + pos + 16, 2);
+        // The leader ends a failed export with an error record
+        if (pos + 18 + identifiers_len > len || identifiers_len == EXPORT_BINARY_ERROR) return 0;
+
+        uint32_t meta_id = (uint32_t) (slot_data >> 34);
+        if (meta_id && identifiers_len) {
+            uint8_t *identifiers = data + pos + 18;
+            uint8_t next = identifiers[identifiers_len];
+            identifiers[identifiers_len] = 0;
+            uint32_t rc = ht_stage_identifiers(staged, meta_id, identifiers);
+            identifiers[identifiers_len] = next;
+            if (!rc) return 0;
+        }
+        if (!ht_stage_slot(staged, hash, slot_data)) return 0;
+        pos += 18 + identifiers_len;
+    }
+    return pos == len;
+}
+
+// Applies a log record, the byte after the record can be overwritten temporarily
+static int repl_apply(uint8_t type, uint8_t *payload, uint32_t len) {
+    if (type == REPLOG_INSERT || type == REPLOG_UPDATE) {
+        uint64_t hash, data;
+        if (len != 16) return 0;
+        memcpy(&hash, payload, 8);
+        memcpy(&data, payload + 8, 8);
+        return ht_apply_slot(type, hash, data);
+    }
+
+    if (type == REPLOG_IDENTIFIERS) {
+        uint32_t meta_id;
+        if (len < 4) return 0;
+        memcpy(&meta_id, payload, 4);
+        uint8_t next = payload[len];
+        payload[len] = 0;
+        ht_apply_identifiers(meta_id, payload + 4);
+        payload[len] = next;
+        return 1;
+    }
+    return 0;
+}
+
+// Makes a complete snapshot current, the previous version is freed once no reader can reach it
+static void repl_switch_snapshot(ht_version_t *staged) {
+    pthread_mutex_lock(&save_mutex);
+    if (ht_stage_save(staged)) {
+        uint64_t locked = metrics_wrlock(&rwlock);
+        if (!ht_stage_switch(staged)) fprintf(stderr, "failed to persist the snapshot\n");
+        metrics_unlock(&rwlock, locked, 1);
+    } else {
+        fprintf(stderr, "failed to save the identifiers of the snapshot\n");
+    }
+    pthread_mutex_unlock(&save_mutex);
+    ht_version_free(staged);
+}
+
+/*
+ * Connects to the leader, reconnecting after errors, and applies what it sends.
+ * Records received by one read are applied under one write lock.
+ */
+static void *repl_follower_thread(void *arg) {
+    (void) arg;
+    // Position in the leader's log, set once a snapshot is complete
+    uint64_t epoch = 0, lsn = 0, head = 0;
+    // Snapshot being received
+    ht_version_t *staged = 0;
+    uint8_t *in = 0;
+    uint32_t in_len = 0, in_size = REPL_CHUNK_LEN;
+
+    // One more byte for the NUL after the last record
+    if (!(in = malloc(in_size + 1))) {
+        fprintf(stderr, "replication buffer malloc failed\n");
+        return 0;
+    }
+
+    while (1) {
+        int fd = repl_connect();
+        if (fd < 0) {
+            usleep(REPL_RETRY_MS * 1000);
+            continue;
+        }
+        repl_timeout(fd, REPL_TIMEOUT_MS);
+
+        uint8_t hello[REPLOG_HELLO_LEN];
+        memcpy(hello, &epoch, 8);
+        memcpy(hello + 8, &lsn, 8);
+        if (!repl_write(fd, hello, REPLOG_HELLO_LEN, 0)) {
+            close(fd);
+            usleep(REPL_RETRY_MS * 1000);
+            continue;
+        }
+        printf("following %s:%s\n", leader_host, leader_port);
+
+        uint64_t snapshot_epoch = 0, snapshot_lsn = 0;
+        uint8_t in_snapshot = 0;
+        int rc = 1;
+        in_len = 0;
+
+        while (rc) {
+            if (in_len == in_size) {
+                uint8_t *grown;
+                if (!(grown = realloc(in, in_size * 2 + 1))) {
+                    fprintf(stderr, "replication buffer realloc failed\n");
+                    break;
+                }
+                in = grown;
+                in_size *= 2;
+            }
+
+            ssize_t n = read(fd, in + in_len, in_size - in_len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            in_len += (uint32_t) n;
+
+            uint32_t pos = 0;
+            uint64_t locked = 0;
+            while (rc && in_len - pos >= REPLOG_HEADER_LEN) {
+                uint8_t type = in[pos];
+                uint32_t len;
+                memcpy(&len, in + pos + 1, 4);
+                if (in_len - pos - REPLOG_HEADER_LEN < len) {
+                    // Makes room for a record larger than the buffer
+                    if (REPLOG_HEADER_LEN + (uint64_t) len > in_size && !pos) {
+                        uint8_t *grown;
+                        if (!(grown = realloc(in, REPLOG_HEADER_LEN + (size_t) len + 1))) {
+                            fprintf(stderr, "replication buffer realloc failed\n");
+                            rc = 0;
+                        } else {
+                            in = grown;
+                            in_size = REPLOG_HEADER_LEN + len;
+                        }
+                    }
+                    break;
+                }
+                uint8_t *payload = in + pos + REPLOG_HEADER_LEN;
+
+                if (type == REPLOG_START && len == REPLOG_START_LEN) {
+                    memcpy(&snapshot_epoch, payload, 8);
+                    memcpy(&snapshot_lsn, payload + 8, 8);
+                    in_snapshot = payload[16];
+                    if (in_snapshot) {
+                        printf("receiving a snapshot from the leader\n");
+                        ht_version_free(staged);
+                        rc = (staged = ht_stage_new()) != 0;
+                    } else {
+                        epoch = snapshot_epoch;
+                        lsn = snapshot_lsn;
+                    }
+                } else if (type == REPLOG_HEARTBEAT && len == 8) {
+                    memcpy(&head, payload, 8);
+                } else if (type == REPLOG_SNAPSHOT_END && in_snapshot) {
+                    if (locked) {
+                        metrics_unlock(&rwlock, locked, 1);
+                        locked = 0;
+                    }
+                    repl_switch_snapshot(staged);
+                    staged = 0;
+                    in_snapshot = 0;
+                    epoch = snapshot_epoch;
+                    lsn = snapshot_lsn;
+                    printf("applied the snapshot, continuing from the leader's log\n");
+                } else if (type == REPLOG_SNAPSHOT && in_snapshot) {
+                    // Staged without the lock, no reader can reach it
+                    if (!(rc = repl_apply_snapshot(staged, payload, len))) {
+                        fprintf(stderr, "invalid replication record of type %u\n", type);
+                    }
+                } else {
+                    if (!locked) locked = metrics_wrlock(&rwlock);
+                    if (!in_snapshot && snapshot_epoch) {
+                        rc = repl_apply(type, payload, len);
+                        lsn += REPLOG_HEADER_LEN + len;
+                    } else {
+                        rc = 0;
+                    }
+                    if (!rc) fprintf(stderr, "invalid replication record of type %u\n", type);
+                }
+                pos += REPLOG_HEADER_LEN + len;
+            }
+            if (locked) metrics_unlock(&rwlock, locked, 1);
+
+            memmove(in, in + pos, in_len - pos);
+            in_len -= pos;
+            replog_follow(epoch, lsn, head, 1);
+        }
+
+        close(fd);
+        // An incomplete snapshot is dropped, the current version still matches the position
+        ht_version_free(staged);
+        staged = 0;
+        replog_follow(epoch, lsn, head, 0);
+        fprintf(stderr, "lost connection to the leader %s:%s\n", leader_host, leader_port);
+        usleep(REPL_RETRY_MS * 1000);
+    }
+    return 0;
+}
+
+// Starts following a leader at host:port
+int repl_follow(char *address) {
+    char *colon = strrchr(address, ':');
+    if (!colon || colon == address || !colon[1] || colon - address >= NI_MAXHOST || strlen(colon + 1) >= NI_MAXSERV) {
+        fprintf(stderr, "invalid leader address: %s\n", address);
+        return 0;
+    }
+    snprintf(leader_host, sizeof(leader_host), "%.*s", (int) (colon - address), address);
+    snprintf(leader_port, sizeof(leader_port), "%s", colon + 1);
+
+    following = 1;
+    replog_follow(0, 0, 0, 0);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, repl_follower_thread, 0)) {
+        fprintf(stderr, "failed to start replication follower thread\n");
+        return 0;
+    }
+    pthread_detach(tid);
+    return 1;
+}
+
+uint8_t repl_following() {
+    return following;
+}
+
+void repl_close() {
+    if (listen_fd >= 0) {
+        shutdown(listen_fd, SHUT_RDWR);
+        close(listen_fd);
+        listen_fd = -1;
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef TITLE_FINGERPRINT_DB_REPL_H
+#define TITLE_FINGERPRINT_DB_REPL_H
+
+#include <stdint.h>
+
+// Waits this long for new records before a heartbeat, followers reconnect after missing a few
+#define REPL_HEARTBEAT_MS 1000
+#define REPL_TIMEOUT_MS 5000
+#define REPL_RETRY_MS 1000
+// Bytes of the log sent, and applied under one write lock, at a time
+#define REPL_CHUNK_LEN 65536
+#define REPL_FOLLOWERS_MAX 64
+
+int repl_listen(char *port);
+
+int repl_follow(char *address);
+
+// Followers only take updates from their leader
+uint8_t repl_following();
+
+void repl_close();
+
+#endif //TITLE_FINGERPRINT_DB_REPL_H
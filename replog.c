@@ -0,0 +1,227 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * In-memory log of index operations shipped to followers. It keeps the most recent
+ * records in a ring, so a follower that reconnects catches up from where it stopped
+ * as long as its position hasn't been overwritten yet. The epoch changes when the log
+ * can no longer continue what followers have, e.g. after a reload or a restart of the leader,
+ * which makes them start over from a snapshot.
+ * Records are appended by the indexing path, under the write lock.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <jemalloc/jemalloc.h>
+#include "replog.h"
+
+static pthread_mutex_t replog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replog_cond = PTHREAD_COND_INITIALIZER;
+
+static uint8_t *ring = 0;
+static uint64_t ring_size = 0;
+// Offsets of the oldest kept and the next record, both growing within an epoch
+static uint64_t tail = 0;
+static uint64_t head = 0;
+static uint64_t epoch = 0;
+
+static replog_state_t state = {0};
+
+static void replog_new_epoch() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t next = (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+    epoch = next > epoch ? next : epoch + 1;
+    tail = 0;
+    head = 0;
+}
+
+int replog_init(uint64_t size) {
+    if (!(ring = malloc(size))) {
+        fprintf(stderr, "replication log malloc failed\n");
+        return 0;
+    }
+    ring_size = size;
+    state.role = REPLOG_LEADER;
+
+    pthread_mutex_lock(&replog_mutex);
+    replog_new_epoch();
+    pthread_mutex_unlock(&replog_mutex);
+    return 1;
+}
+
+// Followers start over with a snapshot
+void replog_reset() {
+    if (!ring) return;
+    pthread_mutex_lock(&replog_mutex);
+    replog_new_epoch();
+    pthread_cond_broadcast(&replog_cond);
+    pthread_mutex_unlock(&replog_mutex);
+}
+
+static void ring_write(uint64_t offset, const void *data, uint32_t len) {
+    uint64_t pos = offset % ring_size;
+    uint64_t first = ring_size - pos < len ? ring_size - pos : len;
+    memcpy(ring + pos, data, first);
+    memcpy(ring, (const uint8_t *) data + first, len - first);
+}
+
+static void ring_read(uint64_t offset, void *data, uint32_t len) {
+    uint64_t pos = offset % ring_size;
+    uint64_t first = ring_size - pos < len ? ring_size - pos : len;
+    memcpy(data, ring + pos, first);
+    memcpy((uint8_t *) data + first, ring, len - first);
+}
+
+static int replog_append(uint8_t type, const void *a, uint32_t a_len, const void *b, uint32_t b_len) {
+    uint8_t header[REPLOG_HEADER_LEN];
+    uint32_t len = a_len + b_len;
+
+    if (!ring) return 1;
+
+    header[0] = type;
+    memcpy(header + 1, &len, 4);
+
+    pthread_mutex_lock(&replog_mutex);
+    if (REPLOG_HEADER_LEN + (uint64_t) len > ring_size) {
+        // Followers can't be given this record, so they have to start over
+        fprintf(stderr, "replication record of %u bytes doesn't fit in the log\n", len);
+        replog_new_epoch();
+        pthread_cond_broadcast(&replog_cond);
+        pthread_mutex_unlock(&replog_mutex);
+        return 0;
+    }
+
+    // Drops the oldest records until the new one fits
+    while (head + REPLOG_HEADER_LEN + len - tail > ring_size) {
+        uint8_t old[REPLOG_HEADER_LEN];
+        uint32_t old_len;
+        ring_read(tail, old, REPLOG_HEADER_LEN);
+        memcpy(&old_len, old + 1, 4);
+        tail += REPLOG_HEADER_LEN + old_len;
+    }
+
+    ring_write(head, header, REPLOG_HEADER_LEN);
+    ring_write(head + REPLOG_HEADER_LEN, a, a_len);
+    ring_write(head + REPLOG_HEADER_LEN + a_len, b, b_len);
+    head += REPLOG_HEADER_LEN + len;
+
+    pthread_cond_broadcast(&replog_cond);
+    pthread_mutex_unlock(&replog_mutex);
+    return 1;
+}
+
+int replog_slot(uint8_t type, uint64_t hash, uint64_t data) {
+    uint64_t payload[2] = {hash, data};
+    return replog_append(type, payload, sizeof(payload), 0, 0);
+}
+
+int replog_identifiers(uint32_t meta_id, uint8_t *identifiers) {
+    return replog_append(REPLOG_IDENTIFIERS, &meta_id, 4, identifiers, (uint32_t) strlen((char *) identifiers));
+}
+
+/*
+ * Returns 1 if a follower at lsn of epoch can continue from the log. Otherwise returns 0
+ * and sets the current epoch and the end of the log, from where the follower continues after a snapshot.
+ */
+uint8_t replog_position(uint64_t *follower_epoch, uint64_t *lsn) {
+    uint8_t found;
+    pthread_mutex_lock(&replog_mutex);
+    found = *follower_epoch == epoch && *lsn >= tail && *lsn <= head;
+    if (!found) {
+        *follower_epoch = epoch;
+        *lsn = head;
+    }
+    pthread_mutex_unlock(&replog_mutex);
+    return found;
+}
+
+/*
+ * Copies records from lsn on, waiting up to timeout_ms for new ones. Returns the number of bytes,
+ * which can end in the middle of a record, or -1 if the follower fell behind the kept records or
+ * the epoch changed.
+ */
+int64_t replog_read(uint64_t follower_epoch, uint64_t lsn, uint8_t *buf, uint32_t buf_len, uint32_t timeout_ms) {
+    int64_t len = -1;
+
+    pthread_mutex_lock(&replog_mutex);
+    if (follower_epoch == epoch && lsn == head) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (follower_epoch == epoch && lsn == head) {
+            if (pthread_cond_timedwait(&replog_cond, &replog_mutex, &deadline) == ETIMEDOUT) break;
+        }
+    }
+
+    if (follower_epoch == epoch && lsn >= tail && lsn <= head) {
+        len = head - lsn < buf_len ? (int64_t) (head - lsn) : buf_len;
+        ring_read(lsn, buf, (uint32_t) len);
+    }
+    pthread_mutex_unlock(&replog_mutex);
+    return len;
+}
+
+uint64_t replog_head() {
+    pthread_mutex_lock(&replog_mutex);
+    uint64_t lsn = head;
+    pthread_mutex_unlock(&replog_mutex);
+    return lsn;
+}
+
+void replog_connected(int32_t delta) {
+    __atomic_add_fetch(&state.connections, delta, __ATOMIC_RELAXED);
+}
+
+// Called by a follower as it applies the leader's log
+void replog_follow(uint64_t follower_epoch, uint64_t applied, uint64_t leader_head, uint8_t connected) {
+    pthread_mutex_lock(&replog_mutex);
+    state.role = REPLOG_FOLLOWER;
+    state.epoch = follower_epoch;
+    state.applied = applied;
+    state.head = leader_head > applied ? leader_head : applied;
+    state.connections = connected;
+    pthread_mutex_unlock(&replog_mutex);
+}
+
+replog_state_t replog_state() {
+    pthread_mutex_lock(&replog_mutex);
+    replog_state_t current = state;
+    if (current.role == REPLOG_LEADER) {
+        current.epoch = epoch;
+        current.head = head;
+        current.applied = head;
+        current.connections = __atomic_load_n(&state.connections, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&replog_mutex);
+    return current;
+}
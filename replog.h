@@ -0,0 +1,70 @@
+#ifndef TITLE_FINGERPRINT_DB_REPLOG_H
+#define TITLE_FINGERPRINT_DB_REPLOG_H
+
+#include <stdint.h>
+
+/*
+ * Replication stream sent by a leader to its followers, see repl.c.
+ * Record: uint8 type, uint32 payload length, payload. Integers are little-endian.
+ *
+ * REPLOG_INSERT, REPLOG_UPDATE payload: uint64 hash, uint64 slot data, as in OPLOG_INSERT and OPLOG_UPDATE
+ * REPLOG_IDENTIFIERS payload: uint32 meta_id, identifiers as passed to ht_index
+ * These are the log records, the LSN of a record is its offset in the leader's log.
+ *
+ * REPLOG_START payload: uint64 epoch, uint64 LSN the log continues from, uint8 1 if a snapshot comes first
+ * REPLOG_SNAPSHOT payload: slots in EXPORT_FORMAT_BINARY
+ * REPLOG_SNAPSHOT_END: no payload
+ * REPLOG_HEARTBEAT payload: uint64 LSN of the end of the leader's log
+ *
+ * A follower connects with uint64 epoch, uint64 LSN it has applied up to (0 and 0 the first time).
+ */
+
+#define REPLOG_INSERT 1
+#define REPLOG_UPDATE 2
+#define REPLOG_IDENTIFIERS 3
+#define REPLOG_START 4
+#define REPLOG_SNAPSHOT 5
+#define REPLOG_SNAPSHOT_END 6
+#define REPLOG_HEARTBEAT 7
+
+#define REPLOG_HEADER_LEN 5
+#define REPLOG_HELLO_LEN 16
+#define REPLOG_START_LEN 17
+// Most recent records kept in memory for followers to catch up from
+#define REPLOG_SIZE 67108864
+
+#define REPLOG_LEADER 1
+#define REPLOG_FOLLOWER 2
+
+typedef struct replog_state {
+    uint8_t role;
+    uint64_t epoch;
+    // End of the leader's log, as last heard of by a follower
+    uint64_t head;
+    // Follower's position in the leader's log
+    uint64_t applied;
+    // Followers connected to a leader, or 1 if a follower is connected to its leader
+    uint32_t connections;
+} replog_state_t;
+
+int replog_init(uint64_t size);
+
+void replog_reset();
+
+int replog_slot(uint8_t type, uint64_t hash, uint64_t data);
+
+int replog_identifiers(uint32_t meta_id, uint8_t *identifiers);
+
+uint8_t replog_position(uint64_t *epoch, uint64_t *lsn);
+
+int64_t replog_read(uint64_t epoch, uint64_t lsn, uint8_t *buf, uint32_t buf_len, uint32_t timeout_ms);
+
+uint64_t replog_head();
+
+void replog_connected(int32_t delta);
+
+void replog_follow(uint64_t epoch, uint64_t applied, uint64_t head, uint8_t connected);
+
+replog_state_t replog_state();
+
+#endif //TITLE_FINGERPRINT_DB_REPLOG_H
@@ -0,0 +1,400 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Router in front of hash-range shards (see shard.c). It keeps no rows itself: a lookup
+ * normalizes and hashes the text once, sends every shard a probe with the title hashes
+ * it owns, and then checks the returned slots in the same order as ht_identify does,
+ * so the first matching ngram wins like on a single instance. Identifiers of the match
+ * are fetched from its shard. Records to index are sent to the shard owning their title.
+ *
+ * Each thread has its own connections to the shards, all probes of a lookup are written
+ * before any response is read, so shards work on them in parallel.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <jemalloc/jemalloc.h>
+#include "ht.h"
+#include "text.h"
+#include "arena.h"
+#include "client.h"
+#include "metrics.h"
+#include "shard.h"
+#include "router.h"
+
+typedef struct router_shard {
+    char *host;
+    char *port;
+} router_shard_t;
+
+typedef struct router_thread {
+    client_t *clients[SHARDS_MAX];
+    // Index requests sent to each shard whose responses aren't read yet
+    uint32_t pending[SHARDS_MAX];
+    // Receive timeout in ms each connection has, 0 before it's set
+    uint32_t timeouts[SHARDS_MAX];
+    uint32_t indexed;
+} router_thread_t;
+
+static router_shard_t shards[SHARDS_MAX];
+static uint32_t shards_len = 0;
+
+static __thread router_thread_t router_thread;
+static pthread_once_t router_once = PTHREAD_ONCE_INIT;
+static pthread_key_t router_key;
+
+static void router_thread_close(void *arg) {
+    router_thread_t *rt = arg;
+    for (uint32_t s = 0; s < shards_len; s++) {
+        client_close(rt->clients[s]);
+        rt->clients[s] = 0;
+    }
+}
+
+static void router_key_init() {
+    pthread_key_create(&router_key, router_thread_close);
+}
+
+// Parses the comma separated host:port of each shard, in shard order
+int router_parse(char *list) {
+    char *copy = strdup(list);
+    char *saveptr;
+    if (!copy) return 0;
+
+    for (char *address = strtok_r(copy, ",", &saveptr); address; address = strtok_r(0, ",", &saveptr)) {
+        char *colon = strrchr(address, ':');
+        if (!colon || colon == address || !colon[1] || shards_len == SHARDS_MAX) {
+            fprintf(stderr, "invalid shard address: %s\n", address);
+            return 0;
+        }
+        *colon = 0;
+        shards[shards_len].host = address;
+        shards[shards_len].port = colon + 1;
+        shards_len++;
+    }
+    return shards_len > 0;
+}
+
+uint8_t router_enabled() {
+    return shards_len > 0;
+}
+
+/*
+ * Connects on first use, and again after a failure. A stalled shard fails the request once
+ * its deadline (metrics_now time, 0 for none) passes, or after ROUTER_TIMEOUT_MS.
+ */
+static client_t *router_client(router_thread_t *rt, uint32_t s, uint64_t deadline) {
+    if (!rt->clients[s]) {
+        pthread_once(&router_once, router_key_init);
+        pthread_setspecific(router_key, rt);
+        if (!(rt->clients[s] = client_connect_tcp(shards[s].host, shards[s].port))) return 0;
+        rt->timeouts[s] = 0;
+    }
+
+    uint32_t timeout = ROUTER_TIMEOUT_MS;
+    if (deadline) {
+        uint64_t now = metrics_now();
+        uint64_t left = deadline > now ? (deadline - now) / 1000000 : 0;
+        // 0 would wait forever
+        if (left < timeout) timeout = left ? (uint32_t) left : 1;
+    }
+    if (timeout != rt->timeouts[s]) {
+        if (!client_set_timeout(rt->clients[s], timeout)) return 0;
+        rt->timeouts[s] = timeout;
+    }
+    return rt->clients[s];
+}
+
+// The connection can't be resynchronized with its unread responses
+static void router_fail(router_thread_t *rt, uint32_t s) {
+    fprintf(stderr, "shard %u at %s:%s failed\n", s, shards[s].host, shards[s].port);
+    client_close(rt->clients[s]);
+    rt->clients[s] = 0;
+    rt->pending[s] = 0;
+    metrics_count(METRICS_ROUTER_SHARD_ERRORS, 1);
+}
+
+static int router_read_slots(client_response_t *response, uint32_t *batch, uint32_t n,
+                             uint64_t *slots_data, uint8_t *slots_lens) {
+    uint32_t pos = 0;
+    if (response->status != PROTO_OK) return 0;
+    for (uint32_t k = 0; k < n; k++) {
+        if (pos >= response->payload_len) return 0;
+        uint8_t slots_len = response->payload[pos++];
+        if (slots_len > MAX_SLOTS_PER_TITLE || response->payload_len - pos < slots_len * 8) return 0;
+        for (uint32_t j = 0; j < slots_len; j++, pos += 8) {
+            slots_data[batch[k] * MAX_SLOTS_PER_TITLE + j] = proto_get_u64(response->payload + pos);
+        }
+        slots_lens[batch[k]] = slots_len;
+    }
+    return pos == response->payload_len;
+}
+
+/*
+ * Sends each shard the hashes it owns, PROTO_PROBE_MAX per request, and then reads
+ * the slots of each hash. Responses come in the order the requests were sent.
+ */
+static int router_probe(router_thread_t *rt, uint64_t *hashes, uint8_t *owners, uint32_t len, uint64_t deadline,
+                        uint64_t *slots_data, uint8_t *slots_lens) {
+    uint64_t probe[PROTO_PROBE_MAX];
+    uint32_t batch[PROTO_PROBE_MAX];
+    uint32_t unread[SHARDS_MAX] = {0};
+    int rc = 1;
+    uint32_t s;
+
+    for (s = 0; s < shards_len && rc; s++) {
+        uint32_t n = 0;
+        client_t *client = 0;
+        for (uint32_t i = 0; i < len && rc; i++) {
+            if (owners[i] == s) probe[n++] = hashes[i];
+            if (n && (n == PROTO_PROBE_MAX || i == len - 1)) {
+                if (!client) client = router_client(rt, s, deadline);
+                if (!client || !client_send_probe(client, probe, n)) rc = 0;
+                unread[s]++;
+                n = 0;
+            }
+        }
+        if (rc && client && !client_flush(client)) rc = 0;
+    }
+
+    for (s = 0; s < shards_len && rc; s++) {
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < len && rc; i++) {
+            if (owners[i] == s) batch[n++] = i;
+            if (n && (n == PROTO_PROBE_MAX || i == len - 1)) {
+                client_response_t response;
+                if (!client_recv_raw(rt->clients[s], &response)) {
+                    // The response may be partly read, so the retry needs a new connection
+                    router_fail(rt, s);
+                    unread[s] = 0;
+                    rc = 0;
+                    break;
+                }
+                if (!router_read_slots(&response, batch, n, slots_data, slots_lens)) {
+                    fprintf(stderr, "malformed probe response from shard %u\n", s);
+                    rc = 0;
+                }
+                unread[s]--;
+                n = 0;
+            }
+        }
+    }
+
+    if (!rc) {
+        for (s = 0; s < shards_len; s++) {
+            if (unread[s]) router_fail(rt, s);
+        }
+    }
+    return rc;
+}
+
+static int router_identifiers(router_thread_t *rt, uint32_t s, uint32_t meta_id, uint64_t deadline,
+                              uint8_t *identifiers, uint32_t identifiers_max_len) {
+    client_t *client = router_client(rt, s, deadline);
+    client_response_t response;
+    if (!client || !client_send_identifiers(client, meta_id) || !client_recv_raw(client, &response)) {
+        router_fail(rt, s);
+        return 0;
+    }
+
+    if (response.status != PROTO_OK || response.payload_len < 2) return 1;
+    uint32_t len = proto_get_u16(response.payload);
+    if (len > response.payload_len - 2) len = response.payload_len - 2;
+    if (len >= identifiers_max_len) len = identifiers_max_len - 1;
+    memcpy(identifiers, response.payload + 2, len);
+    identifiers[len] = 0;
+    return 1;
+}
+
+static inline uint64_t router_trace_start(trace_t *trace) {
+    return trace ? metrics_now() : 0;
+}
+
+static inline void router_trace_stop(trace_t *trace, uint32_t stage, uint64_t start) {
+    if (trace) trace->stage_ns[stage] += metrics_now() - start;
+}
+
+// Returns 0 if a shard couldn't be reached, otherwise sets found like ht_identify returns it
+int router_identify(uint8_t *text, result_t *result, trace_t *trace, uint64_t deadline, uint32_t *found) {
+    router_thread_t *rt = &router_thread;
+    arena_t *arena = arena_local();
+    size_t mark = arena_mark(arena);
+    uint32_t ngrams_max = MAX_LOOKUP_NGRAMS + 5;
+
+    uint8_t *output_text = arena_alloc(arena, MAX_LOOKUP_TEXT_LEN);
+    uint32_t output_text_len = MAX_LOOKUP_TEXT_LEN;
+
+    uint32_t *map = arena_alloc(arena, sizeof(uint32_t) * MAX_LOOKUP_TEXT_LEN);
+    uint32_t map_len = MAX_LOOKUP_TEXT_LEN;
+
+    line_t *lines = arena_alloc(arena, sizeof(line_t) * MAX_LOOKUP_TEXT_LEN);
+    uint32_t lines_len = MAX_LOOKUP_TEXT_LEN;
+
+    line_t *ngrams = arena_alloc(arena, sizeof(line_t) * ngrams_max);
+    uint64_t *hashes = arena_alloc(arena, sizeof(uint64_t) * ngrams_max);
+    uint8_t *owners = arena_alloc(arena, ngrams_max);
+    uint64_t *slots_data = arena_alloc(arena, sizeof(uint64_t) * MAX_SLOTS_PER_TITLE * ngrams_max);
+    uint8_t *slots_lens = arena_alloc(arena, ngrams_max);
+
+    *found = 0;
+    if (!output_text || !map || !lines || !ngrams || !hashes || !owners || !slots_data || !slots_lens) {
+        arena_release(arena, mark);
+        return 0;
+    }
+
+    uint64_t t = router_trace_start(trace);
+    uint32_t processed = text_process_parallel(text, output_text, &output_text_len, map, &map_len, lines, &lines_len);
+    router_trace_stop(trace, TRACE_NORMALIZE, t);
+    // Text that can't be normalized isn't found, the shards weren't needed
+    if (!processed) {
+        arena_release(arena, mark);
+        return 1;
+    }
+
+    uint32_t ngrams_len = ht_ngrams(lines, lines_len, ngrams);
+
+    uint8_t *ngram_texts[TEXT_HASH_LANES];
+    uint32_t ngram_lens[TEXT_HASH_LANES];
+
+    t = router_trace_start(trace);
+    for (uint32_t i = 0; i < ngrams_len; i += TEXT_HASH_LANES) {
+        uint32_t n = ngrams_len - i < TEXT_HASH_LANES ? ngrams_len - i : TEXT_HASH_LANES;
+        for (uint32_t l = 0; l < n; l++) {
+            ngram_texts[l] = output_text + ngrams[i + l].start;
+            ngram_lens[l] = ngrams[i + l].end - ngrams[i + l].start + 1;
+        }
+        text_hash56_batch(ngram_texts, ngram_lens, n, hashes + i);
+        for (uint32_t l = 0; l < n; l++) {
+            owners[i + l] = (uint8_t) shard_of(hashes[i + l], shards_len);
+        }
+    }
+    router_trace_stop(trace, TRACE_HASH, t);
+
+    // A connection may have been closed by a restarted shard, so it's tried once more within the same time
+    t = metrics_now();
+    if (!deadline) deadline = t + (uint64_t) ROUTER_TIMEOUT_MS * 1000000;
+    memset(slots_lens, 0, ngrams_len);
+    int rc = router_probe(rt, hashes, owners, ngrams_len, deadline, slots_data, slots_lens) ||
+             router_probe(rt, hashes, owners, ngrams_len, deadline, slots_data, slots_lens);
+    uint64_t probed = metrics_since(METRICS_ROUTER_PROBE, t);
+    if (trace) trace->stage_ns[TRACE_PROBE] += probed - t;
+
+    uint64_t row_hits = 0, name_hits = 0;
+    uint32_t slots_checked = 0, name_positions = 0;
+
+    for (uint32_t i = 0; i < ngrams_len && rc && !*found; i++) {
+        if (!slots_lens[i]) continue;
+        row_hits++;
+
+        uint32_t id;
+        int32_t name_pos;
+        uint8_t name_len;
+        t = router_trace_start(trace);
+        uint8_t match = ht_match(output_text, output_text_len, ngrams + i, slots_data + i * MAX_SLOTS_PER_TITLE,
+                                 slots_lens[i], &name_pos, &name_len, &id, &slots_checked, &name_positions);
+        router_trace_stop(trace, TRACE_LOCATE, t);
+        if (name_pos >= 0) name_hits++;
+
+        if (match) {
+            t = router_trace_start(trace);
+            ht_extract(text, map, map_len, ngrams + i, name_pos, name_len, result);
+            router_trace_stop(trace, TRACE_EXTRACT, t);
+
+            if (id) {
+                t = router_trace_start(trace);
+                rc = router_identifiers(rt, owners[i], id, deadline, result->identifiers, sizeof(result->identifiers));
+                router_trace_stop(trace, TRACE_FETCH, t);
+            }
+
+            *found = rc;
+        }
+    }
+
+    if (rc) ht_count_lookup((uint8_t) *found, ngrams_len, row_hits, name_hits);
+    if (trace) {
+        trace->lines = lines_len;
+        trace->candidates = ngrams_len;
+        trace->rows_probed = ngrams_len;
+        trace->row_hits = (uint32_t) row_hits;
+        trace->slots_checked = slots_checked;
+        trace->name_positions = name_positions;
+        trace->found = (uint8_t) *found;
+    }
+    arena_release(arena, mark);
+    return rc;
+}
+
+static int router_drain(router_thread_t *rt, uint32_t s, uint32_t keep) {
+    client_response_t response;
+    while (rt->pending[s] > keep) {
+        if (!client_recv(rt->clients[s], &response)) {
+            router_fail(rt, s);
+            return 0;
+        }
+        rt->pending[s]--;
+        if (response.status == PROTO_OK) rt->indexed++;
+        metrics_count(response.status == PROTO_OK ? METRICS_INDEX_INDEXED : METRICS_INDEX_REJECTED, 1);
+    }
+    return 1;
+}
+
+/*
+ * Sends a record to the shard owning its title without waiting for the response,
+ * returns 0 if it can't be indexed. Titles the fingerprint rejects aren't sent.
+ */
+uint32_t router_index(uint8_t *title, uint8_t *name, uint8_t *identifiers) {
+    router_thread_t *rt = &router_thread;
+    uint64_t hash, name_fingerprint;
+
+    if (!title || !name || !ht_fingerprint(title, name, &hash, &name_fingerprint)) {
+        metrics_count(METRICS_INDEX_REJECTED, 1);
+        return 0;
+    }
+
+    uint32_t s = shard_of(hash, shards_len);
+    // The shard stops reading requests while its responses aren't read
+    if (rt->pending[s] >= ROUTER_WINDOW && !router_drain(rt, s, ROUTER_WINDOW / 2)) return 0;
+
+    client_t *client = router_client(rt, s, 0);
+    if (!client || !client_send_index(client, title, name, identifiers ? identifiers : (uint8_t *) "")) {
+        router_fail(rt, s);
+        return 0;
+    }
+    rt->pending[s]++;
+    return 1;
+}
+
+// Waits for the records sent by router_index, returns how many of them the shards indexed
+uint32_t router_index_wait() {
+    router_thread_t *rt = &router_thread;
+    for (uint32_t s = 0; s < shards_len; s++) {
+        if (rt->pending[s]) router_drain(rt, s, 0);
+    }
+
+    uint32_t indexed = rt->indexed;
+    rt->indexed = 0;
+    return indexed;
+}
@@ -0,0 +1,23 @@
+#ifndef TITLE_FINGERPRINT_DB_ROUTER_H
+#define TITLE_FINGERPRINT_DB_ROUTER_H
+
+#include <stdint.h>
+#include "ht.h"
+#include "trace.h"
+
+// Index requests in flight to a shard before the router reads their responses
+#define ROUTER_WINDOW 256
+// Longest wait for the shards, of a lookup without a deadline or of a response to index
+#define ROUTER_TIMEOUT_MS 5000
+
+int router_parse(char *shards);
+
+uint8_t router_enabled();
+
+int router_identify(uint8_t *text, result_t *result, trace_t *trace, uint64_t deadline, uint32_t *found);
+
+uint32_t router_index(uint8_t *title, uint8_t *name, uint8_t *identifiers);
+
+uint32_t router_index_wait();
+
+#endif //TITLE_FINGERPRINT_DB_ROUTER_H
@@ -0,0 +1,183 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Compact encoding of hashtable rows for the hashtable db.
+ *
+ * The first byte is the number of slots, then a bit stream (LSB first) with
+ * field widths, the first hash32, deltas of the hash32 values sorted ascending,
+ * and meta_id, name hash and name length of each slot. Widths are the bits
+ * needed for the largest value in the row, so slots without a meta_id cost nothing
+ * for it. hash32 and name hashes are random, which limits what can be saved,
+ * so rows that wouldn't get smaller are stored raw after a 0 byte.
+ *
+ * Slots come out sorted by hash32, slots with the same hash32 keep their order.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "rowcodec.h"
+
+typedef struct bit_writer {
+    uint8_t *out;
+    uint64_t acc;
+    uint32_t bits;
+} bit_writer_t;
+
+typedef struct bit_reader {
+    uint8_t *p;
+    uint8_t *end;
+    uint64_t acc;
+    uint32_t bits;
+} bit_reader_t;
+
+static inline void bits_put(bit_writer_t *w, uint64_t value, uint32_t width) {
+    if (!width) return;
+    w->acc |= value << w->bits;
+    w->bits += width;
+    while (w->bits >= 8) {
+        *w->out++ = (uint8_t) w->acc;
+        w->acc >>= 8;
+        w->bits -= 8;
+    }
+}
+
+static inline void bits_flush(bit_writer_t *w) {
+    if (w->bits) *w->out++ = (uint8_t) w->acc;
+    w->acc = 0;
+    w->bits = 0;
+}
+
+// Returns 0 if the stream ends early
+static inline uint32_t bits_get(bit_reader_t *r, uint32_t width, uint64_t *value) {
+    while (r->bits < width) {
+        if (r->p == r->end) return 0;
+        r->acc |= ((uint64_t) *r->p++) << r->bits;
+        r->bits += 8;
+    }
+    *value = width ? r->acc & ((1ULL << width) - 1) : 0;
+    if (width) {
+        r->acc >>= width;
+        r->bits -= width;
+    }
+    return 1;
+}
+
+static inline uint32_t bits_width(uint64_t value) {
+    return value ? 64 - (uint32_t) __builtin_clzll(value) : 0;
+}
+
+// Returns the encoded length, out must have room for ROWCODEC_MAX_LEN(slots_len) bytes
+uint32_t rowcodec_encode(slot_t *slots, uint32_t slots_len, uint8_t *out) {
+    slot_t sorted[255];
+    uint32_t hash_width = 0, meta_width = 0, len_width = 0;
+
+    if (!slots_len || slots_len > 255) return 0;
+
+    // Stable insertion sort, rows are short
+    for (uint32_t i = 0; i < slots_len; i++) {
+        slot_t slot = slots[i];
+        uint32_t j = i;
+        while (j > 0 && sorted[j - 1].hash32 > slot.hash32) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = slot;
+    }
+
+    for (uint32_t i = 0; i < slots_len; i++) {
+        uint32_t w;
+        if (i && (w = bits_width(sorted[i].hash32 - sorted[i - 1].hash32)) > hash_width) hash_width = w;
+        if ((w = bits_width(sorted[i].data >> 34)) > meta_width) meta_width = w;
+        if ((w = bits_width(sorted[i].data & 0x3F)) > len_width) len_width = w;
+    }
+
+    uint32_t bits = 14 + 32 + (slots_len - 1) * hash_width + slots_len * (meta_width + 28 + len_width);
+    uint32_t len = 1 + (bits + 7) / 8;
+
+    if (len >= 1 + sizeof(slot_t) * slots_len) {
+        out[0] = 0;
+        memcpy(out + 1, slots, sizeof(slot_t) * slots_len);
+        return 1 + sizeof(slot_t) * slots_len;
+    }
+
+    out[0] = (uint8_t) slots_len;
+    bit_writer_t w = {out + 1, 0, 0};
+    bits_put(&w, hash_width, 6);
+    bits_put(&w, meta_width, 5);
+    bits_put(&w, len_width, 3);
+    bits_put(&w, sorted[0].hash32, 32);
+    for (uint32_t i = 1; i < slots_len; i++) {
+        bits_put(&w, sorted[i].hash32 - sorted[i - 1].hash32, hash_width);
+    }
+    for (uint32_t i = 0; i < slots_len; i++) {
+        bits_put(&w, sorted[i].data >> 34, meta_width);
+        bits_put(&w, (sorted[i].data >> 6) & 0xFFFFFFF, 28);
+        bits_put(&w, sorted[i].data & 0x3F, len_width);
+    }
+    bits_flush(&w);
+    return len;
+}
+
+// Returns the number of slots in an encoded row, or 0 if it's malformed
+uint32_t rowcodec_count(uint8_t *data, uint32_t data_len) {
+    if (!data_len) return 0;
+    if (data[0]) return data[0];
+    if ((data_len - 1) % sizeof(slot_t)) return 0;
+    return (data_len - 1) / sizeof(slot_t);
+}
+
+// Returns the number of decoded slots, or 0 if the row is malformed or has more than slots_max slots
+uint32_t rowcodec_decode(uint8_t *data, uint32_t data_len, slot_t *slots, uint32_t slots_max) {
+    uint32_t slots_len = rowcodec_count(data, data_len);
+    if (!slots_len || slots_len > slots_max) return 0;
+
+    if (!data[0]) {
+        memcpy(slots, data + 1, sizeof(slot_t) * slots_len);
+        return slots_len;
+    }
+
+    bit_reader_t r = {data + 1, data + data_len, 0, 0};
+    uint64_t hash_width, meta_width, len_width, value;
+    if (!bits_get(&r, 6, &hash_width) || !bits_get(&r, 5, &meta_width) || !bits_get(&r, 3, &len_width)
+        || hash_width > 32 || meta_width > 30 || len_width > 6) {
+        return 0;
+    }
+
+    if (!bits_get(&r, 32, &value)) return 0;
+    slots[0].hash32 = (uint32_t) value;
+    for (uint32_t i = 1; i < slots_len; i++) {
+        if (!bits_get(&r, (uint32_t) hash_width, &value)) return 0;
+        slots[i].hash32 = slots[i - 1].hash32 + (uint32_t) value;
+    }
+
+    for (uint32_t i = 0; i < slots_len; i++) {
+        uint64_t meta_id, name_hash28, name_len;
+        if (!bits_get(&r, (uint32_t) meta_width, &meta_id) || !bits_get(&r, 28, &name_hash28)
+            || !bits_get(&r, (uint32_t) len_width, &name_len)) {
+            return 0;
+        }
+        slots[i].data = (meta_id << 34) | (name_hash28 << 6) | name_len;
+    }
+    return slots_len;
+}
@@ -0,0 +1,20 @@
+#ifndef TITLE_FINGERPRINT_DB_ROWCODEC_H
+#define TITLE_FINGERPRINT_DB_ROWCODEC_H
+
+#include <stdint.h>
+#include "ht.h"
+
+// Format of rows in the hashtable db, stored as its user_version
+#define ROWCODEC_FORMAT_RAW 0
+#define ROWCODEC_FORMAT_PACKED 1
+
+// Encoded rows never take more than the raw slots and a count byte
+#define ROWCODEC_MAX_LEN(slots_len) (1 + sizeof(slot_t) * (slots_len))
+
+uint32_t rowcodec_encode(slot_t *slots, uint32_t slots_len, uint8_t *out);
+
+uint32_t rowcodec_count(uint8_t *data, uint32_t data_len);
+
+uint32_t rowcodec_decode(uint8_t *data, uint32_t data_len, slot_t *slots, uint32_t slots_max);
+
+#endif //TITLE_FINGERPRINT_DB_ROWCODEC_H
@@ -0,0 +1,73 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Hash-range sharding. The hash24 row space is split into equal ranges, and a shard
+ * only indexes titles whose hash falls in its range, so each process holds a part of
+ * the rows and identifiers. Lookups go through a router (see router.c), which knows
+ * all shards in order and probes each one only for the hashes it owns.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "ht.h"
+#include "shard.h"
+
+// A single shard owns all rows
+uint32_t shard_index = 0;
+uint32_t shard_count = 1;
+
+// Parses index/count, e.g. 0/4 for the first of four shards
+int shard_parse(char *str) {
+    char *end;
+    unsigned long index = strtoul(str, &end, 10);
+    if (end == str || *end != '/') {
+        fprintf(stderr, "invalid shard: %s\n", str);
+        return 0;
+    }
+
+    char *count_str = end + 1;
+    unsigned long count = strtoul(count_str, &end, 10);
+    if (end == count_str || *end || !count || count > SHARDS_MAX || index >= count) {
+        fprintf(stderr, "invalid shard: %s\n", str);
+        return 0;
+    }
+
+    shard_index = (uint32_t) index;
+    shard_count = (uint32_t) count;
+    return 1;
+}
+
+uint32_t shard_of(uint64_t hash, uint32_t count) {
+    return (uint32_t) (((hash >> 32) * count) / HASHTABLE_SIZE);
+}
+
+uint8_t shard_owns(uint64_t hash) {
+    return shard_of(hash, shard_count) == shard_index;
+}
+
+void shard_range(uint32_t index, uint32_t count, uint32_t *row_start, uint32_t *row_end) {
+    *row_start = (uint32_t) (((uint64_t) HASHTABLE_SIZE * index + count - 1) / count);
+    *row_end = (uint32_t) (((uint64_t) HASHTABLE_SIZE * (index + 1) + count - 1) / count);
+}
@@ -0,0 +1,20 @@
+#ifndef TITLE_FINGERPRINT_DB_SHARD_H
+#define TITLE_FINGERPRINT_DB_SHARD_H
+
+#include <stdint.h>
+
+// Shard i of n owns rows [ceil(i * HASHTABLE_SIZE / n), ceil((i + 1) * HASHTABLE_SIZE / n)) of the hash24 space
+#define SHARDS_MAX 64
+
+extern uint32_t shard_index;
+extern uint32_t shard_count;
+
+int shard_parse(char *str);
+
+uint32_t shard_of(uint64_t hash, uint32_t count);
+
+uint8_t shard_owns(uint64_t hash);
+
+void shard_range(uint32_t index, uint32_t count, uint32_t *row_start, uint32_t *row_end);
+
+#endif //TITLE_FINGERPRINT_DB_SHARD_H
@@ -20,6 +20,9 @@
  ***** END LICENSE BLOCK *****
  */
 
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <jemalloc/jemalloc.h>
 #include <unicode/ustdio.h>
 #include <unicode/ustring.h>
@@ -31,24 +34,59 @@
 #include "text.h"
 
 UNormalizer2 *unorm2;
+uint32_t text_threads = 1;
+
+static uint32_t text_pool_start();
 
 uint32_t text_init() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    text_threads = cpus > TEXT_PARALLEL_MAX_THREADS ? TEXT_PARALLEL_MAX_THREADS : (cpus > 0 ? (uint32_t) cpus : 1);
+
     UErrorCode status = U_ZERO_ERROR;
     unorm2 = unorm2_getNFKDInstance(&status);
     if (status != U_ZERO_ERROR) {
         fprintf(stderr, "unorm2_getNFKDInstance failed, error=%s\n", u_errorName(status));
         return 0;
     }
-    return 1;
+    return text_pool_start();
 }
 
-uint32_t text_process(uint8_t *text, uint8_t *output_text, uint32_t *output_text_len,
-                      uint32_t *map, uint32_t *map_len, line_t *lines, uint32_t *lines_len) {
+// A code point takes 1-4 UTF-8 bytes, so its map entries are written without a loop
+static inline void text_map_fill(uint32_t *map, uint32_t map_len, uint32_t end, uint32_t si) {
+    uint32_t *p = map + map_len;
+    switch (end - map_len) {
+        case 4:
+            p[3] = si;
+            // fallthrough
+        case 3:
+            p[2] = si;
+            // fallthrough
+        case 2:
+            p[1] = si;
+            // fallthrough
+        case 1:
+            p[0] = si;
+    }
+}
+
+/*
+ * Normalizes text (NUL-terminated if text_len is -1) and, when "track" is set, also fills the output-to-input offset map
+ * and the line ranges. It is always inlined with a constant "track",
+ * so text_normalize and text_process each get a loop without the unused bookkeeping.
+ */
+static inline __attribute__((always_inline))
+uint32_t text_process_generic(uint8_t *text, int32_t text_len, uint8_t *output_text, uint32_t *output_text_len,
+                              uint32_t *map, uint32_t *map_len, line_t *lines, uint32_t *lines_len,
+                              const uint8_t track, uint8_t *truncated) {
     UErrorCode status = U_ZERO_ERROR;
     int32_t max_output_text_len = *output_text_len - 1;
     *output_text_len = 0;
-    if(map) *map_len = 0;
-    if(lines) *lines_len = 0;
+    if (track) {
+        *map_len = 0;
+        *lines_len = 0;
+    }
+    uint32_t map_offset = 0;
+    uint32_t lines_offset = 0;
     int32_t output_text_offset = 0;
     UChar uc[16] = {0};
 
@@ -66,14 +104,14 @@ uint32_t text_process(uint8_t *text, uint8_t *output_text, uint32_t *output_text
 
         si = i;
 
-        U8_NEXT(text, i, -1, ci);
+        U8_NEXT(text, i, text_len, ci);
         //printf("%C\n", ci);
         if (u_isUAlphabetic(ci)) {
 
-            if(lines) {
+            if (track) {
                 if (prev_new) {
-                    lines[*lines_len].start = output_text_offset;
-                    (*lines_len)++;
+                    lines[lines_offset].start = output_text_offset;
+                    lines_offset++;
                 }
                 prev_new = 0;
             }
@@ -110,10 +148,9 @@ uint32_t text_process(uint8_t *text, uint8_t *output_text, uint32_t *output_text
                         U8_APPEND(output_text, output_text_offset, max_output_text_len, cj, error);
                         if (error) break;
 
-                        if(map) {
-                            while (*map_len < output_text_offset) {
-                                map[(*map_len)++] = si;
-                            }
+                        if (track) {
+                            text_map_fill(map, map_offset, output_text_offset, si);
+                            map_offset = output_text_offset;
                         }
                     }
                 } while (cj > 0);
@@ -124,34 +161,300 @@ uint32_t text_process(uint8_t *text, uint8_t *output_text, uint32_t *output_text
                 U8_APPEND(output_text, output_text_offset, max_output_text_len, ci, error);
                 if (error) break;
 
-                if(map) {
-                    while (*map_len < output_text_offset) {
-                        map[(*map_len)++] = si;
-                    }
+                if (track) {
+                    text_map_fill(map, map_offset, output_text_offset, si);
+                    map_offset = output_text_offset;
                 }
             }
-        } else if (u_getIntPropertyValue(ci, UCHAR_LINE_BREAK) == U_LB_LINE_FEED) {
-            if(lines) {
-                if (!prev_new) {
-                    lines[(*lines_len) - 1].end = output_text_offset - 1;
-                }
-                prev_new = 1;
+        } else if (track && u_getIntPropertyValue(ci, UCHAR_LINE_BREAK) == U_LB_LINE_FEED) {
+            if (!prev_new) {
+                lines[lines_offset - 1].end = output_text_offset - 1;
             }
+            prev_new = 1;
         }
-    } while (ci > 0);
+    } while (ci > 0 && i != text_len);
 
     output_text[output_text_offset] = 0;
     *output_text_len = output_text_offset;
 
-    if(lines) {
+    // Output was cut short by the output buffer or an invalid byte sequence
+    if (truncated) *truncated = error || ci < 0;
+
+    if (track) {
         if (!prev_new) {
-            lines[(*lines_len) - 1].end = *output_text_len - 1;
+            lines[lines_offset - 1].end = *output_text_len - 1;
         }
+        *map_len = map_offset;
+        *lines_len = lines_offset;
     }
 
     return 1;
 }
 
+uint32_t text_normalize(uint8_t *text, uint8_t *output_text, uint32_t *output_text_len) {
+    return text_process_generic(text, -1, output_text, output_text_len, 0, 0, 0, 0, 0, 0);
+}
+
+uint32_t text_process(uint8_t *text, uint8_t *output_text, uint32_t *output_text_len,
+                      uint32_t *map, uint32_t *map_len, line_t *lines, uint32_t *lines_len) {
+    return text_process_generic(text, -1, output_text, output_text_len, map, map_len, lines, lines_len, 1, 0);
+}
+
+typedef struct text_chunk {
+    uint8_t *text;
+    uint32_t text_len;
+    uint8_t *output_text;
+    uint32_t output_text_len;
+    uint32_t *map;
+    uint32_t map_len;
+    line_t *lines;
+    uint32_t lines_len;
+    uint8_t truncated;
+    uint32_t rc;
+} text_chunk_t;
+
+static void text_chunk_process(text_chunk_t *chunk) {
+    chunk->rc = text_process_generic(chunk->text, chunk->text_len,
+                                     chunk->output_text, &chunk->output_text_len,
+                                     chunk->map, &chunk->map_len, chunk->lines, &chunk->lines_len,
+                                     1, &chunk->truncated);
+}
+
+/*
+ * Worker threads are started once by text_init and take chunks of the current job.
+ * Only one text is processed by the pool at a time, concurrent callers process their text on their own thread.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    text_chunk_t *chunks;
+    uint32_t chunks_len;
+    uint32_t next;
+    uint32_t finished;
+    uint8_t busy;
+    // Output, map and lines of each chunk, TEXT_CHUNK_SIZE of each per thread, used by the caller holding busy
+    uint8_t *buf;
+} text_pool = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .work = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+        .chunks = 0,
+        .chunks_len = 0,
+        .next = 0,
+        .finished = 0,
+        .busy = 0,
+        .buf = 0
+};
+
+// NFKD can expand text, a chunk that doesn't fit is processed again sequentially
+#define TEXT_CHUNK_SIZE (TEXT_PARALLEL_ROUND_LEN * 2 + 16)
+
+static void *text_pool_thread(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&text_pool.mutex);
+    while (1) {
+        while (text_pool.next >= text_pool.chunks_len) pthread_cond_wait(&text_pool.work, &text_pool.mutex);
+
+        text_chunk_t *chunk = &text_pool.chunks[text_pool.next++];
+        pthread_mutex_unlock(&text_pool.mutex);
+        text_chunk_process(chunk);
+        pthread_mutex_lock(&text_pool.mutex);
+
+        if (++text_pool.finished == text_pool.chunks_len) pthread_cond_signal(&text_pool.done);
+    }
+    return 0;
+}
+
+static uint32_t text_pool_acquire() {
+    pthread_mutex_lock(&text_pool.mutex);
+    uint8_t busy = text_pool.busy;
+    text_pool.busy = 1;
+    pthread_mutex_unlock(&text_pool.mutex);
+    return !busy;
+}
+
+static void text_pool_release() {
+    pthread_mutex_lock(&text_pool.mutex);
+    text_pool.busy = 0;
+    pthread_mutex_unlock(&text_pool.mutex);
+}
+
+// Processes all chunks on the pool threads and the calling thread
+static void text_pool_run(text_chunk_t *chunks, uint32_t chunks_len) {
+    pthread_mutex_lock(&text_pool.mutex);
+    text_pool.chunks = chunks;
+    text_pool.chunks_len = chunks_len;
+    text_pool.next = 0;
+    text_pool.finished = 0;
+    pthread_cond_broadcast(&text_pool.work);
+
+    while (text_pool.next < text_pool.chunks_len) {
+        text_chunk_t *chunk = &text_pool.chunks[text_pool.next++];
+        pthread_mutex_unlock(&text_pool.mutex);
+        text_chunk_process(chunk);
+        pthread_mutex_lock(&text_pool.mutex);
+        text_pool.finished++;
+    }
+
+    while (text_pool.finished < text_pool.chunks_len) pthread_cond_wait(&text_pool.done, &text_pool.mutex);
+
+    text_pool.chunks = 0;
+    text_pool.chunks_len = 0;
+    text_pool.next = 0;
+    pthread_mutex_unlock(&text_pool.mutex);
+}
+
+static uint32_t text_pool_start() {
+    static uint8_t started = 0;
+    if (started) return 1;
+    started = 1;
+
+    if (text_threads < 2) return 1;
+    if (!(text_pool.buf = malloc((sizeof(uint8_t) + sizeof(uint32_t) + sizeof(line_t)) * TEXT_CHUNK_SIZE *
+                                 text_threads))) {
+        fprintf(stderr, "chunk malloc failed, text is processed sequentially\n");
+        text_threads = 1;
+        return 1;
+    }
+
+    for (uint32_t i = 1; i < text_threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, text_pool_thread, 0)) {
+            fprintf(stderr, "pthread_create failed\n");
+            text_threads = i;
+            break;
+        }
+        pthread_detach(thread);
+    }
+    return 1;
+}
+
+/*
+ * Splits text after line feeds into chunks and processes them on the thread pool.
+ * Each chunk starts right after a line feed, which is the same state text_process is in at that point,
+ * so stitching chunk outputs together with shifted offsets gives exactly the sequential result.
+ * Input is read in rounds of about as many bytes as the output buffer still has room for, at most TEXT_PARALLEL_ROUND_LEN.
+ * The first chunk that would not fit or is cut short (invalid UTF-8) is processed again sequentially
+ * from its start with the remaining output buffer, so truncation happens at the same place as in text_process.
+ */
+uint32_t text_process_parallel(uint8_t *text, uint8_t *output_text, uint32_t *output_text_len,
+                               uint32_t *map, uint32_t *map_len, line_t *lines, uint32_t *lines_len) {
+    uint32_t max_output_text_len = *output_text_len - 1;
+
+    // The output buffer also caps how much input the first round reads
+    uint32_t round_len = (uint32_t) strnlen((char *) text, max_output_text_len);
+    if (text_threads < 2 || round_len < TEXT_PARALLEL_MIN_LEN || !text_pool_acquire()) {
+        return text_process(text, output_text, output_text_len, map, map_len, lines, lines_len);
+    }
+
+    text_chunk_t chunks[TEXT_PARALLEL_MAX_THREADS] = {0};
+    uint32_t chunks_size = TEXT_CHUNK_SIZE;
+    uint8_t *buf = text_pool.buf;
+    if (round_len > TEXT_PARALLEL_ROUND_LEN) round_len = TEXT_PARALLEL_ROUND_LEN;
+
+    uint32_t output_text_offset = 0;
+    uint32_t start = 0;
+    uint32_t rc = 1;
+    uint8_t done = 0;
+    *map_len = 0;
+    *lines_len = 0;
+
+    while (!done) {
+        uint32_t chunks_len = 0;
+        while (chunks_len < text_threads && text[start]) {
+            uint32_t chunk_len = round_len / text_threads;
+            if (chunk_len < 1) chunk_len = 1;
+            uint32_t end = start + (uint32_t) strnlen((char *) text + start, chunk_len);
+            // Chunks end after a line feed, the last one of a round possibly beyond round_len
+            while (text[end] && text[end - 1] != '\n') end++;
+
+            text_chunk_t *chunk = &chunks[chunks_len];
+            chunk->text = text + start;
+            chunk->text_len = end - start;
+            chunk->output_text_len = chunks_size;
+            chunk->output_text = buf + chunks_len * chunks_size;
+            chunk->map = (uint32_t *) (buf + text_threads * chunks_size) + chunks_len * chunks_size;
+            chunk->lines = (line_t *) (buf + (sizeof(uint8_t) + sizeof(uint32_t)) * text_threads * chunks_size) +
+                           chunks_len * chunks_size;
+            chunks_len++;
+
+            start = end;
+            if (chunks_len * chunk_len >= round_len) break;
+        }
+
+        if (!chunks_len) break;
+        text_pool_run(chunks, chunks_len);
+
+        for (uint32_t i = 0; i < chunks_len && !done; i++) {
+            text_chunk_t *chunk = &chunks[i];
+
+            if (!chunk->rc) {
+                rc = 0;
+                done = 1;
+                break;
+            }
+
+            if (chunk->truncated || output_text_offset + chunk->output_text_len > max_output_text_len) {
+                // Same as the sequential run from this line start on, with what is left of the output buffer
+                uint32_t tail_output_text_len = max_output_text_len + 1 - output_text_offset;
+                uint32_t tail_map_len = 0;
+                uint32_t tail_lines_len = 0;
+                if (!text_process(chunk->text, output_text + output_text_offset, &tail_output_text_len,
+                                  map + *map_len, &tail_map_len, lines + *lines_len, &tail_lines_len)) {
+                    rc = 0;
+                    done = 1;
+                    break;
+                }
+
+                uint32_t text_offset = (uint32_t) (chunk->text - text);
+                for (uint32_t j = 0; j < tail_map_len; j++) map[*map_len + j] += text_offset;
+                for (uint32_t j = 0; j < tail_lines_len; j++) {
+                    lines[*lines_len + j].start += output_text_offset;
+                    lines[*lines_len + j].end += output_text_offset;
+                }
+                *map_len += tail_map_len;
+                *lines_len += tail_lines_len;
+                output_text_offset += tail_output_text_len;
+                done = 1;
+                break;
+            }
+
+            memcpy(output_text + output_text_offset, chunk->output_text, chunk->output_text_len);
+
+            uint32_t text_offset = (uint32_t) (chunk->text - text);
+            for (uint32_t j = 0; j < chunk->map_len; j++) {
+                map[(*map_len)++] = chunk->map[j] + text_offset;
+            }
+
+            for (uint32_t j = 0; j < chunk->lines_len; j++) {
+                lines[*lines_len].start = chunk->lines[j].start + output_text_offset;
+                lines[*lines_len].end = chunk->lines[j].end + output_text_offset;
+                (*lines_len)++;
+            }
+
+            output_text_offset += chunk->output_text_len;
+        }
+
+        if (done || !text[start] || output_text_offset >= max_output_text_len) break;
+
+        // The next round reads about as much input as the output buffer still has room for
+        round_len = (uint32_t) strnlen((char *) text + start, max_output_text_len - output_text_offset);
+        if (round_len > TEXT_PARALLEL_ROUND_LEN) round_len = TEXT_PARALLEL_ROUND_LEN;
+        if (!round_len) round_len = 1;
+    }
+
+    text_pool_release();
+
+    if (!rc) {
+        return text_process(text, output_text, output_text_len, map, map_len, lines, lines_len);
+    }
+
+    output_text[output_text_offset] = 0;
+    *output_text_len = output_text_offset;
+    return 1;
+}
+
 uint32_t text_process_name(uint8_t *text, uint8_t *output_text, uint32_t *output_text_len) {
     UErrorCode status = U_ZERO_ERROR;
     int32_t max_output_text_len = *output_text_len - 1;
@@ -241,6 +544,255 @@ uint64_t text_hash56(uint8_t *text, uint32_t text_len) {
     return (XXH64_digest(&state64)) >> 8;
 }
 
+/*
+ * Multi-lane XXH64. Hashes TEXT_HASH_LANES independent texts in lockstep so that
+ * the multiply-rotate chains of different lanes overlap, which either vectorizes
+ * (on targets with 64-bit vector multiplies) or keeps scalar multipliers busy.
+ * Results are bit-identical to XXH64 with seed 0, so they can replace
+ * text_hash28 and text_hash56 calls.
+ */
+
+#define LANES_PRIME64_1 11400714785074694791ULL
+#define LANES_PRIME64_2 14029467366897019727ULL
+#define LANES_PRIME64_3 1609587929392839161ULL
+#define LANES_PRIME64_4 9650029242287828579ULL
+#define LANES_PRIME64_5 2870177450012600261ULL
+
+#define LANES_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t lanes_round(uint64_t acc, uint64_t input) {
+    acc += input * LANES_PRIME64_2;
+    acc = LANES_ROTL(acc, 31);
+    acc *= LANES_PRIME64_1;
+    return acc;
+}
+
+static inline uint64_t lanes_merge_round(uint64_t acc, uint64_t val) {
+    val = lanes_round(0, val);
+    acc ^= val;
+    acc = acc * LANES_PRIME64_1 + LANES_PRIME64_4;
+    return acc;
+}
+
+static inline uint64_t lanes_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t lanes_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+// Finishes a single lane from the state left by the stripe loop
+static inline uint64_t lanes_finish(uint8_t *p, uint8_t *end, uint64_t len,
+                                    uint64_t v1, uint64_t v2, uint64_t v3, uint64_t v4) {
+    uint64_t h;
+
+    while (p + 32 <= end) {
+        v1 = lanes_round(v1, lanes_read64(p));
+        v2 = lanes_round(v2, lanes_read64(p + 8));
+        v3 = lanes_round(v3, lanes_read64(p + 16));
+        v4 = lanes_round(v4, lanes_read64(p + 24));
+        p += 32;
+    }
+
+    if (len >= 32) {
+        h = LANES_ROTL(v1, 1) + LANES_ROTL(v2, 7) + LANES_ROTL(v3, 12) + LANES_ROTL(v4, 18);
+        h = lanes_merge_round(h, v1);
+        h = lanes_merge_round(h, v2);
+        h = lanes_merge_round(h, v3);
+        h = lanes_merge_round(h, v4);
+    } else {
+        h = LANES_PRIME64_5;
+    }
+
+    h += len;
+
+    while (p + 8 <= end) {
+        h ^= lanes_round(0, lanes_read64(p));
+        h = LANES_ROTL(h, 27) * LANES_PRIME64_1 + LANES_PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (uint64_t) lanes_read32(p) * LANES_PRIME64_1;
+        h = LANES_ROTL(h, 23) * LANES_PRIME64_2 + LANES_PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h ^= (*p) * LANES_PRIME64_5;
+        h = LANES_ROTL(h, 11) * LANES_PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= LANES_PRIME64_2;
+    h ^= h >> 29;
+    h *= LANES_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Hashes texts that all have the same length, every step runs on all lanes
+static void text_hash64_lanes_fixed(uint8_t **texts, uint32_t text_len, uint64_t *hashes) {
+    uint64_t h[TEXT_HASH_LANES];
+    uint32_t offset = 0;
+
+    if (text_len >= 32) {
+        uint64_t v1[TEXT_HASH_LANES], v2[TEXT_HASH_LANES], v3[TEXT_HASH_LANES], v4[TEXT_HASH_LANES];
+        for (uint32_t l = 0; l < TEXT_HASH_LANES; l++) {
+            v1[l] = LANES_PRIME64_1 + LANES_PRIME64_2;
+            v2[l] = LANES_PRIME64_2;
+            v3[l] = 0;
+            v4[l] = -LANES_PRIME64_1;
+        }
+
+        for (; offset + 32 <= text_len; offset += 32) {
+            for (uint32_t l = 0; l < TEXT_HASH_LANES; l++) {
+                uint8_t *p = texts[l] + offset;
+                v1[l] = lanes_round(v1[l], lanes_read64(p));
+                v2[l] = lanes_round(v2[l], lanes_read64(p + 8));
+                v3[l] = lanes_round(v3[l], lanes_read64(p + 16));
+                v4[l] = lanes_round(v4[l], lanes_read64(p + 24));
+            }
+        }
+
+        for (uint32_t l = 0; l < TEXT_HASH_LANES; l++) {
+            h[l] = LANES_ROTL(v1[l], 1) + LANES_ROTL(v2[l], 7) + LANES_ROTL(v3[l], 12) + LANES_ROTL(v4[l], 18);
+            h[l] = lanes_merge_round(h[l], v1[l]);
+            h[l] = lanes_merge_round(h[l], v2[l]);
+            h[l] = lanes_merge_round(h[l], v3[l]);
+            h[l] = lanes_merge_round(h[l], v4[l]);
+        }
+    } else {
+        for (uint32_t l = 0; l < TEXT_HASH_LANES; l++) h[l] = LANES_PRIME64_5;
+    }
+
+    for (uint32_t l = 0; l < TEXT_HASH_LANES; l++) h[l] += text_len;
+
+    for (; offset + 8 <= text_len; offset += 8) {
+        for (uint32_t l = 0; l < TEXT_HASH_LANES; l++) {
+            h[l] ^= lanes_round(0, lanes_read64(texts[l] + offset));
+            h[l] = LANES_ROTL(h[l], 27) * LANES_PRIME64_1 + LANES_PRIME64_4;
+        }
+    }
+
+    if (offset + 4 <= text_len) {
+        for (uint32_t l = 0; l < TEXT_HASH_LANES; l++) {
+            h[l] ^= (uint64_t) lanes_read32(texts[l] + offset) * LANES_PRIME64_1;
+            h[l] = LANES_ROTL(h[l], 23) * LANES_PRIME64_2 + LANES_PRIME64_3;
+        }
+        offset += 4;
+    }
+
+    for (; offset < text_len; offset++) {
+        for (uint32_t l = 0; l < TEXT_HASH_LANES; l++) {
+            h[l] ^= texts[l][offset] * LANES_PRIME64_5;
+            h[l] = LANES_ROTL(h[l], 11) * LANES_PRIME64_1;
+        }
+    }
+
+    for (uint32_t l = 0; l < TEXT_HASH_LANES; l++) {
+        h[l] ^= h[l] >> 33;
+        h[l] *= LANES_PRIME64_2;
+        h[l] ^= h[l] >> 29;
+        h[l] *= LANES_PRIME64_3;
+        h[l] ^= h[l] >> 32;
+        hashes[l] = h[l];
+    }
+}
+
+/*
+ * Hashes texts of different lengths. Stripes that all lanes have are processed
+ * in lockstep, then each lane finishes its own remainder.
+ */
+static void text_hash64_lanes(uint8_t **texts, uint32_t *text_lens, uint64_t *hashes) {
+    uint32_t min_len = text_lens[0];
+    uint32_t max_len = text_lens[0];
+    for (uint32_t l = 1; l < TEXT_HASH_LANES; l++) {
+        if (text_lens[l] < min_len) min_len = text_lens[l];
+        if (text_lens[l] > max_len) max_len = text_lens[l];
+    }
+
+    if (min_len == max_len) {
+        text_hash64_lanes_fixed(texts, min_len, hashes);
+        return;
+    }
+
+    uint64_t v1[TEXT_HASH_LANES], v2[TEXT_HASH_LANES], v3[TEXT_HASH_LANES], v4[TEXT_HASH_LANES];
+    for (uint32_t l = 0; l < TEXT_HASH_LANES; l++) {
+        v1[l] = LANES_PRIME64_1 + LANES_PRIME64_2;
+        v2[l] = LANES_PRIME64_2;
+        v3[l] = 0;
+        v4[l] = -LANES_PRIME64_1;
+    }
+
+    uint32_t offset = 0;
+    for (; offset + 32 <= min_len; offset += 32) {
+        for (uint32_t l = 0; l < TEXT_HASH_LANES; l++) {
+            uint8_t *p = texts[l] + offset;
+            v1[l] = lanes_round(v1[l], lanes_read64(p));
+            v2[l] = lanes_round(v2[l], lanes_read64(p + 8));
+            v3[l] = lanes_round(v3[l], lanes_read64(p + 16));
+            v4[l] = lanes_round(v4[l], lanes_read64(p + 24));
+        }
+    }
+
+    for (uint32_t l = 0; l < TEXT_HASH_LANES; l++) {
+        hashes[l] = lanes_finish(texts[l] + offset, texts[l] + text_lens[l], text_lens[l],
+                                 v1[l], v2[l], v3[l], v4[l]);
+    }
+}
+
+// Hashes n texts TEXT_HASH_LANES at a time, the last group is padded by repeating the last text
+static void text_hash64_batch(uint8_t **texts, uint32_t *text_lens, uint32_t n, uint64_t *hashes) {
+    uint32_t i = 0;
+    for (; i + TEXT_HASH_LANES <= n; i += TEXT_HASH_LANES) {
+        text_hash64_lanes(texts + i, text_lens + i, hashes + i);
+    }
+
+    if (i < n) {
+        uint8_t *lane_texts[TEXT_HASH_LANES];
+        uint32_t lane_text_lens[TEXT_HASH_LANES];
+        uint64_t lane_hashes[TEXT_HASH_LANES];
+        for (uint32_t l = 0; l < TEXT_HASH_LANES; l++) {
+            uint32_t k = i + l < n ? i + l : n - 1;
+            lane_texts[l] = texts[k];
+            lane_text_lens[l] = text_lens[k];
+        }
+        text_hash64_lanes(lane_texts, lane_text_lens, lane_hashes);
+        memcpy(hashes + i, lane_hashes, (n - i) * sizeof(uint64_t));
+    }
+}
+
+void text_hash28_batch(uint8_t **texts, uint32_t *text_lens, uint32_t n, uint32_t *hashes) {
+    uint64_t hashes64[TEXT_HASH_LANES];
+    for (uint32_t i = 0; i < n; i += TEXT_HASH_LANES) {
+        uint32_t m = n - i < TEXT_HASH_LANES ? n - i : TEXT_HASH_LANES;
+        text_hash64_batch(texts + i, text_lens + i, m, hashes64);
+        for (uint32_t l = 0; l < m; l++) {
+            hashes[i + l] = (uint32_t) (hashes64[l] & 0xFFFFFFF);
+        }
+    }
+}
+
+void text_hash56_batch(uint8_t **texts, uint32_t *text_lens, uint32_t n, uint64_t *hashes) {
+    text_hash64_batch(texts, text_lens, n, hashes);
+    for (uint32_t i = 0; i < n; i++) {
+        hashes[i] >>= 8;
+    }
+}
+
 uint32_t text_original_str(uint8_t *text, uint32_t *map, uint32_t map_len,
                            uint32_t start, uint32_t end, uint8_t *str, uint32_t str_len_max) {
     uint32_t original_start = map[start];
@@ -1,6 +1,15 @@
 #ifndef TITLE_FINGERPRINT_DB_TEXT_H
 #define TITLE_FINGERPRINT_DB_TEXT_H
 
+// Number of texts hashed in parallel by text_hash28_batch and text_hash56_batch
+#define TEXT_HASH_LANES 4
+
+// Lookups that read less input than this (at most the output buffer size) stay on the calling thread
+#define TEXT_PARALLEL_MIN_LEN 2048
+#define TEXT_PARALLEL_MAX_THREADS 8
+// Input bytes split into chunks per round, sizes the chunk buffers allocated once by text_init
+#define TEXT_PARALLEL_ROUND_LEN 4096
+
 typedef struct token {
     uint32_t start;
     uint32_t len;
@@ -14,15 +23,27 @@ typedef struct line {
 
 uint32_t text_init();
 
+// Normalizes text for fingerprinting, used at index time
+uint32_t text_normalize(uint8_t *text, uint8_t *output_text, uint32_t *output_text_len);
+
+// Normalizes text and also returns the offset map to the original text and line ranges, used at lookup time
 uint32_t text_process(uint8_t *text, uint8_t *output_text, uint32_t *output_text_len,
                    uint32_t *map, uint32_t *map_len, line_t *lines, uint32_t *lines_len);
 
+// Same result as text_process, but the input is split at line feeds and processed on the text thread pool
+uint32_t text_process_parallel(uint8_t *text, uint8_t *output_text, uint32_t *output_text_len,
+                               uint32_t *map, uint32_t *map_len, line_t *lines, uint32_t *lines_len);
+
 uint32_t text_process_name(uint8_t *text, uint8_t *output_text, uint32_t *output_text_len);
 
 uint32_t text_hash28(uint8_t *text, uint32_t text_len);
 
 uint64_t text_hash56(uint8_t *text, uint32_t text_len);
 
+void text_hash28_batch(uint8_t **texts, uint32_t *text_lens, uint32_t n, uint32_t *hashes);
+
+void text_hash56_batch(uint8_t **texts, uint32_t *text_lens, uint32_t n, uint64_t *hashes);
+
 uint32_t text_original_str(uint8_t *text, uint32_t *map, uint32_t map_len,
                            uint32_t start, uint32_t end, uint8_t *str, uint32_t str_len_max);
 
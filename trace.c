@@ -0,0 +1,97 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2017 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ * Per-stage breakdown of identify requests. A trace is filled by ht_identify when the client
+ * asks for it with "debug": true, or for a sample of requests when the slow request log is on.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "trace.h"
+
+trace_policy_t trace_policy = {
+        TRACE_SLOW_MS,
+        TRACE_SAMPLE
+};
+
+const char *trace_stage_names[TRACE_STAGES] = {
+        "normalize",
+        "hash",
+        "probe",
+        "locate",
+        "extract",
+        "fetch"
+};
+
+static __thread uint32_t trace_counter = 0;
+
+// Parses options like "slow=50,sample=16"
+int trace_parse(char *options) {
+    char *const tokens[] = {"slow", "sample", NULL};
+    char *value;
+
+    while (*options) {
+        int i = getsubopt(&options, tokens, &value);
+        if (i < 0 || !value || !*value) {
+            fprintf(stderr, "invalid trace option: %s\n", value ? value : "");
+            return 0;
+        }
+
+        char *end;
+        unsigned long long n = strtoull(value, &end, 10);
+        if (*end || n > UINT32_MAX || (i == 1 && !n)) {
+            fprintf(stderr, "invalid trace value: %s\n", value);
+            return 0;
+        }
+
+        if (i == 0) trace_policy.slow_ms = (uint32_t) n;
+        else trace_policy.sample = (uint32_t) n;
+    }
+
+    return 1;
+}
+
+uint32_t trace_sample() {
+    if (!trace_policy.slow_ms) return 0;
+    return ++trace_counter % trace_policy.sample == 0;
+}
+
+void trace_slow(trace_t *trace) {
+    if (!trace_policy.slow_ms || trace->total_ns < (uint64_t) trace_policy.slow_ms * 1000000) return;
+
+    // A single fprintf keeps lines from different threads apart
+    fprintf(stderr, "slow identify: total=%luus lock_wait=%luus %s=%luus %s=%luus %s=%luus %s=%luus %s=%luus %s=%luus "
+                    "text_len=%u lines=%u candidates=%u rows_probed=%u row_hits=%u slots_checked=%u "
+                    "name_positions=%u found=%u\n",
+            (unsigned long) (trace->total_ns / 1000), (unsigned long) (trace->lock_wait_ns / 1000),
+            trace_stage_names[0], (unsigned long) (trace->stage_ns[0] / 1000),
+            trace_stage_names[1], (unsigned long) (trace->stage_ns[1] / 1000),
+            trace_stage_names[2], (unsigned long) (trace->stage_ns[2] / 1000),
+            trace_stage_names[3], (unsigned long) (trace->stage_ns[3] / 1000),
+            trace_stage_names[4], (unsigned long) (trace->stage_ns[4] / 1000),
+            trace_stage_names[5], (unsigned long) (trace->stage_ns[5] / 1000),
+            trace->text_len, trace->lines, trace->candidates, trace->rows_probed, trace->row_hits,
+            trace->slots_checked, trace->name_positions, trace->found);
+}
@@ -0,0 +1,52 @@
+#ifndef TITLE_FINGERPRINT_DB_TRACE_H
+#define TITLE_FINGERPRINT_DB_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_NORMALIZE 0
+#define TRACE_HASH 1
+#define TRACE_PROBE 2
+#define TRACE_LOCATE 3
+// Mapping the matched title and name back to the original text
+#define TRACE_EXTRACT 4
+#define TRACE_FETCH 5
+#define TRACE_STAGES 6
+
+// Slow request logging is off until a threshold is set
+#define TRACE_SLOW_MS 0
+#define TRACE_SAMPLE 1
+
+typedef struct trace {
+    uint64_t stage_ns[TRACE_STAGES];
+    uint64_t lock_wait_ns;
+    uint64_t total_ns;
+    uint32_t text_len;
+    uint32_t lines;
+    // Title ngrams within the length limits
+    uint32_t candidates;
+    uint32_t rows_probed;
+    uint32_t row_hits;
+    uint32_t slots_checked;
+    uint32_t name_positions;
+    uint8_t found;
+} trace_t;
+
+typedef struct trace_policy {
+    uint32_t slow_ms;
+    // Every n-th identify request is traced to find slow ones
+    uint32_t sample;
+} trace_policy_t;
+
+extern trace_policy_t trace_policy;
+
+extern const char *trace_stage_names[TRACE_STAGES];
+
+int trace_parse(char *options);
+
+// Whether the current request should be traced for the slow request log
+uint32_t trace_sample();
+
+// Logs the trace if the request took longer than the threshold
+void trace_slow(trace_t *trace);
+
+#endif //TITLE_FINGERPRINT_DB_TRACE_H